@@ -0,0 +1,16 @@
+#include "bench-images.h"
+#include "synthetic-image.h"
+
+const char *const FIXTURES[FIXTURE_COUNT] = {
+    "./fixtures/200x100_8bpp_in.png", "./fixtures/384x640_24bpp_in.png",
+    "./fixtures/640x384a_1bpp_in.png", "./fixtures/640x384b_8bpp_in.png",
+    "./fixtures/840x584_24bpp_in.png"};
+
+const int SYNTHETIC_SIZES[SYNTHETIC_SIZE_COUNT] = {512, 1024, 2048};
+
+std::string bench_image(int index) {
+  if (index < FIXTURE_COUNT)
+    return FIXTURES[index];
+  int size = SYNTHETIC_SIZES[index - FIXTURE_COUNT];
+  return write_synthetic_png(size, size);
+}
@@ -0,0 +1,18 @@
+#include <string>
+
+/***
+ *  The images the decoding and rendering benchmarks share: the test
+ *  fixtures, then square synthetic images up to the size of a 2K panel.
+ *  Benchmarks take an index into all of them as an argument.
+ */
+const int FIXTURE_COUNT = 5;
+const int SYNTHETIC_SIZE_COUNT = 3;
+const int BENCH_IMAGE_COUNT = FIXTURE_COUNT + SYNTHETIC_SIZE_COUNT;
+
+extern const char *const FIXTURES[FIXTURE_COUNT];
+extern const int SYNTHETIC_SIZES[SYNTHETIC_SIZE_COUNT];
+
+/***
+ *  The filename of image `index`, writing it out first if it's synthetic
+ */
+std::string bench_image(int index);
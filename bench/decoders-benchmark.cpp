@@ -0,0 +1,109 @@
+#include "../src/decoders.h"
+#include "../src/readpng.h"
+#include "bench-images.h"
+#include "image-encoders.h"
+#include "benchmark/benchmark.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum ImageFormat { FORMAT_PNG, FORMAT_QOI, FORMAT_PGM, FORMAT_PBM };
+static const char *FORMAT_NAMES[] = {"PNG", "QOI", "PGM", "PBM"};
+
+/***
+ *  Decode each fixture in each format through the decoder registry. The QOI,
+ *  PGM and PBM copies are made from the PNG fixture before timing starts.
+ */
+static void BM_read_image_file(benchmark::State &state) {
+  std::string png_filename = FIXTURES[state.range(0)];
+  ImageFormat format = static_cast<ImageFormat>(state.range(1));
+  std::string filename;
+
+  switch (format) {
+  case FORMAT_QOI:
+    filename = write_qoi_copy(png_filename);
+    break;
+  case FORMAT_PGM:
+    filename = write_pgm_copy(png_filename);
+    break;
+  case FORMAT_PBM:
+    filename = write_pbm_copy(png_filename);
+    break;
+  case FORMAT_PNG:
+  default:
+    filename = png_filename;
+  }
+
+  int pixels = 0;
+  for (auto _ : state) {
+    ImageProperties image_properties = read_image_file(filename);
+    pixels = image_properties.width * image_properties.height;
+    free_image_properties(image_properties);
+  }
+
+  struct stat file_stat;
+  stat(filename.c_str(), &file_stat);
+  state.SetLabel(std::string(FORMAT_NAMES[format]) + " " +
+                 png_filename.substr(png_filename.find_last_of('/') + 1));
+  state.counters["file_bytes"] = static_cast<double>(file_stat.st_size);
+  state.counters["pixels/s"] = benchmark::Counter(
+      static_cast<double>(state.iterations()) * pixels,
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_read_image_file)
+    ->ArgNames({"fixture", "format"})
+    ->ArgsProduct({benchmark::CreateDenseRange(0, FIXTURE_COUNT - 1, 1),
+                   {FORMAT_PNG, FORMAT_QOI, FORMAT_PGM, FORMAT_PBM}})
+    ->Unit(benchmark::kMicrosecond);
+
+/***
+ *  Decode each PNG fixture after evicting it from the page cache, so every
+ *  iteration reads from the storage device, as the first refresh of a new
+ *  image does on a Pi's SD card.
+ */
+static void BM_read_png_file_cold(benchmark::State &state) {
+  std::string filename = FIXTURES[state.range(0)];
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    int fd = open(filename.c_str(), O_RDONLY);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    state.ResumeTiming();
+
+    ImageProperties image_properties = read_image_file(filename);
+    free_image_properties(image_properties);
+  }
+
+  state.SetLabel(filename.substr(filename.find_last_of('/') + 1));
+}
+BENCHMARK(BM_read_png_file_cold)
+    ->ArgName("fixture")
+    ->DenseRange(0, FIXTURE_COUNT - 1)
+    ->Unit(benchmark::kMicrosecond);
+
+/***
+ *  Decode each PNG fixture, then each synthetic PNG, with read_png_file
+ *  itself rather than through the decoder registry
+ */
+static void BM_read_png_file(benchmark::State &state) {
+  std::string filename = bench_image(static_cast<int>(state.range(0)));
+
+  int pixels = 0;
+  for (auto _ : state) {
+    ImageProperties image_properties = read_png_file(filename);
+    pixels = image_properties.width * image_properties.height;
+    free_image_properties(image_properties);
+  }
+
+  state.SetLabel(filename.substr(filename.find_last_of('/') + 1));
+  state.counters["pixels/s"] = benchmark::Counter(
+      static_cast<double>(state.iterations()) * pixels,
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_read_png_file)
+    ->ArgName("image")
+    ->DenseRange(0, BENCH_IMAGE_COUNT - 1)
+    ->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,33 @@
+#include "benchmark/benchmark.h"
+#include "epd7in5.h"
+
+#include <algorithm>
+#include <vector>
+
+/***
+ *  Display a frame on the simulated panel with every delay scaled to
+ *  nothing, which leaves what a refresh costs the CPU: expanding each 1bpp
+ *  byte into four panel bytes and sending them over SPI one at a time
+ */
+static void BM_epd_display_frame(benchmark::State &state) {
+  EpdIf::SetSimulated(true, 0);
+  Epd epd;
+  epd.Init();
+  std::vector<unsigned char> frame(EPD_WIDTH * EPD_HEIGHT / 8);
+  for (size_t i = 0; i < frame.size(); i++) {
+    frame[i] = static_cast<unsigned char>(i * 37);
+  }
+
+  unsigned long spi_bytes = EpdIf::SimulatedSpiBytes();
+  for (auto _ : state) {
+    epd.DisplayFrame(frame.data());
+  }
+  spi_bytes = EpdIf::SimulatedSpiBytes() - spi_bytes;
+
+  state.counters["spi_bytes"] = static_cast<double>(
+      spi_bytes / std::max<size_t>(1, state.iterations()));
+  state.counters["spi_bytes/s"] = benchmark::Counter(
+      static_cast<double>(spi_bytes), benchmark::Counter::kIsRate);
+  EpdIf::SetSimulated(false);
+}
+BENCHMARK(BM_epd_display_frame)->Unit(benchmark::kMicrosecond);
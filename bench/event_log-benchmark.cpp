@@ -0,0 +1,69 @@
+#include "../src/event_log.h"
+#include "../src/log_formatter.h"
+#include "benchmark/benchmark.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+static std::string log_filename() {
+  return "/tmp/airpanel-event-log-benchmark-" + std::to_string(getpid());
+}
+
+/***
+ *  Record a refresh finishing in the event log, which should take a few
+ *  hundred nanoseconds: a timestamp, and a copy into the file's buffer
+ */
+static void BM_event_log_event(benchmark::State &state) {
+  std::string filename = log_filename();
+  {
+    EventLog log(filename);
+    std::string error;
+    unsigned long id = 0;
+    for (auto _ : state) {
+      log.write(EVENT_REFRESH_FINISHED, {id++, "displayed", error, 4012.5});
+    }
+  }
+  unlink(filename.c_str());
+}
+BENCHMARK(BM_event_log_event);
+
+/***
+ *  The same as a line of the text log, formatted and written to a file as
+ *  the rolling file appender does, for comparison
+ */
+static void BM_text_log_line(benchmark::State &state) {
+  std::string filename = log_filename();
+  FILE *file = fopen(filename.c_str(), "w");
+  unsigned long id = 0;
+  for (auto _ : state) {
+    plog::Record record(plog::debug, "", 0, "", NULL);
+    record << "Request " << id++ << " displayed in " << 4012.5 << " ms";
+    std::string line = plog::AirpanelTxtFormatterUtcTime::format(record);
+    fwrite(line.data(), 1, line.size(), file);
+  }
+  fclose(file);
+  unlink(filename.c_str());
+}
+BENCHMARK(BM_text_log_line);
+
+/***
+ *  Snapshot a 640×384 1bpp frame, which verbose mode used to dump as 1920
+ *  lines of hex
+ */
+static void BM_event_log_frame(benchmark::State &state) {
+  std::string filename = log_filename();
+  std::vector<unsigned char> frame(640 * 384 / 8);
+  for (size_t i = 0; i < frame.size(); i++) {
+    frame[i] = static_cast<unsigned char>(i % 7 == 0 ? 0x00 : 0xff);
+  }
+  {
+    EventLog log(filename);
+    for (auto _ : state) {
+      log.write(EVENT_FRAME, {640, 384, 1, "slide.png",
+                              EventArg::blob(frame.data(), frame.size())});
+    }
+  }
+  unlink(filename.c_str());
+}
+BENCHMARK(BM_event_log_frame)->Unit(benchmark::kMicrosecond);
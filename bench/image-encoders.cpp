@@ -0,0 +1,153 @@
+#include "image-encoders.h"
+#include "../src/core.h"
+#include "../src/readpng.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+static std::string copy_filename(const std::string &png_filename,
+                                 const std::string &extension) {
+  std::string basename =
+      png_filename.substr(png_filename.find_last_of('/') + 1);
+  return "./" + basename.substr(0, basename.find_last_of('.')) + extension;
+}
+
+static void write_file(const std::string &filename,
+                       const std::vector<unsigned char> &contents) {
+  FILE *fp = fopen(filename.c_str(), "wb");
+  if (!fp)
+    abort();
+  fwrite(contents.data(), 1, contents.size(), fp);
+  fclose(fp);
+}
+
+static void put_uint32_be(std::vector<unsigned char> &out, unsigned int value) {
+  out.push_back(value >> 24);
+  out.push_back(value >> 16);
+  out.push_back(value >> 8);
+  out.push_back(value);
+}
+
+static unsigned char gray_at(ImageProperties &image, int x, int y) {
+  png_bytep pixel = image.row_pointers[y] + x * image.bytes_per_pixel;
+  if (image.bytes_per_pixel == 1)
+    return pixel[0];
+  return convert_to_gray(pixel[0], pixel[1], pixel[2], pixel[3]);
+}
+
+std::string write_qoi_copy(const std::string &png_filename) {
+  ImageProperties image = read_png_file(png_filename);
+  std::vector<unsigned char> out = {'q', 'o', 'i', 'f'};
+  put_uint32_be(out, image.width);
+  put_uint32_be(out, image.height);
+  out.push_back(4); // RGBA
+  out.push_back(0); // sRGB
+
+  unsigned char index[64][4];
+  memset(index, 0, sizeof(index));
+  unsigned char previous[4] = {0, 0, 0, 0xFF};
+  int run = 0;
+  int pixel_count = image.width * image.height;
+
+  for (int i = 0; i < pixel_count; i++) {
+    unsigned char *pixel = image.row_pointers[i / image.width] +
+                           (i % image.width) * image.bytes_per_pixel;
+
+    if (memcmp(pixel, previous, 4) == 0) {
+      run++;
+      if (run == 62 || i == pixel_count - 1) {
+        out.push_back(0xC0 | (run - 1));
+        run = 0;
+      }
+      continue;
+    }
+
+    if (run > 0) {
+      out.push_back(0xC0 | (run - 1));
+      run = 0;
+    }
+
+    int hash =
+        (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + pixel[3] * 11) % 64;
+    if (memcmp(index[hash], pixel, 4) == 0) {
+      out.push_back(hash);
+    } else {
+      memcpy(index[hash], pixel, 4);
+
+      if (pixel[3] == previous[3]) {
+        signed char dr = pixel[0] - previous[0];
+        signed char dg = pixel[1] - previous[1];
+        signed char db = pixel[2] - previous[2];
+        signed char dr_dg = dr - dg;
+        signed char db_dg = db - dg;
+
+        if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+          out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+        } else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 &&
+                   db_dg > -9 && db_dg < 8) {
+          out.push_back(0x80 | (dg + 32));
+          out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+        } else {
+          out.push_back(0xFE);
+          out.insert(out.end(), pixel, pixel + 3);
+        }
+      } else {
+        out.push_back(0xFF);
+        out.insert(out.end(), pixel, pixel + 4);
+      }
+    }
+    memcpy(previous, pixel, 4);
+  }
+
+  const unsigned char end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  out.insert(out.end(), end_marker, end_marker + 8);
+  free_image_properties(image);
+
+  std::string filename = copy_filename(png_filename, ".qoi");
+  write_file(filename, out);
+  return filename;
+}
+
+std::string write_pgm_copy(const std::string &png_filename) {
+  ImageProperties image = read_png_file(png_filename);
+  std::string header = "P5\n" + std::to_string(image.width) + " " +
+                       std::to_string(image.height) + "\n255\n";
+  std::vector<unsigned char> out(header.begin(), header.end());
+
+  for (int y = 0; y < image.height; y++) {
+    for (int x = 0; x < image.width; x++) {
+      out.push_back(gray_at(image, x, y));
+    }
+  }
+  free_image_properties(image);
+
+  std::string filename = copy_filename(png_filename, ".pgm");
+  write_file(filename, out);
+  return filename;
+}
+
+std::string write_pbm_copy(const std::string &png_filename) {
+  ImageProperties image = read_png_file(png_filename);
+  std::string header = "P4\n" + std::to_string(image.width) + " " +
+                       std::to_string(image.height) + "\n";
+  std::vector<unsigned char> out(header.begin(), header.end());
+
+  for (int y = 0; y < image.height; y++) {
+    unsigned char byte = 0;
+    for (int x = 0; x < image.width; x++) {
+      // In a PBM, 1 is black
+      if (gray_at(image, x, y) <= 127)
+        byte |= 1 << (7 - (x % 8));
+      if (x % 8 == 7 || x == image.width - 1) {
+        out.push_back(byte);
+        byte = 0;
+      }
+    }
+  }
+  free_image_properties(image);
+
+  std::string filename = copy_filename(png_filename, ".pbm");
+  write_file(filename, out);
+  return filename;
+}
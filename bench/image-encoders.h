@@ -0,0 +1,14 @@
+#include <string>
+
+/***
+ *  Re-encode a PNG as QOI, binary PGM or binary PBM alongside it in the
+ *  current directory, so the decoders can be compared on the same images.
+ *  PGM and PBM copies are converted to gray with convert_to_gray, and PBM
+ *  copies are thresholded at 50% like 1bpp displays. Returns the new
+ *  filename.
+ */
+std::string write_qoi_copy(const std::string &png_filename);
+
+std::string write_pgm_copy(const std::string &png_filename);
+
+std::string write_pbm_copy(const std::string &png_filename);
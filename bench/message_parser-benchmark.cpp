@@ -0,0 +1,58 @@
+#include "../src/message_parser.h"
+#include "../test/cjson-message-parser.h"
+#include "benchmark/benchmark.h"
+
+#include <string>
+
+/***
+ *  A refresh as a client would send it, or a damage message with `rects`
+ *  rectangles, to show how each parser scales with the message's size
+ */
+static std::string message(int rects) {
+  if (rects == 0) {
+    return R"({"type": "socket", "data": {"action": "refresh",)"
+           R"( "image": "/home/pi/slides/2024-05-17/weather-forecast.png",)"
+           R"( "orientation": 90, "offset_x": 16, "offset_y": "-8"}})";
+  }
+  std::string damage = R"({"type": "socket", "data": {"action": "damage",)"
+                       R"( "rects": [)";
+  for (int i = 0; i < rects; i++) {
+    damage += (i ? ", " : "") + std::string(R"({"x": )") +
+              std::to_string(i * 8) + R"(, "y": 120, "width": 64,)"
+                                      R"( "height": 32})";
+  }
+  return damage + "]}}";
+}
+
+/***
+ *  The schema-specific parser, refilling the same Action each time, which
+ *  allocates nothing once it has been filled once
+ */
+static void BM_parse_message(benchmark::State &state) {
+  std::string text = message(static_cast<int>(state.range(0)));
+  Action action = {};
+  for (auto _ : state) {
+    parse_message(text.data(), text.size(), action);
+    benchmark::DoNotOptimize(action);
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(text.size()));
+}
+BENCHMARK(BM_parse_message)->ArgName("rects")->Arg(0)->Arg(4)->Arg(64);
+
+/***
+ *  The cJSON parser it replaced, building and freeing a tree each time
+ */
+static void BM_parse_message_with_cjson(benchmark::State &state) {
+  std::string text = message(static_cast<int>(state.range(0)));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(parse_message_with_cjson(text.c_str()));
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(text.size()));
+}
+BENCHMARK(BM_parse_message_with_cjson)
+    ->ArgName("rects")
+    ->Arg(0)
+    ->Arg(4)
+    ->Arg(64);
@@ -0,0 +1,115 @@
+#include "../src/pipeline.h"
+#include "benchmark/benchmark.h"
+#include "epd7in5.h"
+
+#include <thread>
+
+extern DisplayProperties DISPLAY_PROPERTIES;
+
+static const char *SLIDES[] = {
+    "./fixtures/840x584_24bpp_in.png", "./fixtures/384x640_24bpp_in.png",
+    "./fixtures/640x384b_8bpp_in.png", "./fixtures/200x100_8bpp_in.png"};
+static const int SLIDE_COUNT = sizeof(SLIDES) / sizeof(SLIDES[0]);
+
+// A simulated refresh takes 4000 ms × this, i.e. 80 ms
+static const double TIME_SCALE = 0.02;
+
+// The Waveshare 7.5" panel that Epd drives
+static void use_simulated_panel() {
+  DISPLAY_PROPERTIES.width = 640;
+  DISPLAY_PROPERTIES.height = 384;
+  DISPLAY_PROPERTIES.color_mode = COLOR_MODE_1BPP;
+  DISPLAY_PROPERTIES.processor = BCM2835;
+  EpdIf::SetSimulated(true, TIME_SCALE);
+}
+
+static Action slide(int index) {
+  Action action = {};
+  action.action = "refresh";
+  action.image_filename = SLIDES[index % SLIDE_COUNT];
+  return action;
+}
+
+/***
+ *  A slideshow on the simulated panel, rendering and displaying each slide
+ *  in turn as the socket loop used to
+ */
+static void BM_slideshow_sequential(benchmark::State &state) {
+  use_simulated_panel();
+  Epd epd;
+  epd.Init();
+
+  int index = 0;
+  for (auto _ : state) {
+    std::vector<unsigned char> frame = process_image(slide(index++));
+    epd.DisplayFrame(frame.data());
+  }
+
+  state.counters["frames/s"] = benchmark::Counter(
+      static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+  EpdIf::SetSimulated(false);
+}
+BENCHMARK(BM_slideshow_sequential)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+/***
+ *  The same slideshow through RefreshPipeline, submitting the next slide as
+ *  soon as the previous one starts refreshing, so it renders while the panel
+ *  is busy. Ideally each frame costs no more than the refresh itself.
+ */
+static void BM_slideshow_pipelined(benchmark::State &state) {
+  use_simulated_panel();
+  RefreshPipeline pipeline;
+
+  int index = 0;
+  for (auto _ : state) {
+    unsigned long refreshes = EpdIf::SimulatedRefreshes();
+    pipeline.submit(slide(index++));
+    while (EpdIf::SimulatedRefreshes() == refreshes) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+  pipeline.wait_until_idle();
+
+  state.counters["frames/s"] = benchmark::Counter(
+      static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+  state.counters["idle_ms"] = EpdIf::SimulatedLastIdleMs();
+  EpdIf::SetSimulated(false);
+}
+BENCHMARK(BM_slideshow_pipelined)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+/***
+ *  Render a frame and upload it to the simulated panel over SPI at real
+ *  speed, either whole or streamed in stripes of 32 rows so that rendering
+ *  overlaps the upload. No refresh is started.
+ */
+static void BM_render_and_upload(benchmark::State &state) {
+  use_simulated_panel();
+  EpdIf::SetSimulated(true, 1.0);
+  bool striped = state.range(0) != 0;
+  Epd epd;
+  epd.Init();
+
+  Action action = slide(0);
+  for (auto _ : state) {
+    if (striped) {
+      epd.StartFrame();
+      stream_image(action, 32, STRIPE_RING_LENGTH,
+                   [&](const unsigned char *stripe, size_t length) {
+                     epd.SendPixels(stripe, static_cast<unsigned int>(length));
+                   });
+    } else {
+      std::vector<unsigned char> frame = process_image(action);
+      epd.SendFrame(frame.data());
+    }
+  }
+  EpdIf::SetSimulated(false);
+}
+BENCHMARK(BM_render_and_upload)
+    ->ArgName("striped")
+    ->DenseRange(0, 1)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
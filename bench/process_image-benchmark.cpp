@@ -0,0 +1,144 @@
+#include "../src/core.h"
+#include "../src/readpng.h"
+#include "bench-images.h"
+#include "synthetic-image.h"
+#include "benchmark/benchmark.h"
+
+#include <stdlib.h>
+#include <vector>
+
+extern DisplayProperties DISPLAY_PROPERTIES;
+
+/***
+ *  Render a full-screen image on the 1872×1404 IT8951 panel with 1, 2, 4 and 8
+ *  render threads, in both color modes, to show how process_image scales.
+ *  Compare the real time of each thread count against the single-threaded
+ *  run to get the scaling curve.
+ */
+static void BM_process_image_render_threads(benchmark::State &state) {
+  DISPLAY_PROPERTIES.width = 1872;
+  DISPLAY_PROPERTIES.height = 1404;
+  DISPLAY_PROPERTIES.color_mode = static_cast<int>(state.range(1));
+  DISPLAY_PROPERTIES.processor = IT8951;
+  set_render_threads(static_cast<unsigned int>(state.range(0)));
+
+  Action action = {};
+  action.action = "refresh";
+  action.image_filename = write_synthetic_png(1872, 1404);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(process_image(action));
+  }
+
+  state.counters["pixels/s"] = benchmark::Counter(
+      static_cast<double>(state.iterations()) * 1872 * 1404,
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_process_image_render_threads)
+    ->ArgNames({"threads", "bpp"})
+    ->ArgsProduct({{1, 2, 4, 8}, {COLOR_MODE_1BPP, COLOR_MODE_8BPP}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+/***
+ *  Render the same full-screen image with PNGs decoded to RGBA and to gray.
+ *  The decoded bytes counter shows the memory traffic the render stage reads
+ *  back: four bytes per pixel for RGBA against one for gray.
+ */
+static void BM_process_image_gray_decode(benchmark::State &state) {
+  DISPLAY_PROPERTIES.width = 1872;
+  DISPLAY_PROPERTIES.height = 1404;
+  DISPLAY_PROPERTIES.color_mode = COLOR_MODE_8BPP;
+  DISPLAY_PROPERTIES.processor = IT8951;
+  set_render_threads(1);
+  set_png_gray_decode(state.range(0) != 0);
+
+  Action action = {};
+  action.action = "refresh";
+  action.image_filename = write_synthetic_png(1872, 1404);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(process_image(action));
+  }
+  set_png_gray_decode(false);
+
+  double bytes_per_pixel = state.range(0) ? 1 : 4;
+  state.counters["decoded_bytes"] = 1872 * 1404 * bytes_per_pixel;
+  state.counters["decoded_bytes/s"] = benchmark::Counter(
+      static_cast<double>(state.iterations()) * 1872 * 1404 * bytes_per_pixel,
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_process_image_gray_decode)
+    ->ArgName("gray")
+    ->DenseRange(0, 1)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+/***
+ *  Convert RGBA pixels to gray, as render_rows does for every pixel of an
+ *  image that isn't decoded straight to gray
+ */
+static void BM_convert_to_gray(benchmark::State &state) {
+  std::vector<unsigned char> pixels(64 * 1024 * 4);
+  srand(1);
+  for (unsigned char &byte : pixels) {
+    byte = static_cast<unsigned char>(rand());
+  }
+
+  for (auto _ : state) {
+    unsigned int sum = 0;
+    for (size_t i = 0; i < pixels.size(); i += 4) {
+      sum += convert_to_gray(pixels[i], pixels[i + 1], pixels[i + 2],
+                             pixels[i + 3]);
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+
+  state.counters["pixels/s"] = benchmark::Counter(
+      static_cast<double>(state.iterations()) * pixels.size() / 4,
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_convert_to_gray)->Unit(benchmark::kMicrosecond);
+
+/***
+ *  Render each fixture and synthetic image in every orientation, on the
+ *  640×384 1bpp Waveshare panel and the 1872×1404 8bpp IT8951 panel, on one
+ *  render thread
+ */
+static void BM_process_image(benchmark::State &state) {
+  int color_mode = static_cast<int>(state.range(2));
+  if (color_mode == COLOR_MODE_1BPP) {
+    DISPLAY_PROPERTIES.width = 640;
+    DISPLAY_PROPERTIES.height = 384;
+    DISPLAY_PROPERTIES.processor = BCM2835;
+  } else {
+    DISPLAY_PROPERTIES.width = 1872;
+    DISPLAY_PROPERTIES.height = 1404;
+    DISPLAY_PROPERTIES.processor = IT8951;
+  }
+  DISPLAY_PROPERTIES.color_mode = color_mode;
+  set_render_threads(1);
+
+  Action action = {};
+  action.action = "refresh";
+  action.image_filename = bench_image(static_cast<int>(state.range(0)));
+  action.orientation_specified = true;
+  action.orientation = static_cast<int>(state.range(1));
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(process_image(action));
+  }
+
+  state.SetLabel(action.image_filename.substr(
+      action.image_filename.find_last_of('/') + 1));
+  state.counters["pixels/s"] = benchmark::Counter(
+      static_cast<double>(state.iterations()) * DISPLAY_PROPERTIES.width *
+          DISPLAY_PROPERTIES.height,
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_process_image)
+    ->ArgNames({"image", "orientation", "bpp"})
+    ->ArgsProduct({benchmark::CreateDenseRange(0, BENCH_IMAGE_COUNT - 1, 1),
+                   {0, 90, 180, 270},
+                   {COLOR_MODE_1BPP, COLOR_MODE_8BPP}})
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,41 @@
+#include "synthetic-image.h"
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+std::string write_synthetic_png(int width, int height) {
+  std::string filename = "./synthetic_" + std::to_string(width) + "x" +
+                         std::to_string(height) + ".png";
+
+  FILE *fp = fopen(filename.c_str(), "wb");
+  if (!fp)
+    abort();
+
+  png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = png_create_info_struct(png);
+  if (!png || !info || setjmp(png_jmpbuf(png)))
+    abort();
+
+  png_init_io(png, fp);
+  png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+
+  std::vector<png_byte> row(width * 3);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      row[x * 3 + 0] = static_cast<png_byte>(x * 255 / width);
+      row[x * 3 + 1] = static_cast<png_byte>(y * 255 / height);
+      row[x * 3 + 2] = ((x / 16) ^ (y / 16)) & 1 ? 255 : 0;
+    }
+    png_write_row(png, row.data());
+  }
+
+  png_write_end(png, NULL);
+  png_destroy_write_struct(&png, &info);
+  fclose(fp);
+  return filename;
+}
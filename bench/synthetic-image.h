@@ -0,0 +1,8 @@
+#include <string>
+
+/***
+ *  Write an RGB PNG of the given size filled with a gradient and some
+ *  structure, so benchmarks can exercise images larger than the fixtures.
+ *  Returns the filename, which lives in the current directory.
+ */
+std::string write_synthetic_png(int width, int height);
@@ -38,6 +38,7 @@ Epd::Epd() {
     busy_pin = BUSY_PIN;
     width = EPD_WIDTH;
     height = EPD_HEIGHT;
+    partial = false;
 };
 
 int Epd::Init(void) {
@@ -100,11 +101,19 @@ void Epd::SendData(unsigned char data) {
 }
 
 void Epd::WaitUntilIdle(void) {
-    while(DigitalRead(busy_pin) == 0) {      //0: busy, 1: idle
-        DelayMs(100);
+    WaitUntilIdle(100);
+}
+
+void Epd::WaitUntilIdle(unsigned int poll_ms) {
+    while(IsBusy()) {
+        DelayMs(poll_ms);
     }
 }
 
+bool Epd::IsBusy(void) {
+    return DigitalRead(busy_pin) == 0;      //0: busy, 1: idle
+}
+
 void Epd::Reset(void) {
     DigitalWrite(reset_pin, LOW);                //module reset
     DelayMs(200);
@@ -113,10 +122,50 @@ void Epd::Reset(void) {
 }
 
 void Epd::DisplayFrame(const unsigned char* frame_buffer) {
-    unsigned char temp1, temp2;
+    SendFrame(frame_buffer);
+    Refresh();
+    WaitUntilIdle();
+}
+
+void Epd::SendFrame(const unsigned char* frame_buffer) {
+    StartFrame();
+    SendPixels(frame_buffer, 30720);
+}
+
+void Epd::StartFrame(void) {
+    if (partial) {
+        SendCommand(PARTIAL_OUT);
+        partial = false;
+    }
     SendCommand(DATA_START_TRANSMISSION_1);
-    for(int i = 0; i < 30720; i++) {
-        temp1 = frame_buffer[i];
+}
+
+void Epd::SendWindow(const unsigned char* frame_buffer, unsigned int x,
+                     unsigned int y, unsigned int w, unsigned int h) {
+    unsigned int x_end = x + w - 1;
+    unsigned int y_end = y + h - 1;
+    SendCommand(PARTIAL_IN);
+    partial = true;
+    SendCommand(PARTIAL_WINDOW);
+    SendData(x >> 8);
+    SendData(x & 0xf8);
+    SendData(x_end >> 8);
+    SendData((x_end & 0xf8) | 0x07);
+    SendData(y >> 8);
+    SendData(y & 0xff);
+    SendData(y_end >> 8);
+    SendData(y_end & 0xff);
+    SendData(0x01);     // scan the gates outside the window too
+    SendCommand(DATA_START_TRANSMISSION_1);
+    for (unsigned int row = y; row <= y_end; row++) {
+        SendPixels(frame_buffer + row * (width / 8) + x / 8, w / 8);
+    }
+}
+
+void Epd::SendPixels(const unsigned char* pixels, unsigned int length) {
+    unsigned char temp1, temp2;
+    for(unsigned int i = 0; i < length; i++) {
+        temp1 = pixels[i];
         for(unsigned char j = 0; j < 8; j++) {
             if(temp1 & 0x80)
                 temp2 = 0x03;
@@ -133,9 +182,11 @@ void Epd::DisplayFrame(const unsigned char* frame_buffer) {
             SendData(temp2);
         }
     }
+}
+
+void Epd::Refresh(void) {
     SendCommand(DISPLAY_REFRESH);
     DelayMs(100);
-    WaitUntilIdle();
 }
 
 void Epd::Sleep(void) {
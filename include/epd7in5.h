@@ -71,6 +71,9 @@
 #define AUTO_MEASUREMENT_VCOM                       0x80
 #define READ_VCOM_VALUE                             0x81
 #define VCM_DC_SETTING                              0x82
+#define PARTIAL_WINDOW                              0x90
+#define PARTIAL_IN                                  0x91
+#define PARTIAL_OUT                                 0x92
 
 extern const unsigned char lut_vcom0[];
 extern const unsigned char lut_ww[];
@@ -87,8 +90,27 @@ public:
     ~Epd();
     int  Init(void);
     void WaitUntilIdle(void);
+    void WaitUntilIdle(unsigned int poll_ms);
+    bool IsBusy(void);
     void Reset(void);
     void DisplayFrame(const unsigned char* frame_buffer);
+    /* DisplayFrame in two halves, so the caller can do something else while
+     * the panel refreshes: SendFrame uploads a frame into the panel's RAM
+     * (after which the buffer can be reused) and Refresh starts showing it,
+     * returning while BUSY is still low.
+     */
+    void SendFrame(const unsigned char* frame_buffer);
+    void Refresh(void);
+    /* SendFrame in pieces: StartFrame, then SendPixels for each run of frame
+     * buffer bytes in order, e.g. a stripe of rows at a time.
+     */
+    void StartFrame(void);
+    void SendPixels(const unsigned char* pixels, unsigned int length);
+    /* SendFrame for just a window of a whole frame buffer, x and w being
+     * multiples of 8: the next Refresh only refreshes that window.
+     */
+    void SendWindow(const unsigned char* frame_buffer, unsigned int x,
+                    unsigned int y, unsigned int w, unsigned int h);
     void SendCommand(unsigned char command);
     void SendData(unsigned char data);
     void Sleep(void);
@@ -98,6 +120,7 @@ private:
     unsigned int dc_pin;
     unsigned int cs_pin;
     unsigned int busy_pin;
+    bool partial;
 };
 
 #endif /* EPD7IN5_H */
@@ -26,21 +26,108 @@
  */
 
 #include "bcm2835.h"
+#include "epd7in5.h"
 #include "epdif.h"
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+typedef std::chrono::steady_clock SimulatedClock;
+
+static bool simulated = false;
+static double simulated_time_scale = 1.0;
+static int simulated_dc_level = HIGH;
+static SimulatedClock::time_point simulated_busy_until;
+static std::atomic<unsigned long> spi_bytes(0);
+static std::atomic<unsigned long> simulated_spi_bytes(0);
+static std::atomic<unsigned long> simulated_refreshes(0);
+static std::atomic<double> simulated_last_idle_ms(0);
+// SPI time owed but not slept yet, as sleeping for every byte would take
+// far longer than the transfer itself
+static double simulated_spi_debt_ms = 0;
+
+static SimulatedClock::duration simulated_duration(unsigned int ms) {
+  return std::chrono::duration_cast<SimulatedClock::duration>(
+      std::chrono::duration<double, std::milli>(ms * simulated_time_scale));
+}
+
 EpdIf::EpdIf(){};
 EpdIf::~EpdIf(){};
 
-void EpdIf::DigitalWrite(int pin, int value) { bcm2835_gpio_write(pin, value); }
+void EpdIf::SetSimulated(bool enabled, double time_scale) {
+  simulated = enabled;
+  simulated_time_scale = time_scale;
+}
+
+bool EpdIf::IsSimulated(void) { return simulated; }
+
+unsigned long EpdIf::SpiBytes(void) {
+  return spi_bytes.load(std::memory_order_relaxed);
+}
 
-int EpdIf::DigitalRead(int pin) { return bcm2835_gpio_lev(pin); }
+unsigned long EpdIf::SimulatedSpiBytes(void) { return simulated_spi_bytes; }
 
-void EpdIf::DelayMs(unsigned int delaytime) { bcm2835_delay(delaytime); }
+unsigned long EpdIf::SimulatedRefreshes(void) { return simulated_refreshes; }
 
-void EpdIf::SpiTransfer(unsigned char data) { bcm2835_spi_transfer(data); }
+double EpdIf::SimulatedLastIdleMs(void) { return simulated_last_idle_ms; }
+
+void EpdIf::DigitalWrite(int pin, int value) {
+  if (simulated) {
+    if (pin == DC_PIN)
+      simulated_dc_level = value;
+    return;
+  }
+  bcm2835_gpio_write(pin, value);
+}
+
+int EpdIf::DigitalRead(int pin) {
+  if (simulated) {
+    // 0: busy, 1: idle
+    if (pin == BUSY_PIN && SimulatedClock::now() < simulated_busy_until)
+      return LOW;
+    return HIGH;
+  }
+  return bcm2835_gpio_lev(pin);
+}
+
+void EpdIf::DelayMs(unsigned int delaytime) {
+  if (simulated) {
+    std::this_thread::sleep_for(simulated_duration(delaytime));
+    return;
+  }
+  bcm2835_delay(delaytime);
+}
+
+void EpdIf::SpiTransfer(unsigned char data) {
+  spi_bytes.fetch_add(1, std::memory_order_relaxed);
+  if (simulated) {
+    simulated_spi_bytes++;
+    simulated_spi_debt_ms += SIMULATED_SPI_BYTE_NS * 1e-6 * simulated_time_scale;
+    if (simulated_spi_debt_ms >= 1) {
+      std::this_thread::sleep_for(
+          std::chrono::duration<double, std::milli>(simulated_spi_debt_ms));
+      simulated_spi_debt_ms = 0;
+    }
+    // A command byte is sent with DC low
+    if (simulated_dc_level == LOW && data == DISPLAY_REFRESH) {
+      SimulatedClock::time_point now = SimulatedClock::now();
+      if (simulated_refreshes++ > 0) {
+        simulated_last_idle_ms =
+            std::chrono::duration<double, std::milli>(now -
+                                                      simulated_busy_until)
+                .count();
+      }
+      simulated_busy_until = now + simulated_duration(SIMULATED_REFRESH_MS);
+    }
+    return;
+  }
+  bcm2835_spi_transfer(data);
+}
 
 int EpdIf::IfInit(void)
 {
+    if (simulated) { return 0; }
     if (!bcm2835_init()) { return -1; }
     bcm2835_gpio_fsel(RST_PIN, BCM2835_GPIO_FSEL_OUTP);
     bcm2835_gpio_fsel(DC_PIN, BCM2835_GPIO_FSEL_OUTP);
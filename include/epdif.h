@@ -34,6 +34,11 @@
 #define CS_PIN 8
 #define BUSY_PIN 24
 
+// How long the simulated panel holds BUSY low for a full refresh
+#define SIMULATED_REFRESH_MS 4000
+// How long the simulated SPI bus takes per byte, clocked at 250MHz / 128
+#define SIMULATED_SPI_BYTE_NS 4096
+
 // Pin level definition
 #ifndef LOW
 #define LOW 0
@@ -52,5 +57,20 @@ public:
   static int DigitalRead(int pin);
   static void DelayMs(unsigned int delaytime);
   static void SpiTransfer(unsigned char data);
+  // Bytes sent over SPI since startup, simulated or not
+  static unsigned long SpiBytes(void);
+
+  /* Run without hardware: GPIO and SPI calls are recorded instead of
+   * reaching the bcm2835, SPI transfers take as long as they would on the
+   * wire, and the BUSY pin reads low for as long as a real panel takes to
+   * refresh after each DISPLAY_REFRESH command. All delays are multiplied by
+   * time_scale, so tests can refresh in milliseconds.
+   */
+  static void SetSimulated(bool simulated, double time_scale = 1.0);
+  static bool IsSimulated(void);
+  static unsigned long SimulatedSpiBytes(void);
+  static unsigned long SimulatedRefreshes(void);
+  // How long the panel sat idle between the last two refreshes
+  static double SimulatedLastIdleMs(void);
 };
 #endif
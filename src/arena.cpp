@@ -0,0 +1,135 @@
+#include "arena.h"
+#include "memory_accounting.h"
+
+#include <algorithm>
+#include <stdint.h>
+
+// Every allocation starts on a multiple of this, as malloc's do
+static const size_t ALIGNMENT = 16;
+
+/***
+ *  arena_malloc puts one of these before each allocation, so arena_free
+ *  knows whether to free it or leave it for the arena's next reset, on
+ *  whichever thread it's called
+ */
+struct AllocationHeader {
+  uint64_t source;
+  uint64_t unused;
+};
+
+static_assert(sizeof(AllocationHeader) % ALIGNMENT == 0,
+              "allocations must stay aligned after their header");
+
+static const uint64_t FROM_ARENA = 0x41524e41;  // "ARNA"
+static const uint64_t FROM_MALLOC = 0x4d4c4f43; // "MLOC"
+
+static thread_local RequestArena *current_thread_arena = NULL;
+
+RequestArena::RequestArena(size_t block_bytes, size_t kept_bytes)
+    : block_bytes(block_bytes), kept_bytes(kept_bytes), current(0),
+      offset(0), used_before(0), block_count(0) {}
+
+RequestArena::~RequestArena() {
+  for (Block &block : blocks) {
+    accounted_free(block.data);
+  }
+}
+
+void *RequestArena::allocate(size_t size) {
+  if (size > SIZE_MAX - ALIGNMENT)
+    return NULL;
+  size = std::max(ALIGNMENT, (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT);
+
+  if (current >= blocks.size() || blocks[current].size - offset < size) {
+    /* Move on to the first later block that's big enough, swapping it in
+     * next, or else a new block there. Whatever's left of the block being
+     * left behind goes unused until the next reset.
+     */
+    bool leaving = current < blocks.size();
+    size_t next = leaving ? current + 1 : current;
+    size_t found = next;
+    while (found < blocks.size() && blocks[found].size < size) {
+      found++;
+    }
+    if (found < blocks.size()) {
+      std::swap(blocks[found], blocks[next]);
+    } else {
+      size_t block_size = std::max(block_bytes, size);
+      Block block = {static_cast<unsigned char *>(accounted_malloc(block_size)),
+                     block_size};
+      if (!block.data)
+        return NULL;
+      blocks.insert(blocks.begin() + static_cast<ptrdiff_t>(next), block);
+      block_count++;
+    }
+    if (leaving)
+      used_before += offset;
+    current = next;
+    offset = 0;
+  }
+
+  void *pointer = blocks[current].data + offset;
+  offset += size;
+  return pointer;
+}
+
+void RequestArena::reset() {
+  current = 0;
+  offset = 0;
+  used_before = 0;
+
+  // Always keep the first block, whatever its size
+  size_t kept = 0;
+  size_t keep = 0;
+  while (keep < blocks.size() &&
+         (keep == 0 || kept + blocks[keep].size <= kept_bytes)) {
+    kept += blocks[keep].size;
+    keep++;
+  }
+  for (size_t i = keep; i < blocks.size(); i++) {
+    accounted_free(blocks[i].data);
+  }
+  blocks.resize(keep);
+}
+
+size_t RequestArena::used_bytes() const {
+  return used_before + (current < blocks.size() ? offset : 0);
+}
+
+size_t RequestArena::reserved_bytes() const {
+  size_t reserved = 0;
+  for (const Block &block : blocks) {
+    reserved += block.size;
+  }
+  return reserved;
+}
+
+void *arena_malloc(size_t size) {
+  if (size > SIZE_MAX - sizeof(AllocationHeader))
+    return NULL;
+  RequestArena *arena = current_thread_arena;
+  size_t total = sizeof(AllocationHeader) + size;
+  AllocationHeader *header = static_cast<AllocationHeader *>(
+      arena ? arena->allocate(total) : accounted_malloc(total));
+  if (!header)
+    return NULL;
+  header->source = arena ? FROM_ARENA : FROM_MALLOC;
+  return header + 1;
+}
+
+void arena_free(void *pointer) {
+  if (!pointer)
+    return;
+  AllocationHeader *header = static_cast<AllocationHeader *>(pointer) - 1;
+  // Memory from an arena is only reclaimed when it's reset
+  if (header->source == FROM_MALLOC)
+    accounted_free(header);
+}
+
+RequestArena *current_arena() { return current_thread_arena; }
+
+ArenaScope::ArenaScope(RequestArena *arena) : previous(current_thread_arena) {
+  current_thread_arena = arena;
+}
+
+ArenaScope::~ArenaScope() { current_thread_arena = previous; }
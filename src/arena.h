@@ -0,0 +1,92 @@
+#if !defined(AIRPANEL_ARENA_H)
+#define AIRPANEL_ARENA_H 1
+
+#include <stddef.h>
+#include <vector>
+
+// libpng's structs and the RGBA rows of a 640x384 image take a block or two
+const size_t ARENA_BLOCK_BYTES = 1024 * 1024;
+
+/* Blocks past this many bytes are freed when an arena is reset, so one
+ * huge image doesn't keep its rows' memory pinned from then on
+ */
+const size_t ARENA_KEPT_BYTES = 16 * 1024 * 1024;
+
+/***
+ *  A bump allocator for what one request allocates and frees again before
+ *  it ends: cJSON's nodes and printed replies, and libpng's structs and the
+ *  decoded rows. Allocating bumps an offset into a block, freeing does
+ *  nothing, and reset() takes the offset back to the start, so a request
+ *  needs no malloc at all once the arena has grown to fit. Blocks are kept
+ *  from request to request, up to ARENA_KEPT_BYTES.
+ *
+ *  An arena isn't thread safe: only one thread may allocate from it at a
+ *  time.
+ */
+class RequestArena {
+public:
+  explicit RequestArena(size_t block_bytes = ARENA_BLOCK_BYTES,
+                        size_t kept_bytes = ARENA_KEPT_BYTES);
+  ~RequestArena();
+
+  RequestArena(const RequestArena &) = delete;
+  RequestArena &operator=(const RequestArena &) = delete;
+
+  // Aligned for any type, or NULL if a new block couldn't be allocated
+  void *allocate(size_t size);
+
+  // Everything allocated from the arena must be dead by now
+  void reset();
+
+  // Bytes allocated since the last reset, and held in blocks
+  size_t used_bytes() const;
+  size_t reserved_bytes() const;
+  // Blocks malloc'd over the arena's lifetime
+  unsigned long blocks_allocated() const { return block_count; }
+
+private:
+  struct Block {
+    unsigned char *data;
+    size_t size;
+  };
+
+  std::vector<Block> blocks;
+  size_t block_bytes;
+  size_t kept_bytes;
+  // Allocations are bumped from blocks[current] at offset
+  size_t current;
+  size_t offset;
+  // Bytes in the blocks before current, which have been used up
+  size_t used_before;
+  unsigned long block_count;
+};
+
+/* malloc and free for cJSON (see cJSON_InitHooks) and libpng (see
+ * png_create_read_struct_2). Memory comes from the calling thread's arena
+ * while it has one (see ArenaScope), or is malloc'd otherwise. Either can
+ * be freed on any thread, by arena_free alone.
+ */
+void *arena_malloc(size_t size);
+void arena_free(void *pointer);
+
+// The arena the calling thread allocates from, if any
+RequestArena *current_arena();
+
+/***
+ *  Has the calling thread allocate from an arena, or from malloc if it's
+ *  NULL, until it's destroyed. Scopes nest. Resetting the arena is up to
+ *  its owner, once it knows that nothing allocated from it is in use.
+ */
+class ArenaScope {
+public:
+  explicit ArenaScope(RequestArena *arena);
+  ~ArenaScope();
+
+  ArenaScope(const ArenaScope &) = delete;
+  ArenaScope &operator=(const ArenaScope &) = delete;
+
+private:
+  RequestArena *previous;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include "async_appender.h"
+
+#include <errno.h>
+#include <plog/Record.h>
+
+namespace plog {
+
+/***
+ *  A record rebuilt from a slot, for the appenders written to from the
+ *  writer thread, which report the time and thread it was logged at
+ */
+class QueuedRecord : public Record {
+public:
+  QueuedRecord(Severity severity, const char *func, size_t line,
+               const char *file, const void *object, const util::Time &time,
+               unsigned int tid, const std::string &message)
+      : Record(severity, func, line, file, object), time(time), tid(tid),
+        message(message) {}
+
+  virtual const util::Time &getTime() const { return time; }
+  virtual unsigned int getTid() const { return tid; }
+  virtual const util::nchar *getMessage() const { return message.c_str(); }
+
+private:
+  const util::Time &time;
+  unsigned int tid;
+  const std::string &message;
+};
+
+static size_t round_up_to_power_of_two(size_t n) {
+  size_t rounded = 2;
+  while (rounded < n)
+    rounded <<= 1;
+  return rounded;
+}
+
+AsyncAppender::AsyncAppender(size_t capacity, OverflowPolicy policy)
+    : slots(new Slot[round_up_to_power_of_two(capacity)]),
+      mask(round_up_to_power_of_two(capacity) - 1), overflow_policy(policy),
+      tail(0), dropped_count(0), stopping(false) {
+  for (size_t i = 0; i <= mask; i++) {
+    slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  sem_init(&available, 0, 0);
+  writer = std::thread(&AsyncAppender::writer_loop, this);
+}
+
+AsyncAppender::~AsyncAppender() {
+  stopping = true;
+  sem_post(&available);
+  writer.join();
+  sem_destroy(&available);
+}
+
+void AsyncAppender::addAppender(IAppender *appender) {
+  std::lock_guard<std::mutex> lock(appenders_mutex);
+  appenders.push_back(appender);
+}
+
+void AsyncAppender::write(const Record &record) {
+  bool may_block = overflow_policy == BLOCK_ON_OVERFLOW ||
+                   (overflow_policy == DROP_DEBUG_ON_OVERFLOW &&
+                    record.getSeverity() < debug);
+
+  // Claim the next free slot, as in Vyukov's bounded queue: a slot is free
+  // to fill at position `position` when its sequence equals the position,
+  // and ready to write when it's one more
+  size_t position = tail.load(std::memory_order_relaxed);
+  Slot *slot;
+  for (;;) {
+    slot = &slots[position & mask];
+    size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    if (sequence == position) {
+      if (tail.compare_exchange_weak(position, position + 1,
+                                     std::memory_order_relaxed))
+        break;
+    } else if (sequence < position) {
+      // The ring is full
+      if (!may_block) {
+        dropped_count.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      std::this_thread::yield();
+      position = tail.load(std::memory_order_relaxed);
+    } else {
+      position = tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->severity = record.getSeverity();
+  slot->time = record.getTime();
+  slot->tid = record.getTid();
+  slot->object = record.getObject();
+  slot->line = record.getLine();
+  slot->func.assign(record.getFunc());
+  slot->file = record.getFile();
+  slot->message.assign(record.getMessage());
+  slot->sequence.store(position + 1, std::memory_order_release);
+  sem_post(&available);
+}
+
+void AsyncAppender::flush() {
+  size_t target = tail.load(std::memory_order_acquire);
+  std::unique_lock<std::mutex> lock(flush_mutex);
+  flushed.wait(lock, [this, target] { return written >= target; });
+}
+
+void AsyncAppender::writer_loop() {
+  while (!stopping) {
+    while (sem_wait(&available) == -1 && errno == EINTR) {
+    }
+
+    /* Write every record that's ready, rather than one per wakeup: a slot
+     * claimed earlier may be published after a later one, so wakeups and
+     * ready records don't always match up
+     */
+    for (;;) {
+      Slot &slot = slots[head & mask];
+      if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+        break;
+      write_slot(slot);
+      slot.sequence.store(head + mask + 1, std::memory_order_release);
+      head++;
+      // Once caught up, say how much was lost while behind
+      if (slots[head & mask].sequence.load(std::memory_order_acquire) !=
+          head + 1)
+        report_dropped();
+      {
+        std::lock_guard<std::mutex> lock(flush_mutex);
+        written = head;
+      }
+      flushed.notify_all();
+    }
+  }
+  report_dropped();
+}
+
+void AsyncAppender::write_slot(Slot &slot) {
+  QueuedRecord record(slot.severity, slot.func.c_str(), slot.line, slot.file,
+                      slot.object, slot.time, slot.tid, slot.message);
+  std::lock_guard<std::mutex> lock(appenders_mutex);
+  for (IAppender *appender : appenders) {
+    appender->write(record);
+  }
+}
+
+void AsyncAppender::report_dropped() {
+  unsigned long dropped = dropped_count.load(std::memory_order_relaxed);
+  if (dropped == dropped_reported)
+    return;
+
+  std::string message = std::to_string(dropped - dropped_reported) +
+                        " log records were dropped because the log fell "
+                        "behind";
+  util::Time now;
+  util::ftime(&now);
+  QueuedRecord record(warning, "", 0, "", NULL, now, util::gettid(), message);
+  dropped_reported = dropped;
+  std::lock_guard<std::mutex> lock(appenders_mutex);
+  for (IAppender *appender : appenders) {
+    appender->write(record);
+  }
+}
+
+} // namespace plog
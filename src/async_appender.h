@@ -0,0 +1,110 @@
+#if !defined(AIRPANEL_ASYNC_APPENDER_H)
+#define AIRPANEL_ASYNC_APPENDER_H 1
+
+#include <plog/Appenders/IAppender.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <semaphore.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace plog {
+
+/***
+ *  What to do with a record when the ring is full, because the writer
+ *  thread has fallen behind, say while a write to the SD card stalls
+ */
+enum OverflowPolicy {
+  // Drop the record, so logging never waits
+  DROP_ON_OVERFLOW,
+  // Wait for room, so nothing is lost
+  BLOCK_ON_OVERFLOW,
+  // Drop debug and verbose records, but wait for room for anything more
+  // severe
+  DROP_DEBUG_ON_OVERFLOW
+};
+
+/***
+ *  Hands records to a background thread, which formats and writes them
+ *  through the appenders added to it, so that logging on the render and
+ *  display threads costs a copy of the message rather than a format and a
+ *  write under a lock.
+ *
+ *  Records pass through a bounded ring of slots that any number of threads
+ *  claim without locking, each slot carrying a sequence number that says
+ *  whether it's free to fill or ready to write. Slots keep their message
+ *  strings from one record to the next, so once they've grown to fit, a
+ *  record is queued without allocating. Records dropped on overflow are
+ *  counted, and the count is logged once the writer catches up.
+ */
+class AsyncAppender : public IAppender {
+public:
+  explicit AsyncAppender(size_t capacity = 1024,
+                         OverflowPolicy policy = DROP_DEBUG_ON_OVERFLOW);
+  // Writes out whatever is still queued
+  virtual ~AsyncAppender();
+
+  AsyncAppender(const AsyncAppender &) = delete;
+  AsyncAppender &operator=(const AsyncAppender &) = delete;
+
+  /* Appenders added here are only ever written to from the writer thread,
+   * and must outlive this appender
+   */
+  void addAppender(IAppender *appender);
+
+  virtual void write(const Record &record);
+
+  // Block until every record queued so far has been written
+  void flush();
+
+  unsigned long dropped() const { return dropped_count.load(); }
+
+private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    Severity severity;
+    util::Time time;
+    unsigned int tid;
+    const void *object;
+    size_t line;
+    std::string func;
+    const char *file;
+    std::string message;
+  };
+
+  void writer_loop();
+  void write_slot(Slot &slot);
+  void report_dropped();
+
+  std::unique_ptr<Slot[]> slots;
+  size_t mask;
+  OverflowPolicy overflow_policy;
+
+  // Claimed by producers; the next slot to fill
+  std::atomic<size_t> tail;
+  // Only touched by the writer; the next slot to write
+  size_t head = 0;
+  // Posted once for each record published, so the writer sleeps when idle
+  sem_t available;
+
+  std::atomic<unsigned long> dropped_count;
+  unsigned long dropped_reported = 0;
+
+  std::mutex appenders_mutex;
+  std::vector<IAppender *> appenders;
+
+  std::mutex flush_mutex;
+  std::condition_variable flushed;
+  size_t written = 0;
+
+  std::atomic<bool> stopping;
+  std::thread writer;
+};
+
+} // namespace plog
+
+#endif
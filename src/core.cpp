@@ -19,9 +19,17 @@
  */
 
 #include "core.h"
+#include "arena.h"
+#include "decoders.h"
+#include "event_log.h"
+#include "frame.h"
+#include "mapped_file.h"
+#include "metrics.h"
 #include "readpng.h"
+#include "stripe_ring.h"
+#include "trace.h"
+#include "thread_pool.h"
 
-#include "cJSON.h"
 #include "epd7in5.h"
 #include "epdif.h"
 #include <algorithm>
@@ -29,14 +37,58 @@
 #include <ctype.h>
 #include <iostream>
 #include <math.h>
+#include <memory>
+#include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
+#include <thread>
 #include <vector>
 
 using namespace std;
 
 DisplayProperties DISPLAY_PROPERTIES;
 
+/* process_image renders in bands of rows on a persistent pool of worker
+ * threads, created the first time it's needed and re-created if the number
+ * of threads is changed.
+ */
+static const unsigned int BANDS_PER_THREAD = 4;
+static std::mutex render_pool_mutex;
+static unsigned int render_threads = ThreadPool::default_thread_count();
+static std::shared_ptr<ThreadPool> render_pool;
+
+void set_render_threads(unsigned int threads) {
+  std::lock_guard<std::mutex> lock(render_pool_mutex);
+  threads = threads ? threads : 1;
+  if (threads != render_threads) {
+    render_threads = threads;
+    render_pool.reset();
+  }
+}
+
+unsigned int get_render_threads() {
+  std::lock_guard<std::mutex> lock(render_pool_mutex);
+  return render_threads;
+}
+
+/* In striped mode, images are rendered a stripe of this many rows at a time
+ * and each stripe is sent to the panel while the next one renders; 0 turns
+ * striped mode off.
+ */
+static std::atomic<unsigned int> stripe_rows(0);
+
+void set_stripe_rows(unsigned int rows) { stripe_rows = rows; }
+
+unsigned int get_stripe_rows() { return stripe_rows; }
+
+static std::shared_ptr<ThreadPool> get_render_pool() {
+  std::lock_guard<std::mutex> lock(render_pool_mutex);
+  if (!render_pool) {
+    render_pool = std::make_shared<ThreadPool>(render_threads);
+  }
+  return render_pool;
+}
+
 /***
  * Lift the gamma curve from the pixel from the source image so we can convert
  * to grayscale
@@ -71,94 +123,54 @@ unsigned int convert_to_gray(unsigned int R, unsigned int G, unsigned int B,
 }
 
 /***
- *  Get JSON parsing out of the way and return a struct.
+ *  Map the image's file, unless its bytes came with the action
  */
-Action parse_message(const char *message_string) {
-  Action message = {};
-  char *endptr;
-  message.type = "socket";
-  cJSON *message_json;
-  cJSON *data;
-  message_json = cJSON_Parse(message_string);
-  data = NULL;
-  data = cJSON_GetObjectItemCaseSensitive(message_json, "data");
-  if (cJSON_IsObject(data)) {
-    cJSON *actionJSON = cJSON_GetObjectItemCaseSensitive(data, "action");
-    cJSON *imageJSON = cJSON_GetObjectItemCaseSensitive(data, "image");
-    cJSON *orientationJSON =
-        cJSON_GetObjectItemCaseSensitive(data, "orientation");
-    cJSON *offsetXJSON = cJSON_GetObjectItemCaseSensitive(data, "offset_x");
-    cJSON *offsetYJSON = cJSON_GetObjectItemCaseSensitive(data, "offset_y");
-    if (actionJSON && actionJSON->valuestring != NULL) {
-      message.action = string(actionJSON->valuestring);
-    }
-    if (imageJSON && imageJSON->valuestring != NULL) {
-      message.image_filename = string(imageJSON->valuestring);
-    }
-    if (orientationJSON) {
-      int orientation;
-      if (cJSON_IsNumber(orientationJSON)) {
-        orientation = int(orientationJSON->valueint);
-      } else {
-        long int parsed_orientation =
-            strtol(orientationJSON->valuestring, &endptr, 0);
-        if (!*endptr) {
-          orientation = int(parsed_orientation);
-        } else {
-          // orientation_specified will be false, so this won't be used
-          orientation = 0;
-          LOG_WARNING << "Orientation '" << orientationJSON->valuestring
-                      << "' could not be understood";
-        }
-      }
-      int valid_orientations[] = {0, 90, 180, 270};
-      if (std::find(std::begin(valid_orientations),
-                    std::end(valid_orientations),
-                    orientation) != std::end(valid_orientations)) {
-        message.orientation_specified = true;
-        message.orientation = orientation;
-      } else {
-        LOG_WARNING << "Orientation " << orientation
-                    << " supplied, but valid values are 0, 90, 180 and 270";
-      }
-    }
-    if (offsetXJSON) {
-      int offset_x;
-      if (cJSON_IsNumber(offsetXJSON)) {
-        offset_x = int(offsetXJSON->valueint);
-      } else {
-        long int parsed_offset_x = strtol(offsetXJSON->valuestring, &endptr, 0);
-        if (!*endptr) {
-          offset_x = int(parsed_offset_x);
-        } else {
-          offset_x = 0;
-          LOG_WARNING << "offset_x '" << offsetXJSON->valuestring
-                      << "' could not be understood";
-        }
-      }
-      message.offset_x_specified = true;
-      message.offset_x = offset_x;
-    }
-    if (offsetYJSON) {
-      int offset_y;
-      if (cJSON_IsNumber(offsetYJSON)) {
-        offset_y = int(offsetYJSON->valueint);
-      } else {
-        long int parsed_offset_y = strtol(offsetYJSON->valuestring, &endptr, 0);
-        if (!*endptr) {
-          offset_y = int(parsed_offset_y);
-        } else {
-          offset_y = 0;
-          LOG_WARNING << "offset_y '" << offsetYJSON->valuestring
-                      << "' could not be understood";
-        }
-      }
-      message.offset_y_specified = true;
-      message.offset_y = offset_y;
-    }
+static std::shared_ptr<const ImageBytes> image_bytes_for(const Action &action) {
+  if (action.image_bytes)
+    return action.image_bytes;
+  return std::make_shared<MappedFile>(action.image_filename);
+}
+
+/***
+ *  If the image is a frame file rendered for exactly this display, map it so
+ *  it can be sent straight to the display without decoding or copying it,
+ *  and point frame at its frame data. Returns an empty pointer if the image
+ *  needs to go through process_image instead.
+ */
+std::shared_ptr<const ImageBytes>
+map_display_frame(const Action &action, const unsigned char **frame) {
+  std::shared_ptr<const ImageBytes> file = image_bytes_for(action);
+  if (!is_frame_file(file->data(), file->size()))
+    return nullptr;
+
+  FrameHeader header =
+      read_frame_header(action.image_filename, file->data(), file->size());
+  if (!frame_matches_display(header)) {
+    LOG_DEBUG << "Frame file is " << header.width << "×" << header.height
+              << " at " << header.color_mode
+              << "bpp, which doesn't match the display; translating it";
+    return nullptr;
   }
-  cJSON_Delete(message_json);
-  return message;
+
+  *frame = file->data() + header.data_offset;
+  return file;
+}
+
+static bool display_frame_file(const Action &action) {
+  const unsigned char *frame;
+  std::shared_ptr<const ImageBytes> file = map_display_frame(action, &frame);
+  if (!file)
+    return false;
+
+  LOG_INFO << "Displaying frame file at: " << action.image_filename;
+  write_to_display(frame);
+  return true;
+}
+
+double elapsed_ms(MonotonicClock::time_point since) {
+  return std::chrono::duration<double, std::milli>(MonotonicClock::now() -
+                                                   since)
+      .count();
 }
 
 /***
@@ -167,6 +179,12 @@ Action parse_message(const char *message_string) {
 void process_action(Action action) {
   if (action.action_is_refresh()) {
     if (action.has_image_filename()) {
+      if (display_frame_file(action))
+        return;
+      if (get_stripe_rows()) {
+        stream_to_display(action);
+        return;
+      }
       std::vector<unsigned char> bitmap_frame_buffer = process_image(action);
       write_to_display(bitmap_frame_buffer);
     } else {
@@ -182,8 +200,8 @@ void process_action(Action action) {
  *  offset (and the conversion to PNG byte row index, for convenience)
  */
 Pixel translate_display_pixel_to_image(
-    int x, int y, TranslationProperties translation_properties,
-    ImageProperties image_properties) {
+    int x, int y, const TranslationProperties &translation_properties,
+    const ImageProperties &image_properties) {
 
   Pixel image_pixel = {};
 
@@ -263,8 +281,9 @@ Pixel translate_display_pixel_to_image(
  *  display), return the background color.
  */
 int get_current_pixel(int x, int y,
-                      TranslationProperties translation_properties,
-                      ImageProperties image_properties, int background_color) {
+                      const TranslationProperties &translation_properties,
+                      const ImageProperties &image_properties,
+                      int background_color) {
 
   Pixel image_pixel = translate_display_pixel_to_image(
       x, y, translation_properties, image_properties);
@@ -273,17 +292,16 @@ int get_current_pixel(int x, int y,
   // draw the pixel, otherwise draw the background color.
   if (image_pixel.in_bounds) {
 
-    // The row pointers contain RGBA data as one byte per channel: R, B, G
-    // and A.
-    unsigned int gray_color = convert_to_gray(
-        image_properties
-            .row_pointers[image_pixel.y][image_pixel.x_byte_index + 0],
-        image_properties
-            .row_pointers[image_pixel.y][image_pixel.x_byte_index + 1],
-        image_properties
-            .row_pointers[image_pixel.y][image_pixel.x_byte_index + 2],
-        image_properties
-            .row_pointers[image_pixel.y][image_pixel.x_byte_index + 3]);
+    const png_byte *source =
+        image_properties.row_pointers[image_pixel.y] + image_pixel.x_byte_index;
+
+    /* The row pointers contain either gray data, one byte per pixel, or RGBA
+     * data as one byte per channel: R, B, G and A.
+     */
+    unsigned int gray_color =
+        image_properties.bytes_per_pixel == 1
+            ? source[0]
+            : convert_to_gray(source[0], source[1], source[2], source[3]);
 
     /* If we're in 1 bit per pixel mode, then if a pixel is more than 50%
      * bright, make it white (1). Otherwise, black (0). If we're in 8 bit
@@ -368,61 +386,24 @@ get_translation_properties(Action action, ImageProperties image_properties) {
 }
 
 /***
- *  Receives an Action object with the key `image_filename`
- *  It loads the file and returns a byte array ready to be sent to the display
+ *  Render display rows first_row up to (but not including) end_row into
+ *  destination, which points at the first byte of first_row. The rows are
+ *  laid out exactly as in the full frame buffer.
  */
-std::vector<unsigned char> process_image(Action action) {
-
-  /* The bitmap frame buffer will consist of bytes (i.e. char)
-   * in a vector. For a 1-bit display, each byte represents 8
-   * 1-bit pixels. It will therefore be 1/8 of the width of the
-   * display, and its full height.
-   */
-  unsigned int bytes_per_row = DISPLAY_PROPERTIES.color_mode == COLOR_MODE_1BPP
-                                   ? DISPLAY_PROPERTIES.width / 8
-                                   : DISPLAY_PROPERTIES.width;
-
-  unsigned int frame_buffer_length =
-      static_cast<unsigned int>(bytes_per_row * DISPLAY_PROPERTIES.height);
-  std::vector<unsigned char> bitmap_frame_buffer(frame_buffer_length);
-
-  LOG_INFO << "Loading image file at: " << action.image_filename;
-
-  /* Populate the row pointers with pixel data from the PNG image,
-   * in RGBA format, using libpng -- and return the image width, height,
-   * and bytes_per_pixel
-   */
-  ImageProperties image_properties = read_png_file(action.image_filename);
-
-  LOG_DEBUG << "Image size: " << image_properties.width << "×"
-            << image_properties.height;
-  LOG_DEBUG << "Color type: " << image_properties.color_type;
-  LOG_DEBUG << "Bit depth: " << image_properties.bit_depth;
-  LOG_DEBUG << "Bytes per pixel: " << image_properties.bytes_per_pixel;
-  LOG_DEBUG << "Bytes per row: " << bytes_per_row;
-  LOG_DEBUG << "Is portrait: " << image_properties.is_portrait();
-
-  TranslationProperties translation_properties =
-      get_translation_properties(action, image_properties);
-
-  int background_color_for_color_mode =
-      DISPLAY_PROPERTIES.color_mode == COLOR_MODE_1BPP
-          ? (BACKGROUND_COLOR > 127)
-          : BACKGROUND_COLOR;
-
-  LOG_DEBUG << "Orientation: " << translation_properties.orientation << "°";
-  LOG_DEBUG << "Offset X: " << translation_properties.offset_x;
-  LOG_DEBUG << "Offset Y: " << translation_properties.offset_y;
-  LOG_DEBUG << "Background color: " << background_color_for_color_mode;
-
-  for (int y = 0; y < DISPLAY_PROPERTIES.height; y++) {
+void render_rows(int first_row, int end_row,
+                 const TranslationProperties &translation_properties,
+                 const ImageProperties &image_properties, int background_color,
+                 unsigned char *destination) {
+  unsigned int bytes_per_row = DISPLAY_PROPERTIES.bytes_per_row();
+
+  for (int y = first_row; y < end_row; y++) {
+    unsigned char *row = destination + (y - first_row) * bytes_per_row;
     int current_byte = 0;
 
     for (int x = 0; x < DISPLAY_PROPERTIES.width; x++) {
 
-      int current_pixel =
-          get_current_pixel(x, y, translation_properties, image_properties,
-                            background_color_for_color_mode);
+      int current_pixel = get_current_pixel(
+          x, y, translation_properties, image_properties, background_color);
 
       /* We now have x (between 0 and display_width - 1) and y (between 0 and
        * display_height - 1).
@@ -451,35 +432,324 @@ std::vector<unsigned char> process_image(Action action) {
           current_byte = current_byte | 1 << (7 - (x % 8));
         }
         if (x % 8 == 7) {
-          bitmap_frame_buffer[(y * bytes_per_row) + (x / 8)] =
-              static_cast<unsigned char>(current_byte);
+          row[x / 8] = static_cast<unsigned char>(current_byte);
           current_byte = 0;
         }
       } else {
         // In 8bpp mode, we can just push individual pixels into the frame
         // buffer as they take up an entire byte.
-        bitmap_frame_buffer[(y * bytes_per_row) + x] =
-            static_cast<unsigned char>(current_pixel);
+        row[x] = static_cast<unsigned char>(current_pixel);
       }
     }
   }
 
-  // Debug print byte frame buffer
+}
+
+/***
+ *  A decoded image, ready for rows of the display to be rendered from it
+ */
+struct RenderSource {
+  ImageProperties image_properties;
+  TranslationProperties translation_properties;
+  int background_color;
+};
+
+/***
+ *  Frees a RenderSource's rows when it goes out of scope, so they aren't
+ *  leaked if rendering throws. Freeing them again before then is harmless.
+ */
+struct DecodedRows {
+  ImageProperties &image_properties;
+  ~DecodedRows() { free_image_properties(image_properties); }
+};
+
+static RenderSource load_render_source(Action action) {
+  RenderSource source;
+
+  LOG_INFO << "Loading image file at: " << action.image_filename;
+
+  /* Populate the row pointers with pixel data from the image, in RGBA format,
+   * using the decoder for its format (libpng for PNGs) -- and return the
+   * image width, height, and bytes_per_pixel
+   */
+  ImageProperties &image_properties = source.image_properties;
+  if (action.image_bytes) {
+    image_properties =
+        read_image_memory(action.image_bytes->data(),
+                          action.image_bytes->size(), action.image_filename);
+  } else {
+    image_properties = read_image_file(action.image_filename);
+  }
+
+  LOG_DEBUG << "Image size: " << image_properties.width << "×"
+            << image_properties.height;
+  LOG_DEBUG << "Color type: " << image_properties.color_type;
+  LOG_DEBUG << "Bit depth: " << image_properties.bit_depth;
+  LOG_DEBUG << "Bytes per pixel: " << image_properties.bytes_per_pixel;
+  LOG_DEBUG << "Bytes per row: " << DISPLAY_PROPERTIES.bytes_per_row();
+  LOG_DEBUG << "Is portrait: " << image_properties.is_portrait();
+
+  source.translation_properties =
+      get_translation_properties(action, image_properties);
+
+  source.background_color = DISPLAY_PROPERTIES.color_mode == COLOR_MODE_1BPP
+                                ? (BACKGROUND_COLOR > 127)
+                                : BACKGROUND_COLOR;
+
+  LOG_DEBUG << "Orientation: " << source.translation_properties.orientation
+            << "°";
+  LOG_DEBUG << "Offset X: " << source.translation_properties.offset_x;
+  LOG_DEBUG << "Offset Y: " << source.translation_properties.offset_y;
+  LOG_DEBUG << "Background color: " << source.background_color;
+
+  return source;
+}
+
+/***
+ *  Render rows first_row to end_row - 1 of the display into destination,
+ *  on the render pool if there's more than one render thread
+ */
+static void render_rows_in_bands(int first_row, int end_row,
+                                 const RenderSource &source,
+                                 unsigned char *destination,
+                                 const std::atomic<bool> *cancelled) {
+  unsigned int bytes_per_row = DISPLAY_PROPERTIES.bytes_per_row();
+  unsigned int threads = get_render_threads();
+  int row_count = end_row - first_row;
+  auto is_cancelled = [cancelled]() { return cancelled && cancelled->load(); };
+
+  /* Split the rows into bands of whole rows. Each row starts on a new
+   * byte even in 1bpp mode, so no two bands ever write to the same byte
+   * and the workers need no locking. There are a few bands per thread so
+   * that a thread stuck on a busy part of the image doesn't hold up the
+   * rest.
+   */
+  int band_count = std::max(
+      1, std::min(row_count, static_cast<int>(threads * BANDS_PER_THREAD)));
+  int rows_per_band = (row_count + band_count - 1) / band_count;
+  // Bands rendered on the pool count towards the caller's request
+  RequestMemory *request_memory = current_request_memory();
+
+  auto render_band = [&](unsigned int band) {
+    int band_first_row = first_row + static_cast<int>(band) * rows_per_band;
+    int band_end_row = std::min(end_row, band_first_row + rows_per_band);
+    if (band_first_row < band_end_row && !is_cancelled()) {
+      TraceScope rendering("render", "render_rows", "first_row",
+                           band_first_row);
+      PerfScope counting(metrics().perf[RENDER]);
+      MemoryScope accounting(metrics().memory[RENDER], request_memory);
+      render_rows(band_first_row, band_end_row, source.translation_properties,
+                  source.image_properties, source.background_color,
+                  destination + (band_first_row - first_row) * bytes_per_row);
+    }
+  };
+
+  if (threads <= 1 || row_count < 2) {
+    for (int band = 0; band < band_count; band++) {
+      render_band(static_cast<unsigned int>(band));
+    }
+  } else {
+    get_render_pool()->parallel_for(static_cast<unsigned int>(band_count),
+                                    render_band);
+  }
+}
+
+/***
+ *  Receives an Action object with the key `image_filename`
+ *  It loads the file and returns a byte array ready to be sent to the display
+ *
+ *  If cancelled is given and gets set while the image is being processed,
+ *  this throws RenderCancelled once the image has been decoded, or after the
+ *  band of rows being rendered.
+ */
+std::vector<unsigned char> process_image(Action action,
+                                         const std::atomic<bool> *cancelled) {
+  std::vector<unsigned char> bitmap_frame_buffer;
+  process_image_into(action, bitmap_frame_buffer, cancelled);
+  return bitmap_frame_buffer;
+}
+
+/***
+ *  Like process_image, but renders into an existing frame buffer, so that
+ *  buffers can be reused from frame to frame without reallocating them. If
+ *  timings is given, the decode and render times are recorded in it.
+ */
+void process_image_into(Action action,
+                        std::vector<unsigned char> &bitmap_frame_buffer,
+                        const std::atomic<bool> *cancelled,
+                        StageTimings *timings) {
+
+  /* The bitmap frame buffer will consist of bytes (i.e. char)
+   * in a vector. For a 1-bit display, each byte represents 8
+   * 1-bit pixels. It will therefore be 1/8 of the width of the
+   * display, and its full height. Every byte is overwritten.
+   */
+  bitmap_frame_buffer.resize(DISPLAY_PROPERTIES.frame_buffer_length());
+
+  MonotonicClock::time_point started = MonotonicClock::now();
+  RenderSource source;
+  {
+    PerfScope counting(metrics().perf[DECODE]);
+    MemoryScope accounting(metrics().memory[DECODE]);
+    source = load_render_source(action);
+  }
+  DecodedRows decoded = {source.image_properties};
+  if (timings)
+    timings->decode_ms = elapsed_ms(started);
+
+  if (cancelled && *cancelled) {
+    throw RenderCancelled(action.image_filename);
+  }
+
+  started = MonotonicClock::now();
+  render_rows_in_bands(0, DISPLAY_PROPERTIES.height, source,
+                       bitmap_frame_buffer.data(), cancelled);
+  if (timings)
+    timings->render_ms = elapsed_ms(started);
+
+  free_image_properties(source.image_properties);
+
+  if (cancelled && *cancelled) {
+    throw RenderCancelled(action.image_filename);
+  }
+
+  // Keep a snapshot of the frame in the event log, in verbose mode
   IF_LOG(plog::verbose) {
-    std::stringstream debug_frame_buffer_line;
-    LOG_VERBOSE << "Frame buffer:";
-    for (unsigned int i = 0; i < bitmap_frame_buffer.size(); i++) {
-      if (i % 16 == 0 && i > 0) {
-        LOG_VERBOSE << debug_frame_buffer_line.str();
-        debug_frame_buffer_line.str("");
+    if (EventLog *log = get_event_log()) {
+      log->write(EVENT_FRAME,
+                 {DISPLAY_PROPERTIES.width, DISPLAY_PROPERTIES.height,
+                  DISPLAY_PROPERTIES.color_mode, action.image_filename,
+                  EventArg::blob(bitmap_frame_buffer.data(),
+                                 bitmap_frame_buffer.size())});
+    }
+  }
+}
+
+/***
+ *  Render an image a stripe of stripe_rows rows at a time, into a ring of
+ *  stripe_count stripe buffers, on a thread of its own. Meanwhile, the
+ *  calling thread passes each stripe to transmit as soon as it's rendered,
+ *  in order from the top of the frame, so the frame is never held in memory
+ *  all at once. Any error decoding the image is rethrown here, as is
+ *  RenderCancelled if cancelled is set before the last stripe is rendered.
+ *  If timings is given, the decode time and total time spent rendering are
+ *  recorded in it.
+ */
+void stream_image(
+    Action action, unsigned int stripe_rows, unsigned int stripe_count,
+    const std::function<void(const unsigned char *, size_t)> &transmit,
+    const std::atomic<bool> *cancelled, StageTimings *timings) {
+  unsigned int bytes_per_row = DISPLAY_PROPERTIES.bytes_per_row();
+  stripe_rows = std::max(1u, std::min(stripe_rows, static_cast<unsigned int>(
+                                                       DISPLAY_PROPERTIES
+                                                           .height)));
+  StripeRing ring(stripe_count, stripe_rows * bytes_per_row);
+
+  // Only the renderer writes these, and they're read after it's joined
+  double decode_ms = 0;
+  double render_ms = 0;
+  RequestMemory *request_memory = current_request_memory();
+  RequestArena *arena = current_arena();
+
+  std::thread renderer([&]() {
+    set_trace_thread_name("stripe renderer");
+    MemoryScope rendering_memory(metrics().memory[RENDER], request_memory);
+    // Decodes into the caller's arena, which it doesn't use meanwhile
+    ArenaScope allocating(arena);
+    try {
+      MonotonicClock::time_point started = MonotonicClock::now();
+      RenderSource source;
+      {
+        PerfScope counting(metrics().perf[DECODE]);
+        MemoryScope accounting(metrics().memory[DECODE]);
+        source = load_render_source(action);
       }
-      debug_frame_buffer_line << "0X" << setfill('0') << setw(2)
-                              << std::uppercase << std::hex
-                              << int(bitmap_frame_buffer[i]) << ",";
+      DecodedRows decoded = {source.image_properties};
+      decode_ms = elapsed_ms(started);
+      if (cancelled && *cancelled)
+        throw RenderCancelled(action.image_filename);
+      for (int first_row = 0; first_row < DISPLAY_PROPERTIES.height;
+           first_row += static_cast<int>(stripe_rows)) {
+        unsigned char *stripe = ring.acquire();
+        if (!stripe)
+          break;
+        int end_row = std::min(DISPLAY_PROPERTIES.height,
+                               first_row + static_cast<int>(stripe_rows));
+        started = MonotonicClock::now();
+        TraceScope rendering("render", "stripe", "first_row", first_row);
+        render_rows_in_bands(first_row, end_row, source, stripe, cancelled);
+        // Bands left out when it's cancelled mustn't reach the panel
+        if (cancelled && *cancelled)
+          throw RenderCancelled(action.image_filename);
+        render_ms += elapsed_ms(started);
+        ring.publish((end_row - first_row) * bytes_per_row);
+      }
+      free_image_properties(source.image_properties);
+      ring.close();
+    } catch (...) {
+      ring.close(std::current_exception());
+    }
+  });
+
+  try {
+    const unsigned char *stripe;
+    size_t length;
+    while (ring.next(&stripe, &length)) {
+      transmit(stripe, length);
+      ring.release();
     }
+  } catch (...) {
+    ring.abort();
+    renderer.join();
+    throw;
   }
+  renderer.join();
 
-  return bitmap_frame_buffer;
+  if (timings) {
+    timings->decode_ms = decode_ms;
+    timings->render_ms = render_ms;
+  }
+}
+
+/***
+ *  Like write_to_display(process_image(action)), but streamed to the panel
+ *  a stripe at a time
+ */
+void stream_to_display(Action action) {
+  Epd epd;
+  if (epd.Init() != 0) {
+    LOG_ERROR << "Display initialization failed";
+    return;
+  }
+
+  bool started = false;
+  stream_image(action, get_stripe_rows(), STRIPE_RING_LENGTH,
+               [&](const unsigned char *stripe, size_t length) {
+                 PerfScope counting(metrics().perf[UPLOAD]);
+                 if (!started) {
+                   epd.StartFrame();
+                   started = true;
+                 }
+                 traced_send_pixels(epd, stripe,
+                                    static_cast<unsigned int>(length));
+               });
+  epd.Refresh();
+  PerfScope counting(metrics().perf[BUSY]);
+  traced_wait_until_idle(epd);
+}
+
+void traced_send_pixels(Epd &epd, const unsigned char *pixels,
+                        unsigned int length) {
+  // Each byte of a 1bpp frame goes over SPI as 4
+  TraceScope sending("spi", "SendPixels", "bytes", length * 4);
+  epd.SendPixels(pixels, length);
+}
+
+void traced_wait_until_idle(Epd &epd, unsigned int poll_ms) {
+  while (epd.IsBusy()) {
+    TraceScope polling("panel", "WaitUntilIdle poll");
+    EpdIf::DelayMs(poll_ms);
+  }
 }
 
 /***
@@ -488,11 +758,22 @@ std::vector<unsigned char> process_image(Action action) {
  *  Waveshare to write the frame buffer to the device.
  */
 void write_to_display(std::vector<unsigned char> &bitmap_frame_buffer) {
+  write_to_display(bitmap_frame_buffer.data());
+}
+
+void write_to_display(const unsigned char *bitmap_frame_buffer) {
   Epd epd;
   if (epd.Init() != 0) {
     LOG_ERROR << "Display initialization failed";
   } else {
-    // send the frame buffer to the panel
-    epd.DisplayFrame(bitmap_frame_buffer.data());
+    // send the frame buffer to the panel, as DisplayFrame does
+    {
+      TraceScope sending("spi", "SendFrame");
+      PerfScope counting(metrics().perf[UPLOAD]);
+      epd.SendFrame(bitmap_frame_buffer);
+    }
+    epd.Refresh();
+    PerfScope counting(metrics().perf[BUSY]);
+    traced_wait_until_idle(epd);
   }
 }
@@ -28,19 +28,45 @@
 #include "cJSON.h"
 #include <png.h>
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <vector>
 
 using namespace std;
 
+class Epd;
+class ImageBytes;
+
 /* TODO:5001 Declare here functions that you will use in several files. Those
  * TODO:5001 functions should not be prefixed with `static` keyword. All other
  * TODO:5001 functions should.
  */
 
+// A rectangle of the display, in pixels
+struct DamageRect {
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
 struct Action {
   std::string type;
   std::string action;
   std::string image_filename;
+  /* "fd" or "inline" if the image's bytes come with the message, rather than
+   * being read from image_filename (see attach_payload in main.cpp)
+   */
+  std::string payload;
+  // The image's bytes, if they came with the message. image_filename then
+  // only describes where they came from, in logs and errors.
+  std::shared_ptr<const ImageBytes> image_bytes;
+  /* For `damage` actions, the parts of the shared framebuffer that have
+   * changed; none means all of it
+   */
+  std::vector<DamageRect> damage;
   bool offset_x_specified = false;
   int offset_x;
   bool offset_y_specified = false;
@@ -48,6 +74,9 @@ struct Action {
   bool orientation_specified;
   int orientation;
   bool action_is_refresh() { return action == string("refresh"); };
+  bool action_is_prerender() { return action == string("prerender"); };
+  bool action_is_damage() const { return action == string("damage"); };
+  bool action_is_trace() const { return action == string("trace"); };
   bool has_image_filename() { return image_filename != string(""); }
 };
 
@@ -66,6 +95,13 @@ struct DisplayProperties {
   int orientation;
   bool is_portrait() { return height > width; }
   std::string processor;
+  /* For a 1-bit display, each byte of the frame buffer represents 8 1-bit
+   * pixels, so a row is 1/8 of the width of the display.
+   */
+  unsigned int bytes_per_row() {
+    return color_mode == COLOR_MODE_1BPP ? width / 8 : width;
+  }
+  unsigned int frame_buffer_length() { return bytes_per_row() * height; }
 };
 
 struct TranslationProperties {
@@ -78,6 +114,26 @@ struct TranslationProperties {
   int orientation;
 };
 
+/***
+ *  How long each stage of a refresh took, in milliseconds. Rendering and
+ *  uploading overlap in striped mode, so there they add up to more than the
+ *  time they took together.
+ */
+struct StageTimings {
+  double parse_ms = 0;  // parsing the message
+  double decode_ms = 0; // reading and decoding the image, or mapping a frame
+  double render_ms = 0; // rendering the image into the display's format
+  double upload_ms = 0; // sending the frame to the panel over SPI
+  double busy_ms = 0;   // waiting for the panel to refresh
+  double total_ms = 0;  // from receiving the message to the panel being idle
+};
+
+// Timings are all taken on this clock, which never jumps
+typedef std::chrono::steady_clock MonotonicClock;
+
+double elapsed_ms(MonotonicClock::time_point since);
+
+// Parse a null-terminated message; see message_parser.h
 Action parse_message(const char *message);
 
 unsigned int convert_to_gray(unsigned int R, unsigned int G, unsigned int B,
@@ -85,8 +141,54 @@ unsigned int convert_to_gray(unsigned int R, unsigned int G, unsigned int B,
 
 void process_action(Action action);
 
-std::vector<unsigned char> process_image(Action action);
+std::shared_ptr<const ImageBytes>
+map_display_frame(const Action &action, const unsigned char **frame);
+
+void set_render_threads(unsigned int threads);
+
+unsigned int get_render_threads();
+
+// Stripe buffers in the ring used by stream_image in striped mode
+const unsigned int STRIPE_RING_LENGTH = 3;
+
+/* Rows per stripe in striped mode, where frames are streamed to the panel a
+ * stripe at a time; 0 (the default) renders whole frames
+ */
+void set_stripe_rows(unsigned int rows);
+
+unsigned int get_stripe_rows();
+
+std::vector<unsigned char> process_image(Action action,
+                                         const std::atomic<bool> *cancelled =
+                                             NULL);
+
+void process_image_into(Action action,
+                        std::vector<unsigned char> &bitmap_frame_buffer,
+                        const std::atomic<bool> *cancelled = NULL,
+                        StageTimings *timings = NULL);
+
+void stream_image(
+    Action action, unsigned int stripe_rows, unsigned int stripe_count,
+    const std::function<void(const unsigned char *, size_t)> &transmit,
+    const std::atomic<bool> *cancelled = NULL, StageTimings *timings = NULL);
+
+void stream_to_display(Action action);
+
+// How often Epd::WaitUntilIdle checks whether the panel is still busy
+const unsigned int EPD_BUSY_POLL_MS = 100;
+
+/* Epd::SendPixels and Epd::WaitUntilIdle, with a trace span for each chunk
+ * sent and each poll of BUSY, so that the Waveshare driver needn't know
+ * about tracing
+ */
+void traced_send_pixels(Epd &epd, const unsigned char *pixels,
+                        unsigned int length);
+
+void traced_wait_until_idle(Epd &epd,
+                            unsigned int poll_ms = EPD_BUSY_POLL_MS);
 
 void write_to_display(std::vector<unsigned char> &bitmap_frame_buffer);
 
+void write_to_display(const unsigned char *bitmap_frame_buffer);
+
 #endif
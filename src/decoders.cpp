@@ -0,0 +1,58 @@
+#include "decoders.h"
+#include "exceptions.h"
+#include "frame.h"
+#include "logger.h"
+#include "readpnm.h"
+#include "readqoi.h"
+
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <vector>
+
+static std::vector<ImageDecoder> &image_decoders() {
+  static std::vector<ImageDecoder> decoders = {
+      {"PNG", is_png_file, read_png_memory},
+      {"airpanel frame", is_frame_file, read_frame_memory},
+      {"PBM/PGM", is_pnm_file, read_pnm_memory},
+      {"QOI", is_qoi_file, read_qoi_memory}};
+  return decoders;
+}
+
+void register_image_decoder(const ImageDecoder &decoder) {
+  image_decoders().push_back(decoder);
+}
+
+const ImageDecoder *find_image_decoder(const unsigned char *magic,
+                                       size_t length) {
+  for (const ImageDecoder &decoder : image_decoders()) {
+    if (decoder.matches(magic, length))
+      return &decoder;
+  }
+  return NULL;
+}
+
+/***
+ *  Decode an image of any supported format into RGBA rows. The file is
+ *  mapped into memory once and decoded straight from the mapping.
+ */
+ImageProperties read_image_file(const std::string &filename) {
+  MappedFile file(filename);
+  return read_image_memory(file.data(), file.size(), filename);
+}
+
+/***
+ *  Decode an image that's already in memory, e.g. received over the socket
+ *  or held in a cache, without writing it to a file first
+ */
+ImageProperties read_image_memory(const unsigned char *data, size_t length,
+                                  const std::string &name) {
+  const ImageDecoder *decoder =
+      find_image_decoder(data, std::min(length, IMAGE_MAGIC_LENGTH));
+  if (!decoder) {
+    throw ImageDecodeError(name, "unrecognised image format");
+  }
+
+  LOG_DEBUG << "Decoding " << name << " as " << decoder->name;
+  return decoder->decode(data, length, name);
+}
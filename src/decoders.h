@@ -0,0 +1,43 @@
+#if !defined(AIRPANEL_DECODERS_H)
+#define AIRPANEL_DECODERS_H 1
+
+#include "readpng.h"
+
+#include <stddef.h>
+#include <string>
+
+/***
+ *  process_image doesn't care what format an image is in, as long as it can
+ *  be decoded into 8-bit RGBA or gray rows (see ImageProperties). Decoders
+ *  are picked by the magic bytes at the start of the file, so file
+ *  extensions don't matter.
+ */
+struct ImageDecoder {
+  const char *name;
+  // Returns true if the first bytes of a file (at most
+  // IMAGE_MAGIC_LENGTH of them) look like this decoder's format
+  bool (*matches)(const unsigned char *magic, size_t length);
+  // name is the file name, or a description of where the data came from, to
+  // report in errors
+  ImageProperties (*decode)(const unsigned char *data, size_t length,
+                            const std::string &name);
+};
+
+const size_t IMAGE_MAGIC_LENGTH = 32;
+
+/* Decoders are tried in the order they were registered, after the built-in
+ * PNG, airpanel frame, PBM/PGM and QOI decoders. Register any extra decoders
+ * at startup, before images are processed.
+ */
+void register_image_decoder(const ImageDecoder &decoder);
+
+const ImageDecoder *find_image_decoder(const unsigned char *magic,
+                                       size_t length);
+
+// Decodes into RGBA or gray rows
+ImageProperties read_image_file(const std::string &filename);
+
+ImageProperties read_image_memory(const unsigned char *data, size_t length,
+                                  const std::string &name);
+
+#endif
@@ -0,0 +1,330 @@
+#include "event_log.h"
+#include "exceptions.h"
+
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <plog/Record.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+static_assert(sizeof(EventRecord) == 72, "EventRecord has a fixed layout");
+static_assert(sizeof(EventLogHeader) == 24,
+              "EventLogHeader has a fixed layout");
+
+static const char EVENT_LOG_MAGIC[8] = {'A', 'P', 'E', 'V', 'L', 'O', 'G', 0};
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+// No argument, or record, is anywhere near this long
+static const uint32_t MAX_TAIL_LENGTH = 64 * 1024 * 1024;
+
+static const EventSchema SCHEMAS[EVENT_COUNT] = {
+    {"log", {"severity", "message"}},
+    {"refresh_queued", {"id", "image"}},
+    {"refresh_finished", {"id", "status", "error", "total_ms"}},
+    {"refresh_timings",
+     {"id", "parse_ms", "decode_ms", "render_ms", "upload_ms", "busy_ms"}},
+    {"frame", {"width", "height", "color_mode", "image", "frame"}},
+    {"message_received",
+     {"connection", "message", "payload_bytes", "payload"}},
+    {"refresh_memory", {"id", "allocations", "peak_bytes", "retained_bytes"}},
+};
+
+const EventSchema &event_schema(unsigned int event) {
+  static const EventSchema unknown = {"unknown", {}};
+  return event < EVENT_COUNT ? SCHEMAS[event] : unknown;
+}
+
+EventArg::EventArg(int value) : type(ARG_INT), integer(value) {}
+EventArg::EventArg(unsigned long value)
+    : type(ARG_INT), integer(static_cast<int64_t>(value)) {}
+EventArg::EventArg(int64_t value) : type(ARG_INT), integer(value) {}
+EventArg::EventArg(double value) : type(ARG_DOUBLE), real(value) {}
+EventArg::EventArg(const char *value)
+    : type(ARG_STRING), data(value), length(strlen(value)) {}
+EventArg::EventArg(const std::string &value)
+    : type(ARG_STRING), data(value.data()), length(value.size()) {}
+
+EventArg EventArg::blob(const void *data, size_t length) {
+  EventArg arg;
+  arg.type = ARG_BLOB;
+  arg.data = data;
+  arg.length = length;
+  return arg;
+}
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000ull +
+         static_cast<uint64_t>(now.tv_nsec);
+}
+
+EventLog::EventLog(const std::string &filename,
+                   unsigned int flush_interval_ms)
+    : filename(filename), flush_interval_ms(flush_interval_ms),
+      file(fopen(filename.c_str(), "wb")) {
+  if (!file)
+    throw EventLogError(filename, strerror(errno));
+  setvbuf(file, NULL, _IOFBF, 64 * 1024);
+
+  EventLogHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic));
+  header.version = EVENT_LOG_VERSION;
+  header.byte_order = BYTE_ORDER_MARK;
+  header.record_length = sizeof(EventRecord);
+  // Written out straight away, so the log can be read from the start
+  if (fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file) != 0) {
+    int error = errno;
+    fclose(file);
+    throw EventLogError(filename, strerror(error));
+  }
+
+  flusher = std::thread(&EventLog::flush_loop, this);
+}
+
+EventLog::~EventLog() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closing = true;
+  }
+  closing_changed.notify_all();
+  flusher.join();
+  check_written(fclose(file) == 0);
+}
+
+void EventLog::flush_loop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!closing) {
+    closing_changed.wait_for(lock,
+                             std::chrono::milliseconds(flush_interval_ms));
+    if (unflushed) {
+      check_written(fflush(file) == 0);
+      unflushed = false;
+    }
+  }
+}
+
+void EventLog::check_written(bool written) {
+  if (written || write_failed)
+    return;
+  write_failed = true;
+  fprintf(stderr, "Event log %s: couldn't write events, so some are "
+                  "missing: %s\n",
+          filename.c_str(), strerror(errno));
+}
+
+void EventLog::write(EventId event, std::initializer_list<EventArg> args) {
+  EventRecord record;
+  memset(&record, 0, sizeof(record));
+  record.time_ns = now_ns();
+  record.event = static_cast<uint16_t>(event);
+
+  // Compress any blobs before taking the lock; they're rare, and big
+  std::vector<std::vector<unsigned char>> blobs;
+  unsigned int index = 0;
+  uint32_t tail_length = 0;
+  for (const EventArg &arg : args) {
+    if (index == EVENT_MAX_ARGS)
+      break;
+    record.arg_types[index] = static_cast<uint8_t>(arg.type);
+    switch (arg.type) {
+    case ARG_INT:
+      memcpy(&record.args[index], &arg.integer, sizeof(arg.integer));
+      break;
+    case ARG_DOUBLE:
+      memcpy(&record.args[index], &arg.real, sizeof(arg.real));
+      break;
+    case ARG_STRING:
+      record.args[index] = tail_length | static_cast<uint64_t>(arg.length)
+                                             << 32;
+      tail_length += static_cast<uint32_t>(arg.length);
+      break;
+    case ARG_BLOB: {
+      uLongf compressed_length = compressBound(arg.length);
+      blobs.push_back(std::vector<unsigned char>(4 + compressed_length));
+      std::vector<unsigned char> &blob = blobs.back();
+      uint32_t raw_length = static_cast<uint32_t>(arg.length);
+      memcpy(blob.data(), &raw_length, 4);
+      compress2(blob.data() + 4, &compressed_length,
+                static_cast<const Bytef *>(arg.data), arg.length,
+                Z_BEST_SPEED);
+      blob.resize(4 + compressed_length);
+      record.args[index] = tail_length | static_cast<uint64_t>(blob.size())
+                                             << 32;
+      tail_length += static_cast<uint32_t>(blob.size());
+      break;
+    }
+    case ARG_NONE:
+      break;
+    }
+    index++;
+  }
+  record.tail_length = tail_length;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  bool written = fwrite(&record, sizeof(record), 1, file) == 1;
+  size_t blob_index = 0;
+  for (const EventArg &arg : args) {
+    if (arg.type == ARG_STRING) {
+      written &= fwrite(arg.data, 1, arg.length, file) == arg.length;
+    } else if (arg.type == ARG_BLOB) {
+      const std::vector<unsigned char> &blob = blobs[blob_index++];
+      written &= fwrite(blob.data(), 1, blob.size(), file) == blob.size();
+    }
+  }
+  check_written(written);
+  unflushed = true;
+}
+
+void EventLog::write(const plog::Record &record) {
+  write(EVENT_LOG_MESSAGE, {static_cast<int>(record.getSeverity()),
+                            record.getMessage()});
+}
+
+void EventLog::flush() {
+  std::lock_guard<std::mutex> lock(mutex);
+  check_written(fflush(file) == 0);
+  unflushed = false;
+}
+
+static std::atomic<EventLog *> event_log(nullptr);
+
+void set_event_log(EventLog *log) { event_log = log; }
+
+EventLog *get_event_log() { return event_log.load(); }
+
+EventLogReader::EventLogReader(const std::string &filename)
+    : filename(filename), file(fopen(filename.c_str(), "rb")) {
+  if (!file)
+    throw EventLogError(filename, strerror(errno));
+
+  EventLogHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic)) != 0) {
+    fclose(file);
+    throw EventLogError(filename, "not an event log");
+  }
+  if (header.byte_order != BYTE_ORDER_MARK) {
+    fclose(file);
+    throw EventLogError(filename, "written on a machine of the other "
+                                  "byte order");
+  }
+  if (header.version != EVENT_LOG_VERSION ||
+      header.record_length != sizeof(EventRecord)) {
+    fclose(file);
+    throw EventLogError(filename, "version " +
+                                      std::to_string(header.version) +
+                                      " isn't supported");
+  }
+}
+
+EventLogReader::~EventLogReader() { fclose(file); }
+
+bool EventLogReader::next(Event &event) {
+  EventRecord record;
+  if (fread(&record, sizeof(record), 1, file) != 1)
+    return false;
+  if (record.tail_length > MAX_TAIL_LENGTH)
+    throw EventLogError(filename, "a record is corrupt");
+  tail.resize(record.tail_length);
+  if (record.tail_length &&
+      fread(tail.data(), record.tail_length, 1, file) != 1)
+    return false;
+
+  event.time_ns = record.time_ns;
+  event.event = record.event;
+  event.args.clear();
+  for (unsigned int i = 0; i < EVENT_MAX_ARGS; i++) {
+    if (record.arg_types[i] == ARG_NONE)
+      break;
+    DecodedArg arg;
+    arg.type = static_cast<EventArgType>(record.arg_types[i]);
+    arg.integer = 0;
+    arg.real = 0;
+    uint32_t offset = static_cast<uint32_t>(record.args[i]);
+    uint32_t length = static_cast<uint32_t>(record.args[i] >> 32);
+    switch (arg.type) {
+    case ARG_INT:
+      memcpy(&arg.integer, &record.args[i], sizeof(arg.integer));
+      break;
+    case ARG_DOUBLE:
+      memcpy(&arg.real, &record.args[i], sizeof(arg.real));
+      break;
+    case ARG_STRING:
+      if (static_cast<uint64_t>(offset) + length > tail.size())
+        throw EventLogError(filename, "a record is corrupt");
+      arg.bytes.assign(tail.data() + offset, length);
+      break;
+    case ARG_BLOB: {
+      uint32_t raw_length;
+      if (length < 4 || static_cast<uint64_t>(offset) + length > tail.size())
+        throw EventLogError(filename, "a record is corrupt");
+      memcpy(&raw_length, tail.data() + offset, 4);
+      if (raw_length > MAX_TAIL_LENGTH)
+        throw EventLogError(filename, "a record is corrupt");
+      arg.bytes.resize(raw_length);
+      uLongf uncompressed_length = raw_length;
+      if (uncompress(reinterpret_cast<Bytef *>(&arg.bytes[0]),
+                     &uncompressed_length,
+                     reinterpret_cast<const Bytef *>(tail.data()) + offset + 4,
+                     length - 4) != Z_OK ||
+          uncompressed_length != raw_length)
+        throw EventLogError(filename, "a compressed argument is corrupt");
+      break;
+    }
+    default:
+      throw EventLogError(filename, "a record is corrupt");
+    }
+    event.args.push_back(arg);
+  }
+  return true;
+}
+
+std::string format_event(const Event &event) {
+  time_t seconds = static_cast<time_t>(event.time_ns / 1000000000ull);
+  struct tm t;
+  gmtime_r(&seconds, &t);
+  char line[64];
+  snprintf(line, sizeof(line), "%04d-%02d-%02d %02d:%02d:%02d.%06u ",
+           t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min,
+           t.tm_sec,
+           static_cast<unsigned int>(event.time_ns % 1000000000ull / 1000));
+  std::string text = line;
+
+  // Log messages read as they would in the text log
+  if (event.event == EVENT_LOG_MESSAGE && event.args.size() == 2 &&
+      event.args[0].type == ARG_INT) {
+    snprintf(line, sizeof(line), "%-5s ",
+             plog::severityToString(
+                 static_cast<plog::Severity>(event.args[0].integer)));
+    return text + line + event.args[1].bytes;
+  }
+
+  const EventSchema &schema = event_schema(event.event);
+  text += schema.name;
+  for (size_t i = 0; i < event.args.size(); i++) {
+    const DecodedArg &arg = event.args[i];
+    const char *name = schema.arg_names[i] ? schema.arg_names[i] : "?";
+    text += std::string(" ") + name + "=";
+    switch (arg.type) {
+    case ARG_INT:
+      text += std::to_string(arg.integer);
+      break;
+    case ARG_DOUBLE:
+      snprintf(line, sizeof(line), "%.3f", arg.real);
+      text += line;
+      break;
+    case ARG_STRING:
+      text += "\"" + arg.bytes + "\"";
+      break;
+    case ARG_BLOB:
+      text += "<" + std::to_string(arg.bytes.size()) + " bytes>";
+      break;
+    case ARG_NONE:
+      break;
+    }
+  }
+  return text;
+}
@@ -0,0 +1,184 @@
+#if !defined(AIRPANEL_EVENT_LOG_H)
+#define AIRPANEL_EVENT_LOG_H 1
+
+#include <plog/Appenders/IAppender.h>
+
+#include <condition_variable>
+#include <initializer_list>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+/***
+ *  A binary log of events, each a fixed-layout record of a timestamp, an
+ *  event id and up to EVENT_MAX_ARGS typed arguments, so that logging one
+ *  costs a copy into a buffer rather than formatting text. Strings, and
+ *  frame snapshots compressed with zlib, follow the record they belong to.
+ *  `airpanel-logdump` renders a log back to text, and its snapshots to PNG.
+ *
+ *  A log starts with an EventLogHeader, then each record is an EventRecord
+ *  followed by `tail_length` bytes, which string and blob arguments point
+ *  into. Everything is in the byte order of the machine that wrote it, which
+ *  the header records.
+ */
+enum EventId {
+  EVENT_LOG_MESSAGE,      // a plog record: severity, message
+  EVENT_REFRESH_QUEUED,   // id, image
+  EVENT_REFRESH_FINISHED, // id, status, error, total_ms
+  EVENT_REFRESH_TIMINGS,  // id, parse_ms, decode_ms, render_ms, upload_ms,
+                          // busy_ms
+  EVENT_FRAME,            // width, height, color_mode, image, frame
+  EVENT_MESSAGE_RECEIVED, // connection, message, and for an inline image,
+                          // payload_bytes and in verbose mode payload
+  EVENT_REFRESH_MEMORY,   // id, allocations, peak_bytes, retained_bytes
+  EVENT_COUNT
+};
+
+enum EventArgType { ARG_NONE, ARG_INT, ARG_DOUBLE, ARG_STRING, ARG_BLOB };
+
+const unsigned int EVENT_MAX_ARGS = 6;
+
+// The name of each event, and of its arguments, for decoding
+struct EventSchema {
+  const char *name;
+  const char *arg_names[EVENT_MAX_ARGS];
+};
+
+const EventSchema &event_schema(unsigned int event);
+
+struct EventLogHeader {
+  char magic[8];           // "APEVLOG\0"
+  uint32_t version;        // EVENT_LOG_VERSION
+  uint32_t byte_order;     // 0x01020304, as written
+  uint32_t record_length;  // sizeof(EventRecord)
+  uint32_t reserved;
+};
+
+const uint32_t EVENT_LOG_VERSION = 1;
+
+struct EventRecord {
+  uint64_t time_ns; // since the epoch
+  uint16_t event;
+  uint8_t arg_types[EVENT_MAX_ARGS];
+  uint32_t tail_length;
+  uint32_t reserved;
+  /* ARG_INT and ARG_DOUBLE arguments are stored in place. ARG_STRING and
+   * ARG_BLOB arguments are stored as the offset into the tail in the low 32
+   * bits, and length in the high 32; a blob there starts with the 4-byte
+   * length it decompresses to.
+   */
+  uint64_t args[EVENT_MAX_ARGS];
+};
+
+// An argument to write
+struct EventArg {
+  EventArgType type;
+  int64_t integer;
+  double real;
+  const void *data;
+  size_t length;
+
+  EventArg(int value);
+  EventArg(unsigned long value);
+  EventArg(int64_t value);
+  EventArg(double value);
+  EventArg(const char *value);
+  EventArg(const std::string &value);
+  // A blob, which is compressed as it's written
+  static EventArg blob(const void *data, size_t length);
+
+private:
+  EventArg() {}
+};
+
+// How long an event can sit in an EventLog's buffer before it's written out
+const unsigned int EVENT_LOG_FLUSH_MS = 1000;
+
+/***
+ *  Writes events to a file, from any thread. Records are buffered, and a
+ *  thread of the log's own writes them out within flush_interval_ms, as
+ *  well as when the log is flushed or closed, so the latest events reach
+ *  the file even once the daemon has gone quiet. As a plog appender, it
+ *  records each log message as an EVENT_LOG_MESSAGE. If events can't be
+ *  written, as when the disk is full, that's reported once on stderr: not
+ *  through plog, which would only log to the same file.
+ */
+class EventLog : public plog::IAppender {
+public:
+  // Throws EventLogError if the file can't be created
+  explicit EventLog(const std::string &filename,
+                    unsigned int flush_interval_ms = EVENT_LOG_FLUSH_MS);
+  virtual ~EventLog();
+
+  EventLog(const EventLog &) = delete;
+  EventLog &operator=(const EventLog &) = delete;
+
+  void write(EventId event, std::initializer_list<EventArg> args);
+  virtual void write(const plog::Record &record);
+  void flush();
+
+private:
+  void flush_loop();
+  // With the mutex held
+  void check_written(bool written);
+
+  std::string filename;
+  unsigned int flush_interval_ms;
+  FILE *file;
+  std::mutex mutex;
+  std::condition_variable closing_changed;
+  bool closing = false;
+  // Written to the buffer since it was last flushed
+  bool unflushed = false;
+  bool write_failed = false;
+  std::thread flusher;
+};
+
+/* The log that core and the pipeline record events in, if any. It must
+ * outlive anything that might log to it.
+ */
+void set_event_log(EventLog *log);
+EventLog *get_event_log();
+
+struct DecodedArg {
+  EventArgType type;
+  int64_t integer;
+  double real;
+  std::string bytes; // a string, or a decompressed blob
+};
+
+struct Event {
+  uint64_t time_ns;
+  unsigned int event;
+  std::vector<DecodedArg> args;
+};
+
+/***
+ *  Reads back the events in a log, throwing EventLogError if it isn't one
+ *  or is corrupt. A log cut short, as by a crash, just ends early.
+ */
+class EventLogReader {
+public:
+  explicit EventLogReader(const std::string &filename);
+  ~EventLogReader();
+
+  EventLogReader(const EventLogReader &) = delete;
+  EventLogReader &operator=(const EventLogReader &) = delete;
+
+  bool next(Event &event);
+
+private:
+  std::string filename;
+  FILE *file;
+  std::vector<char> tail;
+};
+
+/* Render an event as a line of text, without a trailing newline. Blobs are
+ * described rather than dumped.
+ */
+std::string format_event(const Event &event);
+
+#endif
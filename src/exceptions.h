@@ -1,3 +1,4 @@
+#pragma once
 #include <stdexcept>
 #include <string>
 
@@ -5,3 +6,50 @@ struct ImageFileNotFound : public std::runtime_error {
   ImageFileNotFound(std::string const &filename)
       : std::runtime_error("Image file not found: " + filename) {}
 };
+
+struct FrameFileError : public std::runtime_error {
+  FrameFileError(std::string const &filename, std::string const &reason)
+      : std::runtime_error("Frame file " + filename + ": " + reason) {}
+};
+
+struct EventLogError : public std::runtime_error {
+  EventLogError(std::string const &filename, std::string const &reason)
+      : std::runtime_error("Event log " + filename + ": " + reason) {}
+};
+
+struct SocketError : public std::runtime_error {
+  SocketError(std::string const &call, std::string const &reason)
+      : std::runtime_error("Socket error in " + call + ": " + reason) {}
+};
+
+struct FramingError : public std::runtime_error {
+  FramingError(std::string const &reason)
+      : std::runtime_error("Malformed message: " + reason) {}
+};
+
+struct MessageError : public std::runtime_error {
+  MessageError(std::string const &reason, size_t offset)
+      : std::runtime_error("Invalid message: " + reason + " (at byte " +
+                           std::to_string(offset) + ")") {}
+};
+
+struct PayloadError : public std::runtime_error {
+  PayloadError(std::string const &reason)
+      : std::runtime_error("Image payload error: " + reason) {}
+};
+
+struct SharedFramebufferError : public std::runtime_error {
+  SharedFramebufferError(std::string const &name, std::string const &reason)
+      : std::runtime_error("Shared framebuffer " + name + ": " + reason) {}
+};
+
+struct RenderCancelled : public std::runtime_error {
+  RenderCancelled(std::string const &filename)
+      : std::runtime_error("Rendering " + filename + " was cancelled") {}
+};
+
+struct ImageDecodeError : public std::runtime_error {
+  ImageDecodeError(std::string const &filename, std::string const &reason)
+      : std::runtime_error("Could not decode image file " + filename + ": " +
+                           reason) {}
+};
@@ -0,0 +1,183 @@
+#include "frame.h"
+#include "core.h"
+#include "exceptions.h"
+#include "readpng.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+extern DisplayProperties DISPLAY_PROPERTIES;
+
+static void put_uint32_le(unsigned char *destination, uint32_t value) {
+  destination[0] = static_cast<unsigned char>(value);
+  destination[1] = static_cast<unsigned char>(value >> 8);
+  destination[2] = static_cast<unsigned char>(value >> 16);
+  destination[3] = static_cast<unsigned char>(value >> 24);
+}
+
+static uint32_t get_uint32_le(const unsigned char *source) {
+  return static_cast<uint32_t>(source[0]) |
+         static_cast<uint32_t>(source[1]) << 8 |
+         static_cast<uint32_t>(source[2]) << 16 |
+         static_cast<uint32_t>(source[3]) << 24;
+}
+
+/***
+ *  The header describing a frame rendered for the current DISPLAY_PROPERTIES
+ */
+FrameHeader frame_header_for_display() {
+  FrameHeader header = {};
+  header.version = FRAME_FILE_VERSION;
+  header.width = DISPLAY_PROPERTIES.width;
+  header.height = DISPLAY_PROPERTIES.height;
+  header.color_mode = DISPLAY_PROPERTIES.color_mode;
+  header.bytes_per_row = DISPLAY_PROPERTIES.bytes_per_row();
+  header.data_offset = FRAME_FILE_HEADER_LENGTH;
+  return header;
+}
+
+/***
+ *  Write a frame buffer produced by process_image to an airpanel frame file
+ */
+void write_frame_file(const std::string &filename,
+                      const std::vector<unsigned char> &bitmap_frame_buffer) {
+  FrameHeader header = frame_header_for_display();
+
+  if (bitmap_frame_buffer.size() != header.data_length()) {
+    throw FrameFileError(filename,
+                         "frame buffer doesn't match the display geometry");
+  }
+
+  unsigned char encoded_header[FRAME_FILE_HEADER_LENGTH];
+  memcpy(encoded_header, FRAME_FILE_MAGIC, sizeof(FRAME_FILE_MAGIC));
+  put_uint32_le(encoded_header + 8, header.version);
+  put_uint32_le(encoded_header + 12, header.width);
+  put_uint32_le(encoded_header + 16, header.height);
+  put_uint32_le(encoded_header + 20, header.color_mode);
+  put_uint32_le(encoded_header + 24, header.bytes_per_row);
+  put_uint32_le(encoded_header + 28, header.data_offset);
+
+  /* The daemon maps frame files, so one mustn't be truncated or half
+   * written where it might be mapped: write a new file and rename it over
+   * the old one, which keeps its pages for as long as they're mapped
+   */
+  std::string temporary = filename + ".tmp";
+  FILE *fp;
+  if ((fp = fopen(temporary.c_str(), "wb")) == NULL) {
+    throw FrameFileError(filename, strerror(errno));
+  }
+
+  bool written =
+      fwrite(encoded_header, 1, sizeof(encoded_header), fp) ==
+          sizeof(encoded_header) &&
+      fwrite(bitmap_frame_buffer.data(), 1, bitmap_frame_buffer.size(), fp) ==
+          bitmap_frame_buffer.size();
+  written = fclose(fp) == 0 && written;
+
+  if (!written || rename(temporary.c_str(), filename.c_str()) != 0) {
+    unlink(temporary.c_str());
+    throw FrameFileError(filename, "could not be written");
+  }
+}
+
+bool is_frame_file(const unsigned char *data, size_t length) {
+  return length >= FRAME_FILE_HEADER_LENGTH &&
+         memcmp(data, FRAME_FILE_MAGIC, sizeof(FRAME_FILE_MAGIC)) == 0;
+}
+
+/***
+ *  Decode and sanity check the header of a mapped frame file, making sure the
+ *  frame data it describes is actually present
+ */
+FrameHeader read_frame_header(const std::string &filename,
+                              const unsigned char *data, size_t length) {
+  if (!is_frame_file(data, length)) {
+    throw FrameFileError(filename, "not an airpanel frame file");
+  }
+
+  FrameHeader header = {};
+  header.version = get_uint32_le(data + 8);
+  header.width = get_uint32_le(data + 12);
+  header.height = get_uint32_le(data + 16);
+  header.color_mode = get_uint32_le(data + 20);
+  header.bytes_per_row = get_uint32_le(data + 24);
+  header.data_offset = get_uint32_le(data + 28);
+
+  if (header.version != FRAME_FILE_VERSION) {
+    throw FrameFileError(filename, "unsupported version " +
+                                       std::to_string(header.version));
+  }
+  if (header.color_mode != COLOR_MODE_1BPP &&
+      header.color_mode != COLOR_MODE_8BPP) {
+    throw FrameFileError(filename, "unsupported color mode " +
+                                       std::to_string(header.color_mode));
+  }
+  uint32_t minimum_bytes_per_row = header.color_mode == COLOR_MODE_1BPP
+                                       ? header.width / 8
+                                       : header.width;
+  if (header.width == 0 || header.height == 0 ||
+      header.bytes_per_row < minimum_bytes_per_row) {
+    throw FrameFileError(filename, "invalid geometry");
+  }
+  if (header.data_offset < FRAME_FILE_HEADER_LENGTH ||
+      header.data_offset > length ||
+      length - header.data_offset < header.data_length()) {
+    throw FrameFileError(filename, "truncated frame data");
+  }
+
+  return header;
+}
+
+/***
+ *  A frame whose geometry and color mode match the display exactly can be
+ *  sent to it as-is
+ */
+bool frame_matches_display(const FrameHeader &header) {
+  FrameHeader display_header = frame_header_for_display();
+  return header.width == display_header.width &&
+         header.height == display_header.height &&
+         header.color_mode == display_header.color_mode &&
+         header.bytes_per_row == display_header.bytes_per_row;
+}
+
+/***
+ *  Expand a frame file into gray rows, so frames rendered for another
+ *  geometry or color mode can go through the regular translation path
+ */
+ImageProperties read_frame_memory(const unsigned char *data, size_t length,
+                                  const std::string &name) {
+  FrameHeader header = read_frame_header(name, data, length);
+
+  ImageProperties image_properties = {};
+  image_properties.width = header.width;
+  image_properties.height = header.height;
+  image_properties.color_type = PNG_COLOR_TYPE_GRAY;
+  image_properties.bit_depth = static_cast<png_byte>(header.color_mode);
+  image_properties.bytes_per_pixel = 1;
+
+  allocate_image_rows(image_properties,
+                      static_cast<size_t>(image_properties.width) *
+                          image_properties.bytes_per_pixel,
+                      name);
+
+  for (int y = 0; y < image_properties.height; y++) {
+    const unsigned char *source =
+        data + header.data_offset + y * header.bytes_per_row;
+    png_bytep row = image_properties.row_pointers[y];
+
+    for (int x = 0; x < image_properties.width; x++) {
+      // Any pixels past the last whole byte of a 1bpp row are never drawn
+      png_byte gray = 0xFF;
+      if (header.color_mode == COLOR_MODE_8BPP) {
+        gray = source[x];
+      } else if (static_cast<uint32_t>(x / 8) < header.bytes_per_row) {
+        gray = ((source[x / 8] >> (7 - (x % 8))) & 1) * 0xFF;
+      }
+      row[x] = gray;
+    }
+  }
+
+  return image_properties;
+}
@@ -0,0 +1,62 @@
+#if !defined(AIRPANEL_FRAME_H)
+#define AIRPANEL_FRAME_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/***
+ *  Airpanel frame files (.apf) hold a frame buffer exactly as process_image
+ *  produces it and the display consumes it, so they can be rendered ahead of
+ *  time and shown without any decoding. The file starts with a fixed 32 byte
+ *  header; all fields are little-endian unsigned 32-bit integers:
+ *
+ *    offset  field
+ *    0       magic, the 8 bytes "APFRAME\0"
+ *    8       format version, currently 1
+ *    12      width of the display in pixels
+ *    16      height of the display in pixels
+ *    20      color mode, i.e. bits per pixel (1 or 8)
+ *    24      bytes per row of frame data
+ *    28      offset of the frame data from the start of the file (32)
+ *
+ *  The frame data follows: height rows of bytes_per_row bytes each. In 1bpp
+ *  mode each byte holds 8 pixels, most significant bit first, 1 being white.
+ */
+
+const char FRAME_FILE_MAGIC[8] = {'A', 'P', 'F', 'R', 'A', 'M', 'E', '\0'};
+const uint32_t FRAME_FILE_VERSION = 1;
+const uint32_t FRAME_FILE_HEADER_LENGTH = 32;
+const char *const FRAME_FILE_EXTENSION = ".apf";
+
+struct FrameHeader {
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t color_mode;
+  uint32_t bytes_per_row;
+  uint32_t data_offset;
+  uint64_t data_length() const {
+    return static_cast<uint64_t>(bytes_per_row) * height;
+  }
+};
+
+struct ImageProperties;
+
+FrameHeader frame_header_for_display();
+
+void write_frame_file(const std::string &filename,
+                      const std::vector<unsigned char> &bitmap_frame_buffer);
+
+bool is_frame_file(const unsigned char *data, size_t length);
+
+FrameHeader read_frame_header(const std::string &filename,
+                              const unsigned char *data, size_t length);
+
+bool frame_matches_display(const FrameHeader &header);
+
+ImageProperties read_frame_memory(const unsigned char *data, size_t length,
+                                  const std::string &name);
+
+#endif
@@ -0,0 +1,120 @@
+#include "framing.h"
+#include "exceptions.h"
+
+#include <algorithm>
+#include <string.h>
+
+FrameReader::FrameReader(size_t max_message_length)
+    : max_length(max_message_length) {}
+
+char *FrameReader::prepare(size_t length) {
+  if (buffer.size() - end >= length)
+    return &buffer[end];
+
+  // Move the unread bytes to the front before growing the buffer
+  if (begin > 0) {
+    memmove(&buffer[0], &buffer[begin], end - begin);
+    end -= begin;
+    scanned -= begin;
+    begin = 0;
+  }
+  if (buffer.size() - end < length) {
+    buffer.resize(std::max(buffer.size() * 2, end + length));
+  }
+  return &buffer[end];
+}
+
+void FrameReader::commit(size_t length) { end += length; }
+
+static size_t read_length_prefix(const char *prefix) {
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(prefix);
+  return static_cast<size_t>(bytes[0]) << 24 |
+         static_cast<size_t>(bytes[1]) << 16 |
+         static_cast<size_t>(bytes[2]) << 8 | static_cast<size_t>(bytes[3]);
+}
+
+bool FrameReader::next(std::string &message, Framing &framing) {
+  while (begin < end) {
+    if (buffer[begin] == '\0') {
+      if (end - begin < LENGTH_PREFIX_BYTES)
+        return false;
+      size_t length = read_length_prefix(&buffer[begin]);
+      if (length > max_length)
+        throw FramingError("a message of " + std::to_string(length) +
+                           " bytes is too long");
+      if (end - begin < LENGTH_PREFIX_BYTES + length)
+        return false;
+
+      message.assign(&buffer[begin + LENGTH_PREFIX_BYTES], length);
+      framing = LENGTH_PREFIXED_FRAMING;
+      begin += LENGTH_PREFIX_BYTES + length;
+      scanned = begin;
+    } else {
+      size_t from = std::max(scanned, begin);
+      const char *newline = static_cast<const char *>(
+          memchr(&buffer[from], '\n', end - from));
+      if (!newline) {
+        scanned = end;
+        if (end - begin > max_length)
+          throw FramingError("a message of more than " +
+                             std::to_string(max_length) +
+                             " bytes is too long");
+        return false;
+      }
+
+      size_t length = static_cast<size_t>(newline - &buffer[begin]);
+      size_t next_begin = begin + length + 1;
+      if (length > 0 && buffer[begin + length - 1] == '\r')
+        length--;
+      message.assign(&buffer[begin], length);
+      framing = NEWLINE_FRAMING;
+      begin = next_begin;
+      scanned = begin;
+      if (message.empty())
+        continue;
+    }
+
+    if (begin == end) {
+      begin = scanned = end = 0;
+    }
+    return true;
+  }
+
+  begin = scanned = end = 0;
+  return false;
+}
+
+bool FrameReader::finish(std::string &message, Framing &framing) {
+  if (next(message, framing))
+    return true;
+  if (begin == end)
+    return false;
+
+  if (buffer[begin] == '\0') {
+    throw FramingError("the connection closed " + std::to_string(end - begin) +
+                       " bytes into a length-prefixed message");
+  }
+
+  message.assign(&buffer[begin], end - begin);
+  framing = NEWLINE_FRAMING;
+  begin = scanned = end = 0;
+  return message.find_first_not_of(" \t\r") != std::string::npos;
+}
+
+std::string frame_message(const std::string &message, Framing framing) {
+  std::string framed;
+  if (framing == LENGTH_PREFIXED_FRAMING) {
+    size_t length = message.size();
+    framed.reserve(LENGTH_PREFIX_BYTES + length);
+    framed += static_cast<char>((length >> 24) & 0xff);
+    framed += static_cast<char>((length >> 16) & 0xff);
+    framed += static_cast<char>((length >> 8) & 0xff);
+    framed += static_cast<char>(length & 0xff);
+    framed += message;
+  } else {
+    framed.reserve(message.size() + 1);
+    framed += message;
+    framed += '\n';
+  }
+  return framed;
+}
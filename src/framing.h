@@ -0,0 +1,66 @@
+#if !defined(AIRPANEL_FRAMING_H)
+#define AIRPANEL_FRAMING_H 1
+
+#include <string>
+#include <vector>
+
+/***
+ *  Messages on the socket are framed one of two ways, and a client can mix
+ *  them freely on one connection:
+ *
+ *  - newline-delimited: the message followed by '\n' (a trailing '\r' is
+ *    dropped, as are blank lines), which is what `echo ... | nc -U` sends
+ *  - length-prefixed: the message's length as a 4-byte big-endian integer,
+ *    followed by that many bytes, for messages that may contain newlines
+ *
+ *  Messages are limited to well under 16 MB, so a length prefix always
+ *  starts with a zero byte, which no JSON message can. Replies are framed
+ *  the same way as the message they answer.
+ */
+enum Framing { NEWLINE_FRAMING, LENGTH_PREFIXED_FRAMING };
+
+const size_t LENGTH_PREFIX_BYTES = 4;
+
+/***
+ *  Collects the bytes a connection has sent, and splits them into messages.
+ *  Reads go straight into the buffer, which grows to fit the longest message
+ *  seen, and bytes already scanned for a newline aren't scanned again, so
+ *  pipelining many messages, or trickling a long one in a byte at a time,
+ *  stays linear.
+ */
+class FrameReader {
+public:
+  explicit FrameReader(size_t max_message_length);
+
+  /* Make room for at least `length` more bytes and return where to put
+   * them, then commit however many were actually read
+   */
+  char *prepare(size_t length);
+  void commit(size_t length);
+
+  /* Take the next complete message off the buffer, returning false if there
+   * isn't one yet. Throws FramingError if the message is too long.
+   */
+  bool next(std::string &message, Framing &framing);
+
+  /* Once the client has hung up, take what's left as a final message, so
+   * that clients which don't end their message with a newline still work.
+   * Throws FramingError if a length-prefixed message was cut short.
+   */
+  bool finish(std::string &message, Framing &framing);
+
+  size_t buffered() const { return end - begin; }
+  size_t capacity() const { return buffer.size(); }
+
+private:
+  std::vector<char> buffer;
+  size_t begin = 0;   // start of the first unread message
+  size_t scanned = 0; // no newline between begin and here
+  size_t end = 0;     // end of the bytes read so far
+  size_t max_length;
+};
+
+// Frame a reply, or a message, for sending
+std::string frame_message(const std::string &message, Framing framing);
+
+#endif
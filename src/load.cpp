@@ -0,0 +1,541 @@
+/***
+ *  airpanel-load: send a daemon messages on any number of connections, to a
+ *  schedule replayed from an event log written with `airpanel --event-log`
+ *  or at an open-loop arrival rate, and report throughput, how many
+ *  refreshes were coalesced and end-to-end latency percentiles.
+ *
+ *  Messages are sent on schedule whether or not earlier ones have been
+ *  answered, as real clients would, so a slow daemon shows up as latency
+ *  rather than as a slower sender.
+ */
+#include "cJSON.h"
+#include "event_log.h"
+#include "exceptions.h"
+#include "framing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <errno.h>
+#include <getopt.h>
+#include <map>
+#include <mutex>
+#include <random>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+extern const char *__progname;
+
+typedef std::chrono::steady_clock Clock;
+
+// Replies are no longer than this
+static const size_t MAX_REPLY_BYTES = 64 * 1024;
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: %s -s SOCKET_PATH [OPTIONS] (-r EVENT_LOG | IMG_PATH...)\n",
+          __progname);
+  fprintf(stderr, "\n");
+  fprintf(stderr, " -h, --help               display help and exit\n");
+  fprintf(stderr, " -s, --socket PATH        the daemon's socket\n");
+  fprintf(stderr, " -d, --daemon AIRPANEL    run AIRPANEL with a simulated "
+                  "panel on the socket\n"
+                  "                          for the length of the run\n");
+  fprintf(stderr, " -r, --replay EVENT_LOG   replay the messages recorded "
+                  "in an event log\n");
+  fprintf(stderr, " -x, --time-scale SCALE   replay SCALE times as fast; 0 "
+                  "sends everything at once\n");
+  fprintf(stderr, " -c, --clients COUNT      connections to send on "
+                  "(default 1)\n");
+  fprintf(stderr, " -R, --rate RATE          refresh IMG_PATHs in turn, RATE "
+                  "times a second on\n"
+                  "                          average, arriving at random\n");
+  fprintf(stderr, " -n, --count COUNT        refreshes to send at --rate "
+                  "(default 100)\n");
+  fprintf(stderr, " -w, --wait SECONDS       how long to wait for the last "
+                  "replies (default 60)\n");
+}
+
+// A message, and when to send it, in ms from the start of the run
+struct Send {
+  double at_ms;
+  unsigned int client;
+  std::string message;
+};
+
+// Recorded messages that can't be replayed, so weren't scheduled
+struct Skipped {
+  // Their descriptor was passed with SCM_RIGHTS, and isn't in the log
+  unsigned long passed_fd = 0;
+  // Their inline image was left out of the log, as it is outside verbose mode
+  unsigned long inline_unrecorded = 0;
+};
+
+// What's known about a message that's been sent
+struct Sent {
+  Clock::time_point sent_at;
+  double queued_ms;
+};
+
+/***
+ *  Everything the reply readers have found out, shared between them
+ */
+struct Results {
+  std::mutex mutex;
+  // Sent but not yet given their immediate reply, per client, in order
+  std::vector<std::deque<Clock::time_point>> awaiting_reply;
+  // Queued but not yet finished, by request id
+  std::map<unsigned long, Sent> in_flight;
+  std::vector<double> queued_ms, displayed_ms, superseded_ms, failed_ms;
+  unsigned long rejected = 0;
+  unsigned long ignored = 0;
+  // The daemon's own timings of displayed refreshes, summed
+  double busy_ms = 0;
+};
+
+static double ms_between(Clock::time_point from, Clock::time_point to) {
+  return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+static std::string refresh_message(const std::string &image) {
+  cJSON *message = cJSON_CreateObject();
+  cJSON_AddStringToObject(message, "type", "message");
+  cJSON *data = cJSON_AddObjectToObject(message, "data");
+  cJSON_AddStringToObject(data, "action", "refresh");
+  cJSON_AddStringToObject(data, "image", image.c_str());
+  char *printed = cJSON_PrintUnformatted(message);
+  std::string text = printed;
+  free(printed);
+  cJSON_Delete(message);
+  return text;
+}
+
+// The "payload" a message's data asks for, if any
+static std::string payload_type(const std::string &json) {
+  cJSON *message = cJSON_Parse(json.c_str());
+  cJSON *payload =
+      cJSON_GetObjectItem(cJSON_GetObjectItem(message, "data"), "payload");
+  std::string type = cJSON_IsString(payload) ? payload->valuestring : "";
+  cJSON_Delete(message);
+  return type;
+}
+
+/***
+ *  Schedule the messages in an event log at the times they were received,
+ *  spreading the daemon's connections over ours in the order they appeared.
+ *  Messages whose image wasn't recorded are counted in skipped instead, as
+ *  the daemon could only reject them.
+ */
+static std::vector<Send> replay_schedule(const std::string &filename,
+                                         double time_scale,
+                                         unsigned int clients,
+                                         Skipped &skipped) {
+  std::vector<Send> schedule;
+  std::map<int64_t, unsigned int> client_for_connection;
+  EventLogReader reader(filename);
+  Event event;
+  uint64_t first_ns = 0;
+  while (reader.next(event)) {
+    if (event.event != EVENT_MESSAGE_RECEIVED || event.args.size() < 2)
+      continue;
+    std::string message = event.args[1].bytes;
+    if (event.args.size() >= 3 && event.args[2].integer > 0) {
+      if (event.args.size() < 4) {
+        skipped.inline_unrecorded++;
+        continue;
+      }
+      message += '\0';
+      message += event.args[3].bytes;
+    }
+    if (payload_type(event.args[1].bytes) == "fd") {
+      skipped.passed_fd++;
+      continue;
+    }
+    if (schedule.empty())
+      first_ns = event.time_ns;
+    auto found = client_for_connection.find(event.args[0].integer);
+    if (found == client_for_connection.end()) {
+      unsigned int client =
+          static_cast<unsigned int>(client_for_connection.size()) % clients;
+      found =
+          client_for_connection.insert({event.args[0].integer, client}).first;
+    }
+    double at_ms = time_scale > 0
+                       ? (event.time_ns - first_ns) / 1e6 / time_scale
+                       : 0;
+    schedule.push_back(Send{at_ms, found->second, message});
+  }
+  return schedule;
+}
+
+/***
+ *  Schedule count refreshes of the images in turn, as a Poisson process:
+ *  the gaps between them are random, averaging 1 / rate seconds
+ */
+static std::vector<Send> rate_schedule(const std::vector<std::string> &images,
+                                       double rate, unsigned long count,
+                                       unsigned int clients) {
+  std::vector<Send> schedule;
+  std::mt19937 random(1);
+  std::exponential_distribution<double> gap_s(rate > 0 ? rate : 1);
+  double at_ms = 0;
+  for (unsigned long i = 0; i < count; i++) {
+    schedule.push_back(Send{at_ms, static_cast<unsigned int>(i % clients),
+                            refresh_message(images[i % images.size()])});
+    if (rate > 0)
+      at_ms += gap_s(random) * 1000;
+  }
+  return schedule;
+}
+
+static int connect_to(const std::string &path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    throw SocketError("socket", strerror(errno));
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ==
+      -1) {
+    int error = errno;
+    close(fd);
+    throw SocketError("connect", strerror(error));
+  }
+  return fd;
+}
+
+/***
+ *  Start the daemon on the socket with a simulated panel, and wait for it
+ *  to accept connections
+ */
+static pid_t start_daemon(const std::string &airpanel,
+                          const std::string &socket_path) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+    execl(airpanel.c_str(), airpanel.c_str(), "-S", "-s", socket_path.c_str(),
+          static_cast<char *>(NULL));
+    _exit(127);
+  }
+  if (pid == -1)
+    throw SocketError("fork", strerror(errno));
+
+  for (int attempt = 0; attempt < 100; attempt++) {
+    try {
+      close(connect_to(socket_path));
+      return pid;
+    } catch (SocketError &) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+  }
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  throw SocketError("connect", "the daemon didn't start listening");
+}
+
+/***
+ *  Read a client's replies until it's closed, matching each immediate reply
+ *  with the message it answers, and each final reply with the refresh
+ */
+static void read_replies(int fd, unsigned int client, Results &results) {
+  FrameReader input(MAX_REPLY_BYTES);
+  std::string reply;
+  Framing framing;
+  while (true) {
+    ssize_t length = read(fd, input.prepare(4096), 4096);
+    if (length <= 0)
+      return;
+    input.commit(static_cast<size_t>(length));
+    Clock::time_point now = Clock::now();
+
+    while (input.next(reply, framing)) {
+      cJSON *json = cJSON_Parse(reply.c_str());
+      cJSON *status = cJSON_GetObjectItem(json, "status");
+      cJSON *id = cJSON_GetObjectItem(json, "id");
+      std::string status_text =
+          cJSON_IsString(status) ? status->valuestring : "";
+      unsigned long request_id =
+          cJSON_IsNumber(id) ? static_cast<unsigned long>(id->valuedouble) : 0;
+
+      std::lock_guard<std::mutex> lock(results.mutex);
+      if (status_text == "displayed" || status_text == "failed" ||
+          status_text == "superseded") {
+        auto found = results.in_flight.find(request_id);
+        if (found != results.in_flight.end()) {
+          double latency_ms = ms_between(found->second.sent_at, now);
+          if (status_text == "displayed") {
+            results.displayed_ms.push_back(latency_ms);
+            cJSON *busy = cJSON_GetObjectItem(
+                cJSON_GetObjectItem(json, "timings"), "busy_ms");
+            if (cJSON_IsNumber(busy))
+              results.busy_ms += busy->valuedouble;
+          } else if (status_text == "failed") {
+            results.failed_ms.push_back(latency_ms);
+          } else {
+            results.superseded_ms.push_back(latency_ms);
+          }
+          results.in_flight.erase(found);
+        }
+      } else if (!results.awaiting_reply[client].empty()) {
+        Clock::time_point sent_at = results.awaiting_reply[client].front();
+        results.awaiting_reply[client].pop_front();
+        double queued_ms = ms_between(sent_at, now);
+        if (status_text == "queued") {
+          results.queued_ms.push_back(queued_ms);
+          results.in_flight[request_id] = Sent{sent_at, queued_ms};
+        } else if (status_text == "error") {
+          results.rejected++;
+        } else {
+          results.ignored++;
+        }
+      }
+      cJSON_Delete(json);
+    }
+  }
+}
+
+// The value below which fraction of the sorted values fall
+static double percentile(const std::vector<double> &sorted, double fraction) {
+  if (sorted.empty())
+    return 0;
+  size_t rank = static_cast<size_t>(fraction * sorted.size() + 0.5);
+  return sorted[std::min(sorted.size() - 1, rank ? rank - 1 : 0)];
+}
+
+static void print_latencies(const char *name, std::vector<double> values) {
+  if (values.empty())
+    return;
+  std::sort(values.begin(), values.end());
+  printf("  %-12s %8zu %10.2f %10.2f %10.2f %10.2f\n", name, values.size(),
+         percentile(values, 0.5), percentile(values, 0.9),
+         percentile(values, 0.99), values.back());
+}
+
+int main(int argc, char *argv[]) {
+  static struct option long_options[] = {
+      {"help", no_argument, 0, 'h'},
+      {"socket", required_argument, 0, 's'},
+      {"daemon", required_argument, 0, 'd'},
+      {"replay", required_argument, 0, 'r'},
+      {"time-scale", required_argument, 0, 'x'},
+      {"clients", required_argument, 0, 'c'},
+      {"rate", required_argument, 0, 'R'},
+      {"count", required_argument, 0, 'n'},
+      {"wait", required_argument, 0, 'w'},
+      {0, 0, 0, 0}};
+  std::string socket_path, daemon, replay;
+  double time_scale = 1, rate = 0, wait_s = 60;
+  long clients = 1, count = 100;
+  char *end;
+  int ch;
+  while ((ch = getopt_long(argc, argv, "hs:d:r:x:c:R:n:w:", long_options,
+                           0)) != -1) {
+    switch (ch) {
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'd':
+      daemon = optarg;
+      break;
+    case 'r':
+      replay = optarg;
+      break;
+    case 'x':
+      time_scale = strtod(optarg, &end);
+      if (*end || time_scale < 0) {
+        fprintf(stderr, "The time scale must be 0 or more\n");
+        return 1;
+      }
+      break;
+    case 'c':
+      clients = strtol(optarg, &end, 0);
+      if (*end || clients < 1 || clients > 1000) {
+        fprintf(stderr, "There must be between 1 and 1000 clients\n");
+        return 1;
+      }
+      break;
+    case 'R':
+      rate = strtod(optarg, &end);
+      if (*end || rate < 0) {
+        fprintf(stderr, "The rate must be 0 or more\n");
+        return 1;
+      }
+      break;
+    case 'n':
+      count = strtol(optarg, &end, 0);
+      if (*end || count < 1) {
+        fprintf(stderr, "The count must be a positive number\n");
+        return 1;
+      }
+      break;
+    case 'w':
+      wait_s = strtod(optarg, &end);
+      if (*end || wait_s < 0) {
+        fprintf(stderr, "The wait must be 0 or more seconds\n");
+        return 1;
+      }
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  std::vector<std::string> images(argv + optind, argv + argc);
+  if (socket_path.empty() || replay.empty() == images.empty()) {
+    usage();
+    return 1;
+  }
+
+  std::vector<Send> schedule;
+  Skipped skipped;
+  try {
+    schedule = replay.empty()
+                   ? rate_schedule(images, rate, count,
+                                   static_cast<unsigned int>(clients))
+                   : replay_schedule(replay, time_scale,
+                                     static_cast<unsigned int>(clients),
+                                     skipped);
+  } catch (EventLogError &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  if (schedule.empty()) {
+    fprintf(stderr, "There are no messages to send\n");
+    return 1;
+  }
+
+  pid_t daemon_pid = 0;
+  Results results;
+  results.awaiting_reply.resize(clients);
+  std::vector<int> fds;
+  std::vector<std::thread> readers;
+  try {
+    if (!daemon.empty())
+      daemon_pid = start_daemon(daemon, socket_path);
+    for (long client = 0; client < clients; client++) {
+      fds.push_back(connect_to(socket_path));
+    }
+  } catch (SocketError &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  for (long client = 0; client < clients; client++) {
+    readers.push_back(std::thread(read_replies, fds[client],
+                                  static_cast<unsigned int>(client),
+                                  std::ref(results)));
+  }
+
+  // Send each message on time, without waiting for replies
+  Clock::time_point started = Clock::now();
+  double most_behind_ms = 0;
+  for (const Send &send : schedule) {
+    Clock::time_point due =
+        started + std::chrono::duration_cast<Clock::duration>(
+                      std::chrono::duration<double, std::milli>(send.at_ms));
+    std::this_thread::sleep_until(due);
+    // Recorded messages may have been length-prefixed, and contain newlines
+    std::string framed = frame_message(send.message, LENGTH_PREFIXED_FRAMING);
+    Clock::time_point now = Clock::now();
+    most_behind_ms = std::max(most_behind_ms, ms_between(due, now));
+    {
+      std::lock_guard<std::mutex> lock(results.mutex);
+      results.awaiting_reply[send.client].push_back(now);
+    }
+    if (::send(fds[send.client], framed.data(), framed.size(), MSG_NOSIGNAL) !=
+        static_cast<ssize_t>(framed.size())) {
+      fprintf(stderr, "Couldn't send to the daemon: %s\n", strerror(errno));
+      break;
+    }
+  }
+  double sending_s = ms_between(started, Clock::now()) / 1000;
+
+  // Wait for every refresh to end one way or another, or until --wait
+  Clock::time_point give_up =
+      Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                         std::chrono::duration<double>(wait_s));
+  while (Clock::now() < give_up) {
+    {
+      std::lock_guard<std::mutex> lock(results.mutex);
+      bool answered = results.in_flight.empty();
+      for (const auto &awaiting : results.awaiting_reply) {
+        answered = answered && awaiting.empty();
+      }
+      if (answered)
+        break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  double total_s = ms_between(started, Clock::now()) / 1000;
+
+  for (int fd : fds) {
+    shutdown(fd, SHUT_RDWR);
+  }
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+  for (int fd : fds) {
+    close(fd);
+  }
+  if (daemon_pid) {
+    kill(daemon_pid, SIGTERM);
+    waitpid(daemon_pid, NULL, 0);
+  }
+
+  std::lock_guard<std::mutex> lock(results.mutex);
+  size_t displayed = results.displayed_ms.size();
+  size_t superseded = results.superseded_ms.size();
+  size_t finished = displayed + superseded + results.failed_ms.size();
+  size_t unanswered = results.in_flight.size();
+  for (const auto &awaiting : results.awaiting_reply) {
+    unanswered += awaiting.size();
+  }
+
+  printf("Sent %zu messages on %ld connection%s in %.2f s (%.2f/s), at most "
+         "%.2f ms behind schedule\n",
+         schedule.size(), clients, clients == 1 ? "" : "s", sending_s,
+         sending_s > 0 ? schedule.size() / sending_s : 0.0, most_behind_ms);
+  if (skipped.passed_fd) {
+    printf("Skipped %lu recorded message%s that passed a descriptor, which "
+           "can't be replayed\n",
+           skipped.passed_fd, skipped.passed_fd == 1 ? "" : "s");
+  }
+  if (skipped.inline_unrecorded) {
+    printf("Skipped %lu recorded message%s whose inline image wasn't "
+           "recorded; record with --verbose to keep them\n",
+           skipped.inline_unrecorded,
+           skipped.inline_unrecorded == 1 ? "" : "s");
+  }
+  printf("Replies: %zu queued, %lu rejected, %lu ignored, %zu unanswered\n",
+         results.queued_ms.size(), results.rejected, results.ignored,
+         unanswered);
+  printf("Refreshes: %zu displayed (%.2f/s), %zu superseded (%.1f%% "
+         "coalesced), %zu failed\n",
+         displayed, total_s > 0 ? displayed / total_s : 0.0, superseded,
+         finished ? 100.0 * superseded / finished : 0.0,
+         results.failed_ms.size());
+  if (displayed) {
+    printf("Panel busy %.1f%% of the run\n",
+           100 * results.busy_ms / 1000 / total_s);
+  }
+  printf("Latency (ms)     count        p50        p90        p99        "
+         "max\n");
+  print_latencies("queued", results.queued_ms);
+  print_latencies("displayed", results.displayed_ms);
+  print_latencies("superseded", results.superseded_ms);
+  print_latencies("failed", results.failed_ms);
+  return unanswered || results.rejected ? 1 : 0;
+}
@@ -1,34 +1,51 @@
 #pragma once
-#include <iomanip>
 #include <plog/Record.h>
 #include <plog/Util.h>
+#include <stdio.h>
+#include <string.h>
 
 namespace plog {
 template <bool useUtcTime> class AirpanelTxtFormatterImpl {
 public:
   static util::nstring header() { return util::nstring(); }
 
+  /* Records come many to a second, so the "YYYY-MM-DD HH:MM:SS." prefix is
+   * only rebuilt when the second changes. Each thread keeps its own, as
+   * records are formatted on whichever thread writes them.
+   */
   static util::nstring format(const Record &record) {
-    tm t;
-    (useUtcTime ? util::gmtime_s : util::localtime_s)(&t,
-                                                      &record.getTime().time);
+    static thread_local time_t prefix_time = -1;
+    static thread_local char prefix[32];
+    static thread_local size_t prefix_length = 0;
 
-    util::nostringstream ss;
-    ss << t.tm_year + 1900 << "-" << std::setfill(PLOG_NSTR('0'))
-       << std::setw(2) << t.tm_mon + 1 << PLOG_NSTR("-")
-       << std::setfill(PLOG_NSTR('0')) << std::setw(2) << t.tm_mday
-       << PLOG_NSTR(" ");
-    ss << std::setfill(PLOG_NSTR('0')) << std::setw(2) << t.tm_hour
-       << PLOG_NSTR(":") << std::setfill(PLOG_NSTR('0')) << std::setw(2)
-       << t.tm_min << PLOG_NSTR(":") << std::setfill(PLOG_NSTR('0'))
-       << std::setw(2) << t.tm_sec << PLOG_NSTR(".")
-       << std::setfill(PLOG_NSTR('0')) << std::setw(3)
-       << record.getTime().millitm << PLOG_NSTR(" ");
-    ss << std::setfill(PLOG_NSTR(' ')) << std::setw(5) << std::left
-       << severityToString(record.getSeverity()) << PLOG_NSTR(" ");
-    ss << record.getMessage() << PLOG_NSTR("\n");
+    const util::Time &time = record.getTime();
+    if (time.time != prefix_time) {
+      tm t;
+      (useUtcTime ? util::gmtime_s : util::localtime_s)(&t, &time.time);
+      int length = snprintf(prefix, sizeof(prefix),
+                            "%04d-%02d-%02d %02d:%02d:%02d.",
+                            t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+                            t.tm_hour, t.tm_min, t.tm_sec);
+      prefix_length = length > 0 ? static_cast<size_t>(length) : 0;
+      prefix_time = time.time;
+    }
 
-    return ss.str();
+    // Milliseconds and severity, padded as "123 DEBUG "
+    char middle[16];
+    int middle_length = snprintf(middle, sizeof(middle), "%03u %-5s ",
+                                 static_cast<unsigned int>(time.millitm),
+                                 severityToString(record.getSeverity()));
+
+    const util::nchar *message = record.getMessage();
+    size_t message_length = strlen(message);
+
+    util::nstring formatted;
+    formatted.reserve(prefix_length + middle_length + message_length + 1);
+    formatted.append(prefix, prefix_length);
+    formatted.append(middle, static_cast<size_t>(middle_length));
+    formatted.append(message, message_length);
+    formatted += PLOG_NSTR('\n');
+    return formatted;
   }
 };
 
@@ -0,0 +1,120 @@
+/***
+ *  airpanel-logdump: print an event log written with `airpanel
+ *  --event-log` as text, and optionally save its frame snapshots as PNGs.
+ */
+#include "constants.h"
+#include "event_log.h"
+#include "exceptions.h"
+
+#include <getopt.h>
+#include <png.h>
+#include <stdio.h>
+#include <string>
+
+extern const char *__progname;
+
+static void usage(void) {
+  fprintf(stderr, "Usage: %s [-p PNG_DIR] EVENT_LOG\n", __progname);
+  fprintf(stderr, "\n");
+  fprintf(stderr, " -h, --help             display help and exit\n");
+  fprintf(stderr, " -p, --png-dir PNG_DIR  save each frame snapshot as "
+                  "PNG_DIR/frame-N.png\n");
+}
+
+/***
+ *  Save a frame, in the display's format, as a grayscale PNG: 1bpp frames
+ *  are already packed the way PNG packs 1-bit rows, with white as 1
+ */
+static bool write_frame_png(const std::string &filename, int width,
+                            int height, int color_mode,
+                            const std::string &frame) {
+  unsigned int bit_depth = color_mode == COLOR_MODE_1BPP ? 1 : 8;
+  size_t row_length = color_mode == COLOR_MODE_1BPP ? width / 8 : width;
+  if (width <= 0 || height <= 0 ||
+      frame.size() < row_length * static_cast<size_t>(height)) {
+    fprintf(stderr, "Frame for %s doesn't match its size\n",
+            filename.c_str());
+    return false;
+  }
+
+  FILE *file = fopen(filename.c_str(), "wb");
+  if (!file) {
+    perror(filename.c_str());
+    return false;
+  }
+  png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = png_create_info_struct(png);
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_write_struct(&png, &info);
+    fclose(file);
+    fprintf(stderr, "Couldn't write %s\n", filename.c_str());
+    return false;
+  }
+  png_init_io(png, file);
+  png_set_IHDR(png, info, width, height, bit_depth, PNG_COLOR_TYPE_GRAY,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+  for (int row = 0; row < height; row++) {
+    png_write_row(png, reinterpret_cast<png_const_bytep>(frame.data()) +
+                           row * row_length);
+  }
+  png_write_end(png, NULL);
+  png_destroy_write_struct(&png, &info);
+  fclose(file);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  static struct option long_options[] = {{"help", no_argument, 0, 'h'},
+                                         {"png-dir", required_argument, 0, 'p'},
+                                         {0, 0, 0, 0}};
+  std::string png_directory;
+  int ch;
+  while ((ch = getopt_long(argc, argv, "hp:", long_options, 0)) != -1) {
+    switch (ch) {
+    case 'p':
+      png_directory = optarg;
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+    return 1;
+  }
+
+  try {
+    EventLogReader reader(argv[optind]);
+    Event event;
+    unsigned int frames = 0;
+    bool ok = true;
+    while (reader.next(event)) {
+      std::string line = format_event(event);
+      if (event.event == EVENT_FRAME && !png_directory.empty() &&
+          event.args.size() == 5 && event.args[4].type == ARG_BLOB) {
+        std::string filename = png_directory + "/frame-" +
+                               std::to_string(frames++) + ".png";
+        if (write_frame_png(filename, static_cast<int>(event.args[0].integer),
+                            static_cast<int>(event.args[1].integer),
+                            static_cast<int>(event.args[2].integer),
+                            event.args[4].bytes)) {
+          line += " saved=" + filename;
+        } else {
+          ok = false;
+        }
+      }
+      printf("%s\n", line.c_str());
+    }
+    return ok ? 0 : 1;
+  } catch (EventLogError &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+}
@@ -5,24 +5,63 @@ extern struct DisplayProperties DISPLAY_PROPERTIES;
 
 #include <algorithm>
 #include <cctype>
+#include <chrono>
 #include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/socket.h>
-#include <sys/time.h>
-#include <sys/un.h>
+#include <string.h>
 #include <vector>
 
+#include "arena.h"
+#include "async_appender.h"
 #include "core.h"
+#include "epdif.h"
+#include "event_log.h"
+#include "mapped_file.h"
+#include "memory_accounting.h"
+#include "message_parser.h"
+#include "metrics.h"
+#include "metrics_server.h"
+#include "perf_counters.h"
+#include "pipeline.h"
+#include "prerender.h"
+#include "readpng.h"
+#include "server.h"
+#include "shared_framebuffer.h"
+#include "thread_pool.h"
+#include "trace.h"
 extern const char *__progname;
 
+/* Records are written out on a thread of their own, so that a slow terminal
+ * or SD card doesn't hold up rendering. The file appender and event log are
+ * declared first so that they outlive the async appender, which writes out
+ * what's left in its ring when the program exits.
+ */
+static std::unique_ptr<
+    plog::RollingFileAppender<plog::AirpanelTxtFormatterUtcTime>>
+    fileAppender;
+static std::unique_ptr<EventLog> eventLog;
+static plog::AsyncAppender asyncAppender;
+
+// Where local producers can draw frames, if --framebuffer was given
+static std::shared_ptr<SharedFramebuffer> shared_framebuffer;
+
+// Recent trace events, and where to dump them, if --trace was given
+static std::unique_ptr<TraceBuffer> traceBuffer;
+static std::string trace_filename;
+// Writes the dumps asked for over the socket, off the server's thread
+static std::unique_ptr<ThreadPool> traceWriter;
+
 static void usage(void) {
   /* TODO:3002 Don't forget to update the usage block with the most
    * TODO:3002 important options. */
   fprintf(stderr, "Usage: %s [-s SOCKET_PATH | -a refresh] [OPTIONS]\n",
           __progname);
+  fprintf(stderr, "       %s -a prerender -O OUTPUT_DIR [OPTIONS] IMG_PATH...\n",
+          __progname);
   fprintf(stderr, "Version: %s\n", PACKAGE_VERSION);
   fprintf(stderr, "\n");
   fprintf(stderr, "Options available in both socket and CLI modes:\n");
@@ -31,6 +70,13 @@ static void usage(void) {
   fprintf(stderr, " -V, --verbose               switch on verbose logging\n");
   fprintf(stderr, " -D, --debug                 switch on debug logging\n");
   fprintf(stderr, " -l, --logfile LOGFILE       log to a file\n");
+  fprintf(stderr, " -E, --event-log FILE        record events and messages "
+                  "to a binary log, with\n"
+                  "                             frames and inline images in "
+                  "verbose mode; read it\n"
+                  "                             with airpanel-logdump "
+                  "or replay it with\n"
+                  "                             airpanel-load\n");
   fprintf(stderr,
           " -W, --width WIDTH           set the display's native width\n");
   fprintf(stderr,
@@ -39,10 +85,35 @@ static void usage(void) {
                   "90, 180 or 270\n");
   fprintf(stderr,
           " -p, --processor PROCESSOR   set processor to BCM2835 or IT8951\n");
+  fprintf(stderr, " -T, --render-threads COUNT  number of threads rendering "
+                  "each image\n");
+  fprintf(stderr, " -R, --stripe-rows ROWS      stream frames to the panel "
+                  "in stripes of ROWS rows\n");
+  fprintf(stderr, " -S, --simulate              drive a simulated panel "
+                  "instead of the hardware\n");
+  fprintf(stderr, " -g, --gray-decode           decode PNGs straight to gray, "
+                  "within a few levels\n");
+  fprintf(stderr, " -t, --trace FILE            trace each stage, dumping "
+                  "Chrome trace JSON to FILE\n"
+                  "                             on exit or a `trace` "
+                  "message\n");
+  fprintf(stderr, " -P, --profile               count cycles, instructions "
+                  "and misses per stage,\n"
+                  "                             for --metrics or printed "
+                  "after a CLI action\n");
+  fprintf(stderr, " -m, --memory                count bytes allocated per "
+                  "stage and per refresh,\n"
+                  "                             for --metrics and the "
+                  "logs\n");
   fprintf(stderr, "\n");
   fprintf(stderr, "Options available in socket mode:\n");
   fprintf(stderr,
           " -s, --socket SOCKET_PATH,   listen on a specified socket\n");
+  fprintf(stderr, " -F, --framebuffer NAME      share a framebuffer in POSIX "
+                  "shared memory\n");
+  fprintf(stderr, " -M, --metrics ADDRESS       serve Prometheus metrics on "
+                  "a socket path or a\n"
+                  "                             port on 127.0.0.1\n");
   fprintf(stderr, "\n");
   fprintf(stderr, "Options available in CLI mode:\n");
   fprintf(stderr, " -a, --action refresh        display an image and exit\n");
@@ -52,17 +123,232 @@ static void usage(void) {
   fprintf(stderr,
           " -y, --offset-y OFFSET_PX    set the image top offset in px\n");
   fprintf(stderr, "\n");
+  fprintf(stderr, "Options available in prerender mode:\n");
+  fprintf(stderr, " -a, --action prerender      render images to frame files "
+                  "and exit\n");
+  fprintf(stderr, " -O, --output-dir DIR        directory to write .apf frame "
+                  "files to\n");
+  fprintf(stderr, " -j, --jobs THREADS          number of images to render at "
+                  "once\n");
+  fprintf(stderr, "\n");
 }
 
+// Milliseconds on the monotonic clock
 inline double get_time() {
-  struct timeval t;
-  struct timezone tzp;
-  gettimeofday(&t, &tzp);
-  return t.tv_sec + t.tv_usec * 1e-6 * 1000;
+  return std::chrono::duration<double, std::milli>(
+             MonotonicClock::now().time_since_epoch())
+      .count();
+}
+
+/***
+ *  Reply to a message as soon as it has been queued (or rejected), as one
+ *  line of JSON, rather than leaving the client blocked for the seconds a
+ *  refresh takes
+ */
+static std::string reply(const char *status, unsigned long id,
+                         const char *error) {
+  cJSON *reply = cJSON_CreateObject();
+  cJSON_AddStringToObject(reply, "status", status);
+  if (id)
+    cJSON_AddNumberToObject(reply, "id", static_cast<double>(id));
+  if (error)
+    cJSON_AddStringToObject(reply, "error", error);
+
+  char *printed = cJSON_PrintUnformatted(reply);
+  std::string line(printed);
+  cJSON_free(printed);
+  cJSON_Delete(reply);
+  return line;
+}
+
+/***
+ *  The final reply to a refresh, once it's on the panel (or isn't going to
+ *  be), with how long each stage took
+ */
+static std::string result_reply(const RefreshResult &result) {
+  cJSON *reply = cJSON_CreateObject();
+  cJSON_AddStringToObject(reply, "status", result.status);
+  cJSON_AddNumberToObject(reply, "id", static_cast<double>(result.id));
+  if (!result.error.empty())
+    cJSON_AddStringToObject(reply, "error", result.error.c_str());
+
+  cJSON *timings = cJSON_AddObjectToObject(reply, "timings");
+  cJSON_AddNumberToObject(timings, "parse_ms", result.timings.parse_ms);
+  cJSON_AddNumberToObject(timings, "decode_ms", result.timings.decode_ms);
+  cJSON_AddNumberToObject(timings, "render_ms", result.timings.render_ms);
+  cJSON_AddNumberToObject(timings, "upload_ms", result.timings.upload_ms);
+  cJSON_AddNumberToObject(timings, "busy_ms", result.timings.busy_ms);
+  cJSON_AddNumberToObject(timings, "total_ms", result.timings.total_ms);
+
+  char *printed = cJSON_PrintUnformatted(reply);
+  std::string line(printed);
+  cJSON_free(printed);
+  cJSON_Delete(reply);
+  return line;
+}
+
+/***
+ *  Producers can hand over an image's bytes with the message, instead of
+ *  writing it to a file and sending its path. It's decoded, or displayed if
+ *  it's a frame for this display, straight from where it is:
+ *
+ *  - "payload": "fd" takes the oldest descriptor the client has passed with
+ *    SCM_RIGHTS (usually a memfd), and maps it if it's sealed against
+ *    shrinking and writing, or copies it otherwise
+ *  - "payload": "inline" takes the bytes that follow the JSON and a '\0' in
+ *    the same message, which must be length-prefixed (see framing.h)
+ */
+static void attach_payload(Action &action, const std::string &message,
+                           PassedFds &passed_fds) {
+  if (action.payload == "fd") {
+    int fd = passed_fds.take();
+    if (fd == -1)
+      throw PayloadError("no descriptor was passed with the message");
+    action.image_filename = "image passed as fd " + std::to_string(fd);
+    action.image_bytes =
+        std::make_shared<MappedFile>(fd, action.image_filename);
+  } else if (action.payload == "inline") {
+    size_t json_length = strlen(message.c_str());
+    if (json_length + 1 >= message.size())
+      throw PayloadError("no image followed the message");
+    action.image_filename = "image sent inline";
+    action.image_bytes = std::make_shared<InlineImageBytes>(
+        message.data() + json_length + 1, message.size() - json_length - 1);
+  } else {
+    throw PayloadError("unknown payload type '" + action.payload + "'");
+  }
+}
+
+/***
+ *  Dump the trace ring to the --trace file, for opening in Perfetto
+ */
+static bool write_trace() {
+  if (!traceBuffer)
+    return false;
+  if (!traceBuffer->write_json(trace_filename)) {
+    LOG_ERROR << "Couldn't write the trace to " << trace_filename << ": "
+              << strerror(errno);
+    return false;
+  }
+  LOG_INFO << "Wrote "
+           << std::min<uint64_t>(traceBuffer->recorded(),
+                                 traceBuffer->capacity())
+           << " trace events to " << trace_filename;
+  return true;
+}
+
+/***
+ *  Record a message for airpanel-load to replay. An inline payload can be
+ *  megabytes, and compressing it would hold up the socket thread, so it's
+ *  only kept in verbose mode, as frames are; otherwise just its length is.
+ */
+static void log_message_received(EventLog &log, unsigned long connection,
+                                 const std::string &message,
+                                 size_t json_length) {
+  if (json_length + 1 >= message.size()) {
+    log.write(EVENT_MESSAGE_RECEIVED, {connection, message});
+    return;
+  }
+  std::string json = message.substr(0, json_length);
+  unsigned long payload_bytes = message.size() - json_length - 1;
+  IF_LOG(plog::verbose) {
+    log.write(EVENT_MESSAGE_RECEIVED,
+              {connection, json, payload_bytes,
+               EventArg::blob(message.data() + json_length + 1,
+                              payload_bytes)});
+    return;
+  }
+  log.write(EVENT_MESSAGE_RECEIVED, {connection, json, payload_bytes});
+}
+
+/***
+ *  Refreshes get two replies: "queued" straight away, and the result once
+ *  the refresh has ended. action is parsed into in place, so that once its
+ *  strings have grown to fit, parsing a message allocates nothing.
+ */
+static std::string handle_message(RefreshPipeline &pipeline,
+                                  const std::string &message,
+                                  PassedFds &passed_fds,
+                                  const Responder &responder, Action &action) {
+  MonotonicClock::time_point received_at = MonotonicClock::now();
+  // Any inline payload follows the JSON and a '\0'
+  size_t json_length = strnlen(message.data(), message.size());
+  LOG_DEBUG << "Received message: " << message.substr(0, json_length);
+  // For replaying with airpanel-load
+  if (EventLog *log = get_event_log()) {
+    log_message_received(*log, responder.connection(), message, json_length);
+  }
+  metrics().messages.fetch_add(1, std::memory_order_relaxed);
+
+  try {
+    parse_message(message.data(), json_length, action);
+  } catch (MessageError &e) {
+    // Don't leave a descriptor it was passed for the next message to take
+    passed_fds.drop_through_message();
+    LOG_ERROR << e.what();
+    return reply("error", 0, e.what());
+  }
+
+  try {
+    StageTimings timings;
+    timings.parse_ms = elapsed_ms(received_at);
+    // Claim the payload even if it won't be used, so the next message
+    // doesn't take its descriptor
+    if (!action.payload.empty()) {
+      attach_payload(action, message, passed_fds);
+    }
+    if (action.action_is_damage()) {
+      if (!shared_framebuffer) {
+        return reply("error", 0,
+                     "there's no shared framebuffer to refresh from; "
+                     "start airpanel with --framebuffer");
+      }
+      action.image_filename =
+          "shared framebuffer " + shared_framebuffer->name();
+      action.image_bytes = shared_framebuffer;
+    } else if (action.action_is_trace()) {
+      if (!traceBuffer) {
+        return reply("error", 0,
+                     "tracing is off; start airpanel with --trace");
+      }
+      // Writing megabytes of JSON would hold up every other client, so the
+      // only reply comes once it's written
+      traceWriter->submit([responder]() {
+        responder.send(write_trace()
+                           ? reply("traced", 0, NULL)
+                           : reply("error", 0, "couldn't write the trace"));
+      });
+      return std::string();
+    } else if (!action.action_is_refresh()) {
+      return reply("ignored", 0, NULL);
+    }
+    if (!action.has_image_filename()) {
+      LOG_WARNING << "Message with `refresh` action received, but no "
+                     "`image` was provided";
+      return reply("error", 0, "no image was provided");
+    }
+    unsigned long id = pipeline.submit(
+        action,
+        [responder](const RefreshResult &result) {
+          responder.send(result_reply(result));
+        },
+        timings);
+    LOG_DEBUG << "Queued request " << id;
+    return reply("queued", id, NULL);
+  } catch (exception &e) {
+    LOG_ERROR << e.what();
+    return reply("error", 0, e.what());
+  }
 }
 
 int main(int argc, char *argv[]) {
-  plog::init(plog::debug, &colorConsoleAppender);
+  asyncAppender.addAppender(&colorConsoleAppender);
+  plog::init(plog::debug, &asyncAppender);
+
+  // Before anything is allocated with cJSON, since they must be freed by
+  // the hook that allocated them
+  cJSON_Hooks hooks = {arena_malloc, arena_free};
+  cJSON_InitHooks(&hooks);
 
   Action cli_action;
   cli_action.type = "cli";
@@ -86,13 +372,31 @@ int main(int argc, char *argv[]) {
       {"orientation", required_argument, 0, 'o'},
       {"image", required_argument, 0, 'i'},
       {"logfile", required_argument, 0, 'l'},
+      {"event-log", required_argument, 0, 'E'},
+      {"output-dir", required_argument, 0, 'O'},
+      {"jobs", required_argument, 0, 'j'},
+      {"render-threads", required_argument, 0, 'T'},
+      {"gray-decode", no_argument, 0, 'g'},
+      {"simulate", no_argument, 0, 'S'},
+      {"stripe-rows", required_argument, 0, 'R'},
+      {"framebuffer", required_argument, 0, 'F'},
+      {"metrics", required_argument, 0, 'M'},
+      {"trace", required_argument, 0, 't'},
+      {"profile", no_argument, 0, 'P'},
+      {"memory", no_argument, 0, 'm'},
       {0, 0, 0, 0}};
 
   char *endptr;
   string optarg_string;
   bool verbose_mode = false;
-
-  while ((ch = getopt_long(argc, argv, "hVDva:W:H:c:p:o:i:s:x:y:b:l:",
+  std::vector<std::string> prerender_images_filenames;
+  std::string output_directory;
+  unsigned int jobs = ThreadPool::default_thread_count();
+  bool render_threads_specified = false;
+  std::string framebuffer_name;
+  std::string metrics_address;
+
+  while ((ch = getopt_long(argc, argv, "hVDva:W:H:c:p:o:i:s:x:y:b:l:E:O:j:T:gSR:F:M:t:Pm",
                            long_options, 0)) != -1) {
 
     if (ch == -1) {
@@ -126,15 +430,29 @@ int main(int argc, char *argv[]) {
     }
 
     case 'l': {
-      static plog::RollingFileAppender<plog::AirpanelTxtFormatterUtcTime>
-          fileAppender(optarg, 100000, 3);
-      plog::get()->addAppender(&fileAppender);
+      fileAppender.reset(
+          new plog::RollingFileAppender<plog::AirpanelTxtFormatterUtcTime>(
+              optarg, 100000, 3));
+      asyncAppender.addAppender(fileAppender.get());
       LOG_INFO << "------------------------------------------------------------"
                   "--------------------";
       LOG_INFO << "Airpanel started; logging to " << optarg;
       break;
     }
 
+    case 'E': {
+      try {
+        eventLog.reset(new EventLog(optarg));
+      } catch (EventLogError &e) {
+        LOG_ERROR << e.what();
+        exit(1);
+      }
+      asyncAppender.addAppender(eventLog.get());
+      set_event_log(eventLog.get());
+      LOG_INFO << "Recording events to " << optarg;
+      break;
+    }
+
     case 'o': {
       int valid_orientations[] = {0, 90, 180, 270};
       long int orientation = strtol(optarg, &endptr, 0);
@@ -231,7 +549,7 @@ int main(int argc, char *argv[]) {
 
     case 'a': {
       optarg_string.assign(optarg);
-      string valid_actions[] = {"refresh"};
+      string valid_actions[] = {"refresh", "prerender"};
       std::transform(optarg_string.begin(), optarg_string.end(),
                      optarg_string.begin(), ::tolower);
 
@@ -239,7 +557,8 @@ int main(int argc, char *argv[]) {
                     optarg_string) != std::end(valid_actions)) {
         cli_action.action = optarg_string;
       } else {
-        LOG_ERROR << "The only supported action is 'refresh'. You requested '"
+        LOG_ERROR << "Supported actions are 'refresh' and 'prerender'. You "
+                     "requested '"
                   << optarg << "'.";
         exit(1);
       }
@@ -248,6 +567,84 @@ int main(int argc, char *argv[]) {
 
     case 'i': {
       cli_action.image_filename = optarg;
+      prerender_images_filenames.push_back(optarg);
+      break;
+    }
+
+    case 'T': {
+      long int parsed_threads = strtol(optarg, &endptr, 0);
+      if (!*endptr && parsed_threads > 0) {
+        set_render_threads(static_cast<unsigned int>(parsed_threads));
+        render_threads_specified = true;
+      } else {
+        LOG_ERROR << "The number of render threads must be a positive number.";
+        exit(1);
+      }
+      break;
+    }
+
+    case 'R': {
+      long int parsed_rows = strtol(optarg, &endptr, 0);
+      if (!*endptr && parsed_rows > 0) {
+        set_stripe_rows(static_cast<unsigned int>(parsed_rows));
+      } else {
+        LOG_ERROR << "The number of rows per stripe must be a positive "
+                     "number.";
+        exit(1);
+      }
+      break;
+    }
+
+    case 'S': {
+      EpdIf::SetSimulated(true);
+      break;
+    }
+
+    case 'F': {
+      framebuffer_name = optarg;
+      break;
+    }
+
+    case 'M': {
+      metrics_address = optarg;
+      break;
+    }
+
+    case 'P': {
+      set_perf_counters(true);
+      break;
+    }
+
+    case 'm': {
+      set_memory_accounting(true);
+      break;
+    }
+
+    case 't': {
+      trace_filename = optarg;
+      traceBuffer.reset(new TraceBuffer());
+      set_trace_buffer(traceBuffer.get());
+      break;
+    }
+
+    case 'g': {
+      set_png_gray_decode(true);
+      break;
+    }
+
+    case 'O': {
+      output_directory = optarg;
+      break;
+    }
+
+    case 'j': {
+      long int parsed_jobs = strtol(optarg, &endptr, 0);
+      if (!*endptr && parsed_jobs > 0) {
+        jobs = static_cast<unsigned int>(parsed_jobs);
+      } else {
+        LOG_ERROR << "The number of jobs must be a positive number.";
+        exit(1);
+      }
       break;
     }
 
@@ -295,6 +692,57 @@ int main(int argc, char *argv[]) {
            << ", " << DISPLAY_PROPERTIES.processor << " " << bpp_string
            << orientation_string;
 
+  if (cli_action.action_is_prerender()) {
+    if (SOCKET_PATH) {
+      LOG_ERROR << "You specified a socket address to listen on but also an "
+                   "action to perform. Please choose just one.";
+      exit(1);
+    }
+
+    for (int i = optind; i < argc; i++) {
+      prerender_images_filenames.push_back(argv[i]);
+    }
+
+    if (prerender_images_filenames.empty()) {
+      LOG_ERROR << "You must pass the paths of the images to pre-render.";
+      exit(1);
+    }
+
+    if (output_directory.empty()) {
+      LOG_ERROR << "You must pass a directory to write the frames to using "
+                   "the -O or --output-dir option.";
+      exit(1);
+    }
+
+    // Images are already rendered in parallel, so unless asked otherwise
+    // render each one on a single thread rather than oversubscribing cores
+    if (!render_threads_specified) {
+      set_render_threads(1);
+    }
+
+    PrerenderReport report;
+    try {
+      report = prerender_images(cli_action, prerender_images_filenames,
+                                output_directory, jobs);
+    } catch (exception &e) {
+      LOG_ERROR << e.what();
+      exit(1);
+    }
+
+    char throughput[160];
+    snprintf(throughput, sizeof(throughput),
+             "Pre-rendered %u frames (%u failed) in %.2f ms on %u threads: "
+             "%.1f frames/s, %.2f MB written, %lu tasks stolen",
+             report.frames_rendered, report.frames_failed, report.elapsed_ms,
+             report.threads, report.frames_per_second(),
+             report.bytes_written / 1e6, report.steals);
+    LOG_INFO << throughput;
+    if (get_perf_counters())
+      fputs(render_profile(metrics()).c_str(), stdout);
+    write_trace();
+    exit(report.frames_failed ? 1 : 0);
+  }
+
   if (cli_action.action_is_refresh()) {
     if (SOCKET_PATH) {
       LOG_ERROR << "You specified a socket address to listen on but also an "
@@ -320,6 +768,9 @@ int main(int argc, char *argv[]) {
     char timeTaken[20];
     sprintf(timeTaken, "Took %.2f ms", (time_end - time_start));
     LOG_DEBUG << timeTaken;
+    if (get_perf_counters())
+      fputs(render_profile(metrics()).c_str(), stdout);
+    write_trace();
     exit(0);
   }
 
@@ -347,77 +798,66 @@ int main(int argc, char *argv[]) {
 
   LOG_INFO << "Listening on socket " << SOCKET_PATH;
 
+  if (!framebuffer_name.empty()) {
+    if (framebuffer_name[0] != '/')
+      framebuffer_name = "/" + framebuffer_name;
+    try {
+      shared_framebuffer =
+          std::make_shared<SharedFramebuffer>(framebuffer_name);
+    } catch (SharedFramebufferError &e) {
+      LOG_ERROR << e.what();
+      exit(1);
+    }
+    LOG_INFO << "Sharing a " << DISPLAY_PROPERTIES.frame_buffer_length()
+             << " byte framebuffer at " << framebuffer_name;
+  }
+
   /*
-   * We will receive a JSON encoded message on the UNIX socket, in this
-   * format:
+   * We will receive JSON encoded messages on the UNIX socket, each on a line
+   * of its own or length-prefixed (see framing.h), in this format:
    * {"type":"message","data":{"action":"refresh","image":"/path/to/the/image.png"}}
+   *
+   * or, once a producer has drawn into the shared framebuffer:
+   * {"type":"message","data":{"action":"damage","rects":[{"x":0,"y":0,"width":64,"height":32}]}}
    */
 
-  struct sockaddr_un addr;
-  char buf[1024];
-  int fd, cl, rc;
-
-  // if (argc > 1)
-  //  SOCKET_PATH = argv[1];
-
-  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-    LOG_ERROR << "Socket error";
-    exit(-1);
-  }
-
-  memset(&addr, 0, sizeof(addr));
-  addr.sun_family = AF_UNIX;
-  if (*SOCKET_PATH == '\0') {
-    *addr.sun_path = '\0';
-    strncpy(addr.sun_path + 1, SOCKET_PATH + 1, sizeof(addr.sun_path) - 2);
-  } else {
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
-    unlink(SOCKET_PATH);
-  }
-
-  if (::bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ==
-      -1) {
-    LOG_ERROR << "Bind error. Maybe try `sudo`?";
-    exit(-1);
-  }
-
-  if (listen(fd, 5) == -1) {
-    LOG_ERROR << "Listen error";
-    exit(-1);
-  }
-
-  while (1) {
-    if ((cl = accept(fd, NULL, NULL)) == -1) {
-      LOG_ERROR << "Accept error";
-      continue;
-    }
-
-    while ((rc = static_cast<int>(read(cl, buf, sizeof(buf)))) > 0) {
-      // Ensure the buffer passed to cJSON is null terminated, so the strlen
-      // it calls doesn't suffer
-      buf[rc - 1] = '\0'; // chops off the last \n too
-      LOG_DEBUG << "Received message: " << buf;
-      double time_start = get_time();
-
-      try {
-        Action action = parse_message(buf);
-        process_action(action);
-      } catch (exception &e) {
-        LOG_ERROR << e.what();
+  // Rendering and the panel are handled on the pipeline's own threads, so
+  // the server only has to parse and queue messages
+  RefreshPipeline pipeline;
+  // For each message's replies, which are small, and reset after each one
+  RequestArena message_arena(16 * 1024);
+  // Every message is parsed into this one, on the server's thread
+  Action message_action;
+  if (traceBuffer)
+    traceWriter.reset(new ThreadPool(1));
+
+  try {
+    SocketServer server(SOCKET_PATH, [&pipeline, &message_arena,
+                                      &message_action](
+                                         const std::string &message,
+                                         PassedFds &passed_fds,
+                                         const Responder &responder) {
+      std::string reply;
+      {
+        ArenaScope allocating(&message_arena);
+        reply = handle_message(pipeline, message, passed_fds, responder,
+                               message_action);
       }
-
-      double time_end = get_time();
-      char timeTaken[20];
-      sprintf(timeTaken, "Took %.2f ms", (time_end - time_start));
-      LOG_DEBUG << timeTaken;
-    }
-    if (rc == -1) {
-      LOG_ERROR << "Read error";
-      exit(-1);
-    } else if (rc == 0) {
-      LOG_INFO << "EOF";
-      close(cl);
+      message_arena.reset();
+      // Don't keep a passed image mapped until the next message
+      message_action.image_bytes.reset();
+      return reply;
+    });
+    set_trace_thread_name("socket server");
+    std::unique_ptr<MetricsServer> metrics_server;
+    if (!metrics_address.empty()) {
+      metrics_server.reset(new MetricsServer(metrics_address));
+      LOG_INFO << "Serving metrics on " << metrics_address;
     }
+    server.run();
+  } catch (SocketError &e) {
+    LOG_ERROR << e.what() << ". Maybe try `sudo`?";
+    exit(-1);
   }
 
   return EXIT_SUCCESS;
@@ -0,0 +1,99 @@
+#include "mapped_file.h"
+#include "exceptions.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string &filename) {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw ImageFileNotFound(filename);
+  }
+
+  bool mapped = map(fd);
+  // The mapping keeps the file contents available after the descriptor closes
+  close(fd);
+  if (!mapped) {
+    throw ImageFileNotFound(filename);
+  }
+}
+
+/***
+ *  A client can shrink a file it has passed whenever it likes, and reading
+ *  a mapping past the new end of the file raises SIGBUS. So passed files
+ *  are only mapped if they're memfds sealed against shrinking and writing,
+ *  and anything else is copied.
+ */
+MappedFile::MappedFile(int fd, const std::string &name) {
+  bool loaded = is_sealed(fd) ? map(fd) : copy(fd);
+  close(fd);
+  if (!loaded) {
+    throw PayloadError(name + " isn't a regular file or memfd that can be "
+                              "mapped");
+  }
+}
+
+bool MappedFile::is_sealed(int fd) {
+#if defined(F_GET_SEALS)
+  const int needed = F_SEAL_SHRINK | F_SEAL_WRITE;
+  int seals = fcntl(fd, F_GET_SEALS);
+  return seals != -1 && (seals & needed) == needed;
+#else
+  (void)fd;
+  return false;
+#endif
+}
+
+bool MappedFile::copy(int fd) {
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+    return false;
+  }
+
+  // Whatever's there now, up to the size it had, in case it's shrinking
+  copied.resize(static_cast<size_t>(file_stat.st_size));
+  size_t position = 0;
+  while (position < copied.size()) {
+    ssize_t length = pread(fd, &copied[position], copied.size() - position,
+                           static_cast<off_t>(position));
+    if (length == -1 && errno == EINTR)
+      continue;
+    if (length == -1)
+      return false;
+    if (length == 0)
+      break;
+    position += static_cast<size_t>(length);
+  }
+  copied.resize(position);
+  this->length = position;
+  return true;
+}
+
+bool MappedFile::map(int fd) {
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+    return false;
+  }
+
+  length = static_cast<size_t>(file_stat.st_size);
+  if (length > 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    void *address = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED) {
+      length = 0;
+      return false;
+    }
+    mapping = static_cast<unsigned char *>(address);
+    madvise(address, length, MADV_SEQUENTIAL);
+    madvise(address, length, MADV_WILLNEED);
+  }
+  return true;
+}
+
+MappedFile::~MappedFile() {
+  if (mapping)
+    munmap(mapping, length);
+}
@@ -0,0 +1,73 @@
+#if !defined(AIRPANEL_MAPPED_FILE_H)
+#define AIRPANEL_MAPPED_FILE_H 1
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/***
+ *  The bytes of an image or frame, wherever they're held
+ */
+class ImageBytes {
+public:
+  virtual ~ImageBytes() {}
+  virtual const unsigned char *data() const = 0;
+  virtual size_t size() const = 0;
+  // A copy of all the bytes, for when they might change once they're used
+  virtual void copy_to(std::vector<unsigned char> &buffer) const {
+    buffer.assign(data(), data() + size());
+  }
+};
+
+/***
+ *  A read-only memory mapping of a whole file, unmapped when it goes out of
+ *  scope. The kernel is told that the file will be read sequentially, so it
+ *  reads ahead aggressively. Throws ImageFileNotFound if the file can't be
+ *  opened.
+ */
+class MappedFile : public ImageBytes {
+public:
+  explicit MappedFile(const std::string &filename);
+  /* Map a file a client has passed, and close fd. Only memfds sealed with
+   * F_SEAL_SHRINK and F_SEAL_WRITE are mapped; any other file is copied, so
+   * the client can't pull the bytes out from under the mapping. name
+   * describes it in errors, which are thrown as PayloadError.
+   */
+  MappedFile(int fd, const std::string &name);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const unsigned char *data() const override {
+    return mapping ? mapping : copied.data();
+  }
+  size_t size() const override { return length; }
+
+private:
+  static bool is_sealed(int fd);
+  bool map(int fd);
+  bool copy(int fd);
+
+  unsigned char *mapping = nullptr;
+  size_t length = 0;
+  // The bytes of a passed file that couldn't safely be mapped
+  std::vector<unsigned char> copied;
+};
+
+// Bytes a client has sent inline, for when it can't pass a file
+class InlineImageBytes : public ImageBytes {
+public:
+  InlineImageBytes(const char *bytes, size_t length)
+      : bytes(bytes, length) {}
+
+  const unsigned char *data() const override {
+    return reinterpret_cast<const unsigned char *>(bytes.data());
+  }
+  size_t size() const override { return bytes.size(); }
+
+private:
+  std::string bytes;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#include "memory_accounting.h"
+
+#include <malloc.h>
+#include <new>
+#include <stdlib.h>
+
+/***
+ *  Allocations are counted at their usable size, which malloc_usable_size
+ *  gives again when they're freed, so nothing needs to be stored alongside
+ *  them. Nothing here may allocate, since it runs inside operator new.
+ */
+static std::atomic<bool> memory_accounting(false);
+static std::atomic<int64_t> live_bytes(0);
+
+static thread_local MemoryTotals *current_stage = NULL;
+static thread_local RequestMemory *current_request = NULL;
+
+void set_memory_accounting(bool enabled) { memory_accounting = enabled; }
+
+bool get_memory_accounting() {
+  return memory_accounting.load(std::memory_order_relaxed);
+}
+
+static void count_allocation(void *pointer) {
+  if (!pointer || !get_memory_accounting())
+    return;
+  size_t size = malloc_usable_size(pointer);
+  live_bytes.fetch_add(static_cast<int64_t>(size), std::memory_order_relaxed);
+  if (MemoryTotals *stage = current_stage) {
+    stage->allocations.fetch_add(1, std::memory_order_relaxed);
+    stage->allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+  if (RequestMemory *request = current_request)
+    request->allocated(size);
+}
+
+static void count_free(void *pointer) {
+  if (!pointer || !get_memory_accounting())
+    return;
+  size_t size = malloc_usable_size(pointer);
+  live_bytes.fetch_sub(static_cast<int64_t>(size), std::memory_order_relaxed);
+  if (MemoryTotals *stage = current_stage)
+    stage->freed_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (RequestMemory *request = current_request)
+    request->freed(size);
+}
+
+void *accounted_malloc(size_t size) {
+  void *pointer = malloc(size);
+  count_allocation(pointer);
+  return pointer;
+}
+
+void accounted_free(void *pointer) {
+  count_free(pointer);
+  free(pointer);
+}
+
+int64_t accounted_live_bytes() {
+  return live_bytes.load(std::memory_order_relaxed);
+}
+
+MemoryTotals::MemoryTotals()
+    : allocations(0), allocated_bytes(0), freed_bytes(0) {}
+
+RequestMemory::RequestMemory() : allocations(0), live_bytes(0), peak_bytes(0) {}
+
+void RequestMemory::allocated(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  int64_t live =
+      live_bytes.fetch_add(static_cast<int64_t>(size),
+                           std::memory_order_relaxed) +
+      static_cast<int64_t>(size);
+  int64_t peak = peak_bytes.load(std::memory_order_relaxed);
+  while (live > peak &&
+         !peak_bytes.compare_exchange_weak(peak, live,
+                                           std::memory_order_relaxed)) {
+  }
+}
+
+void RequestMemory::freed(size_t size) {
+  live_bytes.fetch_sub(static_cast<int64_t>(size), std::memory_order_relaxed);
+}
+
+RequestMemory *current_request_memory() { return current_request; }
+
+MemoryScope::MemoryScope(MemoryTotals &stage)
+    : MemoryScope(stage, current_request) {}
+
+MemoryScope::MemoryScope(MemoryTotals &stage, RequestMemory *request)
+    : previous_stage(current_stage), previous_request(current_request) {
+  current_stage = &stage;
+  current_request = request;
+}
+
+MemoryScope::~MemoryScope() {
+  current_stage = previous_stage;
+  current_request = previous_request;
+}
+
+/***
+ *  Every operator new and delete in the program, so the standard library's
+ *  containers and strings are counted too. Only the C++11 forms need
+ *  replacing: the rest are defined in terms of these.
+ */
+void *operator new(size_t size) {
+  void *pointer = malloc(size ? size : 1);
+  if (!pointer)
+    throw std::bad_alloc();
+  count_allocation(pointer);
+  return pointer;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  void *pointer = malloc(size ? size : 1);
+  count_allocation(pointer);
+  return pointer;
+}
+
+void *operator new[](size_t size, const std::nothrow_t &nothrow) noexcept {
+  return operator new(size, nothrow);
+}
+
+void operator delete(void *pointer) noexcept {
+  count_free(pointer);
+  free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept { operator delete(pointer); }
+
+void operator delete(void *pointer, const std::nothrow_t &) noexcept {
+  operator delete(pointer);
+}
+
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept {
+  operator delete(pointer);
+}
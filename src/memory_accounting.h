@@ -0,0 +1,81 @@
+#if !defined(AIRPANEL_MEMORY_ACCOUNTING_H)
+#define AIRPANEL_MEMORY_ACCOUNTING_H 1
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Whether allocations are counted; off by default (see --memory). While
+ * it's off, operator new and accounted_malloc cost one atomic load more
+ * than malloc. Turn it on at startup: memory allocated before it was on
+ * and freed after counts as a negative amount.
+ */
+void set_memory_accounting(bool enabled);
+bool get_memory_accounting();
+
+/* malloc and free, counted like operator new and delete, for C buffers
+ * that outlive the call that allocates them, such as decoded rows and
+ * libpng's own structs (see png_create_read_struct_2)
+ */
+void *accounted_malloc(size_t size);
+void accounted_free(void *pointer);
+
+// Bytes counted as allocated and not yet freed, on every thread
+int64_t accounted_live_bytes();
+
+/***
+ *  What the threads of one stage, e.g. decoding, have allocated and freed,
+ *  over every request
+ */
+struct MemoryTotals {
+  MemoryTotals();
+
+  std::atomic<uint64_t> allocations;
+  std::atomic<uint64_t> allocated_bytes;
+  std::atomic<uint64_t> freed_bytes;
+};
+
+/***
+ *  What one request has allocated and freed, on whichever threads worked
+ *  on it. Memory handed on to another request, such as a reused frame
+ *  buffer, counts as retained by the request that allocated it and as a
+ *  saving for the one that frees it.
+ */
+struct RequestMemory {
+  RequestMemory();
+
+  void allocated(size_t size);
+  void freed(size_t size);
+
+  std::atomic<uint64_t> allocations;
+  // Allocated and not yet freed, which is what the request retained once
+  // it has ended
+  std::atomic<int64_t> live_bytes;
+  // The most that was live at once
+  std::atomic<int64_t> peak_bytes;
+};
+
+// The request the calling thread is counting towards, if any
+RequestMemory *current_request_memory();
+
+/***
+ *  Counts what the calling thread allocates and frees, from its
+ *  construction to its destruction, towards a stage and a request, if
+ *  accounting is on. Scopes nest, and the one-argument form carries on
+ *  counting towards the enclosing scope's request.
+ */
+class MemoryScope {
+public:
+  explicit MemoryScope(MemoryTotals &stage);
+  MemoryScope(MemoryTotals &stage, RequestMemory *request);
+  ~MemoryScope();
+
+  MemoryScope(const MemoryScope &) = delete;
+  MemoryScope &operator=(const MemoryScope &) = delete;
+
+private:
+  MemoryTotals *previous_stage;
+  RequestMemory *previous_request;
+};
+
+#endif
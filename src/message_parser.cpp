@@ -0,0 +1,561 @@
+#include "message_parser.h"
+#include "exceptions.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <climits>
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+// Skipped values nested deeper than this are rejected rather than risking
+// the stack, as cJSON does
+static const int MAX_NESTING = 1000;
+
+// Bits for the keys seen so far in an object, so that the first of any
+// repeated key counts
+enum DataKey {
+  ACTION_KEY = 1 << 0,
+  IMAGE_KEY = 1 << 1,
+  PAYLOAD_KEY = 1 << 2,
+  ORIENTATION_KEY = 1 << 3,
+  OFFSET_X_KEY = 1 << 4,
+  OFFSET_Y_KEY = 1 << 5,
+  RECTS_KEY = 1 << 6
+};
+
+enum RectKey {
+  X_KEY = 1 << 0,
+  Y_KEY = 1 << 1,
+  WIDTH_KEY = 1 << 2,
+  HEIGHT_KEY = 1 << 3,
+  ALL_RECT_KEYS = X_KEY | Y_KEY | WIDTH_KEY | HEIGHT_KEY
+};
+
+namespace {
+
+/***
+ *  A key, decoded into a buffer that fits the longest one the schema has;
+ *  longer keys can't be one of them, so only need skipping
+ */
+struct Key {
+  char name[16];
+  size_t length = 0;
+  bool too_long = false;
+
+  void operator()(const char *bytes, size_t count) {
+    if (length + count > sizeof(name)) {
+      too_long = true;
+      return;
+    }
+    memcpy(name + length, bytes, count);
+    length += count;
+  }
+
+  bool is(const char *expected) const {
+    return !too_long && length == strlen(expected) &&
+           memcmp(name, expected, length) == 0;
+  }
+};
+
+struct AppendTo {
+  std::string &value;
+  void operator()(const char *bytes, size_t count) {
+    value.append(bytes, count);
+  }
+};
+
+struct Discard {
+  void operator()(const char *, size_t) {}
+};
+
+class MessageParser {
+public:
+  MessageParser(const char *message, size_t length)
+      : begin(message), at(message), end(message + length) {}
+
+  void parse(Action &action);
+
+private:
+  [[noreturn]] void fail(const std::string &reason) const {
+    throw MessageError(reason, static_cast<size_t>(at - begin));
+  }
+
+  void skip_whitespace() {
+    while (at < end &&
+           (*at == ' ' || *at == '\t' || *at == '\n' || *at == '\r'))
+      at++;
+  }
+
+  // Skip whitespace, and return the next character without consuming it,
+  // or '\0' at the end of the message
+  char peek() {
+    skip_whitespace();
+    return at < end ? *at : '\0';
+  }
+
+  bool consume(char c) {
+    if (peek() != c)
+      return false;
+    at++;
+    return true;
+  }
+
+  void expect(char c, const char *context) {
+    if (!consume(c))
+      fail(std::string("expected '") + c + "' " + context);
+  }
+
+  bool consume_literal(const char *literal) {
+    size_t length = strlen(literal);
+    if (static_cast<size_t>(end - at) < length ||
+        memcmp(at, literal, length) != 0)
+      return false;
+    at += length;
+    return true;
+  }
+
+  bool consume_null() { return peek() == 'n' && consume_literal("null"); }
+
+  template <typename OnMember> void parse_object(OnMember on_member);
+  template <typename OnElement> void parse_array(OnElement on_element);
+  template <typename Sink> void parse_string(Sink &sink);
+  template <typename Sink> void parse_escape(Sink &sink);
+  unsigned int parse_hex4();
+  const char *scan_number();
+  void skip_value();
+
+  void parse_data(Action &action);
+  void parse_rects(std::vector<DamageRect> &rects);
+  void parse_string_field(const char *field, std::string &value);
+  bool parse_int_field(const char *field, int &value);
+
+  const char *begin;
+  const char *at;
+  const char *end;
+  int depth = 0;
+};
+
+} // namespace
+
+template <typename OnMember>
+void MessageParser::parse_object(OnMember on_member) {
+  expect('{', "to start an object");
+  if (++depth > MAX_NESTING)
+    fail("values are nested too deeply");
+  if (!consume('}')) {
+    do {
+      if (peek() != '"')
+        fail("expected a key");
+      Key key;
+      parse_string(key);
+      expect(':', "after a key");
+      on_member(key);
+    } while (consume(','));
+    expect('}', "to end an object");
+  }
+  depth--;
+}
+
+template <typename OnElement>
+void MessageParser::parse_array(OnElement on_element) {
+  expect('[', "to start an array");
+  if (++depth > MAX_NESTING)
+    fail("values are nested too deeply");
+  if (!consume(']')) {
+    do {
+      on_element();
+    } while (consume(','));
+    expect(']', "to end an array");
+  }
+  depth--;
+}
+
+/***
+ *  Decode the string starting at the opening quote into `sink`, handing it
+ *  runs of plain characters at a time
+ */
+template <typename Sink> void MessageParser::parse_string(Sink &sink) {
+  at++;
+  const char *run = at;
+  while (at < end) {
+    unsigned char c = static_cast<unsigned char>(*at);
+    if (c == '"') {
+      sink(run, static_cast<size_t>(at - run));
+      at++;
+      return;
+    } else if (c == '\\') {
+      sink(run, static_cast<size_t>(at - run));
+      at++;
+      parse_escape(sink);
+      run = at;
+    } else if (c < 0x20) {
+      fail("strings can't contain control characters");
+    } else {
+      at++;
+    }
+  }
+  fail("a string isn't terminated");
+}
+
+unsigned int MessageParser::parse_hex4() {
+  if (end - at < 4)
+    fail("a \\u escape needs four hex digits");
+  unsigned int code = 0;
+  for (int i = 0; i < 4; i++, at++) {
+    char c = *at;
+    code <<= 4;
+    if (c >= '0' && c <= '9')
+      code |= static_cast<unsigned int>(c - '0');
+    else if (c >= 'a' && c <= 'f')
+      code |= static_cast<unsigned int>(c - 'a' + 10);
+    else if (c >= 'A' && c <= 'F')
+      code |= static_cast<unsigned int>(c - 'A' + 10);
+    else
+      fail("a \\u escape needs four hex digits");
+  }
+  return code;
+}
+
+template <typename Sink> void MessageParser::parse_escape(Sink &sink) {
+  if (at == end)
+    fail("a string isn't terminated");
+  char c = *at++;
+  char decoded;
+  switch (c) {
+  case '"':
+  case '\\':
+  case '/':
+    decoded = c;
+    break;
+  case 'b':
+    decoded = '\b';
+    break;
+  case 'f':
+    decoded = '\f';
+    break;
+  case 'n':
+    decoded = '\n';
+    break;
+  case 'r':
+    decoded = '\r';
+    break;
+  case 't':
+    decoded = '\t';
+    break;
+  case 'u': {
+    unsigned int code = parse_hex4();
+    if (code >= 0xdc00 && code <= 0xdfff)
+      fail("a \\u escape is an unpaired low surrogate");
+    if (code >= 0xd800 && code <= 0xdbff) {
+      if (!consume_literal("\\u"))
+        fail("a \\u escape is an unpaired high surrogate");
+      unsigned int low = parse_hex4();
+      if (low < 0xdc00 || low > 0xdfff)
+        fail("a \\u escape is an unpaired high surrogate");
+      code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+    }
+
+    // Encode as UTF-8
+    char utf8[4];
+    size_t length;
+    if (code < 0x80) {
+      utf8[0] = static_cast<char>(code);
+      length = 1;
+    } else if (code < 0x800) {
+      utf8[0] = static_cast<char>(0xc0 | (code >> 6));
+      utf8[1] = static_cast<char>(0x80 | (code & 0x3f));
+      length = 2;
+    } else if (code < 0x10000) {
+      utf8[0] = static_cast<char>(0xe0 | (code >> 12));
+      utf8[1] = static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+      utf8[2] = static_cast<char>(0x80 | (code & 0x3f));
+      length = 3;
+    } else {
+      utf8[0] = static_cast<char>(0xf0 | (code >> 18));
+      utf8[1] = static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+      utf8[2] = static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+      utf8[3] = static_cast<char>(0x80 | (code & 0x3f));
+      length = 4;
+    }
+    sink(utf8, length);
+    return;
+  }
+  default:
+    fail(std::string("'\\") + c + "' isn't a valid escape");
+  }
+  sink(&decoded, 1);
+}
+
+/***
+ *  Check the number at `at` against JSON's grammar, and return where it ends
+ */
+const char *MessageParser::scan_number() {
+  const char *p = at;
+  if (p < end && *p == '-')
+    p++;
+  if (p < end && *p == '0') {
+    p++;
+  } else if (p < end && *p >= '1' && *p <= '9') {
+    while (p < end && isdigit(static_cast<unsigned char>(*p)))
+      p++;
+  } else {
+    fail("a number is malformed");
+  }
+  if (p < end && *p == '.') {
+    p++;
+    if (p == end || !isdigit(static_cast<unsigned char>(*p)))
+      fail("a number is malformed");
+    while (p < end && isdigit(static_cast<unsigned char>(*p)))
+      p++;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    if (p < end && (*p == '+' || *p == '-'))
+      p++;
+    if (p == end || !isdigit(static_cast<unsigned char>(*p)))
+      fail("a number is malformed");
+    while (p < end && isdigit(static_cast<unsigned char>(*p)))
+      p++;
+  }
+  return p;
+}
+
+void MessageParser::skip_value() {
+  char c = peek();
+  switch (c) {
+  case '{':
+    parse_object([this](const Key &) { skip_value(); });
+    break;
+  case '[':
+    parse_array([this] { skip_value(); });
+    break;
+  case '"': {
+    Discard discard;
+    parse_string(discard);
+    break;
+  }
+  case 't':
+  case 'f':
+  case 'n':
+    if (!consume_literal("true") && !consume_literal("false") &&
+        !consume_literal("null"))
+      fail("expected a value");
+    break;
+  default:
+    // peek() gives '\0' at the end of the message, where at can't be read
+    if (at == end || (c != '-' && !isdigit(static_cast<unsigned char>(c))))
+      fail("expected a value");
+    at = scan_number();
+  }
+}
+
+// Parse [-]digits, and nothing else, into an int
+static bool parse_decimal(const char *from, const char *to, int &value) {
+  bool negative = from < to && *from == '-';
+  if (negative)
+    from++;
+  if (from == to)
+    return false;
+  long long magnitude = 0;
+  for (; from < to; from++) {
+    if (!isdigit(static_cast<unsigned char>(*from)))
+      return false;
+    magnitude = magnitude * 10 + (*from - '0');
+    if (magnitude > static_cast<long long>(INT_MAX) + 1)
+      return false;
+  }
+  long long signed_value = negative ? -magnitude : magnitude;
+  if (signed_value > INT_MAX)
+    return false;
+  value = static_cast<int>(signed_value);
+  return true;
+}
+
+void MessageParser::parse_string_field(const char *field,
+                                       std::string &value) {
+  if (consume_null())
+    return;
+  if (peek() != '"')
+    fail(std::string("\"") + field + "\" should be a string");
+  AppendTo append = {value};
+  parse_string(append);
+}
+
+/***
+ *  Parse a whole number, or a string holding one, returning false if the
+ *  field is null
+ */
+bool MessageParser::parse_int_field(const char *field, int &value) {
+  char c = peek();
+  if (c == 'n' && consume_null())
+    return false;
+
+  if (c == '"') {
+    const char *from = ++at;
+    while (at < end && *at != '"' && *at != '\\' &&
+           static_cast<unsigned char>(*at) >= 0x20)
+      at++;
+    if (at == end || *at != '"' || !parse_decimal(from, at, value)) {
+      at = from - 1;
+      fail(std::string("\"") + field +
+           "\" should be a whole number, or a string holding one in decimal");
+    }
+    at++;
+    return true;
+  }
+
+  if (c != '-' && !isdigit(static_cast<unsigned char>(c)))
+    fail(std::string("\"") + field +
+         "\" should be a whole number, or a string holding one");
+  const char *number_end = scan_number();
+  if (parse_decimal(at, number_end, value)) {
+    at = number_end;
+    return true;
+  }
+
+  // Allow 90.0 or 9e1, but not 90.5, or anything that doesn't fit an int
+  char digits[32];
+  size_t length = static_cast<size_t>(number_end - at);
+  double parsed = NAN;
+  if (length < sizeof(digits)) {
+    memcpy(digits, at, length);
+    digits[length] = '\0';
+    parsed = strtod(digits, NULL);
+  }
+  if (!(parsed >= INT_MIN && parsed <= INT_MAX))
+    fail(std::string("\"") + field + "\" is out of range");
+  if (parsed != floor(parsed))
+    fail(std::string("\"") + field + "\" should be a whole number");
+  value = static_cast<int>(parsed);
+  at = number_end;
+  return true;
+}
+
+void MessageParser::parse_rects(std::vector<DamageRect> &rects) {
+  if (consume_null())
+    return;
+  if (peek() != '[')
+    fail("\"rects\" should be an array of rectangles");
+  parse_array([this, &rects] {
+    if (peek() != '{')
+      fail("each of \"rects\" should be an object with x, y, width and "
+           "height");
+    DamageRect rect;
+    unsigned int seen = 0;
+    parse_object([this, &rect, &seen](const Key &key) {
+      if (key.is("x") && !(seen & X_KEY)) {
+        seen |= parse_int_field("x", rect.x) ? X_KEY : 0;
+      } else if (key.is("y") && !(seen & Y_KEY)) {
+        seen |= parse_int_field("y", rect.y) ? Y_KEY : 0;
+      } else if (key.is("width") && !(seen & WIDTH_KEY)) {
+        seen |= parse_int_field("width", rect.width) ? WIDTH_KEY : 0;
+      } else if (key.is("height") && !(seen & HEIGHT_KEY)) {
+        seen |= parse_int_field("height", rect.height) ? HEIGHT_KEY : 0;
+      } else {
+        skip_value();
+      }
+    });
+    if (seen != ALL_RECT_KEYS)
+      fail("a rectangle in \"rects\" needs an x, y, width and height");
+    if (rect.width < 0 || rect.height < 0)
+      fail("a rectangle in \"rects\" can't have a negative width or height");
+    rects.push_back(rect);
+  });
+}
+
+void MessageParser::parse_data(Action &action) {
+  if (consume_null())
+    return;
+  if (peek() != '{')
+    fail("\"data\" should be an object");
+
+  unsigned int seen = 0;
+  auto first = [&seen](const Key &key, const char *name, DataKey bit) {
+    if (!key.is(name) || (seen & bit))
+      return false;
+    seen |= bit;
+    return true;
+  };
+  parse_object([this, &action, &first](const Key &key) {
+    if (first(key, "action", ACTION_KEY)) {
+      parse_string_field("action", action.action);
+    } else if (first(key, "image", IMAGE_KEY)) {
+      parse_string_field("image", action.image_filename);
+    } else if (first(key, "payload", PAYLOAD_KEY)) {
+      parse_string_field("payload", action.payload);
+    } else if (first(key, "orientation", ORIENTATION_KEY)) {
+      int orientation;
+      if (parse_int_field("orientation", orientation)) {
+        if (orientation == 0 || orientation == 90 || orientation == 180 ||
+            orientation == 270) {
+          action.orientation_specified = true;
+          action.orientation = orientation;
+        } else {
+          LOG_WARNING << "Orientation " << orientation
+                      << " supplied, but valid values are 0, 90, 180 and 270";
+        }
+      }
+    } else if (first(key, "offset_x", OFFSET_X_KEY)) {
+      action.offset_x_specified =
+          parse_int_field("offset_x", action.offset_x);
+    } else if (first(key, "offset_y", OFFSET_Y_KEY)) {
+      action.offset_y_specified =
+          parse_int_field("offset_y", action.offset_y);
+    } else if (first(key, "rects", RECTS_KEY)) {
+      parse_rects(action.damage);
+    } else {
+      skip_value();
+    }
+  });
+}
+
+void MessageParser::parse(Action &action) {
+  action.type = "socket";
+  action.action.clear();
+  action.image_filename.clear();
+  action.payload.clear();
+  action.image_bytes.reset();
+  action.damage.clear();
+  action.offset_x_specified = false;
+  action.offset_x = 0;
+  action.offset_y_specified = false;
+  action.offset_y = 0;
+  action.orientation_specified = false;
+  action.orientation = 0;
+
+  if (peek() != '{')
+    fail("a message should be a JSON object");
+  bool seen_data = false;
+  parse_object([this, &action, &seen_data](const Key &key) {
+    if (key.is("data") && !seen_data) {
+      seen_data = true;
+      parse_data(action);
+    } else {
+      skip_value();
+    }
+  });
+  if (peek() != '\0' || at != end)
+    fail("there's more after the message");
+}
+
+void parse_message(const char *message, size_t length, Action &action) {
+  TraceScope parsing("parse", "parse_message", "bytes",
+                     static_cast<int64_t>(length));
+  PerfScope counting(metrics().perf[PARSE]);
+  MemoryScope accounting(metrics().memory[PARSE]);
+  MessageParser(message, length).parse(action);
+}
+
+/***
+ *  Get JSON parsing out of the way and return a struct.
+ */
+Action parse_message(const char *message) {
+  Action action = {};
+  parse_message(message, strlen(message), action);
+  return action;
+}
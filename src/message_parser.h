@@ -0,0 +1,31 @@
+#if !defined(AIRPANEL_MESSAGE_PARSER_H)
+#define AIRPANEL_MESSAGE_PARSER_H 1
+
+#include "core.h"
+
+#include <stddef.h>
+
+/***
+ *  Parses a socket message straight into an Action, in a single pass over
+ *  its bytes and without building a JSON tree. Only the keys an Action has
+ *  are read, and everything else is checked for well-formedness and skipped:
+ *
+ *    {"type": "socket",
+ *     "data": {"action": "refresh", "image": "/path/to/image.png",
+ *              "payload": "fd", "orientation": 90,
+ *              "offset_x": 10, "offset_y": "-20",
+ *              "rects": [{"x": 0, "y": 0, "width": 8, "height": 8}]}}
+ *
+ *  Numeric fields take whole numbers, or strings holding a decimal whole
+ *  number, in the range of an int; string fields take strings; and any field
+ *  may be null, which is the same as leaving it out. If a key is repeated,
+ *  the first one counts.
+ *
+ *  `action`'s strings and damage are cleared and refilled in place, so
+ *  parsing into the same Action again allocates nothing once its strings
+ *  have grown to fit. Throws MessageError, saying what's wrong and where, if
+ *  the message isn't valid JSON or doesn't fit the schema.
+ */
+void parse_message(const char *message, size_t length, Action &action);
+
+#endif
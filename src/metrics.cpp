@@ -0,0 +1,410 @@
+#include "metrics.h"
+
+#include "epdif.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+LatencyHistogram::LatencyHistogram() : sum_us(0) {
+  for (unsigned int i = 0; i < BUCKETS; i++) {
+    buckets[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+unsigned int LatencyHistogram::bucket_for(uint64_t us) {
+  if (us < SUB_BUCKETS)
+    return static_cast<unsigned int>(us);
+  unsigned int magnitude = 63 - static_cast<unsigned int>(__builtin_clzll(us));
+  // 16 buckets for each power of two from 2^4 up
+  unsigned int group = magnitude - 4;
+  unsigned int bucket =
+      SUB_BUCKETS + group * SUB_BUCKETS +
+      static_cast<unsigned int>((us >> group) & (SUB_BUCKETS - 1));
+  return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+uint64_t LatencyHistogram::bucket_end(unsigned int bucket) {
+  if (bucket < SUB_BUCKETS)
+    return bucket + 1;
+  unsigned int group = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+  unsigned int sub_bucket = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+  return static_cast<uint64_t>(SUB_BUCKETS + sub_bucket + 1) << group;
+}
+
+void LatencyHistogram::record(double ms) {
+  uint64_t us = ms > 0 ? static_cast<uint64_t>(ms * 1000 + 0.5) : 0;
+  buckets[bucket_for(us)].fetch_add(1, std::memory_order_relaxed);
+  sum_us.fetch_add(us, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const {
+  uint64_t total = 0;
+  for (unsigned int i = 0; i < BUCKETS; i++) {
+    total += buckets[i].load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+double LatencyHistogram::sum_ms() const {
+  return sum_us.load(std::memory_order_relaxed) / 1000.0;
+}
+
+uint64_t LatencyHistogram::count_up_to(double ms) const {
+  uint64_t total = 0;
+  for (unsigned int i = 0; i < BUCKETS && bucket_end(i) <= ms * 1000 + 1;
+       i++) {
+    total += buckets[i].load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+double LatencyHistogram::quantile_ms(double quantile) const {
+  uint64_t counts[BUCKETS];
+  uint64_t total = 0;
+  for (unsigned int i = 0; i < BUCKETS; i++) {
+    counts[i] = buckets[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0)
+    return 0;
+
+  // The rank of the value wanted, counting from 1
+  uint64_t rank = static_cast<uint64_t>(quantile * total + 0.5);
+  rank = rank < 1 ? 1 : rank > total ? total : rank;
+  uint64_t seen = 0;
+  for (unsigned int i = 0; i < BUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= rank)
+      return (bucket_end(i) - 1) / 1000.0;
+  }
+  return (bucket_end(BUCKETS - 1) - 1) / 1000.0;
+}
+
+Metrics::Metrics()
+    : messages(0), displayed(0), failed(0), coalesced(0), dropped(0),
+      frame_cache_hits(0), frame_cache_misses(0), queue_depth(0),
+      request_peak_bytes_max(0), last_request_peak_bytes(0),
+      last_request_retained_bytes(0), retained_bytes(0) {}
+
+void Metrics::record(const StageTimings &timings) {
+  stages[PARSE].record(timings.parse_ms);
+  stages[DECODE].record(timings.decode_ms);
+  stages[RENDER].record(timings.render_ms);
+  stages[UPLOAD].record(timings.upload_ms);
+  stages[BUSY].record(timings.busy_ms);
+  stages[TOTAL].record(timings.total_ms);
+}
+
+void Metrics::record(const RequestMemory &memory) {
+  int64_t peak = memory.peak_bytes.load(std::memory_order_relaxed);
+  int64_t retained = memory.live_bytes.load(std::memory_order_relaxed);
+  last_request_peak_bytes.store(peak, std::memory_order_relaxed);
+  last_request_retained_bytes.store(retained, std::memory_order_relaxed);
+  retained_bytes.fetch_add(retained, std::memory_order_relaxed);
+  int64_t most = request_peak_bytes_max.load(std::memory_order_relaxed);
+  while (peak > most && !request_peak_bytes_max.compare_exchange_weak(
+                            most, peak, std::memory_order_relaxed)) {
+  }
+}
+
+Metrics &metrics() {
+  static Metrics daemon_metrics;
+  return daemon_metrics;
+}
+
+static const char *const STAGE_NAMES[STAGE_COUNT] = {
+    "parse", "decode", "render", "upload", "busy", "total"};
+
+// Histogram buckets for Prometheus, in seconds, from a millisecond to a
+// minute; the panel's own refresh takes seconds
+static const double BUCKET_SECONDS[] = {0.001, 0.0025, 0.005, 0.01, 0.025,
+                                        0.05,  0.1,    0.25,  0.5,  1,
+                                        2.5,   5,      10,    30,   60};
+
+static const double QUANTILES[] = {0.5, 0.9, 0.99, 1};
+
+static void append(std::string &text, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void append(std::string &text, const char *format, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  text += line;
+}
+
+static void append_counter(std::string &text, const char *name,
+                           const char *help, uint64_t value) {
+  append(text, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name,
+         name, static_cast<unsigned long long>(value));
+}
+
+/***
+ *  Each stage's counts, and the ratios that tell whether it's bound by
+ *  compute, cache misses or branch misses
+ */
+static void append_perf_counters(std::string &text, const Metrics &metrics) {
+  unsigned int available = perf_counters_available();
+  for (int counter = 0; counter < PERF_COUNTER_COUNT; counter++) {
+    if (!(available & (1u << counter)))
+      continue;
+    const char *name = perf_counter_name(static_cast<PerfCounter>(counter));
+    // The task clock counts nanoseconds, which Prometheus wants in seconds
+    bool seconds = counter == PERF_TASK_CLOCK;
+    const char *metric = seconds ? "cpu_seconds" : name;
+    append(text,
+           "# HELP airpanel_stage_%s_total %s counted by perf_event_open on "
+           "each stage's threads.\n"
+           "# TYPE airpanel_stage_%s_total counter\n",
+           metric, seconds ? "CPU time" : name, metric);
+    for (unsigned int stage = 0; stage < TOTAL; stage++) {
+      uint64_t value = metrics.perf[stage].values[counter];
+      if (seconds) {
+        append(text, "airpanel_stage_cpu_seconds_total{stage=\"%s\"} %.6f\n",
+               STAGE_NAMES[stage], value / 1e9);
+      } else {
+        append(text, "airpanel_stage_%s_total{stage=\"%s\"} %llu\n", name,
+               STAGE_NAMES[stage], static_cast<unsigned long long>(value));
+      }
+    }
+  }
+
+  unsigned int needed = 1u << PERF_CYCLES | 1u << PERF_INSTRUCTIONS;
+  if ((available & needed) != needed)
+    return;
+  text += "# HELP airpanel_stage_instructions_per_cycle Instructions each "
+          "stage retired per cycle.\n"
+          "# TYPE airpanel_stage_instructions_per_cycle gauge\n";
+  for (unsigned int stage = 0; stage < TOTAL; stage++) {
+    const PerfTotals &totals = metrics.perf[stage];
+    uint64_t cycles = totals.values[PERF_CYCLES];
+    append(text,
+           "airpanel_stage_instructions_per_cycle{stage=\"%s\"} %.3f\n",
+           STAGE_NAMES[stage],
+           cycles ? static_cast<double>(totals.values[PERF_INSTRUCTIONS]) /
+                        cycles
+                  : 0.0);
+  }
+  text += "# HELP airpanel_stage_misses_per_kilo_instruction Cache and "
+          "branch misses per 1000 instructions of each stage.\n"
+          "# TYPE airpanel_stage_misses_per_kilo_instruction gauge\n";
+  for (unsigned int stage = 0; stage < TOTAL; stage++) {
+    const PerfTotals &totals = metrics.perf[stage];
+    uint64_t instructions = totals.values[PERF_INSTRUCTIONS];
+    for (int counter : {PERF_CACHE_MISSES, PERF_BRANCH_MISSES}) {
+      if (!(available & (1u << counter)))
+        continue;
+      append(text,
+             "airpanel_stage_misses_per_kilo_instruction{stage=\"%s\","
+             "counter=\"%s\"} %.3f\n",
+             STAGE_NAMES[stage],
+             perf_counter_name(static_cast<PerfCounter>(counter)),
+             instructions ? 1000.0 * totals.values[counter] / instructions
+                          : 0.0);
+    }
+  }
+}
+
+static void append_gauge(std::string &text, const char *name,
+                         const char *help, int64_t value) {
+  append(text, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, help, name,
+         name, static_cast<long long>(value));
+}
+
+/***
+ *  What each stage allocated, and what refreshes allocated at most and
+ *  retained; retained bytes that keep growing are a leak
+ */
+static void append_memory(std::string &text, const Metrics &metrics) {
+  text += "# HELP airpanel_stage_allocations_total Allocations made on each "
+          "stage's threads.\n"
+          "# TYPE airpanel_stage_allocations_total counter\n";
+  for (unsigned int stage = 0; stage < TOTAL; stage++) {
+    append(text, "airpanel_stage_allocations_total{stage=\"%s\"} %llu\n",
+           STAGE_NAMES[stage],
+           static_cast<unsigned long long>(metrics.memory[stage].allocations));
+  }
+  text += "# HELP airpanel_stage_allocated_bytes_total Bytes allocated on "
+          "each stage's threads.\n"
+          "# TYPE airpanel_stage_allocated_bytes_total counter\n";
+  for (unsigned int stage = 0; stage < TOTAL; stage++) {
+    append(text,
+           "airpanel_stage_allocated_bytes_total{stage=\"%s\"} %llu\n",
+           STAGE_NAMES[stage],
+           static_cast<unsigned long long>(
+               metrics.memory[stage].allocated_bytes));
+  }
+  text += "# HELP airpanel_stage_freed_bytes_total Bytes freed on each "
+          "stage's threads.\n"
+          "# TYPE airpanel_stage_freed_bytes_total counter\n";
+  for (unsigned int stage = 0; stage < TOTAL; stage++) {
+    append(text, "airpanel_stage_freed_bytes_total{stage=\"%s\"} %llu\n",
+           STAGE_NAMES[stage],
+           static_cast<unsigned long long>(metrics.memory[stage].freed_bytes));
+  }
+
+  append_gauge(text, "airpanel_request_peak_bytes_max",
+               "The most any refresh has had allocated at once.",
+               metrics.request_peak_bytes_max);
+  append_gauge(text, "airpanel_request_peak_bytes",
+               "The most the last refresh to end had allocated at once.",
+               metrics.last_request_peak_bytes);
+  append_gauge(text, "airpanel_request_retained_bytes",
+               "Bytes the last refresh to end left allocated.",
+               metrics.last_request_retained_bytes);
+  append_gauge(text, "airpanel_retained_bytes",
+               "Bytes refreshes left allocated, summed over all of them.",
+               metrics.retained_bytes);
+  append_gauge(text, "airpanel_live_bytes",
+               "Bytes allocated and not yet freed since counting started.",
+               accounted_live_bytes());
+}
+
+std::string render_metrics(const Metrics &metrics) {
+  std::string text;
+  text.reserve(16 * 1024);
+
+  text += "# HELP airpanel_stage_duration_seconds How long each stage of "
+          "displayed refreshes took.\n"
+          "# TYPE airpanel_stage_duration_seconds histogram\n";
+  for (unsigned int stage = 0; stage < STAGE_COUNT; stage++) {
+    const LatencyHistogram &histogram = metrics.stages[stage];
+    for (double le : BUCKET_SECONDS) {
+      append(text,
+             "airpanel_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} "
+             "%llu\n",
+             STAGE_NAMES[stage], le,
+             static_cast<unsigned long long>(histogram.count_up_to(le * 1000)));
+    }
+    uint64_t count = histogram.count();
+    append(text,
+           "airpanel_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} "
+           "%llu\n",
+           STAGE_NAMES[stage], static_cast<unsigned long long>(count));
+    append(text, "airpanel_stage_duration_seconds_sum{stage=\"%s\"} %.6f\n",
+           STAGE_NAMES[stage], histogram.sum_ms() / 1000);
+    append(text, "airpanel_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+           STAGE_NAMES[stage], static_cast<unsigned long long>(count));
+  }
+
+  text += "# HELP airpanel_stage_duration_quantile_seconds Quantiles of how "
+          "long each stage took, to within 1/16.\n"
+          "# TYPE airpanel_stage_duration_quantile_seconds gauge\n";
+  for (unsigned int stage = 0; stage < STAGE_COUNT; stage++) {
+    for (double quantile : QUANTILES) {
+      append(text,
+             "airpanel_stage_duration_quantile_seconds{stage=\"%s\","
+             "quantile=\"%g\"} %.6f\n",
+             STAGE_NAMES[stage], quantile,
+             metrics.stages[stage].quantile_ms(quantile) / 1000);
+    }
+  }
+
+  append_counter(text, "airpanel_messages_total",
+                 "Messages received on the socket.", metrics.messages);
+
+  text += "# HELP airpanel_refreshes_total Refreshes by how they ended; "
+          "coalesced and dropped refreshes were skipped for newer ones.\n"
+          "# TYPE airpanel_refreshes_total counter\n";
+  append(text, "airpanel_refreshes_total{outcome=\"displayed\"} %llu\n",
+         static_cast<unsigned long long>(metrics.displayed));
+  append(text, "airpanel_refreshes_total{outcome=\"failed\"} %llu\n",
+         static_cast<unsigned long long>(metrics.failed));
+  append(text, "airpanel_refreshes_total{outcome=\"coalesced\"} %llu\n",
+         static_cast<unsigned long long>(metrics.coalesced));
+  append(text, "airpanel_refreshes_total{outcome=\"dropped\"} %llu\n",
+         static_cast<unsigned long long>(metrics.dropped));
+
+  uint64_t hits = metrics.frame_cache_hits;
+  uint64_t misses = metrics.frame_cache_misses;
+  append_counter(text, "airpanel_frame_cache_hits_total",
+                 "Refreshes shown from a pre-rendered frame.", hits);
+  append_counter(text, "airpanel_frame_cache_misses_total",
+                 "Refreshes whose image had to be decoded and rendered.",
+                 misses);
+  append(text,
+         "# HELP airpanel_frame_cache_hit_ratio Share of refreshes shown "
+         "from a pre-rendered frame.\n"
+         "# TYPE airpanel_frame_cache_hit_ratio gauge\n"
+         "airpanel_frame_cache_hit_ratio %g\n",
+         hits + misses ? static_cast<double>(hits) / (hits + misses) : 0.0);
+
+  append(text,
+         "# HELP airpanel_queue_depth Refreshes submitted but not yet "
+         "ended.\n"
+         "# TYPE airpanel_queue_depth gauge\n"
+         "airpanel_queue_depth %lld\n",
+         static_cast<long long>(metrics.queue_depth));
+
+  append_counter(text, "airpanel_spi_bytes_total",
+                 "Bytes sent to the panel over SPI.", EpdIf::SpiBytes());
+
+  if (get_perf_counters())
+    append_perf_counters(text, metrics);
+  if (get_memory_accounting())
+    append_memory(text, metrics);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  append(text,
+         "# HELP airpanel_peak_resident_memory_bytes Peak resident set "
+         "size.\n"
+         "# TYPE airpanel_peak_resident_memory_bytes gauge\n"
+         "airpanel_peak_resident_memory_bytes %lld\n",
+         static_cast<long long>(usage.ru_maxrss) * 1024);
+  return text;
+}
+
+std::string render_profile(const Metrics &metrics) {
+  unsigned int available = perf_counters_available();
+  std::string text;
+  append(text, "%-8s %5s %10s %14s %14s %6s %11s %12s\n", "stage", "runs",
+         "cpu ms", "cycles", "instructions", "IPC", "cache MPKI",
+         "branch MPKI");
+  for (unsigned int stage = 0; stage < TOTAL; stage++) {
+    const PerfTotals &totals = metrics.perf[stage];
+    uint64_t values[PERF_COUNTER_COUNT];
+    for (int counter = 0; counter < PERF_COUNTER_COUNT; counter++) {
+      values[counter] = totals.values[counter];
+    }
+    // A column per figure, each "-" if what it needs wasn't counted
+    char columns[6][32];
+    const unsigned int per_instruction = 1u << PERF_INSTRUCTIONS;
+    const unsigned int needs[6] = {
+        1u << PERF_TASK_CLOCK,
+        1u << PERF_CYCLES,
+        per_instruction,
+        1u << PERF_CYCLES | per_instruction,
+        1u << PERF_CACHE_MISSES | per_instruction,
+        1u << PERF_BRANCH_MISSES | per_instruction};
+    double instructions = values[PERF_INSTRUCTIONS] ? values[PERF_INSTRUCTIONS]
+                                                    : 1;
+    snprintf(columns[0], sizeof(columns[0]), "%.2f",
+             values[PERF_TASK_CLOCK] / 1e6);
+    snprintf(columns[1], sizeof(columns[1]), "%llu",
+             static_cast<unsigned long long>(values[PERF_CYCLES]));
+    snprintf(columns[2], sizeof(columns[2]), "%llu",
+             static_cast<unsigned long long>(values[PERF_INSTRUCTIONS]));
+    snprintf(columns[3], sizeof(columns[3]), "%.2f",
+             values[PERF_CYCLES]
+                 ? static_cast<double>(values[PERF_INSTRUCTIONS]) /
+                       values[PERF_CYCLES]
+                 : 0.0);
+    snprintf(columns[4], sizeof(columns[4]), "%.2f",
+             1000 * values[PERF_CACHE_MISSES] / instructions);
+    snprintf(columns[5], sizeof(columns[5]), "%.2f",
+             1000 * values[PERF_BRANCH_MISSES] / instructions);
+    for (int column = 0; column < 6; column++) {
+      if ((available & needs[column]) != needs[column])
+        strcpy(columns[column], "-");
+    }
+    append(text, "%-8s %5llu %10s %14s %14s %6s %11s %12s\n",
+           STAGE_NAMES[stage],
+           static_cast<unsigned long long>(totals.runs.load()), columns[0],
+           columns[1], columns[2], columns[3], columns[4], columns[5]);
+  }
+  return text;
+}
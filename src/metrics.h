@@ -0,0 +1,105 @@
+#if !defined(AIRPANEL_METRICS_H)
+#define AIRPANEL_METRICS_H 1
+
+#include "core.h"
+#include "memory_accounting.h"
+#include "perf_counters.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+/***
+ *  A latency histogram in the style of HdrHistogram: below 16 µs each
+ *  microsecond has a bucket of its own, and above that each power of two is
+ *  split into 16 buckets, so any value is counted to within 1/16 of itself
+ *  however long it is. Recording is a few relaxed atomic adds, safe from any
+ *  thread; reading takes a snapshot that may be a record or two behind.
+ */
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+
+  void record(double ms);
+
+  uint64_t count() const;
+  double sum_ms() const;
+  // Refreshes counted up to `ms`, give or take the width of a bucket
+  uint64_t count_up_to(double ms) const;
+  // The upper bound of the bucket `quantile` of the values fall within
+  double quantile_ms(double quantile) const;
+
+  static const unsigned int SUB_BUCKETS = 16;
+  // Enough for values up to 2^40 µs, about 12 days
+  static const unsigned int BUCKETS = SUB_BUCKETS * 38;
+
+  static unsigned int bucket_for(uint64_t us);
+  // One more than the largest value, in µs, that falls in a bucket
+  static uint64_t bucket_end(unsigned int bucket);
+
+private:
+  std::atomic<uint64_t> buckets[BUCKETS];
+  std::atomic<uint64_t> sum_us;
+};
+
+enum Stage { PARSE, DECODE, RENDER, UPLOAD, BUSY, TOTAL, STAGE_COUNT };
+
+/***
+ *  What the daemon has done since it started, for scraping with Prometheus
+ *  (see MetricsServer). Everything is updated with relaxed atomics, so
+ *  counting costs the request path next to nothing.
+ */
+struct Metrics {
+  Metrics();
+
+  // Record the stage timings of a displayed refresh
+  void record(const StageTimings &timings);
+  // Record what a refresh allocated, however it ended, with --memory
+  void record(const RequestMemory &memory);
+
+  LatencyHistogram stages[STAGE_COUNT];
+
+  std::atomic<uint64_t> messages;
+  std::atomic<uint64_t> displayed;
+  std::atomic<uint64_t> failed;
+  // Skipped, because a newer refresh superseded them before or after they
+  // were rendered
+  std::atomic<uint64_t> coalesced;
+  std::atomic<uint64_t> dropped;
+  // Refreshes whose image was a pre-rendered frame, which needed no decoding
+  // or rendering, and those that weren't
+  std::atomic<uint64_t> frame_cache_hits;
+  std::atomic<uint64_t> frame_cache_misses;
+  // Refreshes submitted but not yet displayed, failed or superseded
+  std::atomic<int64_t> queue_depth;
+
+  // What each stage's threads counted, with --profile; TOTAL isn't used
+  PerfTotals perf[STAGE_COUNT];
+
+  // What each stage's threads allocated, with --memory; TOTAL isn't used
+  MemoryTotals memory[STAGE_COUNT];
+  // The most any refresh has had allocated at once
+  std::atomic<int64_t> request_peak_bytes_max;
+  // What the last refresh to end had allocated at most, and retained
+  std::atomic<int64_t> last_request_peak_bytes;
+  std::atomic<int64_t> last_request_retained_bytes;
+  // Retained, summed over every refresh that has ended
+  std::atomic<int64_t> retained_bytes;
+};
+
+// The daemon's metrics
+Metrics &metrics();
+
+/* Render metrics in Prometheus' text exposition format, along with bytes
+ * sent to the panel, the process' peak resident set size, with --profile,
+ * each stage's performance counters and, with --memory, what each stage
+ * and refresh allocated
+ */
+std::string render_metrics(const Metrics &metrics);
+
+/* Render each stage's performance counters as a table for --profile, with
+ * "-" for any the machine doesn't have
+ */
+std::string render_profile(const Metrics &metrics);
+
+#endif
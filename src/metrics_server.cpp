@@ -0,0 +1,152 @@
+#include "metrics_server.h"
+#include "exceptions.h"
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Requests are read only as far as the end of their headers
+static const size_t MAX_REQUEST_BYTES = 8192;
+
+static int listen_on(const std::string &address) {
+  bool unix_socket = address[0] == '/';
+  int fd = socket(unix_socket ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC,
+                  0);
+  if (fd == -1)
+    throw SocketError("socket", strerror(errno));
+
+  int result;
+  if (unix_socket) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(address.c_str());
+    result = ::bind(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                    sizeof(addr));
+  } else {
+    char *end;
+    long port = strtol(address.c_str(), &end, 10);
+    if (*end != '\0' || port <= 0 || port > 65535) {
+      close(fd);
+      throw SocketError("bind", "Invalid metrics port " + address);
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    result = ::bind(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                    sizeof(addr));
+  }
+  if (result == -1) {
+    int error = errno;
+    close(fd);
+    throw SocketError("bind", strerror(error));
+  }
+
+  if (listen(fd, SOMAXCONN) == -1) {
+    int error = errno;
+    close(fd);
+    throw SocketError("listen", strerror(error));
+  }
+  return fd;
+}
+
+MetricsServer::MetricsServer(const std::string &address)
+    : path(address[0] == '/' ? address : std::string()),
+      listen_fd(listen_on(address)) {
+  if ((wake_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+    int error = errno;
+    close(listen_fd);
+    if (!path.empty())
+      unlink(path.c_str());
+    throw SocketError("eventfd", strerror(error));
+  }
+  thread = std::thread(&MetricsServer::serve, this);
+}
+
+MetricsServer::~MetricsServer() {
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) == -1) {
+    LOG_ERROR << "Couldn't stop the metrics server: " << strerror(errno);
+  }
+  thread.join();
+  close(wake_fd);
+  close(listen_fd);
+  if (!path.empty())
+    unlink(path.c_str());
+}
+
+void MetricsServer::serve() {
+  struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+  while (true) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      LOG_ERROR << "Metrics server stopped: " << strerror(errno);
+      return;
+    }
+    if (fds[1].revents)
+      return;
+    if (!(fds[0].revents & POLLIN))
+      continue;
+
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+      LOG_WARNING << "Couldn't accept a metrics scrape: " << strerror(errno);
+      continue;
+    }
+    respond(fd);
+    close(fd);
+  }
+}
+
+/***
+ *  Read a request as far as the blank line that ends its headers, then
+ *  answer it with the metrics. Scrapes are few and far between, so they're
+ *  answered one at a time, with a timeout so a stalled one can't wedge the
+ *  server.
+ */
+void MetricsServer::respond(int fd) {
+  struct timeval timeout = {METRICS_SERVER_TIMEOUT_MS / 1000,
+                            METRICS_SERVER_TIMEOUT_MS % 1000 * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  std::string request;
+  char buffer[1024];
+  while (request.find("\r\n\r\n") == std::string::npos &&
+         request.find("\n\n") == std::string::npos) {
+    ssize_t length = read(fd, buffer, sizeof(buffer));
+    if (length <= 0 || request.size() + length > MAX_REQUEST_BYTES)
+      return;
+    request.append(buffer, length);
+  }
+
+  std::string body = render_metrics(metrics());
+  std::string response =
+      "HTTP/1.0 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+      "Content-Length: " +
+      std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+  size_t sent = 0;
+  while (sent < response.size()) {
+    ssize_t length = send(fd, response.data() + sent, response.size() - sent,
+                          MSG_NOSIGNAL);
+    if (length <= 0)
+      return;
+    sent += length;
+  }
+}
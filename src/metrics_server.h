@@ -0,0 +1,36 @@
+#if !defined(AIRPANEL_METRICS_SERVER_H)
+#define AIRPANEL_METRICS_SERVER_H 1
+
+#include <string>
+#include <thread>
+
+// How long a scraper has to send its request before it's hung up on
+const int METRICS_SERVER_TIMEOUT_MS = 1000;
+
+/***
+ *  Serves the daemon's metrics (see metrics.h) to Prometheus over HTTP, on
+ *  a thread of its own so a scrape never holds up a client of the socket.
+ *  An address starting with '/' is the path of a Unix socket; anything else
+ *  is a TCP port, which is only listened on at 127.0.0.1. Every request,
+ *  whatever its path, gets the metrics back and the connection closed.
+ */
+class MetricsServer {
+public:
+  MetricsServer(const std::string &address);
+  // Stops serving, waiting for any scrape under way to finish
+  ~MetricsServer();
+
+  MetricsServer(const MetricsServer &) = delete;
+  MetricsServer &operator=(const MetricsServer &) = delete;
+
+private:
+  void serve();
+  void respond(int fd);
+
+  std::string path;
+  int listen_fd = -1;
+  int wake_fd = -1;
+  std::thread thread;
+};
+
+#endif
@@ -0,0 +1,126 @@
+#include "perf_counters.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <mutex>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static std::atomic<bool> counting(false);
+static std::atomic<unsigned int> available(0);
+
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} COUNTERS[PERF_COUNTER_COUNT] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"task_clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}};
+
+// What's read from each counter
+struct PerfReading {
+  uint64_t value;
+  uint64_t time_enabled;
+  uint64_t time_running;
+};
+
+/***
+ *  The calling thread's counters, each opened on its own rather than as a
+ *  group so that those the machine has work without those it hasn't, and
+ *  closed when the thread exits
+ */
+struct ThreadCounters {
+  ThreadCounters() {
+    unsigned int opened = 0;
+    int error = 0;
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = COUNTERS[i].type;
+      attr.config = COUNTERS[i].config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format =
+          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      fds[i] = static_cast<int>(
+          syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+      if (fds[i] == -1) {
+        error = errno;
+      } else {
+        opened |= 1u << i;
+      }
+    }
+    available.fetch_or(opened);
+
+    static std::once_flag reported;
+    if (error) {
+      std::call_once(reported, [&]() {
+        LOG_WARNING << "Some performance counters are unavailable ("
+                    << strerror(error) << "); check "
+                    << "/proc/sys/kernel/perf_event_paranoid";
+      });
+    }
+  }
+
+  ~ThreadCounters() {
+    for (int fd : fds) {
+      if (fd != -1)
+        close(fd);
+    }
+  }
+
+  int fds[PERF_COUNTER_COUNT];
+};
+
+bool read_perf_counters(PerfSample &sample) {
+  static thread_local ThreadCounters counters;
+  bool read_any = false;
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    PerfReading reading;
+    sample.values[i] = 0;
+    if (counters.fds[i] == -1 ||
+        read(counters.fds[i], &reading, sizeof(reading)) != sizeof(reading))
+      continue;
+    // Scale up counts from counters that had to share the hardware
+    if (reading.time_running && reading.time_running < reading.time_enabled) {
+      reading.value = static_cast<uint64_t>(
+          static_cast<double>(reading.value) * reading.time_enabled /
+          reading.time_running);
+    }
+    sample.values[i] = reading.value;
+    read_any = true;
+  }
+  return read_any;
+}
+
+unsigned int perf_counters_available() { return available; }
+
+const char *perf_counter_name(PerfCounter counter) {
+  return COUNTERS[counter].name;
+}
+
+void set_perf_counters(bool enabled) { counting = enabled; }
+
+bool get_perf_counters() { return counting.load(std::memory_order_relaxed); }
+
+PerfTotals::PerfTotals() : runs(0) {
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    values[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void PerfTotals::add(const PerfSample &start, const PerfSample &end) {
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (end.values[i] > start.values[i]) {
+      values[i].fetch_add(end.values[i] - start.values[i],
+                          std::memory_order_relaxed);
+    }
+  }
+  runs.fetch_add(1, std::memory_order_relaxed);
+}
@@ -0,0 +1,79 @@
+#if !defined(AIRPANEL_PERF_COUNTERS_H)
+#define AIRPANEL_PERF_COUNTERS_H 1
+
+#include <atomic>
+#include <stdint.h>
+
+enum PerfCounter {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_CACHE_MISSES,
+  PERF_BRANCH_MISSES,
+  // Nanoseconds the thread spent on a CPU, which the others are out of
+  PERF_TASK_CLOCK,
+  PERF_COUNTER_COUNT
+};
+
+// Readings of the calling thread's counters, zero for any unavailable
+struct PerfSample {
+  uint64_t values[PERF_COUNTER_COUNT];
+};
+
+/* Sample the calling thread's counters, opening them with perf_event_open
+ * the first time each thread does. Returns false, once having logged why,
+ * if none of them could be opened: hardware counters are missing in most
+ * VMs, and need perf_event_paranoid to be 2 or below.
+ */
+bool read_perf_counters(PerfSample &sample);
+
+// A bit for each PerfCounter that some thread has been able to open
+unsigned int perf_counters_available();
+
+const char *perf_counter_name(PerfCounter counter);
+
+// Whether PerfScopes count; off by default (see --profile)
+void set_perf_counters(bool enabled);
+bool get_perf_counters();
+
+/***
+ *  Counts summed over every time, on any thread, a stage has run, e.g.
+ *  each band of a frame rendered on the render pool
+ */
+struct PerfTotals {
+  PerfTotals();
+
+  void add(const PerfSample &start, const PerfSample &end);
+
+  std::atomic<uint64_t> values[PERF_COUNTER_COUNT];
+  // How many times the stage ran
+  std::atomic<uint64_t> runs;
+};
+
+/***
+ *  Adds what the calling thread's counters counted from its construction to
+ *  its destruction to totals, if counting was on when it was constructed;
+ *  otherwise it costs one atomic load. Only the calling thread is counted,
+ *  so work a stage hands to other threads needs scopes of its own.
+ */
+class PerfScope {
+public:
+  explicit PerfScope(PerfTotals &totals)
+      : totals(totals),
+        counting(get_perf_counters() && read_perf_counters(start)) {}
+  ~PerfScope() {
+    PerfSample end;
+    if (counting && read_perf_counters(end))
+      totals.add(start, end);
+  }
+
+  PerfScope(const PerfScope &) = delete;
+  PerfScope &operator=(const PerfScope &) = delete;
+
+private:
+  PerfTotals &totals;
+  // Declared before counting, whose initializer reads into it
+  PerfSample start;
+  bool counting;
+};
+
+#endif
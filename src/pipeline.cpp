@@ -0,0 +1,467 @@
+#include "pipeline.h"
+#include "event_log.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "shared_framebuffer.h"
+#include "trace.h"
+
+#include "epd7in5.h"
+#include <stdio.h>
+
+/***
+ *  Resets an arena when it goes out of scope, at the end of a refresh's
+ *  decoding once its rows have been freed, so they don't stay pinned while
+ *  the pipeline is idle
+ */
+struct ArenaReset {
+  RequestArena &arena;
+  ~ArenaReset() { arena.reset(); }
+};
+
+RefreshPipeline::RefreshPipeline()
+    : free_buffers(PIPELINE_FRAME_BUFFERS), render_cancelled(false),
+      stream_cancelled(false),
+      render_thread(&RefreshPipeline::render_loop, this),
+      display_thread(&RefreshPipeline::display_loop, this) {}
+
+RefreshPipeline::~RefreshPipeline() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  action_available.notify_all();
+  render_thread.join();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    rendering_finished = true;
+  }
+  frame_available.notify_all();
+  display_thread.join();
+}
+
+unsigned long RefreshPipeline::submit(const Action &action,
+                                      RefreshCallback on_finished,
+                                      const StageTimings &timings) {
+  Clock::time_point received_at =
+      Clock::now() - std::chrono::duration_cast<Clock::duration>(
+                         std::chrono::duration<double, std::milli>(
+                             timings.parse_ms));
+  unsigned long id;
+  bool superseding = false;
+  PendingAction superseded;
+  Action newest = action;
+  std::shared_ptr<RequestMemory> memory;
+  if (get_memory_accounting())
+    memory = std::make_shared<RequestMemory>();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    id = next_id++;
+    counters.submitted++;
+
+    if (has_pending_action) {
+      LOG_INFO << "Request " << pending_action.request.id
+               << " superseded by " << id << " before rendering";
+      merge_damage(newest, pending_action.action);
+      superseded = std::move(pending_action);
+      superseding = true;
+    } else if (rendering) {
+      // The action being rendered can only be the newest if nothing is
+      // waiting behind it
+      render_cancelled = true;
+    }
+
+    pending_action = PendingAction{
+        Request{id, received_at, timings, on_finished, memory}, newest};
+    has_pending_action = true;
+  }
+  metrics().queue_depth.fetch_add(1, std::memory_order_relaxed);
+  action_available.notify_one();
+  buffer_available.notify_one();
+  if (EventLog *log = get_event_log()) {
+    log->write(EVENT_REFRESH_QUEUED, {id, action.image_filename});
+  }
+  if (superseding)
+    finish(superseded.request, COALESCED);
+  return id;
+}
+
+/***
+ *  Wait for a free frame buffer to render into, unless the action it's for
+ *  gets superseded in the meantime
+ */
+bool RefreshPipeline::acquire_buffer(std::vector<unsigned char> &buffer) {
+  std::unique_lock<std::mutex> lock(mutex);
+  buffer_available.wait(
+      lock, [this] { return !free_buffers.empty() || render_cancelled; });
+  if (render_cancelled)
+    return false;
+  buffer = std::move(free_buffers.back());
+  free_buffers.pop_back();
+  return true;
+}
+
+void RefreshPipeline::recycle(RenderedFrame &frame) {
+  frame.frame_file.reset();
+  if (!frame.owns_buffer)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    free_buffers.push_back(std::move(frame.buffer));
+    frame.owns_buffer = false;
+  }
+  buffer_available.notify_one();
+}
+
+bool RefreshPipeline::is_idle() const {
+  return counters.displayed + counters.failed + counters.coalesced +
+             counters.dropped ==
+         counters.submitted;
+}
+
+void RefreshPipeline::wait_until_idle() {
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [this] { return is_idle(); });
+}
+
+PipelineStats RefreshPipeline::stats() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
+
+/***
+ *  Tell whoever submitted a refresh how it ended, then count it. Called
+ *  without the lock held, since on_finished can take its time.
+ */
+void RefreshPipeline::finish(Request &request, Outcome outcome,
+                             const std::string &error) {
+  static const char *const statuses[] = {"displayed", "failed", "superseded",
+                                         "superseded"};
+  request.timings.total_ms = elapsed_ms(request.received_at);
+  if (outcome == DISPLAYED || outcome == FAILED) {
+    char time_taken[64];
+    snprintf(time_taken, sizeof(time_taken), "Request %lu took %.2f ms",
+             request.id, request.timings.total_ms);
+    LOG_DEBUG << time_taken;
+  }
+  if (EventLog *log = get_event_log()) {
+    const StageTimings &timings = request.timings;
+    log->write(EVENT_REFRESH_FINISHED,
+               {request.id, statuses[outcome], error, timings.total_ms});
+    log->write(EVENT_REFRESH_TIMINGS,
+               {request.id, timings.parse_ms, timings.decode_ms,
+                timings.render_ms, timings.upload_ms, timings.busy_ms});
+  }
+  if (request.memory) {
+    const RequestMemory &memory = *request.memory;
+    int64_t peak_bytes = memory.peak_bytes;
+    int64_t retained_bytes = memory.live_bytes;
+    LOG_DEBUG << "Request " << request.id << " allocated " << peak_bytes
+              << " bytes at most, and retained " << retained_bytes;
+    if (EventLog *log = get_event_log()) {
+      log->write(EVENT_REFRESH_MEMORY,
+                 {request.id, static_cast<int64_t>(memory.allocations),
+                  peak_bytes, retained_bytes});
+    }
+    metrics().record(memory);
+  }
+
+  if (request.on_finished) {
+    request.on_finished(
+        RefreshResult{request.id, statuses[outcome], error, request.timings});
+    // Let go of whatever the callback holds, such as a client's connection
+    request.on_finished = RefreshCallback();
+  }
+
+  Metrics &daemon_metrics = metrics();
+  switch (outcome) {
+  case DISPLAYED:
+    daemon_metrics.record(request.timings);
+    daemon_metrics.displayed.fetch_add(1, std::memory_order_relaxed);
+    break;
+  case FAILED:
+    daemon_metrics.failed.fetch_add(1, std::memory_order_relaxed);
+    break;
+  case COALESCED:
+    daemon_metrics.coalesced.fetch_add(1, std::memory_order_relaxed);
+    break;
+  case DROPPED:
+    daemon_metrics.dropped.fetch_add(1, std::memory_order_relaxed);
+    break;
+  }
+  daemon_metrics.queue_depth.fetch_sub(1, std::memory_order_relaxed);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    switch (outcome) {
+    case DISPLAYED:
+      counters.displayed++;
+      counters.last_displayed = request.id;
+      break;
+    case FAILED:
+      counters.failed++;
+      break;
+    case COALESCED:
+      counters.coalesced++;
+      break;
+    case DROPPED:
+      counters.dropped++;
+      break;
+    }
+  }
+  idle.notify_all();
+}
+
+/***
+ *  Render the latest action into a frame buffer, or map it if it's a frame
+ *  file for this display, and hand it on to the display thread.
+ */
+void RefreshPipeline::render_loop() {
+  set_trace_thread_name("render");
+  while (true) {
+    PendingAction pending;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      action_available.wait(
+          lock, [this] { return stopping || has_pending_action; });
+      if (!has_pending_action)
+        return;
+      pending = std::move(pending_action);
+      has_pending_action = false;
+      rendering = true;
+      render_cancelled = false;
+    }
+    ArenaReset resetting = {render_arena};
+
+    RenderedFrame frame;
+    frame.request = std::move(pending.request);
+    frame.owns_buffer = false;
+    frame.data = NULL;
+    frame.streamed = false;
+    frame.action = pending.action;
+    try {
+      TraceScope rendering("pipeline", "render", "id",
+                           static_cast<int64_t>(frame.request.id));
+      MemoryScope accounting(metrics().memory[RENDER],
+                             frame.request.memory.get());
+      ArenaScope allocating(&render_arena);
+      Clock::time_point started = Clock::now();
+      if (pending.action.action_is_damage()) {
+        // Copy the shared framebuffer, so the producer can carry on drawing
+        if (!acquire_buffer(frame.buffer))
+          throw RenderCancelled(pending.action.image_filename);
+        frame.owns_buffer = true;
+        pending.action.image_bytes->copy_to(frame.buffer);
+        frame.data = frame.buffer.data();
+        frame.request.timings.render_ms = elapsed_ms(started);
+      } else if ((frame.frame_file =
+                      map_display_frame(pending.action, &frame.data))) {
+        frame.request.timings.decode_ms = elapsed_ms(started);
+        metrics().frame_cache_hits.fetch_add(1, std::memory_order_relaxed);
+      } else if (get_stripe_rows()) {
+        frame.streamed = true;
+        metrics().frame_cache_misses.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        metrics().frame_cache_misses.fetch_add(1, std::memory_order_relaxed);
+        if (!acquire_buffer(frame.buffer))
+          throw RenderCancelled(pending.action.image_filename);
+        frame.owns_buffer = true;
+        process_image_into(pending.action, frame.buffer, &render_cancelled,
+                           &frame.request.timings);
+        frame.data = frame.buffer.data();
+      }
+    } catch (RenderCancelled &) {
+      recycle(frame);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        LOG_INFO << "Request " << frame.request.id
+                 << " superseded while rendering";
+        rendering = false;
+        if (has_pending_action)
+          merge_damage(pending_action.action, frame.action);
+      }
+      finish(frame.request, COALESCED);
+      continue;
+    } catch (exception &e) {
+      LOG_ERROR << e.what();
+      recycle(frame);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        rendering = false;
+      }
+      finish(frame.request, FAILED, e.what());
+      continue;
+    }
+
+    // Whichever frame loses is recycled outside the lock
+    bool superseding = false;
+    RenderedFrame superseded;
+    superseded.owns_buffer = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      rendering = false;
+      counters.rendered++;
+      if (has_pending_action) {
+        LOG_INFO << "Request " << frame.request.id << " superseded by "
+                 << pending_action.request.id << " after rendering";
+        merge_damage(pending_action.action, frame.action);
+        superseded = std::move(frame);
+        superseding = true;
+      } else {
+        if (has_ready_frame) {
+          LOG_INFO << "Request " << ready_frame.request.id
+                   << " superseded by " << frame.request.id
+                   << " before display";
+          merge_damage(frame.action, ready_frame.action);
+          superseded = std::move(ready_frame);
+          superseding = true;
+        }
+        ready_frame = std::move(frame);
+        has_ready_frame = true;
+        // A frame half streamed to the panel is abandoned for this one
+        if (streaming)
+          stream_cancelled = true;
+      }
+    }
+    recycle(superseded);
+    if (superseding)
+      finish(superseded.request, DROPPED);
+    frame_available.notify_one();
+  }
+}
+
+/***
+ *  Send the latest rendered frame to the panel whenever it's free. This is
+ *  the only thread that talks to the panel.
+ */
+void RefreshPipeline::display_loop() {
+  Epd epd;
+  bool initialized = false;
+
+  // The frame the panel is refreshing with, if any
+  bool showing = false;
+  Request showing_request;
+  Clock::time_point busy_since;
+
+  set_trace_thread_name("display");
+  while (true) {
+    /* Leave the next frame where it is until the panel is free, so that a
+     * newer frame can still replace it in the meantime
+     */
+    if (showing) {
+      {
+        TraceScope waiting("pipeline", "busy", "id",
+                           static_cast<int64_t>(showing_request.id));
+        PerfScope counting(metrics().perf[BUSY]);
+        MemoryScope accounting(metrics().memory[BUSY],
+                               showing_request.memory.get());
+        traced_wait_until_idle(epd, PIPELINE_BUSY_POLL_MS);
+      }
+      showing_request.timings.busy_ms = elapsed_ms(busy_since);
+      finish(showing_request, DISPLAYED);
+      showing = false;
+    }
+
+    RenderedFrame frame;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      frame_available.wait(
+          lock, [this] { return rendering_finished || has_ready_frame; });
+      if (!has_ready_frame)
+        return;
+      frame = std::move(ready_frame);
+      has_ready_frame = false;
+    }
+
+    if (!initialized) {
+      initialized = epd.Init() == 0;
+    }
+    if (!initialized) {
+      LOG_ERROR << "Display initialization failed";
+      recycle(frame);
+      finish(frame.request, FAILED, "Display initialization failed");
+      continue;
+    }
+
+    StageTimings &timings = frame.request.timings;
+    if (frame.streamed) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        streaming = true;
+        stream_cancelled = false;
+      }
+      bool started = false;
+      Outcome abandoned = DISPLAYED;
+      std::string error;
+      ArenaReset resetting = {stream_arena};
+      try {
+        TraceScope streaming("pipeline", "stream", "id",
+                             static_cast<int64_t>(frame.request.id));
+        MemoryScope accounting(metrics().memory[UPLOAD],
+                               frame.request.memory.get());
+        ArenaScope allocating(&stream_arena);
+        stream_image(frame.action, get_stripe_rows(), STRIPE_RING_LENGTH,
+                     [&](const unsigned char *stripe, size_t length) {
+                       PerfScope counting(metrics().perf[UPLOAD]);
+                       Clock::time_point sending = Clock::now();
+                       if (!started) {
+                         epd.StartFrame();
+                         started = true;
+                       }
+                       traced_send_pixels(
+                           epd, stripe, static_cast<unsigned int>(length));
+                       timings.upload_ms += elapsed_ms(sending);
+                     },
+                     &stream_cancelled, &timings);
+      } catch (RenderCancelled &) {
+        LOG_INFO << "Request " << frame.request.id
+                 << " superseded while streaming";
+        abandoned = COALESCED;
+      } catch (exception &e) {
+        LOG_ERROR << e.what();
+        abandoned = FAILED;
+        error = e.what();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        streaming = false;
+      }
+      if (abandoned != DISPLAYED) {
+        if (started) {
+          // Don't leave the panel holding part of a frame, it's initialized
+          // afresh for the next one
+          epd.Reset();
+          initialized = false;
+        }
+        finish(frame.request, abandoned, error);
+        continue;
+      }
+    } else {
+      // send the frame buffer to the panel, after which it can be reused
+      TraceScope uploading("pipeline", "upload", "id",
+                           static_cast<int64_t>(frame.request.id));
+      PerfScope counting(metrics().perf[UPLOAD]);
+      MemoryScope accounting(metrics().memory[UPLOAD],
+                             frame.request.memory.get());
+      Clock::time_point sending = Clock::now();
+      DamageRect window = damage_window(frame.action.damage);
+      if (frame.action.action_is_damage() && !is_whole_display(window)) {
+        TraceScope sending("spi", "SendWindow");
+        epd.SendWindow(frame.data, static_cast<unsigned int>(window.x),
+                       static_cast<unsigned int>(window.y),
+                       static_cast<unsigned int>(window.width),
+                       static_cast<unsigned int>(window.height));
+      } else {
+        TraceScope sending("spi", "SendFrame");
+        epd.SendFrame(frame.data);
+      }
+      timings.upload_ms = elapsed_ms(sending);
+      recycle(frame);
+    }
+    busy_since = Clock::now();
+    epd.Refresh();
+
+    showing = true;
+    showing_request = std::move(frame.request);
+  }
+}
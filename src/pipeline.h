@@ -0,0 +1,184 @@
+#if !defined(AIRPANEL_PIPELINE_H)
+#define AIRPANEL_PIPELINE_H 1
+
+#include "arena.h"
+#include "core.h"
+#include "memory_accounting.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct PipelineStats {
+  unsigned long submitted;
+  // Made ready for the panel: rendered, mapped from a frame file, or set up
+  // to be streamed
+  unsigned long rendered;
+  unsigned long displayed;
+  unsigned long failed;
+  // Superseded by a newer request before or while being rendered
+  unsigned long coalesced;
+  // Superseded by a newer request after being rendered, but before display
+  unsigned long dropped;
+  unsigned long last_displayed;
+};
+
+/***
+ *  How a refresh ended: "displayed" once the panel has finished refreshing
+ *  with it, "failed" (with an error), or "superseded" by a newer refresh
+ */
+struct RefreshResult {
+  unsigned long id;
+  const char *status;
+  std::string error;
+  StageTimings timings;
+};
+
+typedef std::function<void(const RefreshResult &result)> RefreshCallback;
+
+/* Frames are rendered into one of this many reusable frame buffers: one
+ * can be rendered into while the other waits for, or is uploaded to, the
+ * panel
+ */
+const unsigned int PIPELINE_FRAME_BUFFERS = 2;
+
+// How often the display thread checks whether the panel is still busy
+const unsigned int PIPELINE_BUSY_POLL_MS = 5;
+
+/***
+ *  Refreshes run on two threads of their own, so whoever submits them never
+ *  waits for the panel. A render thread decodes and renders the latest
+ *  action into a frame buffer, and a display thread, which owns the panel
+ *  and only initializes it once, sends the latest rendered frame to it.
+ *
+ *  The display thread uploads a frame and starts the refresh, then hands
+ *  the frame buffer straight back, so frame N+1 is decoded and rendered
+ *  while the panel holds BUSY low for frame N. The next upload starts as
+ *  soon as BUSY goes high, so for a slideshow the panel's own refresh time
+ *  is the only cost of each frame. In striped mode (see set_stripe_rows) the
+ *  display thread renders each frame itself as it streams it to the panel,
+ *  since decoding it ahead would hold the whole image in memory. A frame
+ *  being streamed is abandoned as soon as a newer one is ready, and the
+ *  panel is reset if any of it had been sent.
+ *
+ *  Every intermediate frame would cost a multi-second flash, so the newest
+ *  request always wins: it replaces any action still waiting to be
+ *  rendered, cancels the one being rendered, and replaces any rendered
+ *  frame still waiting for the panel. When the panel frees up, only the
+ *  newest frame is shown. Damage to the shared framebuffer (see
+ *  shared_framebuffer.h) is accumulated as it's superseded, and only the
+ *  damaged window is uploaded and refreshed. There's one pipeline per
+ *  display.
+ *
+ *  Each thread decodes into an arena of its own (see arena.h), which is
+ *  reset as soon as a refresh is done with it.
+ */
+class RefreshPipeline {
+public:
+  RefreshPipeline();
+  // Displays the latest refresh already submitted before returning
+  ~RefreshPipeline();
+
+  RefreshPipeline(const RefreshPipeline &) = delete;
+  RefreshPipeline &operator=(const RefreshPipeline &) = delete;
+
+  /* Queue a refresh action, which must have an image, and return its
+   * request id without waiting for it to be rendered or displayed.
+   * on_finished is called once the refresh has ended one way or another,
+   * on a pipeline thread, or in the submit call that supersedes it. timings
+   * can carry the time already spent parsing the action, which counts
+   * towards the total.
+   */
+  unsigned long submit(const Action &action,
+                       RefreshCallback on_finished = RefreshCallback(),
+                       const StageTimings &timings = StageTimings());
+
+  /* Block until every refresh submitted so far has been displayed, has
+   * failed or has been superseded
+   */
+  void wait_until_idle();
+
+  PipelineStats stats();
+
+private:
+  typedef MonotonicClock Clock;
+
+  // What every stage needs to know about a refresh
+  struct Request {
+    unsigned long id;
+    // When the message was received, which is before it was submitted
+    Clock::time_point received_at;
+    StageTimings timings;
+    RefreshCallback on_finished;
+    // What it allocated, with --memory
+    std::shared_ptr<RequestMemory> memory;
+  };
+
+  // How a refresh ended, which decides which counter it goes towards
+  enum Outcome { DISPLAYED, FAILED, COALESCED, DROPPED };
+
+  struct PendingAction {
+    Request request;
+    Action action;
+  };
+
+  struct RenderedFrame {
+    Request request;
+    // One of the pipeline's frame buffers, if owns_buffer
+    std::vector<unsigned char> buffer;
+    bool owns_buffer;
+    // Frame files that match the display are sent from the mapping itself
+    std::shared_ptr<const ImageBytes> frame_file;
+    const unsigned char *data;
+    // In striped mode, frames are rendered as they're streamed to the panel
+    bool streamed;
+    Action action;
+  };
+
+  void render_loop();
+  void display_loop();
+  void finish(Request &request, Outcome outcome,
+              const std::string &error = std::string());
+  bool is_idle() const;
+  bool acquire_buffer(std::vector<unsigned char> &buffer);
+  void recycle(RenderedFrame &frame);
+
+  std::mutex mutex;
+  std::condition_variable action_available;
+  std::condition_variable frame_available;
+  std::condition_variable idle;
+  std::condition_variable buffer_available;
+
+  std::vector<std::vector<unsigned char>> free_buffers;
+
+  // Only used by the render thread, and by the display thread for streaming
+  RequestArena render_arena;
+  RequestArena stream_arena;
+
+  // The latest action not yet being rendered, and latest frame not yet shown
+  bool has_pending_action = false;
+  PendingAction pending_action;
+  bool has_ready_frame = false;
+  RenderedFrame ready_frame;
+
+  bool rendering = false;
+  std::atomic<bool> render_cancelled;
+  // Set when a newer frame is ready while one is streamed to the panel
+  bool streaming = false;
+  std::atomic<bool> stream_cancelled;
+
+  unsigned long next_id = 1;
+  PipelineStats counters = {};
+  bool stopping = false;
+  bool rendering_finished = false;
+
+  std::thread render_thread;
+  std::thread display_thread;
+};
+
+#endif
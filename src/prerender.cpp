@@ -0,0 +1,125 @@
+#include "prerender.h"
+#include "frame.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <map>
+#include <string.h>
+#include <sys/stat.h>
+
+/***
+ *  The frame file for an image lives in the output directory, named after the
+ *  image with its extension replaced, e.g. photos/cat.png -> out/cat.apf
+ */
+std::string prerender_output_filename(const std::string &image_filename,
+                                      const std::string &output_directory) {
+  std::string basename = image_filename;
+  size_t slash = basename.find_last_of('/');
+  if (slash != std::string::npos)
+    basename = basename.substr(slash + 1);
+  size_t dot = basename.find_last_of('.');
+  if (dot != std::string::npos && dot > 0)
+    basename = basename.substr(0, dot);
+
+  std::string directory = output_directory.empty() ? "." : output_directory;
+  if (directory[directory.size() - 1] != '/')
+    directory += "/";
+  return directory + basename + FRAME_FILE_EXTENSION;
+}
+
+/***
+ *  Only the image's basename is kept, so a/logo.png and b/logo.png, or
+ *  logo.png and logo.qoi, would be rendered to the same frame file, and
+ *  whichever finished last would win. Refuse the whole batch up front
+ *  instead. An image listed more than once is only rendered once.
+ */
+static std::vector<std::string>
+distinct_images(const std::vector<std::string> &image_filenames,
+                const std::string &output_directory) {
+  std::vector<std::string> distinct;
+  std::map<std::string, const std::string *> image_for_frame;
+  for (const std::string &image_filename : image_filenames) {
+    std::string frame_filename =
+        prerender_output_filename(image_filename, output_directory);
+    auto inserted = image_for_frame.insert({frame_filename, &image_filename});
+    if (inserted.second) {
+      distinct.push_back(image_filename);
+    } else if (*inserted.first->second != image_filename) {
+      throw FrameFileError(frame_filename,
+                           *inserted.first->second + " and " + image_filename +
+                               " would both be pre-rendered to it");
+    }
+  }
+  return distinct;
+}
+
+/***
+ *  Render every image into a display-native frame file, using a work-stealing
+ *  thread pool so that a batch of images is spread across all cores. `action`
+ *  supplies the orientation and offsets applied to every image. Throws
+ *  FrameFileError if two images would be rendered to the same frame file.
+ */
+PrerenderReport prerender_images(Action action,
+                                 const std::vector<std::string> &images,
+                                 const std::string &output_directory,
+                                 unsigned int thread_count) {
+  PrerenderReport report;
+  std::vector<std::string> image_filenames =
+      distinct_images(images, output_directory);
+
+  if (!output_directory.empty() &&
+      mkdir(output_directory.c_str(), 0755) == -1 && errno != EEXIST) {
+    throw FrameFileError(output_directory, strerror(errno));
+  }
+
+  std::atomic<unsigned int> frames_rendered(0);
+  std::atomic<unsigned int> frames_failed(0);
+  std::atomic<unsigned long long> bytes_written(0);
+  const unsigned int total = static_cast<unsigned int>(image_filenames.size());
+  const unsigned int progress_step = total >= 10 ? total / 10 : 1;
+
+  auto time_start = std::chrono::steady_clock::now();
+  {
+    ThreadPool pool(thread_count);
+    report.threads = pool.size();
+
+    for (const std::string &image_filename : image_filenames) {
+      pool.submit([&, image_filename]() {
+        Action image_action = action;
+        image_action.image_filename = image_filename;
+        std::string frame_filename =
+            prerender_output_filename(image_filename, output_directory);
+
+        try {
+          std::vector<unsigned char> bitmap_frame_buffer =
+              process_image(image_action);
+          write_frame_file(frame_filename, bitmap_frame_buffer);
+          bytes_written += bitmap_frame_buffer.size();
+        } catch (exception &e) {
+          LOG_ERROR << e.what();
+          frames_failed++;
+          return;
+        }
+
+        unsigned int done = ++frames_rendered;
+        LOG_DEBUG << "Rendered " << image_filename << " to " << frame_filename;
+        if (done % progress_step == 0 || done == total) {
+          LOG_INFO << "Pre-rendered " << done << " of " << total << " frames";
+        }
+      });
+    }
+
+    pool.wait();
+    report.steals = pool.steal_count();
+  }
+  auto time_end = std::chrono::steady_clock::now();
+
+  report.frames_rendered = frames_rendered;
+  report.frames_failed = frames_failed;
+  report.bytes_written = bytes_written;
+  report.elapsed_ms =
+      std::chrono::duration<double, std::milli>(time_end - time_start).count();
+  return report;
+}
@@ -0,0 +1,29 @@
+#if !defined(AIRPANEL_PRERENDER_H)
+#define AIRPANEL_PRERENDER_H 1
+
+#include "core.h"
+
+#include <string>
+#include <vector>
+
+struct PrerenderReport {
+  unsigned int frames_rendered = 0;
+  unsigned int frames_failed = 0;
+  unsigned int threads = 0;
+  unsigned long steals = 0;
+  unsigned long long bytes_written = 0;
+  double elapsed_ms = 0;
+  double frames_per_second() {
+    return elapsed_ms > 0 ? frames_rendered * 1000.0 / elapsed_ms : 0;
+  }
+};
+
+std::string prerender_output_filename(const std::string &image_filename,
+                                      const std::string &output_directory);
+
+PrerenderReport prerender_images(Action action,
+                                 const std::vector<std::string> &image_filenames,
+                                 const std::string &output_directory,
+                                 unsigned int thread_count);
+
+#endif
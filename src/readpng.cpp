@@ -1,43 +1,63 @@
+#include "arena.h"
+#include "config.h"
 #include "exceptions.h"
 #include "logger.h"
+#include "mapped_file.h"
 #include "readpng.h"
+#include "trace.h"
+#include <atomic>
 #include <png.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
 
-ImageProperties read_png_file(std::string filename) {
-  ImageProperties image_properties;
-
-  FILE *fp;
-
-  if ((fp = fopen(filename.c_str(), "rb")) == NULL) {
-    throw ImageFileNotFound(filename);
+/***
+ *  libpng pulls its input through read_png_data from a buffer in memory, so
+ *  a mapped file is read with a handful of large page faults instead of
+ *  many small stdio reads, and PNG bytes that are already in memory need no
+ *  temporary file.
+ */
+static std::atomic<bool> png_gray_decode(false);
+
+struct PngMemorySource {
+  const unsigned char *data;
+  size_t length;
+  size_t position;
+};
+
+static void read_png_data(png_structp png, png_bytep destination,
+                          png_size_t length) {
+  PngMemorySource *source =
+      static_cast<PngMemorySource *>(png_get_io_ptr(png));
+  if (source->length - source->position < length) {
+    png_error(png, "unexpected end of PNG data");
   }
+  memcpy(destination, source->data + source->position, length);
+  source->position += length;
+}
 
-  png_structp png =
-      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (!png)
-    abort();
-
-  png_infop info = png_create_info_struct(png);
-  if (!info)
-    abort();
-
-  if (setjmp(png_jmpbuf(png)))
-    abort();
-
-  png_init_io(png, fp);
+/***
+ *  libpng allocates its structs and buffers through these, from the
+ *  request's arena if there is one (see arena.h), and counted with --memory
+ */
+static png_voidp png_malloc_arena(png_structp, png_alloc_size_t size) {
+  return arena_malloc(size);
+}
 
-  png_read_info(png, info);
+static void png_free_arena(png_structp, png_voidp pointer) {
+  arena_free(pointer);
+}
 
-  image_properties.width = png_get_image_width(png, info);
-  image_properties.height = png_get_image_height(png, info);
-  image_properties.color_type = png_get_color_type(png, info);
-  image_properties.bit_depth = png_get_bit_depth(png, info);
+void set_png_gray_decode(bool enabled) { png_gray_decode = enabled; }
 
-  // Read any color_type into 8bit depth, RGBA format.
-  // See http://www.libpng.org/pub/png/libpng-manual.txt
+bool get_png_gray_decode() { return png_gray_decode; }
 
+/***
+ *  Read any color_type into 8bit depth, RGBA format.
+ *  See http://www.libpng.org/pub/png/libpng-manual.txt
+ */
+static void set_rgba_transforms(png_structp png, png_infop info,
+                                ImageProperties &image_properties) {
   if (image_properties.bit_depth == 16)
     png_set_strip_16(png);
 
@@ -61,24 +81,173 @@ ImageProperties read_png_file(std::string filename) {
   if (image_properties.color_type == PNG_COLOR_TYPE_GRAY ||
       image_properties.color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
     png_set_gray_to_rgb(png);
+}
+
+/***
+ *  Read any color_type into 8bit gray, so the render stage reads one byte
+ *  per pixel rather than four. libpng converts color to gray in linear light
+ *  with the same Rec. 709 weights as convert_to_gray, but in fixed point,
+ *  with a 2.2 power curve standing in for the exact sRGB curve and through
+ *  8bit linear tables, which loses precision in the shadows; see
+ *  GRAY_DECODE_TOLERANCE. Transparent pixels are composited against
+ *  BACKGROUND_COLOR, where convert_to_gray scales by alpha (i.e. composites
+ *  against black).
+ */
+static void set_gray_transforms(png_structp png, png_infop info,
+                                ImageProperties &image_properties) {
+  bool has_alpha =
+      (image_properties.color_type & PNG_COLOR_MASK_ALPHA) != 0 ||
+      png_get_valid(png, info, PNG_INFO_tRNS) != 0;
+
+  if (image_properties.color_type == PNG_COLOR_TYPE_PALETTE)
+    png_set_palette_to_rgb(png);
+
+  if (image_properties.color_type == PNG_COLOR_TYPE_GRAY &&
+      image_properties.bit_depth < 8)
+    png_set_expand_gray_1_2_4_to_8(png);
+
+  if (png_get_valid(png, info, PNG_INFO_tRNS))
+    png_set_tRNS_to_alpha(png);
+
+  if (image_properties.bit_depth == 16)
+    png_set_strip_16(png);
+
+  // Both the image and the display are sRGB, but telling libpng so makes it
+  // do the gray conversion and alpha compositing in linear light
+  png_set_gamma_fixed(png, PNG_DEFAULT_sRGB, PNG_DEFAULT_sRGB);
+
+  if (image_properties.color_type & PNG_COLOR_MASK_COLOR ||
+      image_properties.color_type == PNG_COLOR_TYPE_PALETTE)
+    png_set_rgb_to_gray_fixed(png, PNG_ERROR_ACTION_NONE, 21260, 71520);
+
+  if (has_alpha) {
+    png_color_16 background = {};
+    background.red = background.green = background.blue = background.gray =
+        static_cast<png_uint_16>(BACKGROUND_COLOR);
+    png_set_background_fixed(png, &background, PNG_BACKGROUND_GAMMA_SCREEN, 0,
+                             PNG_FP_1);
+  }
+}
+
+bool is_png_file(const unsigned char *magic, size_t length) {
+  return length >= 8 && png_sig_cmp(magic, 0, 8) == 0;
+}
+
+ImageProperties read_png_file(std::string filename) {
+  TraceScope reading("decode", "read_png_file");
+  MappedFile file(filename);
+  return read_png_memory(file.data(), file.size(), filename);
+}
+
+ImageProperties read_png_memory(const unsigned char *data, size_t length,
+                                const std::string &name) {
+  TraceScope decoding("decode", "read_png_memory", "bytes",
+                      static_cast<int64_t>(length));
+  ImageProperties image_properties = {};
+  PngMemorySource source = {data, length, 0};
+
+  png_structp png = png_create_read_struct_2(
+      PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, NULL, png_malloc_arena,
+      png_free_arena);
+  if (!png)
+    throw ImageDecodeError(name, "not enough memory to start decoding");
+
+  png_infop info = png_create_info_struct(png);
+  if (!info) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    throw ImageDecodeError(name, "not enough memory to start decoding");
+  }
+
+  // Set between setjmp and a possible longjmp, so they must be volatile
+  png_bytep *volatile row_pointers = NULL;
+  volatile int rows_allocated = 0;
+
+  if (setjmp(png_jmpbuf(png))) {
+    ImageProperties allocated = {};
+    allocated.height = rows_allocated;
+    allocated.row_pointers = row_pointers;
+    free_image_properties(allocated);
+    png_destroy_read_struct(&png, &info, NULL);
+    throw ImageDecodeError(name, "corrupt or truncated PNG data");
+  }
+
+  png_set_read_fn(png, &source, read_png_data);
+
+  png_read_info(png, info);
+
+  image_properties.width = png_get_image_width(png, info);
+  image_properties.height = png_get_image_height(png, info);
+  image_properties.color_type = png_get_color_type(png, info);
+  image_properties.bit_depth = png_get_bit_depth(png, info);
+
+  if (png_gray_decode) {
+    set_gray_transforms(png, info, image_properties);
+  } else {
+    set_rgba_transforms(png, info, image_properties);
+  }
 
   png_read_update_info(png, info);
 
   image_properties.bytes_per_pixel = static_cast<unsigned int>(
       png_get_rowbytes(png, info) / image_properties.width);
 
-  image_properties.row_pointers = static_cast<png_bytep *>(
-      malloc(sizeof(png_bytep) * image_properties.height));
-  for (int y = 0; y < image_properties.height; y++) {
-    image_properties.row_pointers[y] =
-        static_cast<png_byte *>(malloc(png_get_rowbytes(png, info)));
+  try {
+    allocate_image_rows(image_properties, png_get_rowbytes(png, info), name);
+  } catch (ImageDecodeError &) {
+    png_destroy_read_struct(&png, &info, NULL);
+    throw;
   }
+  row_pointers = image_properties.row_pointers;
+  rows_allocated = image_properties.height;
 
-  png_read_image(png, image_properties.row_pointers);
+  png_read_image(png, row_pointers);
 
-  fclose(fp);
   png_destroy_read_struct(&png, &info, NULL);
   png = NULL;
   info = NULL;
   return image_properties;
 }
+
+void allocate_image_rows(ImageProperties &image_properties, size_t row_bytes,
+                         const std::string &name) {
+  uint64_t pixels = static_cast<uint64_t>(image_properties.width) *
+                    static_cast<uint64_t>(image_properties.height);
+  if (image_properties.width <= 0 || image_properties.height <= 0 ||
+      pixels > MAX_IMAGE_PIXELS) {
+    throw ImageDecodeError(name, "a " + std::to_string(image_properties.width) +
+                                     "x" +
+                                     std::to_string(image_properties.height) +
+                                     " image is too large to decode");
+  }
+
+  size_t height = static_cast<size_t>(image_properties.height);
+  png_bytep *row_pointers =
+      static_cast<png_bytep *>(arena_malloc(sizeof(png_bytep) * height));
+  if (!row_pointers)
+    throw ImageDecodeError(name, "not enough memory for the image");
+  for (size_t y = 0; y < height; y++) {
+    row_pointers[y] = static_cast<png_bytep>(arena_malloc(row_bytes));
+    if (!row_pointers[y]) {
+      for (size_t allocated = 0; allocated < y; allocated++) {
+        arena_free(row_pointers[allocated]);
+      }
+      arena_free(row_pointers);
+      throw ImageDecodeError(name, "not enough memory for the image");
+    }
+  }
+  image_properties.row_pointers = row_pointers;
+}
+
+/***
+ *  Release the row buffers allocated by any decoder, which come from the
+ *  request's arena if there was one when they were decoded
+ */
+void free_image_properties(ImageProperties &image_properties) {
+  if (!image_properties.row_pointers)
+    return;
+  for (int y = 0; y < image_properties.height; y++) {
+    arena_free(image_properties.row_pointers[y]);
+  }
+  arena_free(image_properties.row_pointers);
+  image_properties.row_pointers = NULL;
+}
@@ -1,4 +1,6 @@
+#pragma once
 #include <png.h>
+#include <stdint.h>
 #include <string>
 
 struct ImageProperties {
@@ -6,9 +8,46 @@ struct ImageProperties {
   int height;
   png_byte color_type;
   png_byte bit_depth;
+  // 4 for RGBA rows, or 1 for gray rows (see set_png_gray_decode)
   int bytes_per_pixel;
   png_bytep *row_pointers;
   bool is_portrait() { return height > width; }
 };
 
+/* For opaque pixels, gray levels from the gray decode path are within
+ * GRAY_DECODE_TOLERANCE of convert_to_gray's wherever convert_to_gray gives
+ * GRAY_DECODE_SHADOW_LEVEL or more, and within GRAY_DECODE_SHADOW_TOLERANCE
+ * in the shadows below that. Measured over all 2^24 RGB colors the worst
+ * cases are 4 and 19 levels, and 1.6% of colors are more than 2 levels out.
+ */
+const unsigned int GRAY_DECODE_TOLERANCE = 4;
+const unsigned int GRAY_DECODE_SHADOW_LEVEL = 64;
+const unsigned int GRAY_DECODE_SHADOW_TOLERANCE = 20;
+
+/* The most pixels any decoder will allocate rows for, 64 MB of them as RGBA.
+ * Far more than any display needs, but not so many that a bogus header can
+ * take all of a Pi's memory.
+ */
+const uint64_t MAX_IMAGE_PIXELS = 16 * 1024 * 1024;
+
+/* Decode PNGs to 8-bit gray instead of RGBA, off by default */
+void set_png_gray_decode(bool enabled);
+
+bool get_png_gray_decode();
+
+bool is_png_file(const unsigned char *magic, size_t length);
+
 ImageProperties read_png_file(std::string filename);
+
+ImageProperties read_png_memory(const unsigned char *data, size_t length,
+                                const std::string &name);
+
+/* Allocate image_properties' height rows of row_bytes each, for a decoder to
+ * fill in, from the request's arena if there is one. Throws
+ * ImageDecodeError, with nothing left allocated, if the image has more than
+ * MAX_IMAGE_PIXELS or there isn't the memory for it.
+ */
+void allocate_image_rows(ImageProperties &image_properties, size_t row_bytes,
+                         const std::string &name);
+
+void free_image_properties(ImageProperties &image_properties);
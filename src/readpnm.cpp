@@ -0,0 +1,119 @@
+#include "readpnm.h"
+#include "exceptions.h"
+
+#include <algorithm>
+#include <ctype.h>
+#include <stdlib.h>
+
+/***
+ *  Binary PBM (P4) and PGM (P5) files, see http://netpbm.sourceforge.net/doc/
+ *  Both have a short text header followed by the raw pixel data, so they
+ *  decode with a single pass over the file and no decompression.
+ */
+bool is_pnm_file(const unsigned char *magic, size_t length) {
+  return length >= 3 && magic[0] == 'P' &&
+         (magic[1] == '4' || magic[1] == '5') && isspace(magic[2]);
+}
+
+/***
+ *  Read the next unsigned decimal number from a PNM header, skipping any
+ *  whitespace and # comments before it
+ */
+static unsigned int read_pnm_header_number(const std::string &filename,
+                                           const unsigned char *data,
+                                           size_t length, size_t &position) {
+  while (position < length) {
+    if (data[position] == '#') {
+      while (position < length && data[position] != '\n')
+        position++;
+    } else if (isspace(data[position])) {
+      position++;
+    } else {
+      break;
+    }
+  }
+
+  if (position >= length || !isdigit(data[position])) {
+    throw ImageDecodeError(filename, "malformed PBM/PGM header");
+  }
+
+  unsigned long number = 0;
+  while (position < length && isdigit(data[position])) {
+    number = number * 10 + (data[position++] - '0');
+    if (number > 0xFFFFFF) {
+      throw ImageDecodeError(filename, "PBM/PGM dimensions are too large");
+    }
+  }
+  return static_cast<unsigned int>(number);
+}
+
+ImageProperties read_pnm_memory(const unsigned char *data, size_t length,
+                                const std::string &filename) {
+  if (!is_pnm_file(data, length)) {
+    throw ImageDecodeError(filename, "not a binary PBM or PGM file");
+  }
+
+  bool is_bitmap = data[1] == '4';
+  size_t position = 2;
+
+  ImageProperties image_properties = {};
+  image_properties.width =
+      read_pnm_header_number(filename, data, length, position);
+  image_properties.height =
+      read_pnm_header_number(filename, data, length, position);
+  unsigned int max_value =
+      is_bitmap ? 1 : read_pnm_header_number(filename, data, length, position);
+
+  // Exactly one whitespace character separates the header from the pixels
+  position++;
+
+  if (image_properties.width == 0 || image_properties.height == 0 ||
+      max_value == 0 || max_value > 0xFFFF) {
+    throw ImageDecodeError(filename, "invalid PBM/PGM header");
+  }
+
+  size_t bytes_per_sample = max_value > 0xFF ? 2 : 1;
+  size_t source_bytes_per_row =
+      is_bitmap ? (image_properties.width + 7) / 8
+                : image_properties.width * bytes_per_sample;
+
+  if (position > length ||
+      (length - position) / source_bytes_per_row <
+          static_cast<size_t>(image_properties.height)) {
+    throw ImageDecodeError(filename, "truncated PBM/PGM pixel data");
+  }
+
+  image_properties.color_type = PNG_COLOR_TYPE_GRAY;
+  image_properties.bit_depth = is_bitmap ? 1 : 8 * bytes_per_sample;
+  // PBM and PGM are already gray, so decode into gray rows
+  image_properties.bytes_per_pixel = 1;
+
+  allocate_image_rows(image_properties,
+                      static_cast<size_t>(image_properties.width) *
+                          image_properties.bytes_per_pixel,
+                      filename);
+
+  for (int y = 0; y < image_properties.height; y++) {
+    const unsigned char *source = data + position + y * source_bytes_per_row;
+    png_bytep row = image_properties.row_pointers[y];
+
+    for (int x = 0; x < image_properties.width; x++) {
+      png_byte gray;
+      if (is_bitmap) {
+        // In a PBM, 1 is black
+        gray = (source[x / 8] >> (7 - (x % 8))) & 1 ? 0 : 0xFF;
+      } else if (max_value == 0xFF) {
+        gray = source[x];
+      } else {
+        unsigned int sample = bytes_per_sample == 1
+                                  ? source[x]
+                                  : source[x * 2] << 8 | source[x * 2 + 1];
+        gray = static_cast<png_byte>(std::min(sample, max_value) * 0xFF /
+                                     max_value);
+      }
+      row[x] = gray;
+    }
+  }
+
+  return image_properties;
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include "readpng.h"
+
+#include <stddef.h>
+#include <string>
+
+bool is_qoi_file(const unsigned char *magic, size_t length);
+
+ImageProperties read_qoi_memory(const unsigned char *data, size_t length,
+                                const std::string &name);
@@ -0,0 +1,471 @@
+#include "server.h"
+#include "exceptions.h"
+#include "logger.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Reads per wakeup, so one busy client can't monopolize the loop
+static const int READS_PER_EVENT = 16;
+static const size_t READ_BYTES = 4096;
+static const int EVENTS_PER_WAIT = 64;
+
+struct SocketServer::Outbox {
+  struct Reply {
+    int fd;
+    unsigned long serial;
+    std::string framed;
+    // Whether a Responder has just gone, rather than sent a reply
+    bool released;
+  };
+
+  void post(Reply reply) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (closed)
+      return;
+    replies.push_back(std::move(reply));
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+      LOG_ERROR << "Couldn't wake the socket server: " << strerror(errno);
+    }
+  }
+
+  std::mutex mutex;
+  int wake_fd;
+  bool closed;
+  std::vector<Reply> replies;
+};
+
+struct Responder::State {
+  ~State() {
+    if (outbox) {
+      outbox->post(
+          SocketServer::Outbox::Reply{fd, serial, std::string(), true});
+    }
+  }
+
+  std::shared_ptr<SocketServer::Outbox> outbox;
+  int fd;
+  unsigned long serial;
+  Framing framing;
+};
+
+void Responder::send(const std::string &reply) const {
+  if (state && state->outbox) {
+    state->outbox->post(SocketServer::Outbox::Reply{
+        state->fd, state->serial, frame_message(reply, state->framing),
+        false});
+  }
+}
+
+unsigned long Responder::connection() const {
+  return state ? state->serial : 0;
+}
+
+PassedFds::~PassedFds() {
+  for (const Passed &passed : fds) {
+    close(passed.fd);
+  }
+}
+
+int PassedFds::take() {
+  if (fds.empty())
+    return -1;
+  int fd = fds.front().fd;
+  fds.pop_front();
+  return fd;
+}
+
+void PassedFds::drop_through_message() {
+  while (!fds.empty() && fds.front().received < message_end) {
+    close(fds.front().fd);
+    fds.pop_front();
+  }
+}
+
+SocketServer::SocketServer(const std::string &path, MessageHandler handler)
+    : path(path), handler(handler), stopping(false) {
+  if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0)) == -1) {
+    throw SocketError("socket", strerror(errno));
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path[0] == '\0') {
+    memcpy(addr.sun_path + 1, path.data() + 1,
+           std::min(path.size() - 1, sizeof(addr.sun_path) - 2));
+  } else {
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+  }
+
+  if (::bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr),
+             sizeof(addr)) == -1) {
+    int error = errno;
+    close(listen_fd);
+    throw SocketError("bind", strerror(error));
+  }
+
+  if (listen(listen_fd, SOMAXCONN) == -1) {
+    int error = errno;
+    close(listen_fd);
+    throw SocketError("listen", strerror(error));
+  }
+
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    throw_setup_error("epoll_create1", {listen_fd});
+  if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    throw_setup_error("eventfd", {listen_fd, epoll_fd});
+
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1)
+    throw_setup_error("epoll_ctl", {listen_fd, epoll_fd, wake_fd});
+  event.data.fd = wake_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == -1)
+    throw_setup_error("epoll_ctl", {listen_fd, epoll_fd, wake_fd});
+
+  outbox = std::make_shared<Outbox>();
+  outbox->wake_fd = wake_fd;
+  outbox->closed = false;
+}
+
+void SocketServer::throw_setup_error(const char *call,
+                                     std::initializer_list<int> fds) {
+  int error = errno;
+  for (int fd : fds) {
+    close(fd);
+  }
+  if (path[0] != '\0')
+    unlink(path.c_str());
+  throw SocketError(call, strerror(error));
+}
+
+SocketServer::~SocketServer() {
+  {
+    // Responders can outlive the server, but they won't be heard
+    std::lock_guard<std::mutex> lock(outbox->mutex);
+    outbox->closed = true;
+  }
+  for (auto &entry : connections) {
+    close(entry.first);
+  }
+  close(wake_fd);
+  close(epoll_fd);
+  close(listen_fd);
+  if (path[0] != '\0')
+    unlink(path.c_str());
+}
+
+void SocketServer::stop() {
+  stopping = true;
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) == -1) {
+    LOG_ERROR << "Couldn't stop the socket server: " << strerror(errno);
+  }
+}
+
+void SocketServer::run() {
+  struct epoll_event events[EVENTS_PER_WAIT];
+
+  while (!stopping) {
+    int count = epoll_wait(epoll_fd, events, EVENTS_PER_WAIT, -1);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+      throw SocketError("epoll_wait", strerror(errno));
+    }
+
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd) {
+        accept_connections();
+        continue;
+      }
+      if (fd == wake_fd) {
+        uint64_t value;
+        if (read(wake_fd, &value, sizeof(value)) == sizeof(value))
+          deliver_replies();
+        continue;
+      }
+
+      // The connection may have been closed earlier in this batch
+      auto found = connections.find(fd);
+      if (found == connections.end())
+        continue;
+      Connection &connection = found->second;
+
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        read_from(connection);
+      } else if (events[i].events & EPOLLOUT) {
+        write_to(connection);
+      }
+    }
+  }
+}
+
+void SocketServer::accept_connections() {
+  while (true) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG_ERROR << "Accept error: " << strerror(errno);
+      }
+      return;
+    }
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      LOG_ERROR << "Couldn't watch connection: " << strerror(errno);
+      close(fd);
+      continue;
+    }
+    connections.emplace(fd, Connection(fd, next_serial++))
+        .first->second.watched_events = EPOLLIN;
+    LOG_DEBUG << "Accepted connection " << fd << " ("
+              << connections.size() << " open)";
+  }
+}
+
+/***
+ *  Read from the client into its frame reader, collecting any descriptors it
+ *  passes along the way, after the first `received` bytes
+ */
+static ssize_t receive(int fd, char *destination, size_t length,
+                       PassedFds &passed_fds, uint64_t received) {
+  struct iovec iov;
+  iov.iov_base = destination;
+  iov.iov_len = length;
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(sizeof(int) * SERVER_MAX_PASSED_FDS)];
+  } control;
+
+  struct msghdr header;
+  memset(&header, 0, sizeof(header));
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+  header.msg_control = control.buffer;
+  header.msg_controllen = sizeof(control.buffer);
+
+  ssize_t bytes = recvmsg(fd, &header, MSG_CMSG_CLOEXEC);
+  if (bytes < 0)
+    return bytes;
+
+  for (struct cmsghdr *message = CMSG_FIRSTHDR(&header); message;
+       message = CMSG_NXTHDR(&header, message)) {
+    if (message->cmsg_level != SOL_SOCKET || message->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t count = (message->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const unsigned char *fds = CMSG_DATA(message);
+    for (size_t i = 0; i < count; i++) {
+      int passed;
+      memcpy(&passed, fds + i * sizeof(int), sizeof(int));
+      passed_fds.add(passed, received);
+    }
+  }
+  if (header.msg_flags & MSG_CTRUNC) {
+    LOG_WARNING << "Connection " << fd << " passed too many descriptors at "
+                << "once; some were dropped";
+  }
+  return bytes;
+}
+
+/***
+ *  Read what the client has sent so far, and handle every complete message
+ *  in it
+ */
+void SocketServer::read_from(Connection &connection) {
+  bool hung_up = false;
+
+  {
+    TraceScope reading("socket", "read", "fd", connection.fd);
+    for (int reads = 0; reads < READS_PER_EVENT; reads++) {
+      ssize_t length =
+          receive(connection.fd, connection.input.prepare(READ_BYTES),
+                  READ_BYTES, connection.passed_fds, connection.received);
+      if (length > 0) {
+        connection.input.commit(static_cast<size_t>(length));
+        connection.received += static_cast<uint64_t>(length);
+        continue;
+      }
+      if (length == 0) {
+        hung_up = true;
+      } else if (errno == EINTR) {
+        continue;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG_ERROR << "Read error: " << strerror(errno);
+        close_connection(connection);
+        return;
+      }
+      break;
+    }
+  }
+
+  std::string message;
+  Framing framing;
+  try {
+    while (connection.input.next(message, framing)) {
+      handle_message(connection, message, framing);
+    }
+    if (hung_up) {
+      while (connection.input.finish(message, framing)) {
+        handle_message(connection, message, framing);
+      }
+      connection.closing = true;
+    }
+  } catch (FramingError &e) {
+    LOG_ERROR << "Connection " << connection.fd << ": " << e.what();
+    close_connection(connection);
+    return;
+  }
+
+  if (connection.passed_fds.size() > SERVER_MAX_PASSED_FDS) {
+    LOG_ERROR << "Connection " << connection.fd << " passed "
+              << connection.passed_fds.size()
+              << " descriptors without messages that use them";
+    close_connection(connection);
+    return;
+  }
+
+  write_to(connection);
+}
+
+void SocketServer::handle_message(Connection &connection,
+                                  const std::string &message,
+                                  Framing framing) {
+  if (message.empty())
+    return;
+
+  Responder responder;
+  responder.state = std::shared_ptr<Responder::State>(new Responder::State{
+      outbox, connection.fd, connection.serial, framing});
+  // The message has just been taken off the front of what's buffered
+  connection.passed_fds.set_message_end(connection.received -
+                                        connection.input.buffered());
+  std::string reply = handler(message, connection.passed_fds, responder);
+  if (!reply.empty())
+    connection.output += frame_message(reply, framing);
+
+  if (responder.state.use_count() == 1) {
+    // The handler didn't keep the responder, so there's nothing to wait for
+    responder.state->outbox.reset();
+  } else {
+    connection.responders++;
+  }
+}
+
+/***
+ *  Pass on the replies Responders have sent since the last time, to the
+ *  clients that are still here
+ */
+void SocketServer::deliver_replies() {
+  std::vector<Outbox::Reply> replies;
+  {
+    std::lock_guard<std::mutex> lock(outbox->mutex);
+    replies.swap(outbox->replies);
+  }
+
+  std::vector<int> replied;
+  for (Outbox::Reply &reply : replies) {
+    auto found = connections.find(reply.fd);
+    if (found == connections.end() || found->second.serial != reply.serial)
+      continue;
+    Connection &connection = found->second;
+    connection.output += reply.framed;
+    if (reply.released)
+      connection.responders--;
+    replied.push_back(reply.fd);
+  }
+
+  // Writing can close a connection, so look each one up again
+  for (int fd : replied) {
+    auto found = connections.find(fd);
+    if (found != connections.end())
+      write_to(found->second);
+  }
+}
+
+/***
+ *  Send as much of the pending replies as the client will take, and watch
+ *  for the socket becoming writable again if it won't take them all
+ */
+void SocketServer::write_to(Connection &connection) {
+  std::string &output = connection.output;
+  size_t &sent = connection.output_sent;
+  while (sent < output.size()) {
+    ssize_t length = send(connection.fd, output.data() + sent,
+                          output.size() - sent, MSG_NOSIGNAL);
+    if (length >= 0) {
+      sent += static_cast<size_t>(length);
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else {
+      // The client has gone away, so its replies can't be delivered
+      close_connection(connection);
+      return;
+    }
+  }
+  if (sent == output.size()) {
+    output.clear();
+    sent = 0;
+  } else if (sent > output.size() / 2) {
+    // Drop what's been sent once it's most of the buffer
+    output.erase(0, sent);
+    sent = 0;
+  }
+
+  if (output.empty() && connection.closing && !connection.responders) {
+    close_connection(connection);
+    return;
+  }
+  if (output.size() - sent > SERVER_MAX_PENDING_BYTES) {
+    LOG_ERROR << "Connection " << connection.fd << " isn't reading replies";
+    close_connection(connection);
+    return;
+  }
+
+  // Once the client has hung up, there's nothing more to read
+  uint32_t watched_events = (connection.closing ? 0 : EPOLLIN) |
+                            (output.empty() ? 0 : EPOLLOUT);
+  if (watched_events != connection.watched_events) {
+    struct epoll_event event = {};
+    event.events = watched_events;
+    event.data.fd = connection.fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection.fd, &event) == -1) {
+      LOG_ERROR << "Couldn't watch connection " << connection.fd << ": "
+                << strerror(errno);
+      close_connection(connection);
+      return;
+    }
+    connection.watched_events = watched_events;
+  }
+}
+
+void SocketServer::close_connection(Connection &connection) {
+  int fd = connection.fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+    LOG_ERROR << "Couldn't stop watching connection " << fd << ": "
+              << strerror(errno);
+  }
+  close(fd);
+  connections.erase(fd);
+  LOG_DEBUG << "Closed connection " << fd << " (" << connections.size()
+            << " open)";
+}
@@ -0,0 +1,161 @@
+#if !defined(AIRPANEL_SERVER_H)
+#define AIRPANEL_SERVER_H 1
+
+#include "framing.h"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Longest message a client can send, which is enough for an 8bpp frame to
+ * be sent inline; must stay under 16 MB (see framing.h)
+ */
+const size_t SERVER_MAX_MESSAGE_BYTES = 8 * 1024 * 1024;
+// Replies are only buffered up to this size per connection
+const size_t SERVER_MAX_PENDING_BYTES = 1024 * 1024;
+// Descriptors a client can pass ahead of the messages that claim them
+const size_t SERVER_MAX_PASSED_FDS = 16;
+
+/***
+ *  Descriptors a client has passed with SCM_RIGHTS that no message has
+ *  claimed yet, oldest first. Whoever takes one owns it; any left are closed
+ *  with the connection. Each is tagged with how far into the stream it
+ *  arrived, which is within the message it was sent with.
+ */
+class PassedFds {
+public:
+  PassedFds() {}
+  PassedFds(PassedFds &&) = default;
+  ~PassedFds();
+
+  PassedFds(const PassedFds &) = delete;
+  PassedFds &operator=(const PassedFds &) = delete;
+
+  // Returns -1 if there are none
+  int take();
+  /* Close every descriptor passed before the end of the message being
+   * handled, for when it can't be parsed: which of them it meant to claim
+   * can't be known, and none may be left for the next message to take by
+   * mistake. Those passed with later messages are kept.
+   */
+  void drop_through_message();
+  size_t size() const { return fds.size(); }
+
+  // For the server: received is how many bytes were read before fd came
+  void add(int fd, uint64_t received) { fds.push_back(Passed{fd, received}); }
+  void set_message_end(uint64_t received) { message_end = received; }
+
+private:
+  struct Passed {
+    int fd;
+    uint64_t received;
+  };
+  std::deque<Passed> fds;
+  uint64_t message_end = 0;
+};
+
+/***
+ *  Sends further replies to a message after its handler has returned, from
+ *  any thread, framed like the message was. Its connection is kept open,
+ *  even once the client has finished sending, until every copy of the
+ *  Responder has gone, and replies to a client that has gone are dropped.
+ */
+class Responder {
+public:
+  void send(const std::string &reply) const;
+  // Tells the connection apart from any other, past or present
+  unsigned long connection() const;
+
+private:
+  friend class SocketServer;
+  struct State;
+  std::shared_ptr<State> state;
+};
+
+/***
+ *  Serves any number of clients on a Unix socket from a single epoll loop.
+ *  Every connection is nonblocking and has buffers of its own, so a slow or
+ *  stalled client can't hold up anyone else. Each message (framed as in
+ *  framing.h) is passed to the handler, whose reply is written back to the
+ *  client framed the same way, along with anything sent later through the
+ *  Responder. Clients can pipeline as many messages as they like without
+ *  waiting for replies. The handler runs on the loop's thread,
+ *  so it mustn't block; refreshes are handed to the RefreshPipeline.
+ *
+ *  A path starting with '\0' names a socket in the abstract namespace.
+ */
+class SocketServer {
+public:
+  // Returns the immediate reply to a message, if it isn't empty
+  typedef std::function<std::string(const std::string &message,
+                                    PassedFds &passed_fds,
+                                    const Responder &responder)>
+      MessageHandler;
+
+  SocketServer(const std::string &path, MessageHandler handler);
+  ~SocketServer();
+
+  SocketServer(const SocketServer &) = delete;
+  SocketServer &operator=(const SocketServer &) = delete;
+
+  // Serve clients until stop() is called
+  void run();
+
+  // Can be called from any thread
+  void stop();
+
+  // Where Responders leave replies for the loop to deliver
+  struct Outbox;
+
+  size_t connection_count() const { return connections.size(); }
+
+private:
+  struct Connection {
+    Connection(int fd, unsigned long serial)
+        : fd(fd), serial(serial), input(SERVER_MAX_MESSAGE_BYTES) {}
+
+    int fd;
+    // Tells this connection apart from a later one given the same fd
+    unsigned long serial;
+    FrameReader input;
+    PassedFds passed_fds;
+    // Bytes read from the client so far
+    uint64_t received = 0;
+    std::string output;
+    size_t output_sent = 0;
+    bool closing = false;
+    uint32_t watched_events = 0;
+    // Responders still held by someone, which may yet send replies
+    unsigned long responders = 0;
+  };
+
+  // Closes what's been opened so far before throwing SocketError
+  [[noreturn]] void throw_setup_error(const char *call,
+                                      std::initializer_list<int> fds);
+  void accept_connections();
+  void read_from(Connection &connection);
+  void write_to(Connection &connection);
+  void handle_message(Connection &connection, const std::string &message,
+                      Framing framing);
+  void close_connection(Connection &connection);
+  void deliver_replies();
+
+  std::string path;
+  MessageHandler handler;
+  int listen_fd = -1;
+  int epoll_fd = -1;
+  int wake_fd = -1;
+  std::atomic<bool> stopping;
+  std::unordered_map<int, Connection> connections;
+  unsigned long next_serial = 1;
+  std::shared_ptr<Outbox> outbox;
+};
+
+#endif
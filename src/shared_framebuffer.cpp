@@ -0,0 +1,124 @@
+#include "shared_framebuffer.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+extern struct DisplayProperties DISPLAY_PROPERTIES;
+
+SharedFramebuffer::SharedFramebuffer(const std::string &name)
+    : shm_name(name), length(DISPLAY_PROPERTIES.frame_buffer_length()) {
+  // Start afresh, rather than with whatever a previous run left behind
+  shm_unlink(name.c_str());
+  fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660);
+  if (fd == -1) {
+    throw SharedFramebufferError(name, strerror(errno));
+  }
+
+  if (ftruncate(fd, static_cast<off_t>(length)) == -1) {
+    int error = errno;
+    close(fd);
+    shm_unlink(name.c_str());
+    throw SharedFramebufferError(name, strerror(error));
+  }
+
+  void *address =
+      mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED) {
+    int error = errno;
+    close(fd);
+    shm_unlink(name.c_str());
+    throw SharedFramebufferError(name, strerror(error));
+  }
+  mapping = static_cast<unsigned char *>(address);
+
+  unsigned char background =
+      DISPLAY_PROPERTIES.color_mode == COLOR_MODE_1BPP
+          ? (BACKGROUND_COLOR > 127 ? 0xff : 0x00)
+          : static_cast<unsigned char>(BACKGROUND_COLOR);
+  memset(mapping, background, length);
+}
+
+SharedFramebuffer::~SharedFramebuffer() {
+  munmap(mapping, length);
+  close(fd);
+  shm_unlink(shm_name.c_str());
+}
+
+void SharedFramebuffer::copy_to(std::vector<unsigned char> &buffer) const {
+  buffer.resize(length);
+  size_t position = 0;
+  while (position < length) {
+    ssize_t read = pread(fd, &buffer[position], length - position,
+                         static_cast<off_t>(position));
+    if (read == -1 && errno == EINTR)
+      continue;
+    if (read == -1)
+      throw SharedFramebufferError(shm_name, strerror(errno));
+    if (read == 0)
+      break;
+    position += static_cast<size_t>(read);
+  }
+  if (position < length) {
+    // Give the producers back a framebuffer they can draw into
+    if (ftruncate(fd, static_cast<off_t>(length)) == -1) {
+      throw SharedFramebufferError(shm_name, strerror(errno));
+    }
+    throw SharedFramebufferError(
+        shm_name, "it was truncated to " + std::to_string(position) +
+                      " bytes, so its size has been put back");
+  }
+}
+
+// Where a rectangle ends, clipped to limit, without overflowing on the way
+static int far_edge(int origin, int extent, int limit) {
+  return static_cast<int>(std::min<int64_t>(
+      limit, static_cast<int64_t>(origin) + static_cast<int64_t>(extent)));
+}
+
+DamageRect damage_window(const std::vector<DamageRect> &damage) {
+  DamageRect whole = {0, 0, DISPLAY_PROPERTIES.width,
+                      DISPLAY_PROPERTIES.height};
+  // The panel can only refresh a window of a 1bpp frame
+  if (damage.empty() || DISPLAY_PROPERTIES.color_mode != COLOR_MODE_1BPP)
+    return whole;
+
+  int left = whole.width, top = whole.height, right = 0, bottom = 0;
+  for (const DamageRect &rect : damage) {
+    left = std::min(left, std::max(0, rect.x));
+    top = std::min(top, std::max(0, rect.y));
+    right = std::max(right, far_edge(rect.x, rect.width, whole.width));
+    bottom = std::max(bottom, far_edge(rect.y, rect.height, whole.height));
+  }
+  if (right <= left || bottom <= top) {
+    // Nothing on the display changed, but refresh something rather than
+    // leave the producer waiting for nothing
+    return whole;
+  }
+
+  left &= ~7;
+  right = std::min(whole.width, (right + 7) & ~7);
+  return DamageRect{left, top, right - left, bottom - top};
+}
+
+bool is_whole_display(const DamageRect &window) {
+  return window.x == 0 && window.y == 0 &&
+         window.width == DISPLAY_PROPERTIES.width &&
+         window.height == DISPLAY_PROPERTIES.height;
+}
+
+void merge_damage(Action &newer, const Action &older) {
+  if (!newer.action_is_damage() || newer.damage.empty())
+    return;
+  if (!older.action_is_damage() || older.damage.empty()) {
+    // The older action would have refreshed everything
+    newer.damage.clear();
+    return;
+  }
+  newer.damage.insert(newer.damage.end(), older.damage.begin(),
+                      older.damage.end());
+}
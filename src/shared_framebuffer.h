@@ -0,0 +1,67 @@
+#if !defined(AIRPANEL_SHARED_FRAMEBUFFER_H)
+#define AIRPANEL_SHARED_FRAMEBUFFER_H 1
+
+#include "core.h"
+#include "mapped_file.h"
+
+#include <string>
+#include <vector>
+
+/***
+ *  A POSIX shared memory object that local producers draw into directly,
+ *  laid out exactly like process_image's output for the display: height
+ *  rows of bytes_per_row bytes, 8 pixels to a byte (most significant bit
+ *  first, 1 being white) in 1bpp mode, or a byte per pixel in 8bpp mode.
+ *
+ *  Producers open it with shm_open and map it shared, draw, then send a
+ *  `damage` message listing the rectangles they changed. The daemon takes a
+ *  copy of the framebuffer when it gets to the message and uploads and
+ *  refreshes just those rectangles, so there's no encoding or decoding
+ *  anywhere in the loop.
+ *
+ *  The object is created afresh, filled with the background color, and
+ *  unlinked again when this goes out of scope.
+ *
+ *  Producers can resize the object as well as draw into it, and reading the
+ *  mapping past a shrunken end raises SIGBUS, so the daemon only ever copies
+ *  it with pread (see copy_to), which just comes up short. Throws
+ *  SharedFramebufferError if it has been, after putting its size back.
+ */
+class SharedFramebuffer : public ImageBytes {
+public:
+  // name is as for shm_open, e.g. "/airpanel"
+  explicit SharedFramebuffer(const std::string &name);
+  ~SharedFramebuffer();
+
+  SharedFramebuffer(const SharedFramebuffer &) = delete;
+  SharedFramebuffer &operator=(const SharedFramebuffer &) = delete;
+
+  const unsigned char *data() const override { return mapping; }
+  size_t size() const override { return length; }
+  void copy_to(std::vector<unsigned char> &buffer) const override;
+  unsigned char *pixels() { return mapping; }
+  const std::string &name() const { return shm_name; }
+
+private:
+  std::string shm_name;
+  // Kept open to read and resize the object through
+  int fd = -1;
+  unsigned char *mapping = nullptr;
+  size_t length = 0;
+};
+
+/* The one window of the display covering all of the damage, which the panel
+ * can refresh on its own: clipped to the display, and widened to whole bytes
+ * of pixels. No damage means the whole display, as does 8bpp mode.
+ */
+DamageRect damage_window(const std::vector<DamageRect> &damage);
+
+bool is_whole_display(const DamageRect &window);
+
+/* When a newer action supersedes an older one before it's displayed, the
+ * newer one has to cover whatever the older one would have. Only matters
+ * for damage, which only covers the rectangles it lists.
+ */
+void merge_damage(Action &newer, const Action &older);
+
+#endif
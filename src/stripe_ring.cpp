@@ -0,0 +1,63 @@
+#include "stripe_ring.h"
+
+StripeRing::StripeRing(unsigned int stripe_count, size_t stripe_length)
+    : stripes(stripe_count ? stripe_count : 1,
+              std::vector<unsigned char>(stripe_length)),
+      lengths(stripes.size()), length(stripe_length) {}
+
+unsigned char *StripeRing::acquire() {
+  std::unique_lock<std::mutex> lock(mutex);
+  changed.wait(lock, [this] {
+    return aborted || published - released < stripes.size();
+  });
+  if (aborted)
+    return NULL;
+  return stripes[published % stripes.size()].data();
+}
+
+void StripeRing::publish(size_t stripe_length) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    lengths[published % stripes.size()] = stripe_length;
+    published++;
+  }
+  changed.notify_all();
+}
+
+void StripeRing::close(std::exception_ptr producer_error) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    error = producer_error;
+  }
+  changed.notify_all();
+}
+
+bool StripeRing::next(const unsigned char **stripe, size_t *stripe_length) {
+  std::unique_lock<std::mutex> lock(mutex);
+  changed.wait(lock, [this] { return closed || released < published; });
+  if (released == published) {
+    if (error)
+      std::rethrow_exception(error);
+    return false;
+  }
+  *stripe = stripes[released % stripes.size()].data();
+  *stripe_length = lengths[released % stripes.size()];
+  return true;
+}
+
+void StripeRing::release() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    released++;
+  }
+  changed.notify_all();
+}
+
+void StripeRing::abort() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    aborted = true;
+  }
+  changed.notify_all();
+}
@@ -0,0 +1,56 @@
+#if !defined(AIRPANEL_STRIPE_RING_H)
+#define AIRPANEL_STRIPE_RING_H 1
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <vector>
+
+/***
+ *  A fixed ring of stripe buffers passed between one producer, which
+ *  renders stripes of rows into them, and one consumer, which sends them to
+ *  the panel. The producer can fill every stripe but the one being sent,
+ *  so rendering and sending overlap while memory stays bounded by the size
+ *  of the ring, however big the panel is.
+ */
+class StripeRing {
+public:
+  StripeRing(unsigned int stripe_count, size_t stripe_length);
+
+  StripeRing(const StripeRing &) = delete;
+  StripeRing &operator=(const StripeRing &) = delete;
+
+  /* Producer: wait for a free stripe to render into, then publish it with
+   * the number of bytes rendered. acquire returns NULL once the consumer
+   * has given up.
+   */
+  unsigned char *acquire();
+  void publish(size_t length);
+  // No more stripes will be published, possibly because of error
+  void close(std::exception_ptr error = nullptr);
+
+  /* Consumer: wait for the next stripe and release it once it's been sent.
+   * next returns false after the last stripe, or rethrows the producer's
+   * error.
+   */
+  bool next(const unsigned char **stripe, size_t *length);
+  void release();
+  void abort();
+
+  size_t stripe_length() const { return length; }
+
+private:
+  std::vector<std::vector<unsigned char>> stripes;
+  std::vector<size_t> lengths;
+  size_t length;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  unsigned long published = 0; // stripes published so far
+  unsigned long released = 0;  // stripes released so far
+  bool closed = false;
+  bool aborted = false;
+  std::exception_ptr error;
+};
+
+#endif
@@ -0,0 +1,145 @@
+#include "thread_pool.h"
+#include "trace.h"
+
+// Identifies the pool and deque of the worker running on the current thread,
+// so that tasks submitted from inside a task stay local to that worker.
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local unsigned int current_worker = 0;
+
+ThreadPool::ThreadPool(unsigned int thread_count) : next_queue(0), steals(0) {
+  if (thread_count == 0)
+    thread_count = 1;
+
+  for (unsigned int i = 0; i < thread_count; i++) {
+    queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+  }
+  for (unsigned int i = 0; i < thread_count; i++) {
+    workers.push_back(std::thread(&ThreadPool::worker_loop, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  wait();
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    stopping = true;
+  }
+  work_available.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+unsigned int ThreadPool::default_thread_count() {
+  unsigned int count = std::thread::hardware_concurrency();
+  return count ? count : 1;
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+  unsigned int index = current_pool == this
+                           ? current_worker
+                           : next_queue++ % static_cast<unsigned int>(
+                                                queues.size());
+
+  // Count the task before it becomes visible, so that a worker can never
+  // finish it before it has been counted as outstanding.
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    outstanding++;
+    queued++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queues[index]->mutex);
+    queues[index]->tasks.push_back(std::move(task));
+  }
+  work_available.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lock(state_mutex);
+  all_done.wait(lock, [this] { return outstanding == 0; });
+}
+
+void ThreadPool::parallel_for(unsigned int count,
+                              const std::function<void(unsigned int)> &body) {
+  std::mutex done_mutex;
+  std::condition_variable done;
+  unsigned int remaining = count;
+
+  for (unsigned int i = 0; i < count; i++) {
+    submit([&, i]() {
+      body(i);
+      // Notify while holding the lock, as the waiting thread owns these
+      // variables and may return as soon as it can see remaining == 0.
+      std::lock_guard<std::mutex> lock(done_mutex);
+      if (--remaining == 0)
+        done.notify_all();
+    });
+  }
+
+  std::unique_lock<std::mutex> lock(done_mutex);
+  done.wait(lock, [&] { return remaining == 0; });
+}
+
+/***
+ *  Take a task from the back of this worker's own deque or, failing that,
+ *  steal one from the front of the other workers' deques.
+ */
+bool ThreadPool::take_task(unsigned int index, std::function<void()> &task) {
+  {
+    std::lock_guard<std::mutex> lock(queues[index]->mutex);
+    if (!queues[index]->tasks.empty()) {
+      task = std::move(queues[index]->tasks.back());
+      queues[index]->tasks.pop_back();
+      return true;
+    }
+  }
+
+  for (size_t i = 1; i < queues.size(); i++) {
+    WorkerQueue &victim = *queues[(index + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      steals++;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ThreadPool::worker_loop(unsigned int index) {
+  current_pool = this;
+  current_worker = index;
+  set_trace_thread_name("thread pool worker");
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(state_mutex);
+      work_available.wait(lock, [this] { return stopping || queued > 0; });
+      if (queued == 0 && stopping)
+        return;
+    }
+
+    std::function<void()> task;
+    if (!take_task(index, task))
+      continue;
+
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      queued--;
+    }
+
+    task();
+    task = nullptr;
+
+    bool finished_all;
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      finished_all = --outstanding == 0;
+    }
+    if (finished_all)
+      all_done.notify_all();
+  }
+}
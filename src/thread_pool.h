@@ -0,0 +1,76 @@
+#if !defined(AIRPANEL_THREAD_POOL_H)
+#define AIRPANEL_THREAD_POOL_H 1
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/***
+ *  A fixed-size, work-stealing thread pool.
+ *
+ *  Each worker owns a deque of tasks. Workers take new work from the back of
+ *  their own deque and, when that runs dry, steal from the front of another
+ *  worker's deque, so a few slow tasks don't leave the other cores idle.
+ *  Tasks submitted from a worker land on that worker's own deque; tasks
+ *  submitted from outside the pool are spread round-robin.
+ */
+class ThreadPool {
+public:
+  explicit ThreadPool(unsigned int thread_count);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Tasks must not throw; catch and report errors inside the task
+  void submit(std::function<void()> task);
+
+  // Block until every task submitted so far has finished running
+  void wait();
+
+  /* Run body(0) ... body(count - 1) on the pool and block until they have all
+   * finished. Unlike wait(), this only waits for its own tasks, so several
+   * threads can share the pool. It must not be called from one of this
+   * pool's own workers.
+   */
+  void parallel_for(unsigned int count,
+                    const std::function<void(unsigned int)> &body);
+
+  unsigned int size() const {
+    return static_cast<unsigned int>(workers.size());
+  }
+
+  // Number of tasks a worker took from another worker's deque
+  unsigned long steal_count() const { return steals.load(); }
+
+  static unsigned int default_thread_count();
+
+private:
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  void worker_loop(unsigned int index);
+  bool take_task(unsigned int index, std::function<void()> &task);
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  std::vector<std::thread> workers;
+
+  std::mutex state_mutex;
+  std::condition_variable work_available;
+  std::condition_variable all_done;
+  size_t queued = 0;      // submitted but not yet taken by a worker
+  size_t outstanding = 0; // submitted but not yet finished
+  bool stopping = false;
+
+  std::atomic<unsigned int> next_queue;
+  std::atomic<unsigned long> steals;
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include "trace.h"
+
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+static std::atomic<TraceBuffer *> trace_buffer(NULL);
+
+/* Every live thread that has named itself, whether or not tracing was on
+ * then, and the latest few that have exited, whose events may still be in
+ * the buffer. A thread is started for each streamed frame, so the rest are
+ * forgotten.
+ */
+static const size_t EXITED_THREAD_NAMES = 32;
+
+struct ThreadName {
+  uint32_t tid;
+  const char *name;
+  bool exited;
+};
+
+static std::mutex thread_names_mutex;
+static std::vector<ThreadName> thread_names;
+
+static uint32_t current_tid() {
+  static thread_local uint32_t tid =
+      static_cast<uint32_t>(syscall(SYS_gettid));
+  return tid;
+}
+
+uint64_t trace_now_ns() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+void set_trace_buffer(TraceBuffer *buffer) { trace_buffer = buffer; }
+
+TraceBuffer *get_trace_buffer() {
+  return trace_buffer.load(std::memory_order_acquire);
+}
+
+/***
+ *  Marks a named thread's name as exited when the thread does, and forgets
+ *  the oldest exited one if there are too many
+ */
+struct ThreadNameRelease {
+  uint32_t tid;
+  ~ThreadNameRelease() {
+    std::lock_guard<std::mutex> lock(thread_names_mutex);
+    size_t exited = 0;
+    for (ThreadName &entry : thread_names) {
+      if (entry.tid == tid)
+        entry.exited = true;
+      if (entry.exited)
+        exited++;
+    }
+    if (exited <= EXITED_THREAD_NAMES)
+      return;
+    for (auto entry = thread_names.begin(); entry != thread_names.end();
+         ++entry) {
+      if (entry->exited) {
+        thread_names.erase(entry);
+        return;
+      }
+    }
+  }
+};
+
+void set_trace_thread_name(const char *name) {
+  uint32_t tid = current_tid();
+  static thread_local ThreadNameRelease release = {tid};
+  (void)release;
+
+  std::lock_guard<std::mutex> lock(thread_names_mutex);
+  for (ThreadName &entry : thread_names) {
+    if (entry.tid == tid) {
+      // Threads' ids are reused once they've exited
+      entry.name = name;
+      entry.exited = false;
+      return;
+    }
+  }
+  thread_names.push_back(ThreadName{tid, name, false});
+}
+
+TraceBuffer::TraceBuffer(size_t capacity)
+    : slots(new Slot[capacity ? capacity : 1]),
+      slot_count(capacity ? capacity : 1), next(0) {
+  for (size_t i = 0; i < slot_count; i++) {
+    slots[i].sequence.store(0, std::memory_order_relaxed);
+  }
+}
+
+void TraceBuffer::record(const char *category, const char *name,
+                         uint64_t start_ns, uint64_t end_ns,
+                         const char *arg_name, int64_t arg) {
+  uint64_t index = next.fetch_add(1, std::memory_order_relaxed);
+  Slot &slot = slots[index % slot_count];
+  slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.event.category = category;
+  slot.event.name = name;
+  slot.event.start_ns = start_ns;
+  slot.event.duration_ns = end_ns > start_ns ? end_ns - start_ns : 0;
+  slot.event.tid = current_tid();
+  slot.event.arg_name = arg_name;
+  slot.event.arg = arg;
+  slot.sequence.store(2 * index + 2, std::memory_order_release);
+}
+
+std::string TraceBuffer::to_json() const {
+  std::string json;
+  json.reserve(4096);
+  json += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  int pid = getpid();
+  char line[512];
+  bool first = true;
+
+  {
+    std::lock_guard<std::mutex> lock(thread_names_mutex);
+    for (const ThreadName &entry : thread_names) {
+      snprintf(line, sizeof(line),
+               "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,"
+               "\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+               first ? "" : ",\n", pid, entry.tid, entry.name);
+      json += line;
+      first = false;
+    }
+  }
+
+  uint64_t end = next.load(std::memory_order_acquire);
+  uint64_t begin = end > slot_count ? end - slot_count : 0;
+  for (uint64_t index = begin; index < end; index++) {
+    const Slot &slot = slots[index % slot_count];
+    if (slot.sequence.load(std::memory_order_acquire) != 2 * index + 2)
+      continue;
+    TraceEvent event = slot.event;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // Overwritten while it was being copied
+    if (slot.sequence.load(std::memory_order_relaxed) != 2 * index + 2)
+      continue;
+
+    // Chrome traces are timed in microseconds
+    int length = snprintf(
+        line, sizeof(line),
+        "%s{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%d,"
+        "\"tid\":%u,\"ts\":%llu.%03u,\"dur\":%llu.%03u",
+        first ? "" : ",\n", event.category, event.name, pid, event.tid,
+        static_cast<unsigned long long>(event.start_ns / 1000),
+        static_cast<unsigned int>(event.start_ns % 1000),
+        static_cast<unsigned long long>(event.duration_ns / 1000),
+        static_cast<unsigned int>(event.duration_ns % 1000));
+    if (event.arg_name) {
+      snprintf(line + length, sizeof(line) - length,
+               ",\"args\":{\"%s\":%lld}}", event.arg_name,
+               static_cast<long long>(event.arg));
+    } else {
+      snprintf(line + length, sizeof(line) - length, "}");
+    }
+    json += line;
+    first = false;
+  }
+  json += "\n]}\n";
+  return json;
+}
+
+bool TraceBuffer::write_json(const std::string &filename) const {
+  std::string json = to_json();
+  std::string temporary = filename + ".tmp";
+  FILE *file = fopen(temporary.c_str(), "w");
+  if (!file)
+    return false;
+  bool written = fwrite(json.data(), 1, json.size(), file) == json.size();
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temporary.c_str(), filename.c_str()) != 0) {
+    unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
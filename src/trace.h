@@ -0,0 +1,113 @@
+#if !defined(AIRPANEL_TRACE_H)
+#define AIRPANEL_TRACE_H 1
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string>
+
+// Enough for a few minutes of a busy slideshow, at 64 bytes an event
+const size_t TRACE_DEFAULT_EVENTS = 64 * 1024;
+
+// A span of time one thread spent in a stage, e.g. parsing a message
+struct TraceEvent {
+  // String literals, which outlive the buffer
+  const char *category;
+  const char *name;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  uint32_t tid;
+  // Named after arg_name, unless that's NULL
+  const char *arg_name;
+  int64_t arg;
+};
+
+/***
+ *  The latest events recorded on any thread, in a ring that overwrites the
+ *  oldest once it's full, for dumping in the Chrome trace format that
+ *  Perfetto (https://ui.perfetto.dev) and chrome://tracing open. Each event
+ *  is a complete begin/end span, so losing the oldest never leaves a begin
+ *  without its end.
+ *
+ *  Recording takes a slot with an atomic add and never blocks or
+ *  allocates. Each slot carries a sequence number, so a dump taken while
+ *  events are being recorded skips any slot that's half written.
+ */
+class TraceBuffer {
+public:
+  explicit TraceBuffer(size_t capacity = TRACE_DEFAULT_EVENTS);
+
+  TraceBuffer(const TraceBuffer &) = delete;
+  TraceBuffer &operator=(const TraceBuffer &) = delete;
+
+  void record(const char *category, const char *name, uint64_t start_ns,
+              uint64_t end_ns, const char *arg_name = NULL, int64_t arg = 0);
+
+  // Events recorded since the buffer was created, including overwritten ones
+  uint64_t recorded() const { return next.load(std::memory_order_relaxed); }
+  size_t capacity() const { return slot_count; }
+
+  // The events still in the ring, oldest first, as Chrome trace JSON
+  std::string to_json() const;
+  // Write to_json() to a file, replacing it all at once; false on failure
+  bool write_json(const std::string &filename) const;
+
+private:
+  struct Slot {
+    // 2n + 1 while event n is being written into it, 2n + 2 once it has
+    std::atomic<uint64_t> sequence;
+    TraceEvent event;
+  };
+
+  std::unique_ptr<Slot[]> slots;
+  size_t slot_count;
+  std::atomic<uint64_t> next;
+};
+
+// Where events are recorded; tracing is off while it's NULL
+void set_trace_buffer(TraceBuffer *buffer);
+TraceBuffer *get_trace_buffer();
+
+/* Name the calling thread in traces, e.g. "render". The name must be a
+ * string literal.
+ */
+void set_trace_thread_name(const char *name);
+
+// Nanoseconds on the monotonic clock, which trace events are timed with
+uint64_t trace_now_ns();
+
+/***
+ *  Records the time from its construction to its destruction as an event,
+ *  if tracing was on when it was constructed; otherwise it costs one atomic
+ *  load. category, name and arg_name must be string literals.
+ */
+class TraceScope {
+public:
+  TraceScope(const char *category, const char *name,
+             const char *arg_name = NULL, int64_t arg = 0)
+      : buffer(get_trace_buffer()), category(category), name(name),
+        arg_name(arg_name), arg(arg), start_ns(buffer ? trace_now_ns() : 0) {}
+  ~TraceScope() {
+    if (buffer)
+      buffer->record(category, name, start_ns, trace_now_ns(), arg_name, arg);
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+  // For an argument only known once the span is under way
+  void set_arg(const char *new_arg_name, int64_t new_arg) {
+    arg_name = new_arg_name;
+    arg = new_arg;
+  }
+
+private:
+  TraceBuffer *buffer;
+  const char *category;
+  const char *name;
+  const char *arg_name;
+  int64_t arg;
+  uint64_t start_ns;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#include "../src/arena.h"
+#include "../src/memory_accounting.h"
+#include "../src/readpng.h"
+#include "cJSON.h"
+#include "gtest/gtest.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+
+TEST(arena, bumps_aligned_allocations_and_reuses_its_blocks) {
+  RequestArena arena(4096);
+  for (int request = 0; request < 3; request++) {
+    unsigned char *previous = NULL;
+    for (int i = 0; i < 200; i++) {
+      unsigned char *pointer =
+          static_cast<unsigned char *>(arena.allocate(1 + i % 40));
+      ASSERT_TRUE(pointer);
+      EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(pointer) % 16);
+      if (previous) {
+        EXPECT_NE(previous, pointer);
+      }
+      memset(pointer, 0xAA, 1 + i % 40);
+      previous = pointer;
+    }
+    EXPECT_GE(arena.used_bytes(), 200u * 16);
+    arena.reset();
+    EXPECT_EQ(0u, arena.used_bytes());
+  }
+  // Only the first request needed any blocks
+  EXPECT_EQ(2u, arena.blocks_allocated());
+}
+
+TEST(arena, gives_big_allocations_a_block_of_their_own) {
+  RequestArena arena(4096, 64 * 1024);
+  ASSERT_TRUE(arena.allocate(100));
+  ASSERT_TRUE(arena.allocate(100000));
+  ASSERT_TRUE(arena.allocate(100));
+  EXPECT_EQ(3u, arena.blocks_allocated());
+  EXPECT_EQ(4096u + 100000u + 4096u, arena.reserved_bytes());
+
+  // The big block is past what's kept, so it's freed
+  arena.reset();
+  EXPECT_EQ(4096u, arena.reserved_bytes());
+}
+
+TEST(arena, mallocs_outside_a_scope_and_frees_on_any_thread) {
+  RequestArena arena;
+  void *from_arena;
+  {
+    ArenaScope allocating(&arena);
+    EXPECT_EQ(&arena, current_arena());
+    from_arena = arena_malloc(100);
+    {
+      ArenaScope not_allocating(NULL);
+      EXPECT_EQ(NULL, current_arena());
+    }
+  }
+  EXPECT_EQ(NULL, current_arena());
+  EXPECT_GE(arena.used_bytes(), 100u);
+
+  void *from_malloc = arena_malloc(100);
+  std::thread freeing([&]() {
+    arena_free(from_arena);
+    arena_free(from_malloc);
+  });
+  freeing.join();
+}
+
+TEST(arena, holds_cjson_replies) {
+  RequestArena arena;
+  cJSON_Hooks hooks = {arena_malloc, arena_free};
+  cJSON_InitHooks(&hooks);
+  {
+    ArenaScope allocating(&arena);
+    cJSON *reply = cJSON_CreateObject();
+    cJSON_AddStringToObject(reply, "status", "queued");
+    cJSON_AddNumberToObject(reply, "id", 7);
+    char *printed = cJSON_PrintUnformatted(reply);
+    EXPECT_STREQ("{\"status\":\"queued\",\"id\":7}", printed);
+    cJSON_free(printed);
+    cJSON_Delete(reply);
+  }
+  cJSON_InitHooks(NULL);
+  EXPECT_GT(arena.used_bytes(), 0u);
+  EXPECT_EQ(1u, arena.blocks_allocated());
+}
+
+/***
+ *  Decoding a PNG takes hundreds of mallocs for libpng's structs and the
+ *  rows, and none at all from a warmed up arena
+ */
+TEST(arena, decodes_without_malloc_once_warmed_up) {
+  const char *filename = "./fixtures/640x384b_8bpp_in.png";
+  MemoryTotals stage;
+  RequestArena arena;
+  set_memory_accounting(true);
+  RequestMemory without_arena;
+  {
+    MemoryScope accounting(stage, &without_arena);
+    ImageProperties image = read_png_file(filename);
+    free_image_properties(image);
+  }
+
+  RequestMemory with_arena;
+  for (int request = 0; request < 5; request++) {
+    MemoryScope accounting(stage, request ? &with_arena : NULL);
+    ArenaScope allocating(&arena);
+    ImageProperties image = read_png_file(filename);
+    free_image_properties(image);
+    arena.reset();
+  }
+  set_memory_accounting(false);
+
+  EXPECT_GT(without_arena.allocations, 384u);
+  // Four decodes, each copying the file name into a std::string
+  EXPECT_LE(with_arena.allocations, 4u);
+  EXPECT_LE(arena.blocks_allocated(), 2u);
+}
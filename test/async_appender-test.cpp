@@ -0,0 +1,162 @@
+#include "../src/async_appender.h"
+#include "../src/log_formatter.h"
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Collects what it's given, and can be stalled like a write to a slow card
+class CollectingAppender : public plog::IAppender {
+public:
+  virtual void write(const plog::Record &record) {
+    std::unique_lock<std::mutex> lock(mutex);
+    stall_ended.wait(lock, [this] { return !stalled; });
+    messages.push_back(record.getMessage());
+    tids.push_back(record.getTid());
+  }
+
+  void stall() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stalled = true;
+  }
+
+  void resume() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stalled = false;
+    }
+    stall_ended.notify_all();
+  }
+
+  std::mutex mutex;
+  std::condition_variable stall_ended;
+  bool stalled = false;
+  std::vector<std::string> messages;
+  std::vector<unsigned int> tids;
+};
+
+static void log(plog::AsyncAppender &appender, plog::Severity severity,
+                const std::string &message) {
+  plog::Record record(severity, "test", 0, __FILE__, NULL);
+  record << message;
+  appender.write(record);
+}
+
+// A record logged at a time of the test's choosing
+class RecordAt : public plog::Record {
+public:
+  RecordAt(time_t seconds, unsigned short milliseconds)
+      : plog::Record(plog::debug, "test", 0, __FILE__, NULL) {
+    time.time = seconds;
+    time.millitm = milliseconds;
+  }
+  virtual const plog::util::Time &getTime() const { return time; }
+
+private:
+  plog::util::Time time;
+};
+
+TEST(async_appender, writes_each_threads_records_in_order) {
+  CollectingAppender collected;
+  {
+    plog::AsyncAppender appender(8, plog::BLOCK_ON_OVERFLOW);
+    appender.addAppender(&collected);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.push_back(std::thread([&appender, t] {
+        for (int i = 0; i < 500; i++) {
+          log(appender, plog::info,
+              std::to_string(t) + " " + std::to_string(i));
+        }
+      }));
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    appender.flush();
+    EXPECT_EQ(0u, appender.dropped());
+  }
+
+  ASSERT_EQ(2000u, collected.messages.size());
+  int next[4] = {0, 0, 0, 0};
+  for (const std::string &message : collected.messages) {
+    int t = message[0] - '0';
+    EXPECT_EQ(std::to_string(t) + " " + std::to_string(next[t]), message);
+    next[t]++;
+  }
+  // Records keep the thread they were logged on
+  EXPECT_NE(plog::util::gettid(), collected.tids[0]);
+}
+
+TEST(async_appender, drops_and_counts_records_when_the_writer_falls_behind) {
+  CollectingAppender collected;
+  plog::AsyncAppender appender(4, plog::DROP_ON_OVERFLOW);
+  appender.addAppender(&collected);
+  collected.stall();
+
+  // None of these wait, although the writer is stuck
+  for (int i = 0; i < 100; i++) {
+    log(appender, plog::error, "record " + std::to_string(i));
+  }
+  // The writer may have taken one record before stalling on it, and the
+  // ring holds four more
+  EXPECT_GE(appender.dropped(), 95u);
+
+  collected.resume();
+  appender.flush();
+  std::lock_guard<std::mutex> lock(collected.mutex);
+  ASSERT_EQ(100 - appender.dropped() + 1, collected.messages.size());
+  EXPECT_EQ("record 0", collected.messages[0]);
+  EXPECT_EQ(std::to_string(appender.dropped()) +
+                " log records were dropped because the log fell behind",
+            collected.messages.back());
+}
+
+TEST(async_appender, only_drops_debug_records_by_default) {
+  CollectingAppender collected;
+  plog::AsyncAppender appender(4);
+  appender.addAppender(&collected);
+  collected.stall();
+
+  for (int i = 0; i < 20; i++) {
+    log(appender, plog::debug, "debug");
+  }
+  EXPECT_GE(appender.dropped(), 15u);
+  unsigned long dropped = appender.dropped();
+
+  // Warnings wait for room instead
+  std::thread resumer([&collected] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    collected.resume();
+  });
+  for (int i = 0; i < 20; i++) {
+    log(appender, plog::warning, "warning");
+  }
+  resumer.join();
+  appender.flush();
+  EXPECT_EQ(dropped, appender.dropped());
+
+  std::lock_guard<std::mutex> lock(collected.mutex);
+  EXPECT_EQ(20, std::count(collected.messages.begin(),
+                           collected.messages.end(), "warning"));
+}
+
+TEST(async_appender, formats_records_with_the_timestamp_of_their_second) {
+  RecordAt first(86400 + 3661, 5);
+  first << "first";
+  EXPECT_EQ("1970-01-02 01:01:01.005 DEBUG first\n",
+            plog::AirpanelTxtFormatterUtcTime::format(first));
+
+  RecordAt same_second(86400 + 3661, 999);
+  same_second << "same second";
+  EXPECT_EQ("1970-01-02 01:01:01.999 DEBUG same second\n",
+            plog::AirpanelTxtFormatterUtcTime::format(same_second));
+
+  RecordAt next_second(86400 + 3662, 0);
+  next_second << "next second";
+  EXPECT_EQ("1970-01-02 01:01:02.000 DEBUG next second\n",
+            plog::AirpanelTxtFormatterUtcTime::format(next_second));
+}
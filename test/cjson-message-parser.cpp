@@ -0,0 +1,116 @@
+#include "cjson-message-parser.h"
+
+#include "cJSON.h"
+#include <algorithm>
+#include <stdlib.h>
+
+Action parse_message_with_cjson(const char *message_string) {
+  Action message = {};
+  char *endptr;
+  message.type = "socket";
+  cJSON *message_json;
+  cJSON *data;
+  message_json = cJSON_Parse(message_string);
+  data = NULL;
+  data = cJSON_GetObjectItemCaseSensitive(message_json, "data");
+  if (cJSON_IsObject(data)) {
+    cJSON *actionJSON = cJSON_GetObjectItemCaseSensitive(data, "action");
+    cJSON *imageJSON = cJSON_GetObjectItemCaseSensitive(data, "image");
+    cJSON *payloadJSON = cJSON_GetObjectItemCaseSensitive(data, "payload");
+    cJSON *rectsJSON = cJSON_GetObjectItemCaseSensitive(data, "rects");
+    cJSON *orientationJSON =
+        cJSON_GetObjectItemCaseSensitive(data, "orientation");
+    cJSON *offsetXJSON = cJSON_GetObjectItemCaseSensitive(data, "offset_x");
+    cJSON *offsetYJSON = cJSON_GetObjectItemCaseSensitive(data, "offset_y");
+    if (actionJSON && actionJSON->valuestring != NULL) {
+      message.action = std::string(actionJSON->valuestring);
+    }
+    if (imageJSON && imageJSON->valuestring != NULL) {
+      message.image_filename = std::string(imageJSON->valuestring);
+    }
+    if (cJSON_IsString(payloadJSON)) {
+      message.payload = std::string(payloadJSON->valuestring);
+    }
+    if (orientationJSON) {
+      int orientation;
+      if (cJSON_IsNumber(orientationJSON)) {
+        orientation = int(orientationJSON->valueint);
+      } else {
+        long int parsed_orientation =
+            strtol(orientationJSON->valuestring, &endptr, 0);
+        if (!*endptr) {
+          orientation = int(parsed_orientation);
+        } else {
+          // orientation_specified will be false, so this won't be used
+          orientation = 0;
+          LOG_WARNING << "Orientation '" << orientationJSON->valuestring
+                      << "' could not be understood";
+        }
+      }
+      int valid_orientations[] = {0, 90, 180, 270};
+      if (std::find(std::begin(valid_orientations),
+                    std::end(valid_orientations),
+                    orientation) != std::end(valid_orientations)) {
+        message.orientation_specified = true;
+        message.orientation = orientation;
+      } else {
+        LOG_WARNING << "Orientation " << orientation
+                    << " supplied, but valid values are 0, 90, 180 and 270";
+      }
+    }
+    if (offsetXJSON) {
+      int offset_x;
+      if (cJSON_IsNumber(offsetXJSON)) {
+        offset_x = int(offsetXJSON->valueint);
+      } else {
+        long int parsed_offset_x = strtol(offsetXJSON->valuestring, &endptr, 0);
+        if (!*endptr) {
+          offset_x = int(parsed_offset_x);
+        } else {
+          offset_x = 0;
+          LOG_WARNING << "offset_x '" << offsetXJSON->valuestring
+                      << "' could not be understood";
+        }
+      }
+      message.offset_x_specified = true;
+      message.offset_x = offset_x;
+    }
+    if (offsetYJSON) {
+      int offset_y;
+      if (cJSON_IsNumber(offsetYJSON)) {
+        offset_y = int(offsetYJSON->valueint);
+      } else {
+        long int parsed_offset_y = strtol(offsetYJSON->valuestring, &endptr, 0);
+        if (!*endptr) {
+          offset_y = int(parsed_offset_y);
+        } else {
+          offset_y = 0;
+          LOG_WARNING << "offset_y '" << offsetYJSON->valuestring
+                      << "' could not be understood";
+        }
+      }
+      message.offset_y_specified = true;
+      message.offset_y = offset_y;
+    }
+    if (cJSON_IsArray(rectsJSON)) {
+      cJSON *rectJSON;
+      cJSON_ArrayForEach(rectJSON, rectsJSON) {
+        cJSON *x = cJSON_GetObjectItemCaseSensitive(rectJSON, "x");
+        cJSON *y = cJSON_GetObjectItemCaseSensitive(rectJSON, "y");
+        cJSON *width = cJSON_GetObjectItemCaseSensitive(rectJSON, "width");
+        cJSON *height = cJSON_GetObjectItemCaseSensitive(rectJSON, "height");
+        if (!cJSON_IsNumber(x) || !cJSON_IsNumber(y) ||
+            !cJSON_IsNumber(width) || !cJSON_IsNumber(height)) {
+          LOG_WARNING << "Damage rectangles need a numeric x, y, width and "
+                         "height; ignoring one that doesn't";
+          continue;
+        }
+        message.damage.push_back(
+            DamageRect{x->valueint, y->valueint, width->valueint,
+                       height->valueint});
+      }
+    }
+  }
+  cJSON_Delete(message_json);
+  return message;
+}
@@ -0,0 +1,14 @@
+#if !defined(AIRPANEL_CJSON_MESSAGE_PARSER_H)
+#define AIRPANEL_CJSON_MESSAGE_PARSER_H 1
+
+#include "../src/core.h"
+
+/***
+ *  parse_message as it was before the schema-specific parser, building a
+ *  cJSON tree and looking up each key in it. Kept to check the new parser
+ *  against, and to benchmark it against; it may crash on values of the wrong
+ *  type, so only give it messages that fit the schema.
+ */
+Action parse_message_with_cjson(const char *message);
+
+#endif
@@ -0,0 +1,184 @@
+#include "../src/core.h"
+#include "../src/decoders.h"
+#include "load-bitmap-fixture.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include <vector>
+
+/***
+ *  The PGM, PBM and QOI fixtures are re-encoded copies of the PNG fixtures
+ *  with the same name, so they must render to the same output bitmaps.
+ */
+
+using testing::ElementsAreArray;
+
+TEST(decoders, picks_decoders_by_magic_bytes) {
+  const unsigned char png[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  const unsigned char pgm[] = {'P', '5', '\n', '2', ' ', '2'};
+  const unsigned char qoi[] = {'q', 'o', 'i', 'f', 0, 0};
+  const unsigned char unknown[] = {'G', 'I', 'F', '8', '9', 'a'};
+
+  EXPECT_STREQ("PNG", find_image_decoder(png, sizeof(png))->name);
+  EXPECT_STREQ("PBM/PGM", find_image_decoder(pgm, sizeof(pgm))->name);
+  EXPECT_STREQ("QOI", find_image_decoder(qoi, sizeof(qoi))->name);
+  EXPECT_EQ(NULL, find_image_decoder(unknown, sizeof(unknown)));
+}
+
+TEST(decoders, should_throw_for_unrecognised_formats) {
+  EXPECT_THROW(process_image(parse_message(R"(
+                {
+                  "type": "message",
+                  "data": {
+                    "action": "refresh",
+                    "image": "./fixtures/200x100_1bpp_orientation_0_out.bmp"
+                  }
+                }
+              )")),
+               ImageDecodeError);
+}
+
+TEST(decoders, decodes_200x100_pgm_to_1bpp_orientation_90) {
+  EXPECT_THAT(
+      process_image(parse_message(R"(
+                {
+                  "type": "message",
+                  "data": {
+                    "action": "refresh",
+                    "image": "./fixtures/200x100_8bpp_in.pgm",
+                    "orientation": 90
+                  }
+                }
+              )")),
+
+      ElementsAreArray(read_bmp_into_byte_array(
+          "./fixtures/200x100_1bpp_orientation_90_out.bmp", COLOR_MODE_1BPP)));
+}
+
+TEST(decoders, decodes_640x384_pbm_to_1bpp_orientation_180) {
+  EXPECT_THAT(process_image(parse_message(R"(
+                {
+                  "type": "message",
+                  "data": {
+                    "action": "refresh",
+                    "image": "./fixtures/640x384a_1bpp_in.pbm",
+                    "orientation": 180
+                  }
+                }
+              )")),
+
+              ElementsAreArray(read_bmp_into_byte_array(
+                  "./fixtures/640x384a_1bpp_orientation_180_out.bmp",
+                  COLOR_MODE_1BPP)));
+}
+
+TEST(decoders, decodes_384x640_qoi_to_1bpp_auto_orientation_portrait) {
+  EXPECT_THAT(
+      process_image(parse_message(R"(
+                {
+                  "type": "message",
+                  "data": {
+                    "action": "refresh",
+                    "image": "./fixtures/384x640_24bpp_in.qoi"
+                  }
+                }
+              )")),
+
+      ElementsAreArray(read_bmp_into_byte_array(
+          "./fixtures/384x640_1bpp_orientation_90_out.bmp", COLOR_MODE_1BPP)));
+}
+
+TEST(decoders, decodes_qoi_identically_to_png) {
+  ImageProperties png = read_image_file("./fixtures/384x640_24bpp_in.png");
+  ImageProperties qoi = read_image_file("./fixtures/384x640_24bpp_in.qoi");
+
+  ASSERT_EQ(png.width, qoi.width);
+  ASSERT_EQ(png.height, qoi.height);
+  for (int y = 0; y < png.height; y++) {
+    ASSERT_EQ(0, memcmp(png.row_pointers[y], qoi.row_pointers[y],
+                        png.width * 4))
+        << "row " << y;
+  }
+
+  free_image_properties(png);
+  free_image_properties(qoi);
+}
+
+TEST(decoders, decodes_png_bytes_from_memory) {
+  FILE *fp = fopen("./fixtures/200x100_8bpp_in.png", "rb");
+  ASSERT_TRUE(fp != NULL);
+  std::vector<unsigned char> png(4096);
+  png.resize(fread(png.data(), 1, png.size(), fp));
+  fclose(fp);
+
+  ImageProperties from_memory =
+      read_image_memory(png.data(), png.size(), "memory");
+  ImageProperties from_file = read_image_file("./fixtures/200x100_8bpp_in.png");
+
+  ASSERT_EQ(from_file.width, from_memory.width);
+  ASSERT_EQ(from_file.height, from_memory.height);
+  for (int y = 0; y < from_file.height; y++) {
+    ASSERT_EQ(0, memcmp(from_file.row_pointers[y], from_memory.row_pointers[y],
+                        from_file.width * from_file.bytes_per_pixel));
+  }
+  free_image_properties(from_memory);
+  free_image_properties(from_file);
+
+  EXPECT_THROW(read_image_memory(png.data(), png.size() / 2, "truncated"),
+               ImageDecodeError);
+}
+
+TEST(decoders, refuses_headers_too_large_for_their_data_or_memory) {
+  // A 16777215x16777215 QOI header followed by an empty end marker
+  const unsigned char qoi[] = {'q', 'o', 'i', 'f', 0,    0xFF, 0xFF, 0xFF,
+                               0,   0xFF, 0xFF, 0xFF, 4, 0,    0,    0,
+                               0,   0,    0,    0,    0, 1};
+  EXPECT_THROW(read_image_memory(qoi, sizeof(qoi), "huge.qoi"),
+               ImageDecodeError);
+
+  ImageProperties image = {};
+  image.width = 8192;
+  image.height = 8192;
+  EXPECT_THROW(allocate_image_rows(image, 8192, "huge"), ImageDecodeError);
+  EXPECT_EQ(NULL, image.row_pointers);
+  image.height = 1;
+  allocate_image_rows(image, 8192, "wide");
+  ASSERT_TRUE(image.row_pointers != NULL);
+  free_image_properties(image);
+}
+
+/***
+ *  Count the pixels where libpng's gray decode path strays further from
+ *  convert_to_gray on the RGBA decode of the same (opaque) image than
+ *  GRAY_DECODE_TOLERANCE allows.
+ */
+static unsigned int gray_decode_outliers(const std::string &filename) {
+  ImageProperties rgba = read_image_file(filename);
+  set_png_gray_decode(true);
+  ImageProperties gray = read_image_file(filename);
+  set_png_gray_decode(false);
+
+  EXPECT_EQ(1, gray.bytes_per_pixel);
+  unsigned int outliers = 0;
+  for (int y = 0; y < rgba.height; y++) {
+    for (int x = 0; x < rgba.width; x++) {
+      png_bytep pixel = rgba.row_pointers[y] + x * 4;
+      int expected = convert_to_gray(pixel[0], pixel[1], pixel[2], pixel[3]);
+      unsigned int difference = abs(expected - gray.row_pointers[y][x]);
+      unsigned int tolerance = expected >= (int)GRAY_DECODE_SHADOW_LEVEL
+                                   ? GRAY_DECODE_TOLERANCE
+                                   : GRAY_DECODE_SHADOW_TOLERANCE;
+      if (difference > tolerance)
+        outliers++;
+    }
+  }
+
+  free_image_properties(rgba);
+  free_image_properties(gray);
+  return outliers;
+}
+
+TEST(decoders, gray_decode_is_within_tolerance_of_convert_to_gray) {
+  EXPECT_EQ(0u, gray_decode_outliers("./fixtures/840x584_24bpp_in.png"));
+  EXPECT_EQ(0u, gray_decode_outliers("./fixtures/384x640_24bpp_in.png"));
+  EXPECT_EQ(0u, gray_decode_outliers("./fixtures/640x384b_8bpp_in.png"));
+}
@@ -0,0 +1,157 @@
+#include "../src/core.h"
+#include "../src/event_log.h"
+#include "../src/exceptions.h"
+#include "gtest/gtest.h"
+
+#include <plog/Init.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+class event_log : public ::testing::Test {
+protected:
+  void SetUp() override {
+    filename = "/tmp/airpanel-event-log-test-" + std::to_string(getpid());
+  }
+
+  void TearDown() override { unlink(filename.c_str()); }
+
+  std::vector<Event> read_events() {
+    EventLogReader reader(filename);
+    std::vector<Event> events;
+    Event event;
+    while (reader.next(event)) {
+      events.push_back(event);
+    }
+    return events;
+  }
+
+  std::string filename;
+};
+
+TEST_F(event_log, reads_back_the_events_written) {
+  std::vector<unsigned char> frame(640 * 384 / 8, 0xff);
+  frame[100] = 0x0f;
+  {
+    EventLog log(filename);
+    log.write(EVENT_REFRESH_QUEUED, {3ul, "slide.png"});
+    log.write(EVENT_REFRESH_FINISHED,
+              {3ul, "failed", std::string("no such file"), 12.5});
+    log.write(EVENT_FRAME, {640, 384, 1, "slide.png",
+                            EventArg::blob(frame.data(), frame.size())});
+
+    plog::Record record(plog::warning, "test", 0, __FILE__, NULL);
+    record << "careful";
+    log.write(record);
+  }
+
+  std::vector<Event> events = read_events();
+  ASSERT_EQ(4u, events.size());
+
+  EXPECT_EQ(EVENT_REFRESH_QUEUED, events[0].event);
+  ASSERT_EQ(2u, events[0].args.size());
+  EXPECT_EQ(ARG_INT, events[0].args[0].type);
+  EXPECT_EQ(3, events[0].args[0].integer);
+  EXPECT_EQ("slide.png", events[0].args[1].bytes);
+
+  std::string finished = format_event(events[1]);
+  EXPECT_EQ(" refresh_finished id=3 status=\"failed\" "
+            "error=\"no such file\" total_ms=12.500",
+            finished.substr(finished.find(' ', 11)));
+
+  ASSERT_EQ(5u, events[2].args.size());
+  EXPECT_EQ(ARG_BLOB, events[2].args[4].type);
+  EXPECT_EQ(std::string(frame.begin(), frame.end()), events[2].args[4].bytes);
+  EXPECT_NE(std::string::npos,
+            format_event(events[2]).find("frame=<30720 bytes>"));
+
+  std::string message = format_event(events[3]);
+  EXPECT_EQ(" WARN  careful", message.substr(message.find(' ', 11)));
+  EXPECT_LE(events[0].time_ns, events[3].time_ns);
+}
+
+TEST_F(event_log, writes_out_the_latest_events_once_it_goes_quiet) {
+  EventLog log(filename, 10);
+  log.write(EVENT_REFRESH_QUEUED, {1ul, "slide.png"});
+  for (int wait = 0; wait < 200 && read_events().empty(); wait++) {
+    usleep(5000);
+  }
+  EXPECT_EQ(1u, read_events().size());
+}
+
+TEST_F(event_log, reports_events_it_cannot_write_once) {
+  // Files can't grow past 4 KB for now, and writing more fails with EFBIG
+  struct rlimit limit;
+  ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &limit));
+  struct rlimit small_limit = limit;
+  small_limit.rlim_cur = 4096;
+  void (*previous_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+  ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &small_limit));
+
+  testing::internal::CaptureStderr();
+  {
+    EventLog log(filename, 10);
+    std::string message(100000, 'x');
+    log.write(EVENT_MESSAGE_RECEIVED, {1ul, message});
+    log.flush();
+    log.write(EVENT_MESSAGE_RECEIVED, {2ul, message});
+    log.flush();
+  }
+  std::string reported = testing::internal::GetCapturedStderr();
+  setrlimit(RLIMIT_FSIZE, &limit);
+  signal(SIGXFSZ, previous_handler);
+
+  size_t first = reported.find("Event log " + filename);
+  ASSERT_NE(std::string::npos, first);
+  EXPECT_EQ(std::string::npos, reported.find("Event log", first + 1));
+}
+
+TEST_F(event_log, ends_early_where_a_log_was_cut_short) {
+  {
+    EventLog log(filename);
+    log.write(EVENT_REFRESH_QUEUED, {1ul, "one.png"});
+    log.write(EVENT_REFRESH_QUEUED, {2ul, "two.png"});
+  }
+  FILE *file = fopen(filename.c_str(), "r+");
+  fseek(file, 0, SEEK_END);
+  ASSERT_EQ(0, ftruncate(fileno(file), ftell(file) - 3));
+  fclose(file);
+
+  std::vector<Event> events = read_events();
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ("one.png", events[0].args[1].bytes);
+}
+
+TEST_F(event_log, refuses_files_that_are_not_event_logs) {
+  EXPECT_THROW(EventLogReader("./fixtures/200x100_8bpp_in.png"),
+               EventLogError);
+  EXPECT_THROW(EventLogReader("./fixtures/does_not_exist.log"),
+               EventLogError);
+}
+
+TEST_F(event_log, snapshots_rendered_frames_in_verbose_mode) {
+  Action action = {};
+  action.action = "refresh";
+  action.image_filename = "./fixtures/640x384a_1bpp_in.png";
+  std::vector<unsigned char> frame;
+  {
+    EventLog log(filename);
+    set_event_log(&log);
+    plog::init(plog::none).setMaxSeverity(plog::verbose);
+    process_image_into(action, frame);
+    plog::get()->setMaxSeverity(plog::none);
+    // Not in verbose mode
+    process_image_into(action, frame);
+    set_event_log(NULL);
+  }
+
+  std::vector<Event> events = read_events();
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ(EVENT_FRAME, events[0].event);
+  ASSERT_EQ(5u, events[0].args.size());
+  EXPECT_EQ(640, events[0].args[0].integer);
+  EXPECT_EQ(384, events[0].args[1].integer);
+  EXPECT_EQ(action.image_filename, events[0].args[3].bytes);
+  EXPECT_EQ(std::string(frame.begin(), frame.end()), events[0].args[4].bytes);
+}
@@ -0,0 +1,67 @@
+#include "../src/core.h"
+#include "../src/frame.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+using testing::ElementsAreArray;
+
+extern DisplayProperties DISPLAY_PROPERTIES;
+
+static Action refresh_action(const std::string &image_filename) {
+  Action action = {};
+  action.action = "refresh";
+  action.image_filename = image_filename;
+  action.orientation_specified = true;
+  action.orientation = 0;
+  return action;
+}
+
+TEST(frame, translates_frame_files_like_images) {
+  std::vector<unsigned char> frame =
+      process_image(refresh_action("./fixtures/640x384a_1bpp_in.png"));
+  write_frame_file("./640x384a.apf", frame);
+
+  EXPECT_THAT(process_image(refresh_action("./640x384a.apf")),
+              ElementsAreArray(frame));
+}
+
+TEST(frame, matches_only_the_display_it_was_rendered_for) {
+  DisplayProperties display_properties = DISPLAY_PROPERTIES;
+  FrameHeader header = frame_header_for_display();
+  EXPECT_TRUE(frame_matches_display(header));
+
+  DISPLAY_PROPERTIES.color_mode = COLOR_MODE_8BPP;
+  EXPECT_FALSE(frame_matches_display(header));
+  DISPLAY_PROPERTIES = display_properties;
+
+  header.height = 100;
+  EXPECT_FALSE(frame_matches_display(header));
+}
+
+TEST(frame, renders_1bpp_frames_on_8bpp_displays) {
+  std::vector<unsigned char> frame =
+      process_image(refresh_action("./fixtures/640x384a_1bpp_in.png"));
+  write_frame_file("./640x384a.apf", frame);
+
+  DisplayProperties display_properties = DISPLAY_PROPERTIES;
+  DISPLAY_PROPERTIES.color_mode = COLOR_MODE_8BPP;
+  std::vector<unsigned char> expected =
+      process_image(refresh_action("./fixtures/640x384a_1bpp_in.png"));
+  std::vector<unsigned char> translated =
+      process_image(refresh_action("./640x384a.apf"));
+  DISPLAY_PROPERTIES = display_properties;
+
+  EXPECT_THAT(translated, ElementsAreArray(expected));
+}
+
+TEST(frame, rejects_truncated_frame_files) {
+  std::vector<unsigned char> frame(DISPLAY_PROPERTIES.frame_buffer_length());
+  write_frame_file("./truncated.apf", frame);
+  truncate("./truncated.apf", FRAME_FILE_HEADER_LENGTH + 10);
+
+  EXPECT_THROW(process_image(refresh_action("./truncated.apf")),
+               FrameFileError);
+}
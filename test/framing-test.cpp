@@ -0,0 +1,116 @@
+#include "../src/exceptions.h"
+#include "../src/framing.h"
+#include "gtest/gtest.h"
+
+#include <string.h>
+
+static void feed(FrameReader &reader, const std::string &bytes) {
+  memcpy(reader.prepare(bytes.size()), bytes.data(), bytes.size());
+  reader.commit(bytes.size());
+}
+
+TEST(framing, splits_messages_that_arrive_together) {
+  FrameReader reader(1024);
+  feed(reader, "one\ntwo\r\n\n\nthree\n");
+
+  std::string message;
+  Framing framing;
+  ASSERT_TRUE(reader.next(message, framing));
+  EXPECT_EQ("one", message);
+  EXPECT_EQ(NEWLINE_FRAMING, framing);
+  ASSERT_TRUE(reader.next(message, framing));
+  EXPECT_EQ("two", message);
+  ASSERT_TRUE(reader.next(message, framing));
+  EXPECT_EQ("three", message);
+  EXPECT_FALSE(reader.next(message, framing));
+  EXPECT_EQ(0u, reader.buffered());
+}
+
+TEST(framing, joins_messages_that_arrive_in_pieces) {
+  FrameReader reader(1024);
+  std::string message;
+  Framing framing;
+
+  std::string json = "{\"type\":\"message\"}\n";
+  for (size_t i = 0; i < json.size() - 1; i++) {
+    feed(reader, json.substr(i, 1));
+    EXPECT_FALSE(reader.next(message, framing));
+  }
+  feed(reader, "\n");
+  ASSERT_TRUE(reader.next(message, framing));
+  EXPECT_EQ("{\"type\":\"message\"}", message);
+}
+
+TEST(framing, reads_length_prefixed_messages) {
+  FrameReader reader(1024);
+  std::string framed =
+      frame_message("with\nnewlines\n", LENGTH_PREFIXED_FRAMING);
+  ASSERT_EQ(LENGTH_PREFIX_BYTES + 14, framed.size());
+  EXPECT_EQ('\0', framed[0]);
+
+  std::string message;
+  Framing framing;
+  feed(reader, framed.substr(0, 2));
+  EXPECT_FALSE(reader.next(message, framing));
+  feed(reader, framed.substr(2, 6));
+  EXPECT_FALSE(reader.next(message, framing));
+  feed(reader, framed.substr(8) + "plain\n");
+
+  ASSERT_TRUE(reader.next(message, framing));
+  EXPECT_EQ("with\nnewlines\n", message);
+  EXPECT_EQ(LENGTH_PREFIXED_FRAMING, framing);
+  ASSERT_TRUE(reader.next(message, framing));
+  EXPECT_EQ("plain", message);
+  EXPECT_EQ(NEWLINE_FRAMING, framing);
+}
+
+TEST(framing, grows_to_fit_long_messages) {
+  FrameReader reader(1024 * 1024);
+  std::string long_message(200 * 1024, 'x');
+  for (size_t i = 0; i < long_message.size(); i += 4096) {
+    feed(reader, long_message.substr(i, 4096));
+  }
+  feed(reader, "\n");
+
+  std::string message;
+  Framing framing;
+  ASSERT_TRUE(reader.next(message, framing));
+  EXPECT_EQ(long_message, message);
+  EXPECT_GE(reader.capacity(), long_message.size());
+}
+
+TEST(framing, rejects_messages_that_are_too_long) {
+  std::string message;
+  Framing framing;
+
+  FrameReader unterminated(16);
+  feed(unterminated, std::string(17, 'x'));
+  EXPECT_THROW(unterminated.next(message, framing), FramingError);
+
+  FrameReader prefixed(16);
+  feed(prefixed, frame_message(std::string(17, 'x'), LENGTH_PREFIXED_FRAMING)
+                     .substr(0, LENGTH_PREFIX_BYTES));
+  EXPECT_THROW(prefixed.next(message, framing), FramingError);
+}
+
+TEST(framing, takes_what_is_left_as_a_final_message) {
+  std::string message;
+  Framing framing;
+
+  FrameReader reader(1024);
+  feed(reader, "first\nno newline");
+  ASSERT_TRUE(reader.finish(message, framing));
+  EXPECT_EQ("first", message);
+  ASSERT_TRUE(reader.finish(message, framing));
+  EXPECT_EQ("no newline", message);
+  EXPECT_FALSE(reader.finish(message, framing));
+
+  FrameReader blank(1024);
+  feed(blank, " \r");
+  EXPECT_FALSE(blank.finish(message, framing));
+
+  FrameReader truncated(1024);
+  feed(truncated,
+       frame_message("cut short", LENGTH_PREFIXED_FRAMING).substr(0, 8));
+  EXPECT_THROW(truncated.finish(message, framing), FramingError);
+}
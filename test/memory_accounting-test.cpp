@@ -0,0 +1,89 @@
+#include "../src/memory_accounting.h"
+#include "../src/metrics.h"
+#include "../src/readpng.h"
+#include "gtest/gtest.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+/***
+ *  Accounting is process-wide, so each test turns it on for itself and
+ *  only compares what it counted before and after.
+ */
+class memory_accounting : public ::testing::Test {
+protected:
+  void SetUp() override { set_memory_accounting(true); }
+  void TearDown() override { set_memory_accounting(false); }
+};
+
+TEST_F(memory_accounting, counts_nothing_while_off) {
+  set_memory_accounting(false);
+  MemoryTotals stage;
+  RequestMemory request;
+  {
+    MemoryScope accounting(stage, &request);
+    std::vector<char> buffer(4096);
+  }
+  EXPECT_EQ(0u, stage.allocations);
+  EXPECT_EQ(0u, request.allocations);
+}
+
+TEST_F(memory_accounting, counts_peak_and_retained_bytes_of_a_request) {
+  MemoryTotals stage;
+  RequestMemory request;
+  std::vector<char> *kept;
+  {
+    MemoryScope accounting(stage, &request);
+    { std::vector<char> freed(100000); }
+    kept = new std::vector<char>(1000);
+  }
+  EXPECT_EQ(3u, request.allocations);
+  EXPECT_GE(request.peak_bytes, 100000);
+  EXPECT_LT(request.peak_bytes, 101000);
+  EXPECT_GE(request.live_bytes, 1000);
+  EXPECT_LT(request.live_bytes, 2000);
+  EXPECT_EQ(3u, stage.allocations);
+  EXPECT_EQ(stage.allocated_bytes - stage.freed_bytes,
+            static_cast<uint64_t>(request.live_bytes));
+
+  // Freed outside the scope, so it doesn't count towards the request
+  delete kept;
+  EXPECT_GE(request.live_bytes, 1000);
+}
+
+TEST_F(memory_accounting, nested_scopes_count_towards_the_enclosing_request) {
+  MemoryTotals outer, inner;
+  RequestMemory request;
+  std::thread worker([&]() {
+    MemoryScope accounting(outer, &request);
+    {
+      MemoryScope decoding(inner);
+      std::string decoded(1000, 'x');
+      EXPECT_EQ(&request, current_request_memory());
+    }
+    std::string rendered(1000, 'x');
+  });
+  worker.join();
+  EXPECT_EQ(1u, inner.allocations);
+  EXPECT_EQ(1u, outer.allocations);
+  EXPECT_EQ(2u, request.allocations);
+  EXPECT_EQ(0, request.live_bytes);
+  EXPECT_EQ(NULL, current_request_memory());
+}
+
+TEST_F(memory_accounting, counts_what_libpng_allocates) {
+  MemoryTotals stage;
+  RequestMemory request;
+  int64_t live_bytes = accounted_live_bytes();
+  {
+    MemoryScope accounting(stage, &request);
+    ImageProperties image = read_png_file("./fixtures/640x384b_8bpp_in.png");
+    // Rows of RGBA, and libpng's own structs besides
+    EXPECT_GT(request.live_bytes, 640 * 384 * 4);
+    EXPECT_GT(stage.allocations, 384u);
+    free_image_properties(image);
+  }
+  EXPECT_EQ(0, request.live_bytes);
+  EXPECT_EQ(live_bytes, accounted_live_bytes());
+}
@@ -0,0 +1,96 @@
+#include "../src/memory_accounting.h"
+#include "../src/pipeline.h"
+#include "epdif.h"
+#include "gtest/gtest.h"
+
+/***
+ *  These take minutes, so they're built into soak-tests rather than
+ *  tests. Accounting is process-wide, as in memory_accounting-test.cpp.
+ */
+class memory_soak : public ::testing::Test {
+protected:
+  void SetUp() override { set_memory_accounting(true); }
+  void TearDown() override { set_memory_accounting(false); }
+};
+
+static Action refresh(const char *image) {
+  Action action = {};
+  action.type = "socket";
+  action.action = "refresh";
+  action.image_filename = image;
+  return action;
+}
+
+static const char *const IMAGES[] = {
+    "./fixtures/200x100_8bpp_in.png", "./fixtures/640x384a_1bpp_in.pbm",
+    "./fixtures/200x100_8bpp_in.pgm", "./fixtures/does_not_exist.png",
+    "./fixtures/640x384a_1bpp_in.png"};
+static const unsigned int IMAGE_COUNT = sizeof(IMAGES) / sizeof(IMAGES[0]);
+
+/* Even the smallest leak is 24 bytes, malloc's least usable size, so
+ * growth of less than this per refresh after warming up means none leaked
+ */
+static const int64_t LEAK_BYTES_PER_REFRESH = 4;
+
+/***
+ *  Refresh with every decoder, and with images that fail, 10,000 times
+ *  over, one at a time so that none is coalesced, and check that nothing is
+ *  left allocated that wasn't after the first few: any leak per refresh
+ *  would show as growth.
+ */
+TEST_F(memory_soak, retains_nothing_over_ten_thousand_refreshes) {
+  const unsigned int REFRESHES = 10000;
+  const unsigned int WARM_UP = 100;
+
+  EpdIf::SetSimulated(true, 0);
+  {
+    RefreshPipeline refresh_pipeline;
+    int64_t live_bytes = 0;
+    for (unsigned int i = 0; i < REFRESHES; i++) {
+      refresh_pipeline.submit(refresh(IMAGES[i % IMAGE_COUNT]));
+      refresh_pipeline.wait_until_idle();
+      if (i == WARM_UP - 1)
+        live_bytes = accounted_live_bytes();
+    }
+
+    PipelineStats stats = refresh_pipeline.stats();
+    EXPECT_EQ(REFRESHES / IMAGE_COUNT * (IMAGE_COUNT - 1), stats.displayed);
+    EXPECT_EQ(REFRESHES, stats.displayed + stats.failed);
+    int64_t refreshed = stats.displayed + stats.failed - WARM_UP;
+    EXPECT_LT(accounted_live_bytes() - live_bytes,
+              refreshed * LEAK_BYTES_PER_REFRESH);
+  }
+  EpdIf::SetSimulated(false);
+}
+
+/***
+ *  Bursts of refreshes that mostly get coalesced or dropped, which takes
+ *  other paths through the pipeline, and leaks no more than they do
+ */
+TEST_F(memory_soak, retains_nothing_over_coalesced_bursts) {
+  const unsigned int SUBMITTED = 2000;
+  const unsigned int BURST = 16;
+  const unsigned int WARM_UP = 160;
+
+  EpdIf::SetSimulated(true, 0);
+  {
+    RefreshPipeline refresh_pipeline;
+    int64_t live_bytes = 0;
+    for (unsigned int i = 0; i < SUBMITTED; i++) {
+      refresh_pipeline.submit(refresh(IMAGES[i % IMAGE_COUNT]));
+      if (i % BURST == BURST - 1)
+        refresh_pipeline.wait_until_idle();
+      if (i == WARM_UP - 1)
+        live_bytes = accounted_live_bytes();
+    }
+    refresh_pipeline.wait_until_idle();
+
+    PipelineStats stats = refresh_pipeline.stats();
+    EXPECT_EQ(SUBMITTED, stats.submitted);
+    EXPECT_GT(stats.coalesced + stats.dropped, 0u);
+    int64_t finished = SUBMITTED - WARM_UP;
+    EXPECT_LT(accounted_live_bytes() - live_bytes,
+              finished * LEAK_BYTES_PER_REFRESH);
+  }
+  EpdIf::SetSimulated(false);
+}
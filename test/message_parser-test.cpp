@@ -0,0 +1,198 @@
+#include "../src/exceptions.h"
+#include "../src/message_parser.h"
+#include "cjson-message-parser.h"
+#include "gtest/gtest.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+static void expect_same_action(const Action &expected, const Action &actual) {
+  EXPECT_EQ(expected.type, actual.type);
+  EXPECT_EQ(expected.action, actual.action);
+  EXPECT_EQ(expected.image_filename, actual.image_filename);
+  EXPECT_EQ(expected.payload, actual.payload);
+  EXPECT_EQ(expected.orientation_specified, actual.orientation_specified);
+  if (expected.orientation_specified) {
+    EXPECT_EQ(expected.orientation, actual.orientation);
+  }
+  EXPECT_EQ(expected.offset_x_specified, actual.offset_x_specified);
+  if (expected.offset_x_specified) {
+    EXPECT_EQ(expected.offset_x, actual.offset_x);
+  }
+  EXPECT_EQ(expected.offset_y_specified, actual.offset_y_specified);
+  if (expected.offset_y_specified) {
+    EXPECT_EQ(expected.offset_y, actual.offset_y);
+  }
+  ASSERT_EQ(expected.damage.size(), actual.damage.size());
+  for (size_t i = 0; i < expected.damage.size(); i++) {
+    EXPECT_EQ(expected.damage[i].x, actual.damage[i].x);
+    EXPECT_EQ(expected.damage[i].y, actual.damage[i].y);
+    EXPECT_EQ(expected.damage[i].width, actual.damage[i].width);
+    EXPECT_EQ(expected.damage[i].height, actual.damage[i].height);
+  }
+}
+
+static std::string error_for(const std::string &message) {
+  Action action = {};
+  try {
+    parse_message(message.data(), message.size(), action);
+  } catch (MessageError &e) {
+    return e.what();
+  }
+  return "";
+}
+
+TEST(message_parser, reads_messages_as_the_cjson_parser_did) {
+  const char *messages[] = {
+      R"({"type": "socket", "data": {"action": "refresh",
+          "image": "./fixtures/640x384_1bpp.png"}})",
+      R"({"data":{"action":"refresh","image":"a.png","orientation":90,
+          "offset_x":10,"offset_y":-20}})",
+      R"({"data": {"orientation": "180", "offset_x": "-5",
+          "offset_y": "12"}})",
+      R"({"data": {"orientation": 45}})",
+      R"({"data": {"orientation": 270.0, "offset_x": 0}})",
+      R"({"data": {"image": "\/tmp\/café \"quoted\"\\😀.png",
+          "action": "refresh", "payload": "\u00e9\ud83d\ude00\n"}})",
+      R"({"ignored": [1, {"data": {"action": "no"}}, "x", true, null],
+          "data": {"unknown": {"deep": [[[]]]}, "action": "prerender",
+          "image": "b.png", "also": -1.5e3}})",
+      R"({"data": {"action": "damage", "rects": [
+          {"x": 0, "y": 0, "width": 8, "height": 8},
+          {"height": 2, "width": 1, "y": 300, "x": 600, "extra": false}]}})",
+      R"({"data": {"action": "refresh", "image": "x.png",
+          "payload": "inline"}})",
+      R"({"data": {"action": "first", "action": "second"}})",
+      R"({"type": "socket"})",
+      "  \r\n\t{ \"data\" : { \"action\" : \"refresh\" } }  \n",
+  };
+
+  for (const char *message : messages) {
+    SCOPED_TRACE(message);
+    Action parsed = {};
+    parse_message(message, strlen(message), parsed);
+    expect_same_action(parse_message_with_cjson(message), parsed);
+  }
+}
+
+TEST(message_parser, refills_an_action_in_place) {
+  std::string first = R"({"data": {"action": "refresh", "offset_x": 3,
+      "image": "/a/long/path/that/does/not/fit/in/a/short/string.png",
+      "rects": [{"x": 0, "y": 0, "width": 8, "height": 8}]}})";
+  std::string second = R"({"data": {"action": "damage",
+      "image": "/another/long/path/to/an/image/in/the/same/place.png"}})";
+
+  Action action = {};
+  parse_message(first.data(), first.size(), action);
+  const char *image_filename = action.image_filename.data();
+  const DamageRect *damage = action.damage.data();
+
+  parse_message(second.data(), second.size(), action);
+  EXPECT_EQ("damage", action.action);
+  EXPECT_EQ("/another/long/path/to/an/image/in/the/same/place.png",
+            action.image_filename);
+  EXPECT_FALSE(action.offset_x_specified);
+  EXPECT_TRUE(action.damage.empty());
+  // Nothing was reallocated
+  EXPECT_EQ(image_filename, action.image_filename.data());
+  EXPECT_EQ(damage, action.damage.data());
+}
+
+TEST(message_parser, only_reads_as_far_as_it_is_told) {
+  // As with inline payloads, which follow the JSON after a '\0'
+  std::string message = R"({"data": {"payload": "inline"}})";
+  message += std::string("\0\x89PNG", 5);
+
+  Action action = {};
+  parse_message(message.data(), message.find('\0'), action);
+  EXPECT_EQ("inline", action.payload);
+  EXPECT_NE("", error_for(message));
+}
+
+TEST(message_parser, never_reads_past_the_end_of_a_message) {
+  // Each message ends where a page no one may read begins, so reading even
+  // a byte past its end would crash
+  long page_size = sysconf(_SC_PAGESIZE);
+  unsigned char *pages = static_cast<unsigned char *>(
+      mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(MAP_FAILED, pages);
+  ASSERT_EQ(0, mprotect(pages + page_size, page_size, PROT_NONE));
+
+  const char *const cut_short[] = {R"({"x":)", R"({"x": )",
+                                   R"({"data": {"unknown":)", R"({"x": [)",
+                                   R"({"x": -)"};
+  for (const char *text : cut_short) {
+    std::vector<char> message(text, text + strlen(text));
+    char *at_end = reinterpret_cast<char *>(pages + page_size) - message.size();
+    memcpy(at_end, message.data(), message.size());
+    Action action = {};
+    EXPECT_THROW(parse_message(at_end, message.size(), action), MessageError)
+        << text;
+  }
+  munmap(pages, 2 * page_size);
+}
+
+TEST(message_parser, rejects_values_of_the_wrong_type) {
+  EXPECT_EQ("Invalid message: \"action\" should be a string (at byte 20)",
+            error_for(R"({"data": {"action": 1}})"));
+  // which the cJSON parser would crash on
+  EXPECT_EQ("Invalid message: \"orientation\" should be a whole number, or a "
+            "string holding one (at byte 25)",
+            error_for(R"({"data": {"orientation": true}})"));
+  EXPECT_NE("", error_for(R"({"data": {"offset_x": "0x10"}})"));
+  EXPECT_NE("", error_for(R"({"data": {"offset_x": " 1"}})"));
+  EXPECT_NE("", error_for(R"({"data": {"offset_x": ""}})"));
+  EXPECT_EQ("Invalid message: \"offset_y\" should be a whole number (at byte "
+            "22)",
+            error_for(R"({"data": {"offset_y": 1.5}})"));
+  EXPECT_EQ("Invalid message: \"offset_y\" is out of range (at byte 22)",
+            error_for(R"({"data": {"offset_y": 3000000000}})"));
+  EXPECT_NE("", error_for(R"({"data": {"offset_y": "-2147483649"}})"));
+  EXPECT_NE("", error_for(R"({"data": {"offset_y": 1e400}})"));
+  EXPECT_NE("", error_for(R"({"data": []})"));
+  EXPECT_NE("", error_for(R"({"data": {"rects": {}}})"));
+  EXPECT_NE("", error_for(R"({"data": {"rects": [1]}})"));
+  EXPECT_EQ("Invalid message: a rectangle in \"rects\" needs an x, y, width "
+            "and height (at byte 28)",
+            error_for(R"({"data": {"rects": [{"x": 0}]}})"));
+  EXPECT_NE("", error_for(R"({"data": {"rects": [{"x": 0, "y": 0, )"
+                          R"("width": -8, "height": 8}]}})"));
+}
+
+TEST(message_parser, accepts_null_as_leaving_a_value_out) {
+  Action action = {};
+  std::string message = R"({"data": {"action": null, "orientation": null,
+      "offset_x": null, "rects": null}})";
+  parse_message(message.data(), message.size(), action);
+  EXPECT_EQ("", action.action);
+  EXPECT_FALSE(action.orientation_specified);
+  EXPECT_FALSE(action.offset_x_specified);
+  EXPECT_TRUE(action.damage.empty());
+}
+
+TEST(message_parser, rejects_malformed_json) {
+  EXPECT_EQ("Invalid message: a message should be a JSON object (at byte 0)",
+            error_for(""));
+  EXPECT_NE("", error_for("refresh"));
+  EXPECT_NE("", error_for("[]"));
+  EXPECT_NE("", error_for("{"));
+  EXPECT_NE("", error_for(R"({"data": {"action": "refresh"})"));
+  EXPECT_NE("", error_for(R"({"data": {"action": "refresh"}}})"));
+  EXPECT_NE("", error_for(R"({"data": {"action": "refresh",}})"));
+  EXPECT_NE("", error_for(R"({"data" {}})"));
+  EXPECT_NE("", error_for(R"({data: {}})"));
+  EXPECT_NE("", error_for(R"({"data": {"image": "unterminated}})"));
+  EXPECT_NE("", error_for(R"({"data": {"image": "\x"}})"));
+  EXPECT_NE("", error_for(R"({"data": {"image": "\ud83d"}})"));
+  EXPECT_NE("", error_for("{\"data\": {\"image\": \"a\tb\"}}"));
+  EXPECT_NE("", error_for(R"({"skipped": 01})"));
+  EXPECT_NE("", error_for(R"({"skipped": -})"));
+  EXPECT_NE("", error_for(R"({"skipped": tru})"));
+  EXPECT_NE("", error_for(R"({"skipped": 1.})"));
+  EXPECT_NE("", error_for(R"({"skipped": 'x'})"));
+  EXPECT_NE("", error_for(std::string("{\"skipped\": ") +
+                          std::string(100000, '[')));
+}
@@ -0,0 +1,115 @@
+#include "../src/metrics.h"
+#include "../src/metrics_server.h"
+#include "gtest/gtest.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+TEST(metrics, buckets_values_to_within_a_sixteenth) {
+  for (uint64_t us = 0; us < 16; us++) {
+    EXPECT_EQ(us, LatencyHistogram::bucket_for(us));
+  }
+  unsigned int previous = LatencyHistogram::bucket_for(15);
+  for (uint64_t us = 16; us < (1ull << 36); us += us / 7 + 1) {
+    unsigned int bucket = LatencyHistogram::bucket_for(us);
+    EXPECT_GE(bucket, previous);
+    EXPECT_LT(us, LatencyHistogram::bucket_end(bucket));
+    EXPECT_GE(us, bucket ? LatencyHistogram::bucket_end(bucket - 1) : 0);
+    EXPECT_LE(LatencyHistogram::bucket_end(bucket) - 1 - us, us / 16);
+    previous = bucket;
+  }
+  EXPECT_EQ(LatencyHistogram::BUCKETS - 1,
+            LatencyHistogram::bucket_for(UINT64_MAX));
+}
+
+TEST(metrics, reports_quantiles_and_cumulative_counts) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(0, histogram.quantile_ms(0.5));
+  for (int ms = 1; ms <= 100; ms++) {
+    histogram.record(ms);
+  }
+  EXPECT_EQ(100u, histogram.count());
+  EXPECT_DOUBLE_EQ(5050, histogram.sum_ms());
+  EXPECT_NEAR(50, histogram.quantile_ms(0.5), 50 / 16.0);
+  EXPECT_NEAR(99, histogram.quantile_ms(0.99), 99 / 16.0);
+  EXPECT_NEAR(100, histogram.quantile_ms(1), 100 / 16.0);
+  // 10 ms falls in a bucket that ends at 10.24 ms, so it isn't counted
+  EXPECT_EQ(9u, histogram.count_up_to(10));
+  EXPECT_EQ(10u, histogram.count_up_to(10.24));
+  EXPECT_EQ(100u, histogram.count_up_to(1000));
+}
+
+TEST(metrics, renders_the_prometheus_text_format) {
+  Metrics metrics;
+  StageTimings timings;
+  timings.parse_ms = 0.05;
+  timings.decode_ms = 20;
+  timings.render_ms = 8;
+  timings.upload_ms = 400;
+  timings.busy_ms = 3800;
+  timings.total_ms = 4300;
+  metrics.record(timings);
+  metrics.displayed = 1;
+  metrics.coalesced = 2;
+  metrics.frame_cache_hits = 1;
+  metrics.frame_cache_misses = 3;
+  metrics.queue_depth = 1;
+
+  std::string text = render_metrics(metrics);
+  EXPECT_NE(std::string::npos,
+            text.find("# TYPE airpanel_stage_duration_seconds histogram\n"));
+  EXPECT_NE(std::string::npos,
+            text.find("airpanel_stage_duration_seconds_bucket{stage=\"busy\","
+                      "le=\"2.5\"} 0\n"
+                      "airpanel_stage_duration_seconds_bucket{stage=\"busy\","
+                      "le=\"5\"} 1\n"));
+  EXPECT_NE(std::string::npos,
+            text.find("airpanel_stage_duration_seconds_sum{stage=\"upload\"} "
+                      "0.400000\n"));
+  EXPECT_NE(std::string::npos,
+            text.find("airpanel_stage_duration_seconds_count{stage=\"total\"} "
+                      "1\n"));
+  EXPECT_NE(std::string::npos,
+            text.find("airpanel_refreshes_total{outcome=\"coalesced\"} 2\n"));
+  EXPECT_NE(std::string::npos,
+            text.find("airpanel_frame_cache_hit_ratio 0.25\n"));
+  EXPECT_NE(std::string::npos, text.find("airpanel_queue_depth 1\n"));
+  EXPECT_NE(std::string::npos, text.find("airpanel_spi_bytes_total "));
+  EXPECT_EQ(std::string::npos,
+            text.find("airpanel_peak_resident_memory_bytes 0\n"));
+}
+
+TEST(metrics, serves_metrics_over_http_on_a_unix_socket) {
+  std::string path =
+      "/tmp/airpanel-metrics-test-" + std::to_string(getpid()) + ".sock";
+  MetricsServer server(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(0, connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                       sizeof(addr)));
+  std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  ASSERT_EQ(static_cast<ssize_t>(request.size()),
+            write(fd, request.data(), request.size()));
+
+  std::string response;
+  char buffer[4096];
+  ssize_t length;
+  while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+    response.append(buffer, length);
+  }
+  close(fd);
+
+  EXPECT_EQ(0u, response.find("HTTP/1.0 200 OK\r\n"));
+  size_t body = response.find("\r\n\r\n");
+  ASSERT_NE(std::string::npos, body);
+  EXPECT_NE(std::string::npos,
+            response.find("Content-Length: " +
+                          std::to_string(response.size() - body - 4)));
+  EXPECT_NE(std::string::npos, response.find("airpanel_messages_total "));
+}
@@ -0,0 +1,75 @@
+#include "../src/metrics.h"
+#include "../src/perf_counters.h"
+#include "gtest/gtest.h"
+
+#include <algorithm>
+
+// Enough work for every counter to see some
+static uint64_t busy_work() {
+  volatile uint64_t sum = 0;
+  for (uint64_t i = 0; i < 2000000; i++) {
+    sum = sum + i * i;
+  }
+  return sum;
+}
+
+TEST(perf_counters, count_nothing_while_off) {
+  PerfTotals totals;
+  set_perf_counters(false);
+  {
+    PerfScope counting(totals);
+    busy_work();
+  }
+  EXPECT_EQ(0u, totals.runs);
+}
+
+TEST(perf_counters, count_the_work_done_in_a_scope) {
+  PerfSample sample;
+  if (!read_perf_counters(sample))
+    GTEST_SKIP() << "perf_event_open isn't allowed here";
+
+  PerfTotals totals;
+  set_perf_counters(true);
+  for (int run = 0; run < 2; run++) {
+    PerfScope counting(totals);
+    busy_work();
+  }
+  set_perf_counters(false);
+  EXPECT_EQ(2u, totals.runs);
+
+  unsigned int available = perf_counters_available();
+  if (available & (1u << PERF_TASK_CLOCK)) {
+    EXPECT_GT(totals.values[PERF_TASK_CLOCK], 100000u);
+  }
+  if (available & (1u << PERF_INSTRUCTIONS)) {
+    EXPECT_GT(totals.values[PERF_INSTRUCTIONS], 2 * 2000000u);
+  }
+}
+
+TEST(perf_counters, profile_has_a_row_per_stage) {
+  Metrics metrics;
+  PerfSample start = {}, end = {};
+  end.values[PERF_CYCLES] = 2000;
+  end.values[PERF_INSTRUCTIONS] = 3000;
+  end.values[PERF_CACHE_MISSES] = 30;
+  end.values[PERF_TASK_CLOCK] = 1500000;
+  metrics.perf[RENDER].add(start, end);
+
+  std::string profile = render_profile(metrics);
+  EXPECT_EQ(0u, profile.find("stage "));
+  EXPECT_EQ(6, std::count(profile.begin(), profile.end(), '\n'));
+  size_t render = profile.find("\nrender ");
+  ASSERT_NE(std::string::npos, render);
+  std::string row = profile.substr(render + 1, profile.find('\n', render + 1) -
+                                                   render - 1);
+  EXPECT_EQ(0u, row.find("render       1 "));
+  // CPU time is 1.50 ms and IPC 1.50, where they were counted
+  unsigned int available = perf_counters_available();
+  unsigned int ipc = 1u << PERF_CYCLES | 1u << PERF_INSTRUCTIONS;
+  if (available & (1u << PERF_TASK_CLOCK) || (available & ipc) == ipc) {
+    EXPECT_NE(std::string::npos, row.find(" 1.50 "));
+  }
+  if ((available & ipc) != ipc) {
+    EXPECT_NE(std::string::npos, row.find(" - "));
+  }
+}
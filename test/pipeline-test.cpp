@@ -0,0 +1,324 @@
+#include "../src/frame.h"
+#include "../src/mapped_file.h"
+#include "../src/pipeline.h"
+#include "../src/shared_framebuffer.h"
+#include "epdif.h"
+#include "gtest/gtest.h"
+
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/***
+ *  These run against the simulated panel, sped up 20 times so that a
+ *  refresh holds BUSY low for a fifth of a second.
+ */
+class pipeline : public ::testing::Test {
+protected:
+  void SetUp() override { EpdIf::SetSimulated(true, 0.05); }
+  void TearDown() override { EpdIf::SetSimulated(false); }
+
+  Action refresh(const std::string &image) {
+    Action action = {};
+    action.type = "socket";
+    action.action = "refresh";
+    action.image_filename = image;
+    return action;
+  }
+};
+
+TEST_F(pipeline, submit_returns_before_the_panel_has_refreshed) {
+  unsigned long refreshes = EpdIf::SimulatedRefreshes();
+  RefreshPipeline refresh_pipeline;
+
+  unsigned long id =
+      refresh_pipeline.submit(refresh("./fixtures/640x384a_1bpp_in.png"));
+  EXPECT_EQ(1u, id);
+  EXPECT_EQ(0u, refresh_pipeline.stats().displayed);
+
+  refresh_pipeline.wait_until_idle();
+  EXPECT_EQ(1u, refresh_pipeline.stats().displayed);
+  EXPECT_EQ(refreshes + 1, EpdIf::SimulatedRefreshes());
+}
+
+TEST_F(pipeline, counts_failed_refreshes_and_carries_on) {
+  RefreshPipeline refresh_pipeline;
+
+  refresh_pipeline.submit(refresh("./fixtures/does_not_exist.png"));
+  refresh_pipeline.wait_until_idle();
+  unsigned long id =
+      refresh_pipeline.submit(refresh("./fixtures/640x384b_8bpp_in.png"));
+  EXPECT_EQ(2u, id);
+
+  refresh_pipeline.wait_until_idle();
+  PipelineStats stats = refresh_pipeline.stats();
+  EXPECT_EQ(2u, stats.submitted);
+  EXPECT_EQ(1u, stats.displayed);
+  EXPECT_EQ(1u, stats.failed);
+}
+
+TEST_F(pipeline, displays_the_latest_refresh_when_destroyed) {
+  unsigned long refreshes = EpdIf::SimulatedRefreshes();
+  {
+    RefreshPipeline refresh_pipeline;
+    refresh_pipeline.submit(refresh("./fixtures/640x384a_1bpp_in.png"));
+    refresh_pipeline.submit(refresh("./fixtures/640x384b_8bpp_in.png"));
+  }
+  EXPECT_GE(EpdIf::SimulatedRefreshes(), refreshes + 1);
+  EXPECT_LE(EpdIf::SimulatedRefreshes(), refreshes + 2);
+}
+
+TEST_F(pipeline, shows_only_the_newest_of_a_burst_of_refreshes) {
+  unsigned long refreshes = EpdIf::SimulatedRefreshes();
+  RefreshPipeline refresh_pipeline;
+
+  refresh_pipeline.submit(refresh("./fixtures/640x384a_1bpp_in.png"));
+  refresh_pipeline.wait_until_idle();
+
+  // These arrive much faster than they can be rendered and displayed
+  const char *images[] = {
+      "./fixtures/640x384b_8bpp_in.png", "./fixtures/384x640_24bpp_in.png",
+      "./fixtures/200x100_8bpp_in.png", "./fixtures/840x584_24bpp_in.png",
+      "./fixtures/640x384a_1bpp_in.png"};
+  unsigned long last_id = 0;
+  for (const char *image : images) {
+    last_id = refresh_pipeline.submit(refresh(image));
+  }
+  refresh_pipeline.wait_until_idle();
+
+  PipelineStats stats = refresh_pipeline.stats();
+  EXPECT_EQ(6u, stats.submitted);
+  EXPECT_EQ(last_id, stats.last_displayed);
+  EXPECT_LE(stats.displayed, 3u);
+  EXPECT_EQ(6u, stats.displayed + stats.coalesced + stats.dropped);
+  EXPECT_EQ(refreshes + stats.displayed, EpdIf::SimulatedRefreshes());
+}
+
+TEST_F(pipeline, renders_the_next_frame_while_the_panel_refreshes) {
+  unsigned long refreshes = EpdIf::SimulatedRefreshes();
+  RefreshPipeline refresh_pipeline;
+
+  // Called on the display thread as soon as the panel is free again
+  unsigned long rendered_when_free = 0;
+  refresh_pipeline.submit(
+      refresh("./fixtures/840x584_24bpp_in.png"),
+      [&](const RefreshResult &) {
+        rendered_when_free = refresh_pipeline.stats().rendered;
+      });
+  while (EpdIf::SimulatedRefreshes() == refreshes) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  // Rendering this takes a good part of the first frame's refresh, but
+  // should be done by the time the panel is free again
+  refresh_pipeline.submit(refresh("./fixtures/384x640_24bpp_in.png"));
+  refresh_pipeline.wait_until_idle();
+
+  EXPECT_EQ(2u, refresh_pipeline.stats().displayed);
+  EXPECT_EQ(refreshes + 2, EpdIf::SimulatedRefreshes());
+  EXPECT_EQ(2u, rendered_when_free);
+}
+
+TEST_F(pipeline, streams_frames_to_the_panel_in_striped_mode) {
+  unsigned long refreshes = EpdIf::SimulatedRefreshes();
+  unsigned long spi_bytes = EpdIf::SimulatedSpiBytes();
+  set_stripe_rows(48);
+  {
+    RefreshPipeline refresh_pipeline;
+    refresh_pipeline.submit(refresh("./fixtures/384x640_24bpp_in.png"));
+    refresh_pipeline.wait_until_idle();
+    EXPECT_EQ(1u, refresh_pipeline.stats().displayed);
+  }
+  set_stripe_rows(0);
+
+  EXPECT_EQ(refreshes + 1, EpdIf::SimulatedRefreshes());
+  // Every byte of a 1bpp frame is sent as 4 bytes, plus the commands
+  EXPECT_GE(EpdIf::SimulatedSpiBytes() - spi_bytes, 640u * 384 / 8 * 4);
+}
+
+TEST_F(pipeline, abandons_a_streamed_frame_for_a_newer_one) {
+  unsigned long refreshes = EpdIf::SimulatedRefreshes();
+  set_stripe_rows(16);
+  std::vector<RefreshResult> results;
+  std::mutex results_mutex;
+  auto on_finished = [&](const RefreshResult &result) {
+    std::lock_guard<std::mutex> lock(results_mutex);
+    results.push_back(result);
+  };
+  {
+    RefreshPipeline refresh_pipeline;
+    unsigned long spi_bytes = EpdIf::SimulatedSpiBytes();
+    refresh_pipeline.submit(refresh("./fixtures/840x584_24bpp_in.png"),
+                            on_finished);
+    while (EpdIf::SimulatedSpiBytes() == spi_bytes) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    unsigned long newest = refresh_pipeline.submit(
+        refresh("./fixtures/384x640_24bpp_in.png"), on_finished);
+    refresh_pipeline.wait_until_idle();
+
+    PipelineStats stats = refresh_pipeline.stats();
+    EXPECT_EQ(newest, stats.last_displayed);
+    EXPECT_EQ(2u, stats.displayed + stats.coalesced);
+    // Whether or not the first was abandoned, no part of it was refreshed
+    EXPECT_EQ(refreshes + stats.displayed, EpdIf::SimulatedRefreshes());
+  }
+  set_stripe_rows(0);
+
+  ASSERT_EQ(2u, results.size());
+  EXPECT_STREQ("displayed", results[1].status);
+  EXPECT_NE(std::string("failed"), results[0].status);
+}
+
+TEST_F(pipeline, reports_how_each_refresh_ended_and_how_long_it_took) {
+  std::vector<RefreshResult> results;
+  std::mutex results_mutex;
+  auto record = [&](const RefreshResult &result) {
+    std::lock_guard<std::mutex> lock(results_mutex);
+    results.push_back(result);
+  };
+
+  unsigned long spi_bytes = EpdIf::SimulatedSpiBytes();
+  RefreshPipeline refresh_pipeline;
+  StageTimings parsed;
+  parsed.parse_ms = 1.5;
+  // Whatever a callback holds is let go of once it's been called
+  std::shared_ptr<int> held = std::make_shared<int>(0);
+  refresh_pipeline.submit(
+      refresh("./fixtures/640x384b_8bpp_in.png"),
+      [&record, held](const RefreshResult &result) { record(result); },
+      parsed);
+  refresh_pipeline.wait_until_idle();
+  EXPECT_EQ(1, held.use_count());
+  // Every byte of a 1bpp frame is sent as 4 bytes, plus the commands
+  EXPECT_GE(EpdIf::SimulatedSpiBytes() - spi_bytes, 640u * 384 / 8 * 4);
+  refresh_pipeline.submit(refresh("./fixtures/does_not_exist.png"), record);
+  refresh_pipeline.wait_until_idle();
+  // The third is superseded by the fourth long before it could be displayed
+  refresh_pipeline.submit(refresh("./fixtures/640x384a_1bpp_in.png"), record);
+  refresh_pipeline.submit(refresh("./fixtures/384x640_24bpp_in.png"), record);
+  refresh_pipeline.wait_until_idle();
+
+  ASSERT_EQ(4u, results.size());
+  const RefreshResult &displayed = results[0];
+  EXPECT_EQ(1u, displayed.id);
+  EXPECT_STREQ("displayed", displayed.status);
+  EXPECT_EQ("", displayed.error);
+  EXPECT_EQ(1.5, displayed.timings.parse_ms);
+  EXPECT_GT(displayed.timings.decode_ms, 0);
+  EXPECT_GT(displayed.timings.render_ms, 0);
+  EXPECT_GT(displayed.timings.upload_ms, 0);
+  EXPECT_GT(displayed.timings.busy_ms, 0);
+  EXPECT_GE(displayed.timings.total_ms,
+            displayed.timings.parse_ms + displayed.timings.decode_ms +
+                displayed.timings.render_ms + displayed.timings.upload_ms +
+                displayed.timings.busy_ms);
+
+  EXPECT_EQ(2u, results[1].id);
+  EXPECT_STREQ("failed", results[1].status);
+  EXPECT_NE("", results[1].error);
+
+  EXPECT_EQ(3u, results[2].id);
+  EXPECT_STREQ("superseded", results[2].status);
+  EXPECT_EQ(4u, results[3].id);
+  EXPECT_STREQ("displayed", results[3].status);
+}
+
+TEST_F(pipeline, displays_images_passed_in_memory) {
+  std::ifstream png_file("./fixtures/640x384b_8bpp_in.png", std::ios::binary);
+  std::string png((std::istreambuf_iterator<char>(png_file)),
+                  std::istreambuf_iterator<char>());
+  int memfd = memfd_create("image", MFD_CLOEXEC);
+  ASSERT_EQ(static_cast<ssize_t>(png.size()),
+            write(memfd, png.data(), png.size()));
+
+  write_frame_file("./in_memory.apf",
+                   process_image(refresh("./fixtures/640x384a_1bpp_in.png")));
+  std::ifstream frame_file("./in_memory.apf", std::ios::binary);
+  std::string frame((std::istreambuf_iterator<char>(frame_file)),
+                    std::istreambuf_iterator<char>());
+
+  std::vector<RefreshResult> results;
+  RefreshPipeline refresh_pipeline;
+  Action from_memfd = refresh("memfd");
+  from_memfd.image_bytes = std::make_shared<MappedFile>(memfd, "memfd");
+  refresh_pipeline.submit(from_memfd, [&](const RefreshResult &result) {
+    results.push_back(result);
+  });
+  refresh_pipeline.wait_until_idle();
+
+  Action inline_frame = refresh("inline");
+  inline_frame.image_bytes =
+      std::make_shared<InlineImageBytes>(frame.data(), frame.size());
+  refresh_pipeline.submit(inline_frame, [&](const RefreshResult &result) {
+    results.push_back(result);
+  });
+  refresh_pipeline.wait_until_idle();
+
+  ASSERT_EQ(2u, results.size());
+  EXPECT_STREQ("displayed", results[0].status);
+  EXPECT_GT(results[0].timings.render_ms, 0);
+  EXPECT_STREQ("displayed", results[1].status);
+  // Frames for this display are sent as they are
+  EXPECT_EQ(0, results[1].timings.render_ms);
+}
+
+TEST_F(pipeline, keeps_passed_images_that_shrink_after_they_are_taken) {
+  const std::string bytes(100000, 'x');
+  int unsealed = memfd_create("unsealed", MFD_CLOEXEC);
+  int sealed = memfd_create("sealed", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  for (int fd : {unsealed, sealed}) {
+    ASSERT_EQ(static_cast<ssize_t>(bytes.size()),
+              write(fd, bytes.data(), bytes.size()));
+  }
+  ASSERT_EQ(0, fcntl(sealed, F_ADD_SEALS,
+                     F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE));
+
+  // Unsealed files are copied, so shrinking them afterwards can't fault
+  int client = dup(unsealed);
+  MappedFile copied(unsealed, "unsealed");
+  ASSERT_EQ(0, ftruncate(client, 0));
+  close(client);
+  ASSERT_EQ(bytes.size(), copied.size());
+  EXPECT_EQ(bytes, std::string(reinterpret_cast<const char *>(copied.data()),
+                               copied.size()));
+
+  client = dup(sealed);
+  MappedFile mapped(sealed, "sealed");
+  EXPECT_EQ(-1, ftruncate(client, 0));
+  close(client);
+  ASSERT_EQ(bytes.size(), mapped.size());
+  EXPECT_EQ('x', mapped.data()[bytes.size() - 1]);
+}
+
+TEST_F(pipeline, refreshes_only_the_damaged_window_of_the_shared_framebuffer) {
+  std::shared_ptr<SharedFramebuffer> framebuffer =
+      std::make_shared<SharedFramebuffer>("/airpanel-pipeline-test-" +
+                                          std::to_string(getpid()));
+  for (int row = 100; row < 132; row++) {
+    memset(framebuffer->pixels() + row * 80 + 8, 0x00, 8);
+  }
+
+  Action damage = {};
+  damage.type = "socket";
+  damage.action = "damage";
+  damage.image_filename = "shared framebuffer";
+  damage.image_bytes = framebuffer;
+  damage.damage = {{64, 100, 64, 32}};
+
+  unsigned long spi_bytes = EpdIf::SimulatedSpiBytes();
+  RefreshPipeline refresh_pipeline;
+  refresh_pipeline.submit(damage);
+  refresh_pipeline.wait_until_idle();
+  EXPECT_EQ(1u, refresh_pipeline.stats().displayed);
+
+  // Just the window's 8 bytes by 32 rows are sent, as 4 bytes each, along
+  // with the commands
+  unsigned long sent = EpdIf::SimulatedSpiBytes() - spi_bytes;
+  EXPECT_GE(sent, 8u * 32 * 4);
+  EXPECT_LT(sent, 8u * 32 * 4 + 1024);
+}
@@ -0,0 +1,108 @@
+#include "../src/frame.h"
+#include "../src/mapped_file.h"
+#include "../src/prerender.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include <stdio.h>
+#include <vector>
+
+using testing::ElementsAreArray;
+
+static std::vector<unsigned char> read_file(const std::string &filename) {
+  std::vector<unsigned char> contents;
+  FILE *fp = fopen(filename.c_str(), "rb");
+  if (!fp)
+    return contents;
+  unsigned char buf[4096];
+  size_t length;
+  while ((length = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    contents.insert(contents.end(), buf, buf + length);
+  }
+  fclose(fp);
+  return contents;
+}
+
+TEST(prerender, names_frames_after_their_image) {
+  EXPECT_EQ("out/cat.apf",
+            prerender_output_filename("photos/cat.png", "out"));
+  EXPECT_EQ("out/cat.apf",
+            prerender_output_filename("photos/cat.png", "out/"));
+  EXPECT_EQ("./dog.apf", prerender_output_filename("dog", ""));
+}
+
+TEST(prerender, refuses_images_that_would_share_a_frame_file) {
+  Action action = {};
+  std::vector<std::string> images = {"./fixtures/200x100_8bpp_in.png",
+                                     "./fixtures/200x100_8bpp_in.pgm"};
+  remove("./prerender_collisions/200x100_8bpp_in.apf");
+  EXPECT_THROW(prerender_images(action, images, "./prerender_collisions", 1),
+               FrameFileError);
+
+  // Nothing was rendered
+  EXPECT_TRUE(read_file("./prerender_collisions/200x100_8bpp_in.apf").empty());
+}
+
+TEST(prerender, renders_an_image_listed_twice_once_over) {
+  Action action = {};
+  std::vector<std::string> images = {"./fixtures/200x100_8bpp_in.png",
+                                     "./fixtures/200x100_8bpp_in.png"};
+  PrerenderReport report =
+      prerender_images(action, images, "./prerender_repeated", 1);
+  EXPECT_EQ(1u, report.frames_rendered);
+  EXPECT_EQ(0u, report.frames_failed);
+}
+
+TEST(prerender, writes_frames_matching_process_image) {
+  Action action = parse_message(R"(
+                {
+                  "type": "message",
+                  "data": {
+                    "action": "refresh",
+                    "image": "./fixtures/200x100_8bpp_in.png",
+                    "orientation": 90
+                  }
+                }
+              )");
+  std::vector<std::string> images = {"./fixtures/200x100_8bpp_in.png",
+                                     "./fixtures/640x384a_1bpp_in.png",
+                                     "./fixtures/does_not_exist.png"};
+
+  PrerenderReport report =
+      prerender_images(action, images, "./prerender_output", 2);
+
+  EXPECT_EQ(2u, report.frames_rendered);
+  EXPECT_EQ(1u, report.frames_failed);
+
+  std::vector<unsigned char> frame =
+      read_file("./prerender_output/200x100_8bpp_in.apf");
+  ASSERT_GT(frame.size(), FRAME_FILE_HEADER_LENGTH);
+  EXPECT_EQ(0, memcmp(frame.data(), FRAME_FILE_MAGIC, 8));
+  EXPECT_THAT(std::vector<unsigned char>(
+                  frame.begin() + FRAME_FILE_HEADER_LENGTH, frame.end()),
+              ElementsAreArray(process_image(action)));
+}
+
+TEST(prerender, leaves_a_mapped_frame_file_intact_when_rendering_it_again) {
+  Action action = {};
+  std::vector<std::string> images = {"./fixtures/200x100_8bpp_in.png"};
+  ASSERT_EQ(1u,
+            prerender_images(action, images, "./prerender_mapped", 1)
+                .frames_rendered);
+  const std::string frame_filename = "./prerender_mapped/200x100_8bpp_in.apf";
+  std::vector<unsigned char> before = read_file(frame_filename);
+
+  // As the daemon maps a frame file to display it
+  MappedFile mapped(frame_filename);
+  action.orientation_specified = true;
+  action.orientation = 180;
+  ASSERT_EQ(1u,
+            prerender_images(action, images, "./prerender_mapped", 1)
+                .frames_rendered);
+
+  std::vector<unsigned char> after = read_file(frame_filename);
+  ASSERT_EQ(before.size(), after.size());
+  EXPECT_NE(before, after);
+  ASSERT_EQ(before.size(), mapped.size());
+  EXPECT_EQ(before, std::vector<unsigned char>(
+                        mapped.data(), mapped.data() + mapped.size()));
+}
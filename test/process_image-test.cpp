@@ -312,3 +312,34 @@ TEST(process_image,
                   "./fixtures/200x100_1bpp_orientation_90_offset_20_20_out.bmp",
                   COLOR_MODE_1BPP)));
 }
+
+TEST(process_image, renders_identically_with_several_render_threads) {
+  Action action = parse_message(R"(
+                {
+                  "type": "message",
+                  "data": {
+                    "action": "refresh",
+                    "image": "./fixtures/840x584_24bpp_in.png",
+                    "orientation": 270
+                  }
+                }
+              )");
+  unsigned int render_threads = get_render_threads();
+
+  set_render_threads(1);
+  std::vector<unsigned char> single_threaded = process_image(action);
+  set_render_threads(7);
+  std::vector<unsigned char> multi_threaded = process_image(action);
+  set_render_threads(render_threads);
+
+  EXPECT_THAT(multi_threaded, ElementsAreArray(single_threaded));
+}
+
+TEST(process_image, stops_when_cancelled) {
+  Action action = {};
+  action.action = "refresh";
+  action.image_filename = "./fixtures/640x384a_1bpp_in.png";
+  std::atomic<bool> cancelled(true);
+
+  EXPECT_THROW(process_image(action, &cancelled), RenderCancelled);
+}
@@ -0,0 +1,294 @@
+#include "../src/server.h"
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/***
+ *  Each test serves an echo handler on a socket of its own, on a thread of
+ *  its own, and talks to it with ordinary blocking clients.
+ */
+class server : public ::testing::Test {
+protected:
+  void SetUp() override {
+    path = "/tmp/airpanel-server-test-" + std::to_string(getpid());
+    socket_server.reset(new SocketServer(
+        path, [this](const std::string &message, PassedFds &passed_fds,
+                     const Responder &responder) {
+          if (message == "later")
+            responders.push_back(responder);
+          if (message == "read fd")
+            return "read " + read_passed_fd(passed_fds.take());
+          if (message == "unparseable") {
+            passed_fds.drop_through_message();
+            return std::string("dropped");
+          }
+          return "echo " + message;
+        }));
+    serving = std::thread([this] { socket_server->run(); });
+  }
+
+  void TearDown() override {
+    socket_server->stop();
+    serving.join();
+    socket_server.reset();
+  }
+
+  static std::string read_passed_fd(int fd) {
+    if (fd == -1)
+      return "nothing";
+    char contents[64];
+    ssize_t length = pread(fd, contents, sizeof(contents), 0);
+    close(fd);
+    return std::string(contents,
+                       length > 0 ? static_cast<size_t>(length) : 0);
+  }
+
+  int connect_client() {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    EXPECT_EQ(0, connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                         sizeof(addr)));
+    return fd;
+  }
+
+  // Send data in one go, passing fds along with it
+  void send_with_fds(int fd, std::string data, const std::vector<int> &fds) {
+    struct iovec iov;
+    iov.iov_base = &data[0];
+    iov.iov_len = data.size();
+    union {
+      struct cmsghdr align;
+      char buffer[CMSG_SPACE(sizeof(int) * 4)];
+    } control;
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    struct cmsghdr *rights = CMSG_FIRSTHDR(&header);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(rights), fds.data(), sizeof(int) * fds.size());
+    ASSERT_EQ(static_cast<ssize_t>(data.size()), sendmsg(fd, &header, 0));
+  }
+
+  void send_all(int fd, const std::string &data) {
+    ASSERT_EQ(static_cast<ssize_t>(data.size()),
+              send(fd, data.data(), data.size(), MSG_NOSIGNAL));
+  }
+
+  // Read up to and including the next newline, or until the server hangs up
+  std::string read_line(int fd) {
+    std::string line;
+    char c;
+    while (read(fd, &c, 1) == 1) {
+      line += c;
+      if (c == '\n')
+        break;
+    }
+    return line;
+  }
+
+  // Read exactly `length` bytes, or fewer if the server hangs up
+  std::string read_bytes(int fd, size_t length) {
+    std::string bytes(length, '\0');
+    size_t got = 0;
+    while (got < length) {
+      ssize_t n = read(fd, &bytes[got], length - got);
+      if (n <= 0)
+        break;
+      got += static_cast<size_t>(n);
+    }
+    bytes.resize(got);
+    return bytes;
+  }
+
+  /* Send `count` messages on one connection as fast as possible, without
+   * waiting for replies, and return how many were answered per second
+   */
+  double pipeline_messages(int count, Framing framing) {
+    int fd = connect_client();
+    std::string messages;
+    std::string replies;
+    for (int i = 0; i < count; i++) {
+      std::string message = "{\"message\":" + std::to_string(i) + "}";
+      messages += frame_message(message, framing);
+      replies += frame_message("echo " + message, framing);
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    std::thread sender([&] { send_all(fd, messages); });
+    std::string received = read_bytes(fd, replies.size());
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - started)
+                         .count();
+    sender.join();
+    close(fd);
+
+    EXPECT_EQ(replies, received);
+    return count / seconds;
+  }
+
+  std::string path;
+  std::unique_ptr<SocketServer> socket_server;
+  // Kept by the handler, on the server's thread
+  std::vector<Responder> responders;
+  std::thread serving;
+};
+
+TEST_F(server, replies_to_each_message_on_a_line_of_its_own) {
+  int fd = connect_client();
+  send_all(fd, "one\ntwo\r\n\nthree\n");
+
+  EXPECT_EQ("echo one\n", read_line(fd));
+  EXPECT_EQ("echo two\n", read_line(fd));
+  EXPECT_EQ("echo three\n", read_line(fd));
+  close(fd);
+}
+
+TEST_F(server, handles_an_unterminated_message_when_the_client_hangs_up) {
+  int fd = connect_client();
+  send_all(fd, "no newline");
+  shutdown(fd, SHUT_WR);
+
+  EXPECT_EQ("echo no newline\n", read_line(fd));
+  EXPECT_EQ("", read_line(fd));
+  close(fd);
+}
+
+TEST_F(server, serves_other_clients_while_one_is_stalled) {
+  int stalled = connect_client();
+  send_all(stalled, "half a mess");
+
+  int fd = connect_client();
+  send_all(fd, "hello\n");
+  EXPECT_EQ("echo hello\n", read_line(fd));
+  close(fd);
+
+  send_all(stalled, "age\n");
+  EXPECT_EQ("echo half a message\n", read_line(stalled));
+  close(stalled);
+}
+
+TEST_F(server, serves_many_clients_at_once) {
+  const int clients = 200;
+  std::vector<int> fds;
+  for (int i = 0; i < clients; i++) {
+    fds.push_back(connect_client());
+    send_all(fds.back(), "client " + std::to_string(i) + "\n");
+  }
+
+  for (int i = 0; i < clients; i++) {
+    EXPECT_EQ("echo client " + std::to_string(i) + "\n", read_line(fds[i]));
+    close(fds[i]);
+  }
+}
+
+TEST_F(server, closes_connections_whose_messages_are_too_long) {
+  int fd = connect_client();
+  std::string chunk(64 * 1024, 'x');
+  size_t sent = 0;
+  while (sent <= SERVER_MAX_MESSAGE_BYTES) {
+    ssize_t length = send(fd, chunk.data(), chunk.size(), MSG_NOSIGNAL);
+    if (length <= 0)
+      break;
+    sent += static_cast<size_t>(length);
+  }
+
+  EXPECT_EQ("", read_line(fd));
+  close(fd);
+}
+
+TEST_F(server, frames_replies_like_the_messages_they_answer) {
+  int fd = connect_client();
+  send_all(fd, frame_message("multi\nline", LENGTH_PREFIXED_FRAMING) +
+                   "plain\n");
+
+  EXPECT_EQ(frame_message("echo multi\nline", LENGTH_PREFIXED_FRAMING),
+            read_bytes(fd, LENGTH_PREFIX_BYTES + 15));
+  EXPECT_EQ("echo plain\n", read_line(fd));
+  close(fd);
+}
+
+TEST_F(server, pipelines_thousands_of_newline_delimited_messages_a_second) {
+  EXPECT_GT(pipeline_messages(20000, NEWLINE_FRAMING), 5000);
+}
+
+TEST_F(server, pipelines_thousands_of_length_prefixed_messages_a_second) {
+  EXPECT_GT(pipeline_messages(20000, LENGTH_PREFIXED_FRAMING), 5000);
+}
+
+TEST_F(server, sends_later_replies_before_closing_the_connection) {
+  int fd = connect_client();
+  send_all(fd, frame_message("later", LENGTH_PREFIXED_FRAMING));
+  shutdown(fd, SHUT_WR);
+  EXPECT_EQ(frame_message("echo later", LENGTH_PREFIXED_FRAMING),
+            read_bytes(fd, LENGTH_PREFIX_BYTES + 10));
+
+  // The handler has kept the responder by now, since it has replied. Reply
+  // from another thread, as the pipeline does, then let go.
+  ASSERT_EQ(1u, responders.size());
+  std::vector<Responder> held;
+  held.swap(responders);
+  std::thread([&held] {
+    held[0].send("done");
+    held.clear();
+  }).join();
+
+  EXPECT_EQ(frame_message("done", LENGTH_PREFIXED_FRAMING),
+            read_bytes(fd, LENGTH_PREFIX_BYTES + 4));
+  EXPECT_EQ("", read_line(fd));
+  close(fd);
+}
+
+TEST_F(server, passes_descriptors_to_the_messages_that_claim_them) {
+  int first = memfd_create("first", MFD_CLOEXEC);
+  int second = memfd_create("second", MFD_CLOEXEC);
+  ASSERT_EQ(5, write(first, "first", 5));
+  ASSERT_EQ(6, write(second, "second", 6));
+
+  // Pass both descriptors along with the first of three messages
+  int fd = connect_client();
+  send_with_fds(fd, "read fd\nread fd\nread fd\n", {first, second});
+  close(first);
+  close(second);
+
+  EXPECT_EQ("read first\n", read_line(fd));
+  EXPECT_EQ("read second\n", read_line(fd));
+  EXPECT_EQ("read nothing\n", read_line(fd));
+  close(fd);
+}
+
+TEST_F(server, drops_only_the_descriptors_of_a_message_it_cannot_parse) {
+  int first = memfd_create("first", MFD_CLOEXEC);
+  int second = memfd_create("second", MFD_CLOEXEC);
+  int third = memfd_create("third", MFD_CLOEXEC);
+  ASSERT_EQ(5, write(first, "first", 5));
+  ASSERT_EQ(6, write(second, "second", 6));
+  ASSERT_EQ(5, write(third, "third", 5));
+
+  // Passed ahead of the message, and with it, then with the next one
+  int fd = connect_client();
+  send_with_fds(fd, "unpar", {first});
+  send_with_fds(fd, "seable\n", {second});
+  send_with_fds(fd, "read fd\n", {third});
+  close(first);
+  close(second);
+  close(third);
+
+  EXPECT_EQ("dropped\n", read_line(fd));
+  EXPECT_EQ("read third\n", read_line(fd));
+  close(fd);
+}
@@ -0,0 +1,99 @@
+#include "../src/shared_framebuffer.h"
+#include "gtest/gtest.h"
+
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern struct DisplayProperties DISPLAY_PROPERTIES;
+
+static void expect_rect(const DamageRect &expected, const DamageRect &actual) {
+  EXPECT_EQ(expected.x, actual.x);
+  EXPECT_EQ(expected.y, actual.y);
+  EXPECT_EQ(expected.width, actual.width);
+  EXPECT_EQ(expected.height, actual.height);
+}
+
+TEST(shared_framebuffer, is_laid_out_like_process_image_output) {
+  std::string name = "/airpanel-test-" + std::to_string(getpid());
+  SharedFramebuffer framebuffer(name);
+  ASSERT_EQ(DISPLAY_PROPERTIES.frame_buffer_length(), framebuffer.size());
+  // White, 8 pixels to a byte
+  EXPECT_EQ(0xff, framebuffer.data()[0]);
+  EXPECT_EQ(0xff, framebuffer.data()[framebuffer.size() - 1]);
+
+  // What a producer draws is what the daemon sees
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  ASSERT_NE(-1, fd);
+  unsigned char *producer = static_cast<unsigned char *>(mmap(
+      NULL, framebuffer.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+  close(fd);
+  ASSERT_NE(MAP_FAILED, producer);
+  producer[100] = 0x0f;
+  EXPECT_EQ(0x0f, framebuffer.data()[100]);
+  munmap(producer, framebuffer.size());
+}
+
+TEST(shared_framebuffer, puts_back_the_size_of_a_truncated_framebuffer) {
+  std::string name = "/airpanel-test-" + std::to_string(getpid());
+  SharedFramebuffer framebuffer(name);
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(0, ftruncate(fd, 100));
+
+  std::vector<unsigned char> copy;
+  EXPECT_THROW(framebuffer.copy_to(copy), SharedFramebufferError);
+  struct stat file_stat;
+  ASSERT_EQ(0, fstat(fd, &file_stat));
+  close(fd);
+  EXPECT_EQ(static_cast<off_t>(framebuffer.size()), file_stat.st_size);
+
+  framebuffer.copy_to(copy);
+  ASSERT_EQ(framebuffer.size(), copy.size());
+  EXPECT_EQ(0xff, copy[0]);
+}
+
+TEST(shared_framebuffer, covers_all_the_damage_with_one_window) {
+  // No damage is all of it
+  expect_rect({0, 0, 640, 384}, damage_window({}));
+
+  // Windows are widened to whole bytes of pixels
+  expect_rect({8, 10, 16, 5}, damage_window({{10, 10, 10, 5}}));
+  expect_rect({0, 0, 48, 30},
+              damage_window({{0, 0, 8, 8}, {33, 20, 7, 10}, {40, 1, 1, 1}}));
+
+  // and clipped to the display
+  expect_rect({624, 370, 16, 14}, damage_window({{630, 370, 100, 100}}));
+  expect_rect({0, 0, 16, 16}, damage_window({{-10, -10, 20, 26}}));
+  // Damage entirely off the display refreshes everything
+  expect_rect({0, 0, 640, 384}, damage_window({{700, 0, 10, 10}}));
+  // however far off it reaches
+  expect_rect({632, 0, 8, 384},
+              damage_window({{639, 0, INT_MAX, INT_MAX}}));
+  EXPECT_TRUE(is_whole_display(damage_window({{0, 0, 640, 384}})));
+}
+
+TEST(shared_framebuffer, accumulates_damage_that_is_superseded) {
+  Action older = {};
+  older.action = "damage";
+  older.damage = {{0, 0, 8, 8}};
+  Action newer = {};
+  newer.action = "damage";
+  newer.damage = {{16, 16, 8, 8}};
+
+  merge_damage(newer, older);
+  ASSERT_EQ(2u, newer.damage.size());
+  expect_rect({0, 0, 24, 24}, damage_window(newer.damage));
+
+  // A refresh of the whole display can't be narrowed down
+  Action refresh = {};
+  refresh.action = "refresh";
+  merge_damage(newer, refresh);
+  EXPECT_TRUE(newer.damage.empty());
+
+  // and damage doesn't widen a refresh, which covers everything already
+  merge_damage(refresh, older);
+  EXPECT_TRUE(refresh.damage.empty());
+}
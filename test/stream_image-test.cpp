@@ -0,0 +1,64 @@
+#include "../src/core.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include <set>
+#include <vector>
+
+using testing::ElementsAreArray;
+
+extern DisplayProperties DISPLAY_PROPERTIES;
+
+static std::vector<unsigned char> stream(const Action &action,
+                                         unsigned int stripe_rows,
+                                         std::set<const unsigned char *>
+                                             *stripes = NULL) {
+  std::vector<unsigned char> streamed;
+  stream_image(action, stripe_rows, STRIPE_RING_LENGTH,
+               [&](const unsigned char *stripe, size_t length) {
+                 EXPECT_LE(length, stripe_rows * DISPLAY_PROPERTIES
+                                                     .bytes_per_row());
+                 if (stripes)
+                   stripes->insert(stripe);
+                 streamed.insert(streamed.end(), stripe, stripe + length);
+               });
+  return streamed;
+}
+
+TEST(stream_image, streams_the_same_frame_as_process_image) {
+  const char *images[] = {"./fixtures/640x384a_1bpp_in.png",
+                          "./fixtures/384x640_24bpp_in.png",
+                          "./fixtures/200x100_8bpp_in.png"};
+  unsigned int stripe_rows[] = {1, 7, 64, 384, 1000};
+
+  for (const char *image : images) {
+    Action action = {};
+    action.action = "refresh";
+    action.image_filename = image;
+    action.orientation_specified = true;
+    action.orientation = 90;
+    std::vector<unsigned char> frame = process_image(action);
+
+    for (unsigned int rows : stripe_rows) {
+      EXPECT_THAT(stream(action, rows), ElementsAreArray(frame))
+          << image << " in stripes of " << rows << " rows";
+    }
+  }
+}
+
+TEST(stream_image, only_uses_the_stripes_in_its_ring) {
+  Action action = {};
+  action.action = "refresh";
+  action.image_filename = "./fixtures/840x584_24bpp_in.png";
+
+  std::set<const unsigned char *> stripes;
+  stream(action, 16, &stripes);
+  EXPECT_LE(stripes.size(), STRIPE_RING_LENGTH);
+}
+
+TEST(stream_image, rethrows_errors_from_the_render_thread) {
+  Action action = {};
+  action.action = "refresh";
+  action.image_filename = "./fixtures/does_not_exist.png";
+
+  EXPECT_THROW(stream(action, 16), ImageFileNotFound);
+}
@@ -0,0 +1,32 @@
+#include "../src/thread_pool.h"
+#include "gtest/gtest.h"
+#include <atomic>
+
+TEST(thread_pool, runs_every_submitted_task) {
+  std::atomic<int> count(0);
+  ThreadPool pool(4);
+  for (int i = 0; i < 1000; i++) {
+    pool.submit([&count]() { count++; });
+  }
+  pool.wait();
+  EXPECT_EQ(1000, count);
+}
+
+TEST(thread_pool, runs_tasks_submitted_from_inside_a_task) {
+  std::atomic<int> count(0);
+  ThreadPool pool(3);
+  for (int i = 0; i < 10; i++) {
+    pool.submit([&pool, &count]() {
+      for (int j = 0; j < 10; j++) {
+        pool.submit([&count]() { count++; });
+      }
+    });
+  }
+  pool.wait();
+  EXPECT_EQ(100, count);
+}
+
+TEST(thread_pool, uses_at_least_one_thread) {
+  ThreadPool pool(0);
+  EXPECT_EQ(1u, pool.size());
+}
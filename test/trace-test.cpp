@@ -0,0 +1,134 @@
+#include "../src/trace.h"
+#include "cJSON.h"
+#include "gtest/gtest.h"
+
+#include <string.h>
+#include <thread>
+#include <vector>
+
+// The trace events in a dump, checking that it's valid JSON
+static std::vector<cJSON *> trace_events(cJSON *trace, const char *phase) {
+  std::vector<cJSON *> events;
+  cJSON *list = cJSON_GetObjectItem(trace, "traceEvents");
+  for (int i = 0; i < cJSON_GetArraySize(list); i++) {
+    cJSON *event = cJSON_GetArrayItem(list, i);
+    if (!strcmp(cJSON_GetObjectItem(event, "ph")->valuestring, phase))
+      events.push_back(event);
+  }
+  return events;
+}
+
+TEST(trace, dumps_spans_as_chrome_trace_json) {
+  TraceBuffer buffer(16);
+  set_trace_thread_name("test");
+  buffer.record("parse", "parse_message", 1000000, 1250500, "bytes", 96);
+  buffer.record("panel", "WaitUntilIdle poll", 2000000, 7000000);
+
+  cJSON *trace = cJSON_Parse(buffer.to_json().c_str());
+  ASSERT_TRUE(trace);
+  std::vector<cJSON *> spans = trace_events(trace, "X");
+  ASSERT_EQ(2u, spans.size());
+  EXPECT_STREQ("parse_message",
+               cJSON_GetObjectItem(spans[0], "name")->valuestring);
+  EXPECT_STREQ("parse", cJSON_GetObjectItem(spans[0], "cat")->valuestring);
+  EXPECT_DOUBLE_EQ(1000, cJSON_GetObjectItem(spans[0], "ts")->valuedouble);
+  EXPECT_DOUBLE_EQ(250.5, cJSON_GetObjectItem(spans[0], "dur")->valuedouble);
+  EXPECT_EQ(96, cJSON_GetObjectItem(cJSON_GetObjectItem(spans[0], "args"),
+                                    "bytes")
+                    ->valueint);
+  EXPECT_FALSE(cJSON_GetObjectItem(spans[1], "args"));
+
+  bool named = false;
+  for (cJSON *metadata : trace_events(trace, "M")) {
+    cJSON *name = cJSON_GetObjectItem(metadata, "args");
+    named = named ||
+            !strcmp("test", cJSON_GetObjectItem(name, "name")->valuestring);
+  }
+  EXPECT_TRUE(named);
+  cJSON_Delete(trace);
+}
+
+TEST(trace, keeps_only_the_latest_events_once_full) {
+  TraceBuffer buffer(4);
+  static const char *const names[] = {"0", "1", "2", "3", "4",
+                                      "5", "6", "7", "8", "9"};
+  for (int i = 0; i < 10; i++) {
+    buffer.record("test", names[i], i * 1000, i * 1000 + 500);
+  }
+  EXPECT_EQ(10u, buffer.recorded());
+
+  cJSON *trace = cJSON_Parse(buffer.to_json().c_str());
+  ASSERT_TRUE(trace);
+  std::vector<cJSON *> spans = trace_events(trace, "X");
+  ASSERT_EQ(4u, spans.size());
+  for (int i = 0; i < 4; i++) {
+    EXPECT_STREQ(names[6 + i],
+                 cJSON_GetObjectItem(spans[i], "name")->valuestring);
+  }
+  cJSON_Delete(trace);
+}
+
+TEST(trace, records_scopes_only_while_tracing_is_on) {
+  TraceBuffer buffer(16);
+  { TraceScope scope("test", "untraced"); }
+  EXPECT_EQ(0u, buffer.recorded());
+
+  set_trace_buffer(&buffer);
+  {
+    TraceScope scope("test", "traced");
+    scope.set_arg("id", 7);
+  }
+  set_trace_buffer(NULL);
+  EXPECT_EQ(1u, buffer.recorded());
+  EXPECT_NE(std::string::npos, buffer.to_json().find("\"args\":{\"id\":7}"));
+}
+
+TEST(trace, dumps_while_threads_are_recording) {
+  TraceBuffer buffer(256);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.push_back(std::thread([&buffer]() {
+      for (int i = 0; i < 20000; i++) {
+        uint64_t now = trace_now_ns();
+        buffer.record("test", "span", now, now + 1, "i", i);
+      }
+    }));
+  }
+  for (int dump = 0; dump < 20; dump++) {
+    cJSON *trace = cJSON_Parse(buffer.to_json().c_str());
+    ASSERT_TRUE(trace);
+    EXPECT_LE(trace_events(trace, "X").size(), 256u);
+    cJSON_Delete(trace);
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(80000u, buffer.recorded());
+  cJSON *trace = cJSON_Parse(buffer.to_json().c_str());
+  ASSERT_TRUE(trace);
+  EXPECT_EQ(256u, trace_events(trace, "X").size());
+  cJSON_Delete(trace);
+}
+
+TEST(trace, forgets_the_names_of_all_but_the_latest_exited_threads) {
+  TraceBuffer buffer(16);
+  for (int t = 0; t < 200; t++) {
+    std::thread([t]() {
+      set_trace_thread_name(t == 199 ? "last worker" : "worker");
+    }).join();
+  }
+
+  cJSON *trace = cJSON_Parse(buffer.to_json().c_str());
+  ASSERT_TRUE(trace);
+  std::vector<cJSON *> names = trace_events(trace, "M");
+  // 32 exited threads, and the few still running
+  EXPECT_LE(names.size(), 40u);
+  bool named = false;
+  for (cJSON *metadata : names) {
+    cJSON *name = cJSON_GetObjectItem(metadata, "args");
+    named = named || !strcmp("last worker",
+                             cJSON_GetObjectItem(name, "name")->valuestring);
+  }
+  EXPECT_TRUE(named);
+  cJSON_Delete(trace);
+}